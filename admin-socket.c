@@ -0,0 +1,457 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include "admin-socket.h"
+#include "server-helper.h"
+#include "user-list.h"
+#include "msg-list.h"
+#include "group-list.h"
+#include "mutexes.h"
+#include "fanout.h"
+#include "admission.h"
+#include "msg-filter.h"
+
+#define ADMIN_LINE 512     // longest command
+#define GROUP_CHUNK 256    // group pointers copied per registry lock
+
+// ======= SNAPSHOTS =========== //
+
+// Head and count of the user list: the users it reaches are never removed,
+// so they can be walked without the lock.
+static UserList users_snapshot(Session *base) {
+    UserList users;
+    pthread_mutex_lock(&userList_mutex);
+    users = *base->userList;
+    pthread_mutex_unlock(&userList_mutex);
+    return users;
+}
+
+static MessageList messages_snapshot(Session *base) {
+    MessageList messages;
+    pthread_mutex_lock(&messageList_mutex);
+    messages = *base->messageList;
+    pthread_mutex_unlock(&messageList_mutex);
+    return messages;
+}
+
+/**
+ * Struct name: GroupCounters
+ * Description: What the admin socket reads from a group, under its lock.
+ */
+typedef struct {
+    unsigned int members;
+    unsigned int memberCapacity;
+    unsigned int lastSeq;
+    unsigned int capacity;
+} GroupCounters;
+
+static void read_group(GroupInfo *group, GroupCounters *counters) {
+    pthread_mutex_lock(&group->lock);
+    counters->members = group->memberCount;
+    counters->memberCapacity = group->memberCapacity;
+    counters->lastSeq = group->lastSeq;
+    counters->capacity = group->capacity;
+    pthread_mutex_unlock(&group->lock);
+}
+
+// ======= COMMANDS =========== //
+
+static void print_stats(AdminSocket *admin, FILE *out) {
+    Session *base = admin->base;
+    UserList users = users_snapshot(base);
+    int online = 0;
+    User *user = users.first;
+    for (int i = 0; i < users.count; i++) {
+        online += __atomic_load_n(&user->isOnline, __ATOMIC_RELAXED) > 0;
+        user = user->next;
+    }
+    MessageList messages = messages_snapshot(base);
+    GroupInfo *first;
+    unsigned int groups = 0;
+    getGroupRange(base->groupList, 0, 0, &first, &groups);
+    pthread_mutex_lock(&base->directList->lock);
+    int conversations = base->directList->count;
+    pthread_mutex_unlock(&base->directList->lock);
+
+    fprintf(out, "uptime %lld s\n", (long long) (time(NULL) - admin->started));
+    if (base->admission != NULL) {
+        Admission admission;
+        getAdmissionStats(base->admission, &admission);
+        fprintf(out, "connections %d of %d\n", admission.sessions, admission.maxSessions);
+        fprintf(out, "logins checking %d of %d, waiting %d (%.1f ms per check)\n", admission.authActive,
+                admission.maxAuth, admission.authWaiting, admission.authMs);
+        fprintf(out, "overloaded %s (max load %.1f per CPU, %d CPUs, min free %ld kB)\n",
+                admission.overloaded ? "yes" : "no", admission.maxLoad, admission.cpus, admission.minFreeKb);
+        fprintf(out, "refused %llu connections, %llu logins\n", admission.shedConnections, admission.shedLogins);
+    }
+    fprintf(out, "users %d, %d online\n", users.count, online);
+    fprintf(out, "groups %u\n", groups);
+    fprintf(out, "messages %d (%zu bytes of text)\n", messages.count, messages.bytes);
+    fprintf(out, "conversations %d\n", conversations);
+    fprintf(out, "log %s\n", __atomic_load_n(&log_level, __ATOMIC_RELAXED) >= LOG_DEBUG ? "debug" : "info");
+    if (base->filter != NULL) {
+        printFilterStats(base->filter, out);
+    }
+}
+
+static void print_groups(AdminSocket *admin, FILE *out, unsigned int from, unsigned int count) {
+    Session *base = admin->base;
+    GroupInfo *chunk[GROUP_CHUNK];
+    unsigned int total = 0, listed = 0;
+    fprintf(out, "%-24s %10s %10s %10s\n", "group", "members", "devices", "messages");
+    while (count > 0) {
+        unsigned int copied = getGroupRange(base->groupList, from, count < GROUP_CHUNK ? count : GROUP_CHUNK,
+                                            chunk, &total);
+        if (copied == 0) {
+            break;
+        }
+        for (unsigned int i = 0; i < copied; i++) {
+            GroupCounters counters;
+            read_group(chunk[i], &counters);
+            fprintf(out, "%-24s %10u %10d %10u\n", chunk[i]->name, counters.members,
+                    countOnlineMembers(base->fanout, chunk[i]), counters.lastSeq);
+        }
+        from += copied;
+        count -= copied;
+        listed += copied;
+    }
+    fprintf(out, "(%u listed, %u groups in all)\n", listed, total);
+}
+
+static void print_queues(AdminSocket *admin, FILE *out) {
+    FanoutPool *pool = admin->base->fanout;
+    fprintf(out, "%-8s %6s %10s %8s\n", "worker", "cpu", "messages", "events");
+    for (int i = 0; i < pool->count; i++) {
+        unsigned long long messages;
+        int events;
+        getFanoutDepth(pool, i, &messages, &events);
+        fprintf(out, "%-8d %6d %10llu %8d\n", i, pool->workers[i].cpu, messages, events);
+    }
+}
+
+static void print_size(FILE *out, const char *name, double bytes) {
+    if (bytes >= 1024.0 * 1024 * 1024) {
+        fprintf(out, "%-14s %10.1f GB\n", name, bytes / (1024.0 * 1024 * 1024));
+    } else if (bytes >= 1024.0 * 1024) {
+        fprintf(out, "%-14s %10.1f MB\n", name, bytes / (1024.0 * 1024));
+    } else {
+        fprintf(out, "%-14s %10.1f kB\n", name, bytes / 1024.0);
+    }
+}
+
+// From the counts and the struct sizes; strings (names, emails, passwords)
+// aren't counted, nor message texts, which stay in the log.
+static void print_memory(AdminSocket *admin, FILE *out) {
+    Session *base = admin->base;
+    UserList users = users_snapshot(base);
+    MessageList messages = messages_snapshot(base);
+    double user_bytes = (double) users.count * sizeof(User) + (double) users.indexCapacity * sizeof(User *);
+
+    double group_bytes = 0, membership_bytes = 0, fanout_bytes = 0;
+    GroupInfo *chunk[GROUP_CHUNK];
+    unsigned int from = 0, total = 0, copied;
+    while ((copied = getGroupRange(base->groupList, from, GROUP_CHUNK, chunk, &total)) > 0) {
+        for (unsigned int i = 0; i < copied; i++) {
+            GroupCounters counters;
+            read_group(chunk[i], &counters);
+            group_bytes += sizeof(GroupInfo) + (double) counters.capacity * sizeof(unsigned int) +
+                           (double) counters.memberCapacity * sizeof(Group *);
+            membership_bytes += (double) counters.members * sizeof(Group);
+            if (__atomic_load_n(&chunk[i]->partitions, __ATOMIC_ACQUIRE) != NULL) {
+                fanout_bytes += (double) base->fanout->count * sizeof(FanoutPartition) +
+                                (double) countOnlineMembers(base->fanout, chunk[i]) * sizeof(FanoutMember);
+            }
+        }
+        from += copied;
+    }
+    for (int i = 0; i < base->fanout->count; i++) {
+        unsigned long long queued;
+        int events;
+        getFanoutDepth(base->fanout, i, &queued, &events);
+        fanout_bytes += (double) queued * (sizeof(Broadcast) + base->fanout->count * sizeof(Broadcast *)) +
+                        2.0 * FANOUT_EVENT_LANE * sizeof(FanoutEvent);
+    }
+    pthread_mutex_lock(&base->directList->lock);
+    double direct_bytes = (double) base->directList->count * sizeof(Conversation) +
+                          (double) base->directList->indexCapacity * sizeof(Conversation *);
+    pthread_mutex_unlock(&base->directList->lock);
+
+    print_size(out, "users", user_bytes);
+    print_size(out, "memberships", membership_bytes);
+    print_size(out, "groups", group_bytes);
+    // Headers in whole blocks, and the texts the log doesn't hold.
+    double header_blocks = (messages.count + MESSAGE_BLOCK - 1) / MESSAGE_BLOCK;
+    print_size(out, "messages", header_blocks * MESSAGE_BLOCK * sizeof(MessageHeader) +
+                                (double) messages.arenaChunks * MESSAGE_ARENA_CHUNK);
+    print_size(out, "conversations", direct_bytes);
+    print_size(out, "fan-out", fanout_bytes);
+
+    // What the process holds in all: resident pages, and the heap in use.
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm != NULL) {
+        long pages, resident;
+        if (fscanf(statm, "%ld %ld", &pages, &resident) == 2) {
+            print_size(out, "resident", (double) resident * sysconf(_SC_PAGESIZE));
+        }
+        fclose(statm);
+    }
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 heap = mallinfo2();
+    print_size(out, "heap in use", (double) heap.uordblks + (double) heap.hblkhd);
+#endif
+}
+
+// The n users who sent the most messages, from one walk of the user list.
+static void print_top(AdminSocket *admin, FILE *out, int n) {
+    User *top[ADMIN_MAX_TOP];
+    unsigned int posts[ADMIN_MAX_TOP];
+    int found = 0;
+    UserList users = users_snapshot(admin->base);
+    User *user = users.first;
+    for (int i = 0; i < users.count; i++, user = user->next) {
+        unsigned int sent = __atomic_load_n(&user->posts, __ATOMIC_RELAXED);
+        if (sent == 0 || (found == n && sent <= posts[n - 1])) {
+            continue;
+        }
+        int at = (found < n) ? found++ : n - 1;
+        while (at > 0 && posts[at - 1] < sent) {
+            top[at] = top[at - 1];
+            posts[at] = posts[at - 1];
+            at--;
+        }
+        top[at] = user;
+        posts[at] = sent;
+    }
+    for (int i = 0; i < found; i++) {
+        fprintf(out, "%10u %s (%s)\n", posts[i], top[i]->name, top[i]->email);
+    }
+    if (found == 0) {
+        fprintf(out, "Nobody has sent a message yet.\n");
+    }
+}
+
+/**
+ * Runs one command line.
+ *
+ * return 0 to keep the connection, -1 to close it ("quit").
+ */
+static int run_command(AdminSocket *admin, char *line, FILE *out) {
+    Session *base = admin->base;
+    char *command = strtok(line, " \t");
+    char *arg1 = strtok(NULL, " \t");
+    char *arg2 = strtok(NULL, " \t");
+    if (command == NULL) {
+        return 0;
+    }
+    if (strcmp(command, "stats") == 0) {
+        print_stats(admin, out);
+    } else if (strcmp(command, "groups") == 0) {
+        unsigned int from = (arg1 != NULL) ? (unsigned int) strtoul(arg1, NULL, 10) : 0;
+        unsigned int count = (arg2 != NULL) ? (unsigned int) strtoul(arg2, NULL, 10) : ADMIN_DEFAULT_PAGE;
+        print_groups(admin, out, from, count);
+    } else if (strcmp(command, "queues") == 0) {
+        print_queues(admin, out);
+    } else if (strcmp(command, "memory") == 0) {
+        print_memory(admin, out);
+    } else if (strcmp(command, "top") == 0) {
+        int n = (arg1 != NULL) ? atoi(arg1) : 10;
+        print_top(admin, out, (n < 1) ? 1 : (n > ADMIN_MAX_TOP) ? ADMIN_MAX_TOP : n);
+    } else if (strcmp(command, "users") == 0) {
+        UserList users = users_snapshot(base);
+        printUserList(&users, out);
+    } else if (strcmp(command, "messages") == 0) {
+        MessageList messages = messages_snapshot(base);
+        printMessageList(&messages, base->userList, base->groupList, out);
+    } else if (strcmp(command, "log") == 0) {
+        if (arg1 != NULL && (strcmp(arg1, "debug") == 0 || strcmp(arg1, "info") == 0)) {
+            __atomic_store_n(&log_level, strcmp(arg1, "debug") == 0 ? LOG_DEBUG : LOG_INFO, __ATOMIC_RELAXED);
+            printf("Admin: log level %s\n", arg1);
+            fprintf(out, "Log level %s.\n", arg1);
+        } else {
+            fprintf(out, "Usage: log debug|info\n");
+        }
+    } else if (strcmp(command, "set") == 0) {
+        if (base->admission == NULL || arg1 == NULL || arg2 == NULL ||
+            setAdmissionLimit(base->admission, arg1, atof(arg2)) == -1) {
+            fprintf(out, "Usage: set max-connections|auth-slots|max-load|min-free-mb <value>\n");
+        } else {
+            printf("Admin: %s set to %s\n", arg1, arg2);
+            fprintf(out, "%s set to %s.\n", arg1, arg2);
+        }
+    } else if (strcmp(command, "reload") == 0) {
+        if (base->filter == NULL) {
+            fprintf(out, "No filter rules (-F).\n");
+        } else if (reloadMessageFilter(base->filter) == -1) {
+            fprintf(out, "Error reading the rules; the previous ones stay.\n");
+        } else {
+            fprintf(out, "Rules reloaded.\n");
+        }
+    } else if (strcmp(command, "quit") == 0) {
+        return -1;
+    } else {
+        fprintf(out, "Commands: stats, groups [from] [count], queues, memory, top [n], users, messages,\n"
+                     "          log debug|info, set <limit> <value>, reload, quit\n");
+    }
+    return 0;
+}
+
+// ======= CONNECTIONS =========== //
+
+// Waits until fd is readable. return 1 if it is, 0 if the server is
+// stopping or the wait timed out.
+static int wait_readable(AdminSocket *admin, int fd, int timeout_ms) {
+    struct pollfd fds[2];
+    fds[0].fd = admin->wakePipe[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = fd;
+    fds[1].events = POLLIN;
+    while (1) {
+        int ready = poll(fds, 2, timeout_ms);
+        if (ready == -1 && errno == EINTR) {
+            continue;
+        }
+        return ready > 0 && !(fds[0].revents & POLLIN) && (fds[1].revents & (POLLIN | POLLHUP));
+    }
+}
+
+// Serves one admin connection until it hangs up, says "quit" or is idle.
+static void serve_client(AdminSocket *admin, int fd) {
+    FILE *out = fdopen(dup(fd), "w");
+    if (out == NULL) {
+        perror("Error opening admin connection");
+        close(fd);
+        return;
+    }
+    char line[ADMIN_LINE];
+    size_t used = 0;
+    int open = 1;
+    while (open && wait_readable(admin, fd, ADMIN_IDLE_SEC * 1000)) {
+        ssize_t received = recv(fd, line + used, sizeof line - 1 - used, 0);
+        if (received <= 0) {
+            break;
+        }
+        used += (size_t) received;
+        char *end;
+        while (open && (end = memchr(line, '\n', used)) != NULL) {
+            *end = '\0';
+            if (end > line && end[-1] == '\r') {
+                end[-1] = '\0';
+            }
+            open = run_command(admin, line, out) == 0;
+            if (open) {
+                fprintf(out, ".\n");
+                fflush(out);
+            }
+            used -= (size_t) (end + 1 - line);
+            memmove(line, end + 1, used);
+        }
+        if (used == sizeof line - 1) {
+            fprintf(out, "Command too long.\n.\n");
+            fflush(out);
+            used = 0;
+        }
+    }
+    fclose(out);
+    close(fd);
+}
+
+static void *admin_thread(void *arg) {
+    AdminSocket *admin = (AdminSocket *) arg;
+    while (wait_readable(admin, admin->listenFd, -1)) {
+        int fd = accept(admin->listenFd, NULL, NULL);
+        if (fd == -1) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                perror("Error accepting an admin connection");
+            }
+            continue;
+        }
+        serve_client(admin, fd);
+    }
+    return NULL;
+}
+
+/**
+ * Listens on path (replacing a socket file left there) and starts the
+ * thread that serves it. Only the server's user may connect.
+ *
+ * param base What every session starts from: the server's structures.
+ * return 0 on success, -1 on failure.
+ */
+int startAdminSocket(AdminSocket *admin, const char *path, Session *base) {
+    memset(admin, 0, sizeof *admin);
+    admin->base = base;
+    admin->started = time(NULL);
+    admin->listenFd = -1;
+    admin->wakePipe[0] = admin->wakePipe[1] = -1;
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Admin socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    if ((admin->path = strdup(path)) == NULL || pipe(admin->wakePipe) == -1) {
+        perror("Error setting up the admin socket");
+        stopAdminSocket(admin);
+        return -1;
+    }
+    admin->listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (admin->listenFd == -1) {
+        perror("Error creating admin socket");
+        stopAdminSocket(admin);
+        return -1;
+    }
+    unlink(path);
+    mode_t mask = umask(0077); // the socket file is created owner-only
+    int bound = bind(admin->listenFd, (struct sockaddr *) &addr, sizeof addr);
+    umask(mask);
+    if (bound == -1 || listen(admin->listenFd, 4) == -1) {
+        perror("Error listening on the admin socket");
+        stopAdminSocket(admin);
+        return -1;
+    }
+    if (pthread_create(&admin->thread, NULL, admin_thread, admin) != 0) {
+        perror("Error creating admin thread");
+        close(admin->listenFd);
+        admin->listenFd = -1;
+        stopAdminSocket(admin);
+        return -1;
+    }
+    printf("Admin socket at %s\n", path);
+    return 0;
+}
+
+/**
+ * Stops the thread (an admin connection in progress is closed after its
+ * current answer) and removes the socket file.
+ */
+void stopAdminSocket(AdminSocket *admin) {
+    if (admin->listenFd != -1) {
+        char byte = 0;
+        ssize_t written = write(admin->wakePipe[1], &byte, 1);
+        (void) written;
+        pthread_join(admin->thread, NULL);
+        close(admin->listenFd);
+        unlink(admin->path);
+    }
+    if (admin->wakePipe[0] != -1) {
+        close(admin->wakePipe[0]);
+        close(admin->wakePipe[1]);
+    }
+    free(admin->path);
+    admin->path = NULL;
+    admin->listenFd = -1;
+}
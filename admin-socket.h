@@ -0,0 +1,51 @@
+#ifndef ADMIN_SOCKET_H
+#define ADMIN_SOCKET_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "protocol.h"
+
+/**
+ * Admin socket (server -A <path>): a Unix socket, reachable only by the
+ * server's own user, for looking into a running server and adjusting it.
+ *
+ *   $ echo stats | nc -U /tmp/chat-admin.sock
+ *
+ * Commands are lines; every answer ends with a line holding only ".".
+ *
+ *   stats                     connections, users, groups, messages, overload, filter
+ *   groups [from] [count]     members, connected devices and messages per group
+ *   queues                    messages and events waiting in each fan-out worker
+ *   memory                    estimated memory by subsystem, and the process totals
+ *   top [n]                   users who sent the most messages since the start
+ *   users, messages           every user, every group message (long)
+ *   log debug|info            trace every request, or not
+ *   set <limit> <value>       admission limits (setAdmissionLimit() in admission.h)
+ *   reload                    re-read the filter rules (-F)
+ *
+ * The answers are built from the live structures by one thread, taking
+ * each lock only long enough to copy what it reads (a list's head and
+ * count, a group's counters, a partition's size): connections go on while
+ * an answer is put together, and it may be a moment old by then.
+ */
+
+#define ADMIN_IDLE_SEC 30      // an admin connection silent this long is closed
+#define ADMIN_DEFAULT_PAGE 100 // groups listed by "groups" without a count
+#define ADMIN_MAX_TOP 100      // most users "top" lists
+
+typedef struct ADMIN_SOCKET {
+    char *path;
+    int listenFd;
+    int wakePipe[2];  // written by stopAdminSocket()
+    pthread_t thread;
+    time_t started;   // the server's start, for the uptime
+    Session *base;    // the server's structures (what every session starts from)
+} AdminSocket;
+
+// Function prototypes
+int startAdminSocket(AdminSocket *admin, const char *path, Session *base);
+void stopAdminSocket(AdminSocket *admin);
+
+#endif // ADMIN_SOCKET_H
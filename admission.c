@@ -0,0 +1,256 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include "admission.h"
+
+#define RESERVED_FDS 64 // descriptors kept for logs, the data directory and attachments
+
+// Start of the password check running on this thread (endAuth() times it).
+static __thread long long auth_started;
+
+static long long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Reads the run queue and available memory, at most every
+// ADMISSION_SAMPLE_MS. Called under lock.
+static void sample_load(Admission *admission) {
+    long long now = monotonic_ms();
+    if (now - admission->sampledAt < ADMISSION_SAMPLE_MS) {
+        return;
+    }
+    admission->sampledAt = now;
+
+    // The fourth field of /proc/loadavg is "runnable/total" right now; the
+    // averages react too slowly to a reconnect storm.
+    double runnable = -1;
+    FILE *file = fopen("/proc/loadavg", "r");
+    if (file != NULL) {
+        double avg1, avg5, avg15;
+        int running, total;
+        if (fscanf(file, "%lf %lf %lf %d/%d", &avg1, &avg5, &avg15, &running, &total) == 5) {
+            runnable = running - 1; // not counting this thread
+        }
+        fclose(file);
+    }
+    if (runnable < 0 && getloadavg(&runnable, 1) != 1) {
+        runnable = 0;
+    }
+    long free_kb = -1;
+    file = fopen("/proc/meminfo", "r");
+    if (file != NULL) {
+        char line[128];
+        while (fgets(line, sizeof line, file) != NULL) {
+            if (sscanf(line, "MemAvailable: %ld kB", &free_kb) == 1) {
+                break;
+            }
+        }
+        fclose(file);
+    }
+
+    int overloaded = runnable > admission->maxLoad * admission->cpus ||
+                     (free_kb >= 0 && free_kb < admission->minFreeKb);
+    if (overloaded != admission->overloaded) {
+        printf(overloaded ? "Overloaded (%.0f runnable, %ld kB free): shedding new work\n"
+                          : "Load back to normal (%.0f runnable, %ld kB free)\n", runnable, free_kb);
+        admission->overloaded = overloaded;
+    }
+}
+
+// When to come back: long enough for the queue ahead to be worked through,
+// spread over as much again. Called under lock.
+static int retry_time(Admission *admission) {
+    double queued = admission->authActive + admission->authWaiting;
+    int base = 1 + (int) (queued * admission->authMs / admission->maxAuth / 1000);
+    if (base > ADMISSION_MAX_RETRY_SEC / 2) {
+        base = ADMISSION_MAX_RETRY_SEC / 2;
+    }
+    return base + (int) (random() % (base + 1));
+}
+
+/**
+ * Sets up the limits.
+ *
+ * param max_sessions Connections served at once, 0 for ADMISSION_MAX_SESSIONS
+ *                    (fewer if the descriptor limit is lower).
+ */
+void initAdmission(Admission *admission, int max_sessions) {
+    memset(admission, 0, sizeof *admission);
+    pthread_mutex_init(&admission->lock, NULL);
+    pthread_cond_init(&admission->authFree, NULL);
+    if (max_sessions <= 0) {
+        max_sessions = ADMISSION_MAX_SESSIONS;
+        struct rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY &&
+            limit.rlim_cur < (rlim_t) max_sessions + RESERVED_FDS) {
+            max_sessions = (limit.rlim_cur > 2 * RESERVED_FDS) ? (int) limit.rlim_cur - RESERVED_FDS : RESERVED_FDS;
+        }
+    }
+    admission->maxSessions = max_sessions;
+    admission->cpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (admission->cpus < 1) {
+        admission->cpus = 1;
+    }
+    admission->maxAuth = admission->cpus;
+    admission->maxAuthQueue = admission->cpus * ADMISSION_AUTH_QUEUE;
+    admission->maxLoad = ADMISSION_MAX_LOAD;
+    admission->minFreeKb = ADMISSION_MIN_FREE_KB;
+    admission->sampledAt = monotonic_ms() - ADMISSION_SAMPLE_MS;
+}
+
+/**
+ * Decides whether to serve a new connection. A resuming connection (one
+ * inherited from the previous server) is always served.
+ *
+ * param retry_after Receives the seconds the client should wait when refused.
+ * return 0 if admitted (releaseConnection() when it closes), -1 if refused.
+ */
+int admitConnection(Admission *admission, int resuming, int *retry_after) {
+    pthread_mutex_lock(&admission->lock);
+    sample_load(admission);
+    int admitted = resuming || (admission->sessions < admission->maxSessions && !admission->overloaded);
+    if (admitted) {
+        admission->sessions++;
+    } else {
+        admission->shedConnections++;
+        *retry_after = retry_time(admission);
+    }
+    pthread_mutex_unlock(&admission->lock);
+    return admitted ? 0 : -1;
+}
+
+void releaseConnection(Admission *admission) {
+    pthread_mutex_lock(&admission->lock);
+    admission->sessions--;
+    pthread_mutex_unlock(&admission->lock);
+}
+
+/**
+ * Waits for a password check slot. Resuming logins wait ahead of new ones.
+ *
+ * param resuming    1 for a client coming back (resumed TLS session, known device).
+ * param retry_after Receives the seconds the client should wait when refused.
+ * return 0 with a slot (endAuth() after the check), -1 if refused.
+ */
+int beginAuth(Admission *admission, int resuming, int *retry_after) {
+    pthread_mutex_lock(&admission->lock);
+    sample_load(admission);
+    // Refused if the queue ahead would take longer than a login may wait
+    // (a new one half as long), or holds maxAuthQueue already.
+    int budget_ms = resuming ? ADMISSION_AUTH_WAIT_MS : ADMISSION_AUTH_WAIT_MS / 2;
+    double expected_ms = (admission->authWaiting + 1) * admission->authMs / admission->maxAuth;
+    int queue_full = admission->authWaiting >= admission->maxAuthQueue || expected_ms > budget_ms;
+    int must_wait = admission->authActive >= admission->maxAuth || (!resuming && admission->priorityWaiting > 0);
+    if ((admission->overloaded && !resuming) || (must_wait && queue_full)) {
+        admission->shedLogins++;
+        *retry_after = retry_time(admission);
+        pthread_mutex_unlock(&admission->lock);
+        return -1;
+    }
+    if (must_wait) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += ADMISSION_AUTH_WAIT_MS / 1000;
+        deadline.tv_nsec += (ADMISSION_AUTH_WAIT_MS % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        admission->authWaiting++;
+        admission->priorityWaiting += resuming;
+        int timed_out = 0;
+        while (!timed_out && (admission->authActive >= admission->maxAuth ||
+                              (!resuming && admission->priorityWaiting > 0))) {
+            timed_out = pthread_cond_timedwait(&admission->authFree, &admission->lock, &deadline) == ETIMEDOUT;
+        }
+        admission->authWaiting--;
+        admission->priorityWaiting -= resuming;
+        if (resuming && admission->priorityWaiting == 0) {
+            pthread_cond_broadcast(&admission->authFree); // new logins may go now
+        }
+        if (admission->authActive >= admission->maxAuth) {
+            admission->shedLogins++;
+            *retry_after = retry_time(admission);
+            pthread_mutex_unlock(&admission->lock);
+            return -1;
+        }
+    }
+    admission->authActive++;
+    pthread_mutex_unlock(&admission->lock);
+    auth_started = monotonic_ms();
+    return 0;
+}
+
+void endAuth(Admission *admission) {
+    double elapsed = (double) (monotonic_ms() - auth_started);
+    pthread_mutex_lock(&admission->lock);
+    admission->authActive--;
+    admission->authMs = (admission->authMs == 0) ? elapsed : 0.9 * admission->authMs + 0.1 * elapsed;
+    pthread_cond_broadcast(&admission->authFree);
+    pthread_mutex_unlock(&admission->lock);
+}
+
+/**
+ * Copies the limits and counters, for the admin socket.
+ */
+void getAdmissionStats(Admission *admission, Admission *out) {
+    pthread_mutex_lock(&admission->lock);
+    sample_load(admission);
+    memcpy(out, admission, sizeof *out);
+    pthread_mutex_unlock(&admission->lock);
+}
+
+/**
+ * Changes a limit while the server runs (admin socket "set").
+ *
+ * param name "max-connections", "auth-slots" (whole numbers, at least 1),
+ *            "max-load" (runnable threads per CPU) or "min-free-mb".
+ * return 0 on success, -1 for an unknown name or a value out of range.
+ */
+int setAdmissionLimit(Admission *admission, const char *name, double value) {
+    if (value <= 0) {
+        return -1;
+    }
+    // A count below 1 would refuse every connection, or leave logins
+    // waiting for a slot that never frees.
+    int counted = strcmp(name, "max-connections") == 0 || strcmp(name, "auth-slots") == 0;
+    if (counted && (value < 1 || value > INT_MAX / ADMISSION_AUTH_QUEUE || value != (int) value)) {
+        return -1;
+    }
+    pthread_mutex_lock(&admission->lock);
+    int result = 0;
+    if (strcmp(name, "max-connections") == 0) {
+        admission->maxSessions = (int) value;
+    } else if (strcmp(name, "auth-slots") == 0) {
+        admission->maxAuth = (int) value;
+        admission->maxAuthQueue = admission->maxAuth * ADMISSION_AUTH_QUEUE;
+        pthread_cond_broadcast(&admission->authFree); // more slots: waiters may go
+    } else if (strcmp(name, "max-load") == 0) {
+        admission->maxLoad = value;
+        admission->sampledAt = monotonic_ms() - ADMISSION_SAMPLE_MS; // judged again on the next sample
+    } else if (strcmp(name, "min-free-mb") == 0) {
+        admission->minFreeKb = (long) (value * 1024);
+        admission->sampledAt = monotonic_ms() - ADMISSION_SAMPLE_MS;
+    } else {
+        result = -1;
+    }
+    pthread_mutex_unlock(&admission->lock);
+    return result;
+}
+
+void freeAdmission(Admission *admission) {
+    if (admission->shedConnections > 0 || admission->shedLogins > 0) {
+        printf("Admission: refused %llu connections and %llu logins while busy\n",
+               admission->shedConnections, admission->shedLogins);
+    }
+    pthread_mutex_destroy(&admission->lock);
+    pthread_cond_destroy(&admission->authFree);
+}
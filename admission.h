@@ -0,0 +1,85 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+/**
+ * Admission control: what the server takes on when it is overloaded.
+ *
+ * Every connection costs a thread (and with TLS a handshake), and every
+ * login or registration a crypt() call of several milliseconds. When many
+ * clients reconnect at once (a network blip, a restart) doing all of it at
+ * once serves nobody. So:
+ *
+ *   - The accept loop admits at most maxSessions connections, and none
+ *     while the machine is overloaded: more runnable threads than maxLoad
+ *     per CPU, or less than minFreeKb of available memory (sampled from
+ *     /proc every ADMISSION_SAMPLE_MS; getloadavg() elsewhere).
+ *   - At most maxAuth password checks run at a time. Other logins queue,
+ *     as long as the checks ahead of them (timed as they run) can be done
+ *     within ADMISSION_AUTH_WAIT_MS; that is also the longest one waits.
+ *   - Resuming clients go first: a login that resumed its TLS session or
+ *     names a device the user already has waits ahead of new ones, may queue
+ *     for the whole wait (new logins only for half of it) and is still
+ *     served while the machine is overloaded.
+ *
+ * The limits can be changed while the server runs (admin-socket.h).
+ *
+ * What is refused is told so, with a time to come back (BUSY_ERROR in
+ * protocol.h), instead of waiting until the client times out. The time
+ * grows with the queue and is spread out, so refused clients don't all
+ * return in the same second.
+ */
+
+#define ADMISSION_MAX_SESSIONS 10000 // default connection limit (lowered to fit RLIMIT_NOFILE)
+#define ADMISSION_MAX_LOAD 2.0       // runnable threads per CPU before new work is shed
+#define ADMISSION_MIN_FREE_KB (64 * 1024) // available memory before new work is shed
+#define ADMISSION_AUTH_QUEUE 64      // most waiting logins per password check slot
+#define ADMISSION_AUTH_WAIT_MS 2000  // longest a login waits for a slot
+#define ADMISSION_SAMPLE_MS 250      // how often load and memory are read
+#define ADMISSION_MAX_RETRY_SEC 30   // longest retry time handed out
+
+/**
+ * Struct name: Admission
+ * Description: Limits and counters, shared by the accept loop and the
+ *              connection threads (all under lock).
+ *
+ * param sessions        Connections admitted and not closed yet.
+ * param authActive      Password checks running.
+ * param authWaiting     Logins waiting for a check, priorityWaiting of them resuming.
+ * param authMs          Average time of a password check.
+ * param overloaded      Load or memory over the limit at the last sample.
+ * param shedConnections Connections refused, shedLogins logins and registrations refused.
+ */
+typedef struct ADMISSION {
+    pthread_mutex_t lock;
+    pthread_cond_t authFree;
+    int maxSessions;
+    int maxAuth;
+    int maxAuthQueue;
+    double maxLoad;
+    long minFreeKb;
+    int cpus;
+    int sessions;
+    int authActive;
+    int authWaiting;
+    int priorityWaiting;
+    double authMs;
+    long long sampledAt;
+    int overloaded;
+    unsigned long long shedConnections;
+    unsigned long long shedLogins;
+} Admission;
+
+// Function prototypes
+void initAdmission(Admission *admission, int max_sessions);
+int admitConnection(Admission *admission, int resuming, int *retry_after);
+void releaseConnection(Admission *admission);
+int beginAuth(Admission *admission, int resuming, int *retry_after);
+void endAuth(Admission *admission);
+void getAdmissionStats(Admission *admission, Admission *out);
+int setAdmissionLimit(Admission *admission, const char *name, double value);
+void freeAdmission(Admission *admission);
+
+#endif // ADMISSION_H
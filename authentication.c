@@ -1,4 +1,4 @@
-// compile:  gcc -lcrypt  authentication.c authentication-main.c
+// compile:  gcc -c authentication.c (link the program with -lcrypt)
 
 #include <stdio.h>
 #include <termios.h>
@@ -7,6 +7,8 @@
 #include <stdlib.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
+#include <time.h>
+#include <crypt.h> // crypt_r(): glibc/libxcrypt, FreeBSD 12+
 #include "authentication.h"
 
 void generatesalt(char salt[]) {
@@ -30,21 +32,25 @@ void generatesalt(char salt[]) {
 // return a pointer to the encoded password 
 char* encode(char *plainpswd) {
    char *savedpswd;
-   char salt[] = "$1$........";
+   // "$5$" selects SHA-256 on FreeBSD and on Linux alike
+   // (crypt_set_format() only exists on FreeBSD)
+   char salt[] = "$5$........";
 
-   // set set encryption algorithm to SHA-256
-   crypt_set_format("sha256");
-  
-   // encode the plainpassword
+   // encode the plainpassword; crypt() returns a static buffer shared by
+   // every thread, crypt_r() one of our own
    generatesalt(salt);
-   char *encoded = crypt(plainpswd, salt);
+   struct crypt_data *data = calloc(1, sizeof(struct crypt_data));
+   if (data == NULL) {
+      return NULL;
+   }
+   char *encoded = crypt_r(plainpswd, salt, data);
 
    // better security
    memset(plainpswd, 0, strlen(plainpswd));
 
    // retrive the password from the crypt buffer
-   savedpswd = (char*) malloc(256);
-   strcpy(savedpswd, encoded);
+   savedpswd = (encoded != NULL) ? strdup(encoded) : NULL;
+   free(data);
 
    return savedpswd;
 }
@@ -54,13 +60,19 @@ char* encode(char *plainpswd) {
 // return 0 if the encoded loginpswd is the same as the
 // savedpswd.  
 int authenticate(char *loginpswd, char *savedpswd) {
-   crypt_set_format("sha256");
-   char* encodedloginpswd = crypt(loginpswd, savedpswd);
+   // the saved password starts with its algorithm, so older "$1$" ones still work
+   struct crypt_data *data = calloc(1, sizeof(struct crypt_data));
+   if (data == NULL) {
+      return 0;
+   }
+   char* encodedloginpswd = crypt_r(loginpswd, savedpswd, data);
 
    // better security
    memset(loginpswd, 0, strlen(loginpswd));
 
-   return strcmp(encodedloginpswd, savedpswd) == 0;
+   int matches = encodedloginpswd != NULL && strcmp(encodedloginpswd, savedpswd) == 0;
+   free(data);
+   return matches;
 }
 
 // read user input with no echo. Thus, what user entered
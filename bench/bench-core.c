@@ -0,0 +1,560 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "../protocol.h"
+#include "../user-list.h"
+#include "../group-list.h"
+#include "../msg-list.h"
+#include "../msg-batch.h"
+#include "../wire-compress.h"
+#include "../mutexes.h"
+#include "../fanout.h"
+#include "../authentication.h"
+#include "../msg-filter.h"
+
+/**
+ * Program name: bench-core.c
+ * Description:  Microbenchmarks of the server's hot paths, run at directory
+ *               sizes from 10 to 1M users: user lookup (LOGIN/REGISTRATION),
+ *               membership checks and fan-out selection (MESSAGE), login and
+ *               logout in a group's fan-out partitions, appending to and
+ *               walking the message history, the batch/page/compressed frame
+ *               codecs, the moderation filter (msg-filter.c) with 10 to 10k
+ *               patterns and password encode/authenticate. Every case runs
+ *               until it has taken at least the minimum time and reports
+ *               nanoseconds per operation, so two builds can be compared
+ *               line by line (-c prints CSV for that).
+ * Compile:      gcc -O2 -pthread -o bench-core bench/bench-core.c user-list.c group-list.c msg-list.c \
+ *                   mutexes.c dedup-window.c authentication.c msg-batch.c wire-compress.c tls-transport.c fanout.c \
+ *                   cpu-affinity.c uring-io.c msg-filter.c -lcrypt -lssl -lcrypto -lz
+ * Run:          ./bench-core [-c] [-f filter] [-n max users] [-t min ms per case]
+ */
+
+#define BENCH_WORKERS 4      // fan-out partitions per group
+#define BENCH_GROUPS 8       // groups per user; the shared one is walked last
+#define BENCH_PROBES 4096    // distinct emails looked up per case
+
+typedef void (*BenchFunction)(long iterations, void *arg);
+
+/**
+ * Struct name: Fixture
+ * Description: A server directory of `users` users, all in group "CMPS"
+ *              (online in its fan-out partitions, one device each) and in
+ *              BENCH_GROUPS - 1 others, with `users` messages in its history.
+ */
+typedef struct {
+    long users;
+    UserList userList;
+    GroupList groupList;
+    MessageList messageList;
+    GroupInfo *group;
+    FanoutPool pool;
+    DeviceCursor *cursors;
+    User **members;
+    char (*hits)[64];
+    char (*misses)[64];
+    unsigned int seq;
+    unsigned int walk;
+    BodyReader reader;
+} Fixture;
+
+static const char *filter = NULL;
+static double min_ns = 200e6;
+static int csv = 0;
+static volatile long sink; // keeps results alive so the compiler can't drop the work
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Runs one case with a growing iteration count until a run takes at least
+ * min_ns, then prints that run.
+ *
+ * param scale Users in the fixture (patterns for the filter cases), 0 for
+ *              cases that don't depend on it.
+ */
+static void run_case(const char *name, long scale, BenchFunction function, void *arg) {
+    char label[96];
+    if (scale > 0) {
+        snprintf(label, sizeof label, "%s/%ld", name, scale);
+    } else {
+        snprintf(label, sizeof label, "%s", name);
+    }
+    if (filter != NULL && strstr(label, filter) == NULL) {
+        return;
+    }
+    long iterations = 1;
+    double elapsed;
+    while (1) {
+        double start = now_ns();
+        function(iterations, arg);
+        elapsed = now_ns() - start;
+        if (elapsed >= min_ns || iterations >= (1L << 30)) {
+            break;
+        }
+        // Aim a little past the minimum, growing at most tenfold per round.
+        double factor = (elapsed > 0) ? 1.4 * min_ns / elapsed : 10;
+        iterations = (long) (iterations * (factor < 10 ? (factor > 2 ? factor : 2) : 10));
+    }
+    if (csv) {
+        printf("%s,%ld,%.1f\n", label, iterations, elapsed / iterations);
+    } else {
+        printf("%-32s %12ld %14.1f ns/op\n", label, iterations, elapsed / iterations);
+    }
+    fflush(stdout);
+}
+
+// ======= USERS =========== //
+
+// LOGIN_TYPE: the email is looked up, then the password checked.
+static void bench_login_lookup(long iterations, void *arg) {
+    Fixture *fixture = (Fixture *) arg;
+    long found = 0;
+    for (long i = 0; i < iterations; i++) {
+        found += findUser(&fixture->userList, fixture->hits[i % BENCH_PROBES]) != NULL;
+    }
+    sink = found;
+}
+
+// REGISTRATION_TYPE: the email must not be taken yet.
+static void bench_register_lookup(long iterations, void *arg) {
+    Fixture *fixture = (Fixture *) arg;
+    long found = 0;
+    for (long i = 0; i < iterations; i++) {
+        found += findUser(&fixture->userList, fixture->misses[i % BENCH_PROBES]) != NULL;
+    }
+    sink = found;
+}
+
+// ======= GROUPS =========== //
+
+// MESSAGE_TYPE: is the sender in the group? (find_membership() in my-server.c)
+static void bench_membership(long iterations, void *arg) {
+    Fixture *fixture = (Fixture *) arg;
+    long found = 0;
+    for (long i = 0; i < iterations; i++) {
+        User *user = fixture->members[(i * 7919) % fixture->users];
+        pthread_mutex_lock(user_lock(user));
+        Group *group = user->groups;
+        while (group != NULL && strcmp(group->name, "CMPS") != 0) {
+            group = group->next;
+        }
+        found += group != NULL && group->info == fixture->group;
+        pthread_mutex_unlock(user_lock(user));
+    }
+    sink = found;
+}
+
+/**
+ * One message's walk of every partition of the group, choosing the members
+ * that haven't been sent it yet: the loop of deliver() in fanout.c without
+ * the sends. One operation is one message to all `users` members.
+ */
+static void bench_fanout_select(long iterations, void *arg) {
+    Fixture *fixture = (Fixture *) arg;
+    long selected = 0;
+    for (long i = 0; i < iterations; i++) {
+        unsigned int seq = ++fixture->seq;
+        for (int w = 0; w < fixture->pool.count; w++) {
+            FanoutPartition *partition = &fixture->group->partitions[w];
+            pthread_mutex_lock(&partition->lock);
+            for (int m = 0; m < partition->count; m++) {
+                FanoutMember *member = &partition->members[m];
+                if (member->cursor->sentSeq >= seq) {
+                    continue;
+                }
+                member->cursor->sentSeq = seq;
+                selected++;
+            }
+            pthread_mutex_unlock(&partition->lock);
+        }
+    }
+    sink = selected;
+}
+
+// A device going offline and coming back: out of the group's partition and in again.
+static void bench_fanout_rejoin(long iterations, void *arg) {
+    Fixture *fixture = (Fixture *) arg;
+    for (long i = 0; i < iterations; i++) {
+        long m = (i * 7919) % fixture->users;
+        int fd = (int) m + 3;
+        removeOnlineMember(&fixture->pool, fixture->group, fixture->members[m], fd);
+        pthread_mutex_lock(&fixture->group->lock);
+        addOnlineMember(&fixture->pool, fixture->group, fixture->members[m], &fixture->cursors[m], fd);
+        pthread_mutex_unlock(&fixture->group->lock);
+    }
+}
+
+// ======= MESSAGES =========== //
+
+// MESSAGE_TYPE: store a message in the history and the group's index.
+static void bench_append(long iterations, void *arg) {
+    Fixture *fixture = (Fixture *) arg;
+    for (long i = 0; i < iterations; i++) {
+        MessageHeader header;
+        header.groupId = fixture->group->id;
+        header.senderId = fixture->members[i % fixture->users]->id;
+        header.timestamp = 1700000000000LL;
+        pthread_mutex_lock(&fixture->group->lock);
+        header.seq = fixture->group->lastSeq + 1;
+        appendGroupMessage(fixture->group, appendMessage(&fixture->messageList, &header, "Hello, CMPS!", -1));
+        pthread_mutex_unlock(&fixture->group->lock);
+    }
+}
+
+// History replay in list order, with the sender and text; one operation
+// is one message.
+static void bench_history_list(long iterations, void *arg) {
+    Fixture *fixture = (Fixture *) arg;
+    unsigned int position = fixture->walk;
+    long bytes = 0;
+    for (long i = 0; i < iterations; i++) {
+        if (position >= (unsigned int) fixture->messageList.count) {
+            position = 0;
+        }
+        MessageHeader *header = getMessageHeader(&fixture->messageList, position++);
+        bytes += header->seq + getSenderName(&fixture->userList, header)[0] +
+                 readMessageBody(&fixture->messageList, header, &fixture->reader)[0];
+    }
+    fixture->walk = position;
+    sink = bytes;
+}
+
+// Retransmission and catch-up: messages fetched by sequence number.
+static void bench_history_seq(long iterations, void *arg) {
+    Fixture *fixture = (Fixture *) arg;
+    unsigned int last = fixture->group->lastSeq;
+    long found = 0;
+    for (long i = 0; i < iterations; i++) {
+        found += getMessageHeader(&fixture->messageList,
+                                  getGroupMessage(fixture->group, 1 + (unsigned int) ((i * 7919) % last))) != NULL;
+    }
+    sink = found;
+}
+
+// ======= CODEC =========== //
+
+// A batch of backlog messages filled to BATCH_MAX_BYTES; one operation is one message.
+static void bench_batch_encode(long iterations, void *arg) {
+    MessageBatch *batch = (MessageBatch *) arg;
+    initBatch(batch, BATCH_MESSAGE_TYPE, "CMPS", 0);
+    for (long i = 0; i < iterations; i++) {
+        if (addBatchMessage(batch, "User42", "Hello, CMPS! See you at the meeting.", i + 1, 1700000000000LL) == -1) {
+            initBatch(batch, BATCH_MESSAGE_TYPE, "CMPS", i);
+            addBatchMessage(batch, "User42", "Hello, CMPS! See you at the meeting.", i + 1, 1700000000000LL);
+        }
+    }
+}
+
+static void count_message(user_message *msg, void *arg) {
+    (*(long *) arg) += msg->seq;
+}
+
+// Decodes a full batch; one operation is one message.
+static void bench_batch_decode(long iterations, void *arg) {
+    MessageBatch *batch = (MessageBatch *) arg;
+    long total = 0;
+    for (long i = 0; i < iterations; i += batch->header.count) {
+        decodeBatch(&batch->header, batch->payload, count_message, &total);
+    }
+    sink = total;
+}
+
+// Batched SEND requests, encoded and decoded; one operation is one request.
+static void bench_op_batch(long iterations, void *arg) {
+    OpBatch *batch = (OpBatch *) arg;
+    c2s_send_message request;
+    long decoded = 0;
+    long i = 0;
+    while (i < iterations) {
+        initOpBatch(batch, BATCH_REQUEST_TYPE);
+        long start = i;
+        while (i < iterations && addBatchRequest(batch, MESSAGE_TYPE, (unsigned int) i + 1, "CMPS Hello there") == 0) {
+            i++;
+        }
+        if (i == start) {
+            break;
+        }
+        size_t offset = 0;
+        while (nextBatchRequest(&batch->header, batch->payload, &offset, &request) == 1) {
+            decoded++;
+        }
+    }
+    sink = decoded;
+}
+
+// Roster pages, encoded and decoded; one operation is one member.
+static void bench_page(long iterations, void *arg) {
+    Page *page = (Page *) arg;
+    char name[BUFFER_SIZE], email[BUFFER_SIZE];
+    int online;
+    long decoded = 0;
+    long i = 0;
+    while (i < iterations) {
+        initPage(page, ROSTER_PAGE_TYPE, 1, (unsigned int) iterations);
+        long start = i;
+        while (i < iterations && addPageMember(page, "User42", "user42@scranton.edu", (int) (i & 1)) == 0) {
+            i++;
+        }
+        if (i == start) {
+            break;
+        }
+        size_t offset = 0;
+        while (nextPageMember(&page->header, page->payload, &offset, name, email, &online) == 1) {
+            decoded++;
+        }
+    }
+    sink = decoded;
+}
+
+// A PRINT_MESSAGE frame compressed for a compressing client and inflated again.
+static void bench_compress(long iterations, void *arg) {
+    CompressedFrame *packed = (CompressedFrame *) arg;
+    static char raw[COMPRESS_MAX_RAW];
+    user_message frame;
+    memset(&frame, 0, sizeof frame);
+    frame.type = PRINT_MESSAGE_TYPE;
+    strcpy(frame.name, "User42");
+    strcpy(frame.message, "Hello, CMPS! See you at the meeting.");
+    strcpy(frame.group, "CMPS");
+    frame.seq = 1;
+    frame.timestamp = 1700000000000LL;
+    long bytes = 0;
+    for (long i = 0; i < iterations; i++) {
+        frame.seq = (unsigned int) i + 1;
+        if (compressFrames(packed, &frame, sizeof frame) == 0) {
+            bytes += decompressFrames(&packed->header, packed->data, raw, sizeof raw);
+        }
+    }
+    sink = bytes;
+}
+
+// ======= FILTER =========== //
+
+#define BENCH_CLEAN_TEXT "Hello, CMPS! See you at the meeting at 3pm, room 204. Bring the slides please."
+#define BENCH_BLOCKED_TEXT "Hello, CMPS! Cheap slides at http://example.com/offer, see you at the meeting."
+
+// A chat line of ordinary length that matches nothing (the common case).
+static void bench_filter_clean(long iterations, void *arg) {
+    FilterAutomaton *automaton = (FilterAutomaton *) arg;
+    long blocked = 0;
+    for (long i = 0; i < iterations; i++) {
+        blocked += scanFilter(automaton, BENCH_CLEAN_TEXT, sizeof BENCH_CLEAN_TEXT - 1);
+    }
+    sink = blocked;
+}
+
+static void bench_filter_blocked(long iterations, void *arg) {
+    FilterAutomaton *automaton = (FilterAutomaton *) arg;
+    long blocked = 0;
+    for (long i = 0; i < iterations; i++) {
+        blocked += scanFilter(automaton, BENCH_BLOCKED_TEXT, sizeof BENCH_BLOCKED_TEXT - 1);
+    }
+    sink = blocked;
+}
+
+// count random lowercase words of 4 to 10 letters, every tenth one open at
+// the end, and a link pattern.
+static FilterAutomaton *build_filter(int count) {
+    char **patterns = (char **) malloc(count * sizeof(char *));
+    if (patterns == NULL) {
+        return NULL;
+    }
+    unsigned int state = 12345;
+    for (int p = 0; p < count - 1; p++) {
+        char word[16];
+        state = state * 1103515245 + 12345;
+        int len = 4 + (int) ((state >> 16) % 7);
+        for (int i = 0; i < len; i++) {
+            state = state * 1103515245 + 12345;
+            word[i] = (char) ('a' + (state >> 16) % 26);
+        }
+        word[len] = (p % 10 == 0) ? '*' : '\0';
+        word[len + 1] = '\0';
+        patterns[p] = strdup(word);
+    }
+    patterns[count - 1] = strdup("http://*");
+    FilterAutomaton *automaton = compileFilter(patterns, count);
+    for (int p = 0; p < count; p++) {
+        free(patterns[p]);
+    }
+    free(patterns);
+    return automaton;
+}
+
+// ======= PASSWORDS =========== //
+
+static void bench_encode(long iterations, void *arg) {
+    for (long i = 0; i < iterations; i++) {
+        char password[] = "correct horse battery staple";
+        free(encode(password));
+    }
+}
+
+static void bench_authenticate(long iterations, void *arg) {
+    char *saved = (char *) arg;
+    long matches = 0;
+    for (long i = 0; i < iterations; i++) {
+        char password[] = "correct horse battery staple";
+        matches += authenticate(password, saved);
+    }
+    sink = matches;
+}
+
+// ======= FIXTURE =========== //
+
+/**
+ * Builds the directory for one scale.
+ *
+ * return 0 on success, -1 if memory ran out.
+ */
+static int build_fixture(Fixture *fixture, long users) {
+    memset(fixture, 0, sizeof(Fixture));
+    fixture->users = users;
+    initUserList(&fixture->userList);
+    initGroupList(&fixture->groupList);
+    initMessageList(&fixture->messageList);
+    fixture->group = getOrCreateGroup(&fixture->groupList, "CMPS", NULL);
+    fixture->cursors = (DeviceCursor *) calloc(users, sizeof(DeviceCursor));
+    fixture->members = (User **) calloc(users, sizeof(User *));
+    fixture->hits = calloc(BENCH_PROBES, sizeof *fixture->hits);
+    fixture->misses = calloc(BENCH_PROBES, sizeof *fixture->misses);
+    if (fixture->group == NULL || fixture->cursors == NULL || fixture->members == NULL ||
+        fixture->hits == NULL || fixture->misses == NULL ||
+        startFanoutPool(&fixture->pool, BENCH_WORKERS, NULL, 0) == -1) {
+        perror("Error building benchmark fixture");
+        return -1;
+    }
+    // Shaped like encode() output: "$5$<salt>$<43-char hash>"
+    char password[] = "$5$abcdefgh$0123456789abcdefghijABCDEFGHIJ0123456789abc";
+    for (long i = 0; i < users; i++) {
+        char email[64], name[64], group[32];
+        snprintf(email, sizeof email, "user%ld@scranton.edu", i);
+        snprintf(name, sizeof name, "User%ld", i);
+        User *user = createUser(email, name, password);
+        if (user == NULL) {
+            return -1;
+        }
+        Group *membership = addUserGroup(user, "CMPS", 0);
+        if (membership == NULL || addGroupMember(fixture->group, membership) == -1) {
+            return -1;
+        }
+        for (int g = 1; g < BENCH_GROUPS; g++) {
+            snprintf(group, sizeof group, "CMPS%ld", 300 + (i + g) % 100);
+            addUserGroup(user, group, 0);
+        }
+        appendUser(&fixture->userList, user);
+        fixture->members[i] = user;
+        fixture->cursors[i].membership = membership;
+        fixture->cursors[i].group = fixture->group;
+        addOnlineMember(&fixture->pool, fixture->group, user, &fixture->cursors[i], (int) i + 3);
+    }
+    srand(42);
+    for (int p = 0; p < BENCH_PROBES; p++) {
+        snprintf(fixture->hits[p], sizeof *fixture->hits, "user%ld@scranton.edu", (long) rand() % users);
+        snprintf(fixture->misses[p], sizeof *fixture->misses, "nobody%d@scranton.edu", p);
+    }
+    bench_append(users, fixture);
+    return 0;
+}
+
+static void free_fixture(Fixture *fixture) {
+    stopFanoutPool(&fixture->pool, &fixture->groupList);
+    freeMessageList(&fixture->messageList);
+    freeUserList(&fixture->userList);
+    freeGroupList(&fixture->groupList);
+    free(fixture->cursors);
+    free(fixture->members);
+    free(fixture->hits);
+    free(fixture->misses);
+}
+
+int main(int argc, char *argv[]) {
+    long max_users = 1000000;
+    int opt;
+    while ((opt = getopt(argc, argv, "cf:n:t:")) != -1) {
+        switch (opt) {
+            case 'c': csv = 1; break;
+            case 'f': filter = optarg; break;
+            case 'n': max_users = atol(optarg); break;
+            case 't': min_ns = atof(optarg) * 1e6; break;
+            default:
+                fprintf(stderr, "Usage: %s [-c] [-f filter] [-n max users] [-t min ms per case]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (csv) {
+        printf("case,iterations,ns_per_op\n");
+    } else {
+        printf("%-32s %12s %17s\n", "case", "iterations", "time");
+    }
+
+    // Codec and passwords don't depend on the directory's size.
+    MessageBatch *batch = (MessageBatch *) malloc(sizeof(MessageBatch));
+    OpBatch *opBatch = (OpBatch *) malloc(sizeof(OpBatch));
+    Page *page = (Page *) malloc(sizeof(Page));
+    CompressedFrame *packed = (CompressedFrame *) malloc(sizeof(CompressedFrame));
+    if (batch == NULL || opBatch == NULL || page == NULL || packed == NULL) {
+        perror("Error allocating frames");
+        return 1;
+    }
+    run_case("codec/batch-encode", 0, bench_batch_encode, batch);
+    initBatch(batch, BATCH_MESSAGE_TYPE, "CMPS", 0);
+    for (unsigned int seq = 1;
+         addBatchMessage(batch, "User42", "Hello, CMPS! See you at the meeting.", seq, 1700000000000LL) == 0; seq++);
+    run_case("codec/batch-decode", 0, bench_batch_decode, batch);
+    run_case("codec/op-batch", 0, bench_op_batch, opBatch);
+    run_case("codec/page", 0, bench_page, page);
+    initCompressedFrame(packed);
+    run_case("codec/compress", 0, bench_compress, packed);
+    for (int patterns = 10; patterns <= 10000; patterns *= 10) {
+        FilterAutomaton *automaton = build_filter(patterns);
+        if (automaton == NULL) {
+            perror("Error compiling filter");
+            return 1;
+        }
+        run_case("filter/clean", patterns, bench_filter_clean, automaton);
+        run_case("filter/blocked", patterns, bench_filter_blocked, automaton);
+        freeFilterAutomaton(automaton);
+    }
+    char password[] = "correct horse battery staple";
+    char *saved = encode(password);
+    if (saved == NULL) {
+        perror("Error encoding password");
+        return 1;
+    }
+    run_case("auth/encode", 0, bench_encode, NULL);
+    run_case("auth/authenticate", 0, bench_authenticate, saved);
+    free(saved);
+    free(batch);
+    free(opBatch);
+    free(page);
+    free(packed);
+
+    for (long users = 10; users <= max_users; users *= 10) {
+        Fixture fixture;
+        double start = now_ns();
+        if (build_fixture(&fixture, users) == -1) {
+            return 1;
+        }
+        if (!csv) {
+            printf("-- %ld users (built in %.0f ms)\n", users, (now_ns() - start) / 1e6);
+        }
+        run_case("user/login-lookup", users, bench_login_lookup, &fixture);
+        run_case("user/register-lookup", users, bench_register_lookup, &fixture);
+        run_case("group/membership", users, bench_membership, &fixture);
+        run_case("group/fanout-select", users, bench_fanout_select, &fixture);
+        run_case("group/fanout-rejoin", users, bench_fanout_rejoin, &fixture);
+        run_case("msg/history-list", users, bench_history_list, &fixture);
+        run_case("msg/history-seq", users, bench_history_seq, &fixture);
+        run_case("msg/append", users, bench_append, &fixture);
+        free_fixture(&fixture);
+    }
+    return 0;
+}
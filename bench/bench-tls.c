@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+#include "../protocol.h"
+#include "../tls-transport.h"
+
+/**
+ * Program name: bench-tls.c
+ * Description:  Compares plaintext and TLS throughput of the transport on the
+ *               server->client fan-out direction, using user_message frames,
+ *               and compares full TLS handshakes with resumed ones.
+ *               A throwaway self-signed certificate for 127.0.0.1 is created
+ *               at startup, so no setup is needed.
+ * Compile:      gcc -O2 -o bench-tls bench/bench-tls.c tls-transport.c -lssl -lcrypto -pthread
+ * Run:          ./bench-tls [frames] [handshakes]
+ */
+
+#define CERT_FILE "/tmp/bench-tls-cert.pem"
+#define KEY_FILE "/tmp/bench-tls-key.pem"
+
+typedef struct {
+    int listen_socket;
+    int use_tls;
+    long frames;     // frames to send per connection (throughput run)
+    int connections; // connections to accept (handshake run)
+} BenchServer;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpu_sec(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+// Writes a self-signed P-256 certificate with an IP SAN of 127.0.0.1.
+static int write_test_certificate(void) {
+    EVP_PKEY *key = EVP_EC_gen("P-256");
+    X509 *cert = X509_new();
+    if (key == NULL || cert == NULL) {
+        return -1;
+    }
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 24 * 3600);
+    X509_set_pubkey(cert, key);
+    X509_NAME *name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *) "127.0.0.1", -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    X509_EXTENSION *san = X509V3_EXT_conf_nid(NULL, NULL, NID_subject_alt_name, "IP:127.0.0.1");
+    X509_add_ext(cert, san, -1);
+    X509_EXTENSION_free(san);
+    X509_sign(cert, key, EVP_sha256());
+
+    FILE *cert_fp = fopen(CERT_FILE, "w");
+    FILE *key_fp = fopen(KEY_FILE, "w");
+    if (cert_fp == NULL || key_fp == NULL) {
+        return -1;
+    }
+    PEM_write_X509(cert_fp, cert);
+    PEM_write_PrivateKey(key_fp, key, NULL, NULL, 0, NULL, NULL);
+    fclose(cert_fp);
+    fclose(key_fp);
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return 0;
+}
+
+static int listen_loopback(int *port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    socklen_t len = sizeof addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof addr) == -1 || listen(fd, 128) == -1) {
+        perror("bench listen");
+        exit(1);
+    }
+    getsockname(fd, (struct sockaddr *) &addr, &len);
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+static int connect_loopback(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof addr) == -1) {
+        perror("bench connect");
+        exit(1);
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    return fd;
+}
+
+// Server side: accept, optionally handshake, then either stream frames
+// (throughput run) or send one ACK so the client reads the session ticket.
+static void *bench_server(void *arg) {
+    BenchServer *server = (BenchServer *) arg;
+    for (int c = 0; c < server->connections; c++) {
+        int fd = accept(server->listen_socket, NULL, NULL);
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+        if (server->use_tls && tls_accept_client(fd) == -1) {
+            exit(1);
+        }
+        if (server->frames > 0) {
+            user_message frame;
+            memset(&frame, 0, sizeof frame);
+            frame.type = PRINT_MESSAGE_TYPE;
+            strcpy(frame.name, "bench");
+            memset(frame.message, 'x', 120);
+            for (long i = 0; i < server->frames; i++) {
+                net_send(fd, &frame, sizeof frame);
+            }
+        } else {
+            s2c_send_ok_ack ack;
+            ack.type = ACK_TYPE;
+            ack.requestId = 0;
+            net_send(fd, &ack, sizeof ack);
+        }
+        // Wait for the client to finish before tearing down.
+        char drain;
+        net_recv(fd, &drain, 1);
+        net_close(fd);
+    }
+    return NULL;
+}
+
+static void run_throughput(int use_tls, long frames) {
+    BenchServer server;
+    pthread_t thread;
+    int port;
+    server.listen_socket = listen_loopback(&port);
+    server.use_tls = use_tls;
+    server.frames = frames;
+    server.connections = 1;
+    pthread_create(&thread, NULL, bench_server, &server);
+
+    int fd = connect_loopback(port);
+    if (use_tls && tls_connect_server(fd, "127.0.0.1") == -1) {
+        exit(1);
+    }
+
+    double wall = now_sec();
+    double cpu = cpu_sec();
+    long long total = (long long) frames * sizeof(user_message);
+    long long received = 0;
+    char buf[64 * 1024];
+    while (received < total) {
+        ssize_t n = net_recv(fd, buf, sizeof buf);
+        if (n <= 0) {
+            printf("connection lost after %lld bytes\n", received);
+            exit(1);
+        }
+        received += n;
+    }
+    wall = now_sec() - wall;
+    cpu = cpu_sec() - cpu;
+
+    int tx = 0, rx = 0;
+    tls_ktls_status(fd, &tx, &rx);
+    printf("%-9s %8ld frames  %8.1f MB/s  %9.0f frames/s  %6.2f CPU-s/GB  kTLS tx=%d rx=%d\n",
+           use_tls ? "TLS" : "plaintext", frames, total / wall / 1e6, frames / wall,
+           cpu / (total / 1e9), tx, rx);
+
+    net_send(fd, "x", 1);
+    net_close(fd);
+    pthread_join(thread, NULL);
+    close(server.listen_socket);
+}
+
+static void run_handshakes(int resume, int count) {
+    BenchServer server;
+    pthread_t thread;
+    int port;
+    server.listen_socket = listen_loopback(&port);
+    server.use_tls = 1;
+    server.frames = 0;
+    server.connections = count;
+    pthread_create(&thread, NULL, bench_server, &server);
+
+    tls_client_forget_session();
+    int resumed = 0;
+    double wall = now_sec();
+    for (int c = 0; c < count; c++) {
+        if (!resume) {
+            tls_client_forget_session();
+        }
+        int fd = connect_loopback(port);
+        if (tls_connect_server(fd, "127.0.0.1") == -1) {
+            exit(1);
+        }
+        s2c_send_ok_ack ack;
+        net_recv(fd, &ack, sizeof ack); // also processes the session ticket
+        resumed += tls_session_reused(fd);
+        net_send(fd, "x", 1);
+        net_close(fd);
+    }
+    wall = now_sec() - wall;
+    printf("%-9s %8d handshakes  %8.0f /s  %7.1f us each  (%d resumed)\n",
+           resume ? "resumed" : "full", count, count / wall, wall / count * 1e6, resumed);
+
+    pthread_join(thread, NULL);
+    close(server.listen_socket);
+}
+
+int main(int argc, char *argv[]) {
+    long frames = (argc > 1) ? atol(argv[1]) : 200000;
+    int handshakes = (argc > 2) ? atoi(argv[2]) : 500;
+
+    if (write_test_certificate() == -1 ||
+        tls_server_init(CERT_FILE, KEY_FILE) == -1 ||
+        tls_client_init(CERT_FILE) == -1) {
+        printf("Error setting up TLS for the benchmark\n");
+        return 1;
+    }
+
+    printf("== throughput (%zu-byte user_message frames, server -> client)\n", sizeof(user_message));
+    run_throughput(0, frames);
+    run_throughput(1, frames);
+
+    printf("== handshakes\n");
+    run_handshakes(0, handshakes);
+    run_handshakes(1, handshakes);
+
+    unlink(CERT_FILE);
+    unlink(KEY_FILE);
+    return 0;
+}
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "../protocol.h"
+#include "../user-list.h"
+#include "../group-list.h"
+#include "../user-store.h"
+
+/**
+ * Program name: bench-user-store.c
+ * Description:  Measures server startup cost of the durable user directory:
+ *               writes a snapshot of N users (each in "CMPS" plus one of 100
+ *               other groups), appends W registrations to the log, then times
+ *               openUserStore() loading both and indexing every group's members.
+ * Compile:      gcc -O2 -o bench-user-store bench/bench-user-store.c user-store.c user-list.c group-list.c \
+ *                   mutexes.c dedup-window.c -pthread
+ * Run:          ./bench-user-store [users] [log records] [datadir]
+ */
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static User *make_user(long i) {
+    char email[64], name[64], group[32];
+    // Shaped like encode() output: "$5$<salt>$<43-char hash>"
+    char password[] = "$5$abcdefgh$0123456789abcdefghijABCDEFGHIJ0123456789abc";
+    snprintf(email, sizeof email, "user%ld@scranton.edu", i);
+    snprintf(name, sizeof name, "User%ld", i);
+    snprintf(group, sizeof group, "CMPS%ld", 300 + i % 100);
+    User *user = createUser(email, name, password);
+    addUserGroup(user, group, 0);
+    return user;
+}
+
+int main(int argc, char *argv[]) {
+    long users = (argc > 1) ? atol(argv[1]) : 1000000;
+    long records = (argc > 2) ? atol(argv[2]) : 1000;
+    const char *dir = (argc > 3) ? argv[3] : "/tmp/bench-user-store";
+    char command[512];
+    UserList userList;
+    GroupList groupList;
+    UserStore store;
+
+    snprintf(command, sizeof command, "rm -rf '%s'", dir);
+    if (system(command) != 0) {
+        return 1;
+    }
+
+    // Build the directory: snapshot of `users`, then `records` log entries.
+    initUserList(&userList);
+    initGroupList(&groupList);
+    if (openUserStore(&store, dir, &userList, &groupList) == -1) {
+        return 1;
+    }
+    double start = now_ms();
+    for (long i = 0; i < users; i++) {
+        appendUser(&userList, make_user(i));
+    }
+    printf("created %ld users in memory: %.0f ms\n", users, now_ms() - start);
+
+    start = now_ms();
+    if (writeUserSnapshot(&store) == -1) {
+        return 1;
+    }
+    printf("snapshot written: %.0f ms\n", now_ms() - start);
+
+    start = now_ms();
+    for (long i = 0; i < records; i++) {
+        User *user = make_user(users + i);
+        appendUser(&userList, user);
+        logRegistration(&store, user);
+    }
+    printf("%ld log records appended (fdatasync each): %.0f ms\n", records, now_ms() - start);
+    freeUserList(&userList);
+    freeGroupList(&groupList);
+    closeUserStore(&store);
+
+    // Restart: this is what the server does before accepting connections.
+    initUserList(&userList);
+    initGroupList(&groupList);
+    start = now_ms();
+    if (openUserStore(&store, dir, &userList, &groupList) == -1) {
+        return 1;
+    }
+    double load = now_ms() - start;
+    User *probe = findUser(&userList, "user12345@scranton.edu");
+    GroupInfo *group = findGroup(&groupList, DEFAULT_GROUP);
+    printf("startup load of %d users: %.1f ms (lookup check: %s, %s has %u members)\n", userList.count, load,
+           (users <= 12345 || (probe != NULL && strcmp(probe->name, "User12345") == 0)) ? "ok" : "FAILED",
+           DEFAULT_GROUP, group != NULL ? group->memberCount : 0);
+
+    freeUserList(&userList);
+    freeGroupList(&groupList);
+    closeUserStore(&store);
+    return 0;
+}
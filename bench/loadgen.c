@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "../protocol.h"
+#include "../tls-transport.h"
+#include "../chat-client.h"
+
+/**
+ * Program name: loadgen.c
+ * Description:  Load generator built on the chat-client library. One thread
+ *               drives every session: each registers a fresh user, then posts
+ *               messages to "CMPS" with one request (or with -b, one batch of
+ *               that many requests) in flight, timing each post from send to ACK. Every session is also a CMPS member,
+ *               so each post is fanned out to all of them; the run waits until the
+ *               fan-out has delivered every message to every session. Finally one more
+ *               connection syncs the group's whole history, to show what a
+ *               reconnect costs on the wire. -z negotiates compression.
+ * Compile:      gcc -O2 -pthread -o loadgen bench/loadgen.c chat-client.c seq-tracker.c msg-batch.c \
+ *                   msg-cache.c wire-compress.c tls-transport.c -lssl -lcrypto -lz
+ * Run:          ./loadgen [-t] [-z] [-b burst] [-A ca.pem] <hostname> <port> [sessions] [messages per session]
+ */
+
+typedef struct {
+    ChatClient *client;
+    int registered;
+    int sent;
+    int acked;
+    unsigned int firstId;   // requests firstId..lastId are in flight
+    unsigned int lastId;
+    int pending;
+    double sentAt;
+} LoadSession;
+
+static long deliveries;
+static long synced;
+static int sync_done;
+static double *latencies;
+static long latencyCount;
+static int failures;
+static int burst = 1;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static void on_response(ChatClient *client, unsigned int request_id, int ok, const char *error) {
+    LoadSession *session = (LoadSession *) client->userData;
+    if (!ok) {
+        if (failures++ < 5) {
+            printf("error: %s\n", error);
+        }
+    }
+    if (!session->registered) {
+        session->registered = ok ? 1 : -1;
+    } else if (session->pending > 0 && request_id >= session->firstId && request_id <= session->lastId) {
+        latencies[latencyCount++] = now_sec() - session->sentAt;
+        session->acked++;
+        session->pending--;
+    }
+}
+
+static void on_message(ChatClient *client, user_message *msg) {
+    deliveries++;
+}
+
+static void on_history(ChatClient *client, user_message *msg) {
+    synced++;
+}
+
+static void on_synced(ChatClient *client, const char *group) {
+    sync_done = 1;
+}
+
+// Posts the session's next message (or burst of messages, as one batch)
+// if it has none in flight.
+static void send_next(LoadSession *session, int messages) {
+    if (session->registered != 1 || session->pending != 0 || session->sent == messages) {
+        return;
+    }
+    int count = (messages - session->sent < burst) ? messages - session->sent : burst;
+    if (burst > 1) {
+        chat_begin_batch(session->client);
+    }
+    session->sentAt = now_sec();
+    for (int i = 0; i < count; i++) {
+        char text[64];
+        snprintf(text, sizeof text, "load message %d", session->sent);
+        unsigned int id = chat_send_message(session->client, "CMPS", text);
+        if (id == 0) {
+            break;
+        }
+        if (session->pending == 0) {
+            session->firstId = id;
+        }
+        session->lastId = id;
+        session->pending++;
+        session->sent++;
+    }
+    if (burst > 1) {
+        chat_end_batch(session->client);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int use_tls = 0;
+    int compress = 0;
+    char *ca_file = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "tzb:A:")) != -1) {
+        if (opt == 'z') {
+            compress = 1;
+            continue;
+        }
+        if (opt == 'b') {
+            burst = (atoi(optarg) > 0) ? atoi(optarg) : 1;
+            continue;
+        }
+        if (opt == 'A') {
+            ca_file = optarg;
+        }
+        use_tls = 1;
+    }
+    if (argc - optind < 2) {
+        printf("Usage: %s [-t] [-z] [-b burst] [-A ca.pem] <hostname> <port> [sessions] [messages per session]\n",
+               argv[0]);
+        return 1;
+    }
+    const char *hostname = argv[optind];
+    const char *port = argv[optind + 1];
+    int count = (argc - optind > 2) ? atoi(argv[optind + 2]) : 100;
+    int messages = (argc - optind > 3) ? atoi(argv[optind + 3]) : 100;
+    if (use_tls && tls_client_init(ca_file) == -1) {
+        return 1;
+    }
+
+    ChatCallbacks callbacks = { on_response, on_message, NULL, NULL, NULL };
+    ChatClient **clients = (ChatClient **) calloc(count, sizeof(ChatClient *));
+    LoadSession *sessions = (LoadSession *) calloc(count, sizeof(LoadSession));
+    latencies = (double *) malloc((size_t) count * messages * sizeof(double));
+    if (clients == NULL || sessions == NULL || latencies == NULL) {
+        return 1;
+    }
+
+    double start = now_sec();
+    for (int i = 0; i < count; i++) {
+        char email[BUFFER_SIZE];
+        char name[64];
+        clients[i] = chat_connect(hostname, port, use_tls, &callbacks, &sessions[i]);
+        if (clients[i] == NULL) {
+            printf("session %d could not connect\n", i);
+            return 1;
+        }
+        sessions[i].client = clients[i];
+        if (compress) {
+            chat_enable_compression(clients[i]);
+        }
+        snprintf(email, sizeof email, "load-%d-%ld-%d@bench", (int) getpid(), (long) time(NULL), i);
+        snprintf(name, sizeof name, "load%d", i);
+        chat_register(clients[i], email, name, "loadgen");
+    }
+    int registered = 0;
+    while (registered < count) {
+        if (chat_run(clients, count, 1000) < count) {
+            printf("a session disconnected during registration\n");
+            return 1;
+        }
+        registered = 0;
+        for (int i = 0; i < count; i++) {
+            registered += sessions[i].registered != 0;
+        }
+    }
+    printf("%d sessions connected and registered in %.2f s\n", count, now_sec() - start);
+
+    long total = (long) count * messages;
+    start = now_sec();
+    long acked = 0;
+    while (acked < total && failures == 0) {
+        for (int i = 0; i < count; i++) {
+            send_next(&sessions[i], messages);
+        }
+        if (chat_run(clients, count, 1000) < count) {
+            printf("a session disconnected\n");
+            break;
+        }
+        acked = 0;
+        for (int i = 0; i < count; i++) {
+            acked += sessions[i].acked;
+        }
+    }
+    double elapsed = now_sec() - start;
+
+    qsort(latencies, latencyCount, sizeof(double), compare_doubles);
+    printf("%ld messages in %.2f s: %.0f msg/s, %.0f deliveries/s (%ld delivered)\n",
+           acked, elapsed, acked / elapsed, deliveries / elapsed, deliveries);
+    if (latencyCount > 0) {
+        printf("post->ack latency: p50 %.2f ms  p99 %.2f ms  max %.2f ms\n",
+               latencies[latencyCount / 2] * 1e3, latencies[latencyCount * 99 / 100] * 1e3,
+               latencies[latencyCount - 1] * 1e3);
+    }
+
+    // The fan-out goes on after the last ACK: wait until every session has
+    // every message (or nothing arrives for 2 s).
+    long expected = (long) count * acked;
+    long before = -1;
+    while (deliveries < expected && deliveries != before) {
+        before = deliveries;
+        if (chat_run(clients, count, 2000) < count) {
+            break;
+        }
+    }
+    elapsed = now_sec() - start;
+    printf("fan-out: %ld of %ld deliveries in %.2f s (%.0f deliveries/s)\n", deliveries, expected, elapsed,
+           deliveries / elapsed);
+
+    unsigned long long bytes = 0;
+    unsigned long reads = 0;
+    for (int i = 0; i < count; i++) {
+        bytes += clients[i]->bytesReceived;
+        reads += clients[i]->recvCalls;
+        chat_exit(clients[i]);
+        chat_process(clients[i], 0);
+        chat_close(clients[i]);
+    }
+    printf("received %.1f MB in %lu reads (%.0f bytes per delivery)\n", bytes / 1e6, reads,
+           deliveries ? (double) bytes / deliveries : 0.0);
+
+    // What a client coming back without a cache downloads.
+    ChatCallbacks sync_callbacks = { NULL, NULL, on_history, on_synced, NULL };
+    ChatClient *reader = chat_connect(hostname, port, use_tls, &sync_callbacks, NULL);
+    if (reader != NULL) {
+        char email[BUFFER_SIZE];
+        snprintf(email, sizeof email, "load-sync-%d-%ld@bench", (int) getpid(), (long) time(NULL));
+        if (compress) {
+            chat_enable_compression(reader);
+        }
+        unsigned int id = chat_register(reader, email, "loadsync", "loadgen");
+        if (chat_wait(reader, id, 10000) == 1) {
+            unsigned long long before_bytes = reader->bytesReceived;
+            unsigned long before_reads = reader->recvCalls;
+            start = now_sec();
+            chat_sync(reader, "CMPS");
+            while (!sync_done && chat_run(&reader, 1, 10000) == 1) {
+            }
+            printf("history sync of %ld messages: %.1f KB in %lu reads, %.1f ms\n", synced,
+                   (reader->bytesReceived - before_bytes) / 1e3, reader->recvCalls - before_reads,
+                   (now_sec() - start) * 1e3);
+        }
+        chat_exit(reader);
+        chat_process(reader, 0);
+        chat_close(reader);
+    }
+    free(clients);
+    free(sessions);
+    free(latencies);
+    return failures > 0;
+}
@@ -0,0 +1,32 @@
+#!/bin/sh
+#
+# Collects a PGO profile (build configured with -DCHAT_PGO=GENERATE; run as
+# `cmake --build <dir> --target pgo-train`).
+#
+# Runs loadgen against the instrumented server (plain, compressed, batched),
+# then stops the server with SIGTERM: it drains, exits normally and writes
+# its profile. loadgen writes its own profile when it exits.
+#
+# usage: bench/pgo-train.sh <server> <loadgen> [port]
+
+set -e
+server=$1
+loadgen=$2
+port=${3:-9876}
+if [ -z "$server" ] || [ -z "$loadgen" ]; then
+    echo "usage: $0 <server> <loadgen> [port]"
+    exit 1
+fi
+
+work=$(mktemp -d)
+"$server" -d "$work" 127.0.0.1 "$port" > "$work/server.log" 2>&1 &
+pid=$!
+trap 'kill $pid 2>/dev/null || true; rm -rf "$work"' EXIT
+sleep 1
+
+"$loadgen" 127.0.0.1 "$port" 50 100
+"$loadgen" -z 127.0.0.1 "$port" 50 100
+"$loadgen" -z -b 10 127.0.0.1 "$port" 50 100
+
+kill -TERM $pid
+wait $pid
@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+#include "protocol.h"
+#include "blob-store.h"
+
+// Paths of the store: "<dir>/<first two hex digits>[/<hash>]".
+static char *blob_path(BlobStore *store, const char *hash, int file) {
+    size_t len = strlen(store->dir) + BLOB_HASH_SIZE + 8;
+    char *path = (char *) malloc(len);
+    if (path == NULL) {
+        return NULL;
+    }
+    if (file) {
+        snprintf(path, len, "%s/%.2s/%s", store->dir, hash, hash);
+    } else {
+        snprintf(path, len, "%s/%.2s", store->dir, hash);
+    }
+    return path;
+}
+
+// A hash is 64 lowercase hex digits; anything else never names a blob.
+static int valid_hash(const char *hash) {
+    size_t len = strlen(hash);
+    if (len != BLOB_HASH_SIZE - 1) {
+        return 0;
+    }
+    return strspn(hash, "0123456789abcdef") == len;
+}
+
+static int make_dir(const char *path) {
+    if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+        perror("Error creating blob directory");
+        return -1;
+    }
+    return 0;
+}
+
+static int fsync_dir(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    int result = fsync(fd);
+    close(fd);
+    return result;
+}
+
+/**
+ * Opens (creating if needed) the blob directory in dir and removes the
+ * temporary files of uploads that never finished.
+ *
+ * return 0 on success, -1 on error.
+ */
+int openBlobStore(BlobStore *store, const char *dir) {
+    size_t len = strlen(dir) + strlen(BLOB_STORE_DIR) + 2;
+    store->dir = (char *) malloc(len);
+    if (store->dir == NULL) {
+        return -1;
+    }
+    snprintf(store->dir, len, "%s/%s", dir, BLOB_STORE_DIR);
+
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof tmp, "%s/%s", store->dir, BLOB_TMP_DIR);
+    if (make_dir(store->dir) == -1 || make_dir(tmp) == -1) {
+        return -1;
+    }
+    DIR *entries = opendir(tmp);
+    if (entries == NULL) {
+        perror("Error reading blob directory");
+        return -1;
+    }
+    int removed = 0;
+    struct dirent *entry;
+    while ((entry = readdir(entries)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            removed += unlinkat(dirfd(entries), entry->d_name, 0) == 0;
+        }
+    }
+    closedir(entries);
+    if (removed > 0) {
+        printf("Blob store: removed %d unfinished uploads\n", removed);
+    }
+    return 0;
+}
+
+/**
+ * Starts an upload of size bytes into a new temporary file.
+ *
+ * return the upload, or NULL on error.
+ */
+BlobUpload *beginBlobUpload(BlobStore *store, unsigned long long size) {
+    BlobUpload *upload = (BlobUpload *) calloc(1, sizeof(BlobUpload));
+    size_t len = strlen(store->dir) + strlen(BLOB_TMP_DIR) + 16;
+    if (upload == NULL || (upload->path = (char *) malloc(len)) == NULL) {
+        perror("Error allocating memory for upload");
+        free(upload);
+        return NULL;
+    }
+    snprintf(upload->path, len, "%s/%s/XXXXXX", store->dir, BLOB_TMP_DIR);
+    upload->fd = mkstemp(upload->path);
+    if (upload->fd == -1) {
+        perror("Error creating upload file");
+        free(upload->path);
+        free(upload);
+        return NULL;
+    }
+    upload->sha = EVP_MD_CTX_new();
+    if (upload->sha == NULL || EVP_DigestInit_ex(upload->sha, EVP_sha256(), NULL) != 1) {
+        printf("Error setting up SHA-256\n");
+        abortBlobUpload(upload);
+        return NULL;
+    }
+    upload->size = size;
+    return upload;
+}
+
+/**
+ * Appends the next chunk of an upload to its file.
+ *
+ * return 0 on success, -1 on error.
+ */
+int writeBlobChunk(BlobUpload *upload, const char *data, size_t len) {
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = write(upload->fd, data + written, len - written);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error writing upload file");
+            return -1;
+        }
+        written += n;
+    }
+    if (EVP_DigestUpdate(upload->sha, data, len) != 1) {
+        return -1;
+    }
+    upload->received += len;
+    return 0;
+}
+
+/**
+ * Stores a complete upload under its hash. If the store has the blob
+ * already, the copy is dropped. Frees the upload either way.
+ *
+ * param hash Receives the hex SHA-256 (BLOB_HASH_SIZE bytes).
+ * return 0 on success, -1 on error.
+ */
+int finishBlobUpload(BlobStore *store, BlobUpload *upload, char *hash) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_len = 0;
+    if (upload->received != upload->size || EVP_DigestFinal_ex(upload->sha, digest, &digest_len) != 1 ||
+        digest_len * 2 != BLOB_HASH_SIZE - 1) {
+        abortBlobUpload(upload);
+        return -1;
+    }
+    for (unsigned int i = 0; i < digest_len; i++) {
+        snprintf(hash + 2 * i, 3, "%02x", digest[i]);
+    }
+
+    char *dir = blob_path(store, hash, 0);
+    char *path = blob_path(store, hash, 1);
+    int result = -1;
+    struct stat st;
+    if (dir == NULL || path == NULL || make_dir(dir) == -1) {
+        abortBlobUpload(upload);
+    } else if (stat(path, &st) == 0) {
+        abortBlobUpload(upload); // same contents, stored before
+        result = 0;
+    } else if (fdatasync(upload->fd) == -1 || rename(upload->path, path) == -1) {
+        perror("Error storing upload");
+        abortBlobUpload(upload);
+    } else {
+        if (fsync_dir(dir) == -1) {
+            perror("Error syncing blob directory");
+        }
+        close(upload->fd);
+        EVP_MD_CTX_free(upload->sha);
+        free(upload->path);
+        free(upload);
+        result = 0;
+    }
+    free(dir);
+    free(path);
+    return result;
+}
+
+/**
+ * Drops an upload that won't be finished, and its temporary file.
+ */
+void abortBlobUpload(BlobUpload *upload) {
+    close(upload->fd);
+    unlink(upload->path);
+    EVP_MD_CTX_free(upload->sha);
+    free(upload->path);
+    free(upload);
+}
+
+/**
+ * Opens a stored blob for reading.
+ *
+ * param size Receives the blob's size.
+ * return the file descriptor, or -1 if there is no blob with that hash.
+ */
+int openBlob(BlobStore *store, const char *hash, unsigned long long *size) {
+    if (!valid_hash(hash)) {
+        errno = ENOENT;
+        return -1;
+    }
+    char *path = blob_path(store, hash, 1);
+    int fd = (path != NULL) ? open(path, O_RDONLY) : -1;
+    free(path);
+    struct stat st;
+    if (fd != -1 && fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    if (fd != -1) {
+        *size = (unsigned long long) st.st_size;
+    }
+    return fd;
+}
+
+void closeBlobStore(BlobStore *store) {
+    free(store->dir);
+    store->dir = NULL;
+}
@@ -0,0 +1,74 @@
+#ifndef BLOB_STORE_H
+#define BLOB_STORE_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+#include "protocol.h"
+
+/**
+ * Content-addressed store of attachments: every blob is a file named by the
+ * SHA-256 of its contents, blobs/<first two hex digits>/<hash> in the data
+ * directory. The same file posted twice, or to two groups, is kept once,
+ * and a stored blob never changes.
+ *
+ * An upload streams into a temporary file in blobs/tmp as its chunks
+ * arrive, hashing them on the way; nothing is held in memory. When the last
+ * byte is in, the file is synced and renamed to its hash. Temporary files
+ * left behind by a crash or a restart are removed at startup.
+ *
+ * Downloads open the blob and the connection sends it from the page cache
+ * (net_send_file()), never copying it through the server per recipient.
+ */
+
+#define BLOB_STORE_DIR "blobs"
+#define BLOB_TMP_DIR "tmp"
+
+typedef struct BLOB_STORE {
+    char *dir;
+} BlobStore;
+
+/**
+ * Struct name: BlobUpload
+ * Description: An upload in progress on one connection.
+ *
+ * param path      The temporary file.
+ * param sha       SHA-256 of the bytes received so far.
+ * param requestId The UPLOAD_TYPE request, named by every chunk.
+ * param group     Where the message referring to the blob goes.
+ * param name      The file's name, shown in that message.
+ */
+typedef struct BLOB_UPLOAD {
+    int fd;
+    char *path;
+    unsigned long long size;
+    unsigned long long received;
+    EVP_MD_CTX *sha;
+    unsigned int requestId;
+    char group[GROUP_NAME_SIZE];
+    char name[BLOB_NAME_SIZE];
+} BlobUpload;
+
+/**
+ * Struct name: BlobDownload
+ * Description: A download in progress on one connection.
+ *
+ * param offset Next byte to send.
+ */
+typedef struct BLOB_DOWNLOAD {
+    int fd;
+    unsigned long long size;
+    unsigned long long offset;
+    unsigned int requestId;
+} BlobDownload;
+
+// Function prototypes
+int openBlobStore(BlobStore *store, const char *dir);
+BlobUpload *beginBlobUpload(BlobStore *store, unsigned long long size);
+int writeBlobChunk(BlobUpload *upload, const char *data, size_t len);
+int finishBlobUpload(BlobStore *store, BlobUpload *upload, char *hash);
+void abortBlobUpload(BlobUpload *upload);
+int openBlob(BlobStore *store, const char *hash, unsigned long long *size);
+void closeBlobStore(BlobStore *store);
+
+#endif // BLOB_STORE_H
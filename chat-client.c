@@ -0,0 +1,1155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <limits.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/rand.h>
+#include "protocol.h"
+#include "seq-tracker.h"
+#include "msg-batch.h"
+#include "msg-cache.h"
+#include "tls-transport.h"
+#include "chat-client.h"
+
+#define INITIAL_SEND_QUEUE 4096
+
+// Quiet version of get_server_connection(): a bot opening hundreds of
+// sessions doesn't want the address printed for each.
+static int connect_socket(const char *hostname, const char *port) {
+    struct addrinfo hints, *servinfo, *p;
+    int fd = -1;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = PF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int status = getaddrinfo(hostname, port, &hints, &servinfo);
+    if (status != 0) {
+        printf("getaddrinfo: %s\n", gai_strerror(status));
+        return -1;
+    }
+    for (p = servinfo; p != NULL; p = p->ai_next) {
+        fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(servinfo);
+    if (fd == -1) {
+        perror("Error connecting to server");
+    }
+    return fd;
+}
+
+/**
+ * Connects to the server (and does the TLS handshake when use_tls is set;
+ * tls_client_init() must have been called). This is the only blocking call
+ * besides chat_wait(); the connection is non-blocking afterwards.
+ *
+ * param callbacks Copied into the client.
+ * param user_data Stored in client->userData.
+ * return the client, or NULL if the connection failed.
+ */
+ChatClient *chat_connect(const char *hostname, const char *port, int use_tls,
+                         const ChatCallbacks *callbacks, void *user_data) {
+    int fd = connect_socket(hostname, port);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (use_tls && tls_connect_server(fd, hostname) == -1) {
+        net_close(fd);
+        return NULL;
+    }
+    // Requests are already coalesced in the send queue; don't let Nagle
+    // hold back the last one.
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    ChatClient *client = (ChatClient *) calloc(1, sizeof(ChatClient));
+    char *recv_buffer = (char *) malloc(CHAT_RECV_BUFFER_SIZE);
+    if (client == NULL || recv_buffer == NULL) {
+        perror("Error allocating memory for chat client");
+        free(client);
+        free(recv_buffer);
+        net_close(fd);
+        return NULL;
+    }
+    client->fd = fd;
+    client->nextRequestId = 1;
+    // Post ids must not repeat across the user's devices and connections.
+    if (RAND_bytes((unsigned char *) &client->nextPostId, sizeof client->nextPostId) != 1) {
+        client->nextPostId = ((unsigned long long) time(NULL) << 32) ^ ((unsigned long long) getpid() << 16);
+    }
+    client->recvBuffer = recv_buffer;
+    initSeqTrackerList(&client->trackers);
+    if (callbacks != NULL) {
+        client->callbacks = *callbacks;
+    }
+    client->userData = user_data;
+    client->waitResult = -1;
+    return client;
+}
+
+/**
+ * Gives the client a local message cache: received and synced messages are
+ * stored in it, and syncs only ask for what it is missing.
+ */
+void chat_set_cache(ChatClient *client, MessageCache *cache) {
+    client->cache = cache;
+}
+
+/**
+ * Names the device this client is, for the next login or registration.
+ * The server keeps a named device's delivery positions while it is away,
+ * so it catches up on its own; logging in with a name that is connected
+ * elsewhere takes the device over. Names are one word, shorter than
+ * DEVICE_NAME_SIZE; NULL or "" means an unnamed device.
+ */
+void chat_set_device(ChatClient *client, const char *name) {
+    snprintf(client->device, sizeof client->device, "%s", name != NULL ? name : "");
+}
+
+// ======= SENDING =========== //
+
+// Writes queued bytes until the socket pushes back.
+static int flush_queue(ChatClient *client) {
+    while (client->sendHead < client->sendLen) {
+        ssize_t n = net_send_some(client->fd, client->sendQueue + client->sendHead,
+                                  client->sendLen - client->sendHead);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            return -1;
+        }
+        client->sendHead += n;
+    }
+    client->sendHead = 0;
+    client->sendLen = 0;
+    return 0;
+}
+
+static int queue_frame(ChatClient *client, const void *frame, size_t len) {
+    if (client->closed) {
+        return -1;
+    }
+    if (client->sendLen + len > client->sendCapacity && client->sendHead > 0) {
+        // Unwritten bytes move to the front; TLS accepts the moved buffer.
+        memmove(client->sendQueue, client->sendQueue + client->sendHead, client->sendLen - client->sendHead);
+        client->sendLen -= client->sendHead;
+        client->sendHead = 0;
+    }
+    if (client->sendLen + len > client->sendCapacity) {
+        size_t capacity = client->sendCapacity ? client->sendCapacity * 2 : INITIAL_SEND_QUEUE;
+        while (capacity < client->sendLen + len) {
+            capacity *= 2;
+        }
+        if (capacity > CHAT_SEND_QUEUE_LIMIT) {
+            return -1; // the server isn't keeping up; let the caller back off
+        }
+        char *queue = (char *) realloc(client->sendQueue, capacity);
+        if (queue == NULL) {
+            perror("Error growing send queue");
+            return -1;
+        }
+        client->sendQueue = queue;
+        client->sendCapacity = capacity;
+    }
+    memcpy(client->sendQueue + client->sendLen, frame, len);
+    client->sendLen += len;
+    return flush_queue(client);
+}
+
+// Queues the collected batch (if it has anything) and empties it.
+static int queue_batch(ChatClient *client) {
+    if (client->batch->header.count == 0) {
+        return 0;
+    }
+    int result = queue_frame(client, client->batch, opBatchFrameSize(client->batch));
+    initOpBatch(client->batch, BATCH_REQUEST_TYPE);
+    return result;
+}
+
+// Encodes a request and queues it (or adds it to the open batch). Returns
+// its requestId, 0 on failure.
+static unsigned int send_request(ChatClient *client, int type, unsigned int request_id, const char *text) {
+    if (client->batch != NULL) {
+        if (addBatchRequest(client->batch, type, request_id, text) == -1) {
+            // Full: this part goes out now, the batch goes on.
+            if (queue_batch(client) == -1) {
+                return 0;
+            }
+            addBatchRequest(client->batch, type, request_id, text);
+        }
+        return request_id;
+    }
+    c2s_send_message request;
+    memset(&request, 0, sizeof request);
+    request.type = type;
+    request.requestId = request_id;
+    snprintf(request.message, sizeof request.message, "%s", text);
+    request.length = strlen(request.message) + 1;
+    if (queue_frame(client, &request, sizeof request) == -1) {
+        return 0;
+    }
+    return request_id;
+}
+
+static unsigned int next_request_id(ChatClient *client) {
+    unsigned int id = client->nextRequestId++;
+    if (client->nextRequestId == 0) {
+        client->nextRequestId = 1; // 0 means "no answer needed"
+    }
+    return id;
+}
+
+/**
+ * Requests a registration. The password is sent as typed (use TLS).
+ *
+ * return the requestId, 0 if it could not be queued.
+ */
+unsigned int chat_register(ChatClient *client, const char *email, const char *name, const char *password) {
+    char text[BUFFER_SIZE];
+    snprintf(text, sizeof text, "%s %s %s %s", email, name, password, client->device);
+    return send_request(client, REGISTRATION_TYPE, next_request_id(client), text);
+}
+
+/**
+ * Requests a login, as the device named with chat_set_device(). The user's
+ * other devices stay logged in. After the ACK the server streams the backlog
+ * this device missed.
+ *
+ * return the requestId, 0 if it could not be queued.
+ */
+unsigned int chat_login(ChatClient *client, const char *email, const char *password) {
+    char text[BUFFER_SIZE];
+    snprintf(text, sizeof text, "%s %s %s", email, password, client->device);
+    return send_request(client, LOGIN_TYPE, next_request_id(client), text);
+}
+
+/**
+ * Posts a message to a group. The ACK arrives once the server stored it;
+ * the message itself comes back through onMessage with its sequence number.
+ * To be able to retry it safely, use chat_post_message() instead.
+ *
+ * return the requestId, 0 if it could not be queued.
+ */
+unsigned int chat_send_message(ChatClient *client, const char *group, const char *text) {
+    return chat_post_message(client, group, text, chat_new_post_id(client));
+}
+
+/**
+ * return a message id for chat_post_message(), never 0.
+ */
+unsigned long long chat_new_post_id(ChatClient *client) {
+    if (++client->nextPostId == 0) {
+        client->nextPostId = 1;
+    }
+    return client->nextPostId;
+}
+
+/**
+ * Posts a message under an id of the caller's (chat_new_post_id()). Sending
+ * the same id again, on this connection or a new one, is acknowledged but
+ * stores and delivers the message only once, so a post whose ACK didn't
+ * arrive can simply be sent again.
+ *
+ * return the requestId, 0 if it could not be queued.
+ */
+unsigned int chat_post_message(ChatClient *client, const char *group, const char *text, unsigned long long post_id) {
+    char request[BUFFER_SIZE];
+    snprintf(request, sizeof request, "%s %016llx %s", group, post_id, text);
+    return send_request(client, POST_TYPE, next_request_id(client), request);
+}
+
+unsigned int chat_join_group(ChatClient *client, const char *group) {
+    return send_request(client, JOIN_GROUP_TYPE, next_request_id(client), group);
+}
+
+/**
+ * Creates a group and joins it. Fails if the name is taken.
+ *
+ * return the requestId, 0 if it could not be queued.
+ */
+unsigned int chat_create_group(ChatClient *client, const char *group) {
+    return send_request(client, CREATE_GROUP_TYPE, next_request_id(client), group);
+}
+
+unsigned int chat_leave_group(ChatClient *client, const char *group) {
+    return send_request(client, LEAVE_GROUP_TYPE, next_request_id(client), group);
+}
+
+/**
+ * Asks for a page of the server's groups, starting at cursor (0 for the
+ * first page, then the page's next). The page arrives through onPage.
+ *
+ * return the requestId (echoed in the page, or in an error), 0 if it could
+ *        not be queued.
+ */
+unsigned int chat_list_groups(ChatClient *client, unsigned int cursor) {
+    char text[BUFFER_SIZE];
+    snprintf(text, sizeof text, "%u", cursor);
+    return send_request(client, LIST_GROUPS_TYPE, next_request_id(client), text);
+}
+
+/**
+ * Asks for a page of a group's members, like chat_list_groups(). Only
+ * members of the group may ask.
+ */
+unsigned int chat_roster(ChatClient *client, const char *group, unsigned int cursor) {
+    char text[BUFFER_SIZE];
+    snprintf(text, sizeof text, "%s %u", group, cursor);
+    return send_request(client, ROSTER_TYPE, next_request_id(client), text);
+}
+
+/**
+ * Sends a direct message to the user with that email. Both users get it
+ * through onDirect, with its sequence number in their conversation.
+ *
+ * return the requestId, 0 if it could not be queued.
+ */
+unsigned int chat_send_direct(ChatClient *client, const char *email, const char *text) {
+    char request[BUFFER_SIZE];
+    snprintf(request, sizeof request, "%s %s", email, text);
+    return send_request(client, DIRECT_MESSAGE_TYPE, next_request_id(client), request);
+}
+
+/**
+ * Fetches the conversation with a user after after_seq (0: all of it)
+ * through onDirect, ending with a message of seq 0.
+ *
+ * return the requestId (only answered on error), 0 if it could not be queued.
+ */
+unsigned int chat_direct_history(ChatClient *client, const char *email, unsigned int after_seq) {
+    char text[BUFFER_SIZE];
+    snprintf(text, sizeof text, "%s %u", email, after_seq);
+    return send_request(client, DIRECT_HISTORY_TYPE, next_request_id(client), text);
+}
+
+/**
+ * Starts a history sync of a group: everything after what the cache holds,
+ * or the whole history if the cache doesn't go back to its start (it was
+ * seeded at a cursor) or there is no cache. Messages arrive through
+ * onHistory, then onSynced. A sync already running for the group is not
+ * repeated.
+ *
+ * return the requestId (only answered on error), 0 if nothing was queued.
+ */
+unsigned int chat_sync(ChatClient *client, const char *group) {
+    char text[BUFFER_SIZE];
+    unsigned int after_seq = 0;
+    if (client->cache != NULL) {
+        pthread_mutex_lock(&client->cache->mutex);
+        CacheGroup *cached = getCacheGroup(client->cache, group);
+        int pending = (cached == NULL) || cached->syncPending;
+        if (!pending) {
+            cached->syncPending = 1;
+            after_seq = (cached->firstSeq == 0) ? cached->syncedSeq : 0;
+        }
+        pthread_mutex_unlock(&client->cache->mutex);
+        if (pending) {
+            return 0;
+        }
+    }
+    snprintf(text, sizeof text, "%s %u", group, after_seq);
+    return send_request(client, SYNC_TYPE, next_request_id(client), text);
+}
+
+// ======= ATTACHMENTS =========== //
+
+static void free_transfer(ChatTransfer *transfer) {
+    if (transfer->fd != -1) {
+        close(transfer->fd);
+    }
+    EVP_MD_CTX_free(transfer->sha);
+    free(transfer->path);
+    free(transfer);
+}
+
+// Queues upload chunks while the send queue is shorter than
+// CHAT_UPLOAD_WINDOW, so a request made meanwhile waits behind a few chunks
+// at most rather than the whole file.
+static int pump_upload(ChatClient *client) {
+    char frame[sizeof(blob_chunk_header) + BLOB_CHUNK_SIZE];
+    ChatTransfer *upload = client->upload;
+    while (upload != NULL && upload->offset < upload->size &&
+           client->sendLen - client->sendHead < CHAT_UPLOAD_WINDOW) {
+        blob_chunk_header header;
+        memset(&header, 0, sizeof header);
+        header.type = BLOB_CHUNK_TYPE;
+        header.requestId = upload->requestId;
+        header.offset = upload->offset;
+        header.size = upload->size;
+        size_t want = upload->size - upload->offset;
+        if (want > BLOB_CHUNK_SIZE) {
+            want = BLOB_CHUNK_SIZE;
+        }
+        ssize_t n = pread(upload->fd, frame + sizeof header, want, (off_t) upload->offset);
+        if (n <= 0) {
+            // A chunk without data cancels the upload; the server's error answers it.
+            perror("Error reading file to upload");
+            n = 0;
+        }
+        header.length = (unsigned) n;
+        memcpy(frame, &header, sizeof header);
+        if (queue_frame(client, frame, sizeof header + n) == -1) {
+            return -1;
+        }
+        upload->offset = (n > 0) ? upload->offset + n : upload->size;
+    }
+    return 0;
+}
+
+/**
+ * Posts a file to a group as an attachment. The server stores it by its
+ * SHA-256 and posts "blob:<hash> <size> <name>" to the group; the answer to
+ * the returned requestId says whether that worked. The file goes out in
+ * chunks as the connection takes them, so keep calling chat_process().
+ * One upload at a time, and not inside a batch.
+ *
+ * return the requestId, 0 if the file can't be read (or is empty or larger
+ *        than BLOB_MAX_SIZE) or the request could not be queued.
+ */
+unsigned int chat_upload(ChatClient *client, const char *group, const char *path) {
+    if (client->upload != NULL || client->batch != NULL) {
+        return 0;
+    }
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+        st.st_size == 0 || st.st_size > BLOB_MAX_SIZE) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return 0;
+    }
+    ChatTransfer *upload = (ChatTransfer *) calloc(1, sizeof(ChatTransfer));
+    if (upload == NULL) {
+        close(fd);
+        return 0;
+    }
+    upload->fd = fd;
+    upload->size = (unsigned long long) st.st_size;
+
+    const char *name = strrchr(path, '/');
+    name = (name != NULL) ? name + 1 : path;
+    char text[BUFFER_SIZE];
+    snprintf(text, sizeof text, "%s %llu %.*s", group, upload->size, BLOB_NAME_SIZE - 1, name);
+    upload->requestId = send_request(client, UPLOAD_TYPE, next_request_id(client), text);
+    if (upload->requestId == 0) {
+        free_transfer(upload);
+        return 0;
+    }
+    client->upload = upload;
+    pump_upload(client);
+    return upload->requestId;
+}
+
+/**
+ * Fetches an attachment into path. Its chunks arrive between the other
+ * frames and are written to "<path>.part"; when the server's ACK comes and
+ * the contents match the hash, the file is renamed to path and the ACK
+ * reaches onResponse. A "<path>.part" left by an interrupted download is
+ * kept and only the rest is fetched. One download at a time.
+ *
+ * return the requestId, 0 if the file can't be written or the request
+ *        could not be queued.
+ */
+unsigned int chat_download(ChatClient *client, const char *hash, const char *path) {
+    if (client->download != NULL || strlen(hash) != BLOB_HASH_SIZE - 1) {
+        return 0;
+    }
+    char part[PATH_MAX];
+    if (snprintf(part, sizeof part, "%s.part", path) >= (int) sizeof part) {
+        return 0;
+    }
+    ChatTransfer *download = (ChatTransfer *) calloc(1, sizeof(ChatTransfer));
+    if (download == NULL) {
+        return 0;
+    }
+    download->fd = open(part, O_RDWR | O_CREAT, 0600);
+    download->path = strdup(path);
+    download->sha = EVP_MD_CTX_new();
+    if (download->fd == -1 || download->path == NULL || download->sha == NULL ||
+        EVP_DigestInit_ex(download->sha, EVP_sha256(), NULL) != 1) {
+        free_transfer(download);
+        return 0;
+    }
+    // Resuming: hash what an earlier attempt already wrote.
+    char buf[BLOB_CHUNK_SIZE];
+    ssize_t n;
+    while ((n = read(download->fd, buf, sizeof buf)) > 0) {
+        EVP_DigestUpdate(download->sha, buf, n);
+        download->offset += n;
+    }
+    if (n == -1) {
+        free_transfer(download);
+        return 0;
+    }
+    snprintf(download->hash, sizeof download->hash, "%s", hash);
+
+    char text[BUFFER_SIZE];
+    snprintf(text, sizeof text, "%s %llu", hash, download->offset);
+    download->requestId = send_request(client, DOWNLOAD_TYPE, next_request_id(client), text);
+    if (download->requestId == 0) {
+        free_transfer(download);
+        return 0;
+    }
+    client->download = download;
+    return download->requestId;
+}
+
+/**
+ * Asks the server to compress what it sends on this connection. Best sent
+ * before logging in, so the backlog is compressed too. Frames keep arriving
+ * uncompressed if the server answers with an error.
+ *
+ * return the requestId, 0 if it could not be queued.
+ */
+unsigned int chat_enable_compression(ChatClient *client) {
+    return send_request(client, COMPRESS_TYPE, next_request_id(client), COMPRESS_ALGORITHM);
+}
+
+/**
+ * Tells the group's online members that the user is typing (typing = 1) or
+ * stopped without posting (0). Events are never answered or stored, and the
+ * server may coalesce or drop them; posting a message ends the typing.
+ */
+void chat_send_typing(ChatClient *client, const char *group, int typing) {
+    char text[BUFFER_SIZE];
+    snprintf(text, sizeof text, "%s %d", group, typing ? EVENT_TYPING : EVENT_STOPPED_TYPING);
+    send_request(client, EVENT_TYPE, 0, text);
+}
+
+/**
+ * Tells the group's online members that the user has read the group up to
+ * seq (a best-effort read receipt, like chat_send_typing()).
+ */
+void chat_send_read(ChatClient *client, const char *group, unsigned int seq) {
+    char text[BUFFER_SIZE];
+    snprintf(text, sizeof text, "%s %d %u", group, EVENT_READ, seq);
+    send_request(client, EVENT_TYPE, 0, text);
+}
+
+/**
+ * Starts collecting requests into one frame (see chat_end_batch()).
+ *
+ * return 0 on success, -1 if out of memory or a batch is already open.
+ */
+int chat_begin_batch(ChatClient *client) {
+    if (client->batch != NULL) {
+        return -1;
+    }
+    client->batch = (OpBatch *) malloc(sizeof(OpBatch));
+    if (client->batch == NULL) {
+        perror("Error allocating memory for batch");
+        return -1;
+    }
+    initOpBatch(client->batch, BATCH_REQUEST_TYPE);
+    return 0;
+}
+
+/**
+ * Sends the requests made since chat_begin_batch() as one frame. The
+ * server runs them in order and answers them all in one frame.
+ *
+ * return 0 on success, -1 if the batch could not be queued.
+ */
+int chat_end_batch(ChatClient *client) {
+    if (client->batch == NULL) {
+        return -1;
+    }
+    int result = queue_batch(client);
+    free(client->batch);
+    client->batch = NULL;
+    return result;
+}
+
+/**
+ * Sends a cumulative acknowledgement for a group.
+ *
+ * param acked     Every message of the group up to this seq was received.
+ * param resend_to If above acked, asks the server to retransmit acked+1..resend_to.
+ */
+static void send_group_ack(ChatClient *client, const char *group, unsigned int acked, unsigned int resend_to) {
+    char text[BUFFER_SIZE];
+    if (resend_to > acked) {
+        snprintf(text, sizeof text, "%s %u %u", group, acked, resend_to);
+    } else {
+        snprintf(text, sizeof text, "%s %u", group, acked);
+    }
+    send_request(client, CLIENT_ACK_TYPE, 0, text);
+}
+
+/**
+ * Acknowledges everything delivered so far in every group.
+ */
+void chat_flush_acks(ChatClient *client) {
+    for (SeqTracker *tracker = client->trackers.first; tracker != NULL; tracker = tracker->next) {
+        if (tracker->unacked > 0) {
+            send_group_ack(client, tracker->group, tracker->delivered, 0);
+            tracker->unacked = 0;
+        }
+    }
+}
+
+/**
+ * Flushes acks and queues the exit frame. Keep processing until the queue
+ * drains (chat_poll_events() stops asking for POLLOUT), then chat_close().
+ */
+void chat_exit(ChatClient *client) {
+    chat_flush_acks(client);
+    c2s_send_exit exit_message;
+    exit_message.type = EXIT_TYPE;
+    queue_frame(client, &exit_message, sizeof exit_message);
+}
+
+// ======= RECEIVING =========== //
+
+// Tracker delivery: cache it and hand it to the application.
+static void deliver_message(user_message *msg, void *arg) {
+    ChatClient *client = (ChatClient *) arg;
+    if (client->cache != NULL) {
+        cacheMessage(client->cache, msg);
+    }
+    if (client->callbacks.onMessage != NULL) {
+        client->callbacks.onMessage(client, msg);
+    }
+}
+
+static void track_batch_message(user_message *msg, void *arg) {
+    ChatClient *client = (ChatClient *) arg;
+    trackMessage(&client->trackers, msg, deliver_message, client);
+}
+
+static void history_message(user_message *msg, void *arg) {
+    ChatClient *client = (ChatClient *) arg;
+    if (client->cache != NULL) {
+        cacheMessage(client->cache, msg);
+    }
+    if (client->callbacks.onHistory != NULL) {
+        client->callbacks.onHistory(client, msg);
+    }
+}
+
+// A download chunk: written in order, anything else fails the download.
+static void handle_chunk(ChatClient *client, blob_chunk_header *header, const char *data) {
+    ChatTransfer *download = client->download;
+    if (download == NULL || header->requestId != download->requestId || download->failed) {
+        return;
+    }
+    download->size = header->size;
+    if (header->offset != download->offset ||
+        write(download->fd, data, header->length) != (ssize_t) header->length ||
+        EVP_DigestUpdate(download->sha, data, header->length) != 1) {
+        download->failed = 1;
+        return;
+    }
+    download->offset += header->length;
+}
+
+// The answer to a download: the file is kept if its contents match the
+// hash. After an error from the server the part stays, to be resumed.
+static int finish_download(ChatClient *client, int ok, const char **error) {
+    ChatTransfer *download = client->download;
+    client->download = NULL;
+    char part[PATH_MAX];
+    snprintf(part, sizeof part, "%s.part", download->path);
+    if (ok) {
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int digest_len = 0;
+        char hash[BLOB_HASH_SIZE] = "";
+        if (EVP_DigestFinal_ex(download->sha, digest, &digest_len) == 1 && digest_len * 2 == BLOB_HASH_SIZE - 1) {
+            for (unsigned int i = 0; i < digest_len; i++) {
+                snprintf(hash + 2 * i, 3, "%02x", digest[i]);
+            }
+        }
+        if (download->failed || strcmp(hash, download->hash) != 0) {
+            unlink(part);
+            ok = 0;
+            *error = "The downloaded file doesn't match its hash.";
+        } else if (rename(part, download->path) == -1) {
+            ok = 0;
+            *error = "Error saving the downloaded file.";
+        }
+    }
+    free_transfer(download);
+    return ok;
+}
+
+static void handle_response(ChatClient *client, unsigned int request_id, int ok, const char *error) {
+    if (request_id != 0 && client->download != NULL && request_id == client->download->requestId) {
+        ok = finish_download(client, ok, &error);
+    } else if (request_id != 0 && client->upload != NULL && request_id == client->upload->requestId) {
+        free_transfer(client->upload); // stored and posted, or refused
+        client->upload = NULL;
+    }
+    if (request_id != 0 && request_id == client->waitId) {
+        client->waitResult = ok;
+    }
+    if (client->callbacks.onResponse != NULL) {
+        client->callbacks.onResponse(client, request_id, ok, error);
+    }
+}
+
+// A live group message: in order through the tracker, acking in batches.
+static void handle_group_message(ChatClient *client, user_message *msg) {
+    int result = trackMessage(&client->trackers, msg, deliver_message, client);
+    SeqTracker *tracker = getSeqTracker(&client->trackers, msg->group);
+    if (tracker != NULL && result == SEQ_GAP && tracker->pendingCount == 1) {
+        // A new gap: ack what we have and ask for the missing range only.
+        send_group_ack(client, tracker->group, tracker->delivered, msg->seq - 1);
+        tracker->unacked = 0;
+    } else if (tracker != NULL && tracker->unacked >= ACK_BATCH_SIZE) {
+        send_group_ack(client, tracker->group, tracker->delivered, 0);
+        tracker->unacked = 0;
+    }
+}
+
+static void handle_batch(ChatClient *client, s2c_batch_header *header, const char *payload) {
+    header->group[GROUP_NAME_SIZE - 1] = '\0';
+    if (header->type == HISTORY_BATCH_TYPE) {
+        if (decodeBatch(header, payload, history_message, client) == -1) {
+            printf("Invalid batch received from server\n");
+        }
+        if (header->count > 0) {
+            return;
+        }
+        // The empty batch ends the sync.
+        if (client->cache != NULL) {
+            pthread_mutex_lock(&client->cache->mutex);
+            CacheGroup *cached = getCacheGroup(client->cache, header->group);
+            if (cached != NULL) {
+                cached->syncPending = 0;
+            }
+            pthread_mutex_unlock(&client->cache->mutex);
+        }
+        if (client->callbacks.onSynced != NULL) {
+            client->callbacks.onSynced(client, header->group);
+        }
+        return;
+    }
+
+    // Backlog since this user's cursor: delivered like live messages.
+    seedSeqTracker(&client->trackers, header->group, header->afterSeq, deliver_message, client);
+    if (decodeBatch(header, payload, track_batch_message, client) == -1) {
+        printf("Invalid batch received from server\n");
+    }
+    SeqTracker *tracker = getSeqTracker(&client->trackers, header->group);
+    if (tracker != NULL && tracker->unacked >= ACK_BATCH_SIZE) {
+        send_group_ack(client, tracker->group, tracker->delivered, 0);
+        tracker->unacked = 0;
+    }
+    // The cache goes on from the cursor; older history is only fetched
+    // when it is asked for (chat_sync()).
+    if (client->cache != NULL) {
+        pthread_mutex_lock(&client->cache->mutex);
+        CacheGroup *cached = getCacheGroup(client->cache, header->group);
+        if (cached != NULL) {
+            seedCacheGroup(cached, header->afterSeq);
+        }
+        pthread_mutex_unlock(&client->cache->mutex);
+    }
+}
+
+// The answers to a request batch, one callback each.
+static void handle_responses(ChatClient *client, op_batch_header *header, const char *payload) {
+    size_t offset = 0;
+    unsigned int request_id;
+    int ok;
+    char error[BUFFER_SIZE];
+    int result = 0;
+    for (unsigned int i = 0; i < header->count; i++) {
+        result = nextBatchResponse(header, payload, &offset, &request_id, &ok, error);
+        if (result != 1) {
+            break;
+        }
+        handle_response(client, request_id, ok, ok ? NULL : error);
+    }
+    if (result == -1) {
+        printf("Invalid response batch received from server\n");
+    }
+}
+
+static void handle_frame(ChatClient *client, const char *frame) {
+    int type;
+    memcpy(&type, frame, sizeof type);
+    if (type == ACK_TYPE) {
+        s2c_send_ok_ack ack;
+        memcpy(&ack, frame, sizeof ack);
+        handle_response(client, ack.requestId, 1, NULL);
+        return;
+    }
+    if (type == BATCH_MESSAGE_TYPE || type == HISTORY_BATCH_TYPE) {
+        s2c_batch_header header;
+        memcpy(&header, frame, sizeof header);
+        handle_batch(client, &header, frame + sizeof header);
+        return;
+    }
+    if (type == BATCH_RESPONSE_TYPE) {
+        op_batch_header header;
+        memcpy(&header, frame, sizeof header);
+        handle_responses(client, &header, frame + sizeof header);
+        return;
+    }
+    if (type == EVENT_TYPE) {
+        s2c_event event;
+        memcpy(&event, frame, sizeof event);
+        event.name[BUFFER_SIZE - 1] = '\0';
+        event.group[GROUP_NAME_SIZE - 1] = '\0';
+        if (client->callbacks.onEvent != NULL) {
+            client->callbacks.onEvent(client, &event);
+        }
+        return;
+    }
+    if (type == DIRECT_MESSAGE_TYPE || type == DIRECT_HISTORY_TYPE) {
+        s2c_direct_message direct;
+        memcpy(&direct, frame, sizeof direct);
+        direct.from[BUFFER_SIZE - 1] = '\0';
+        direct.name[BUFFER_SIZE - 1] = '\0';
+        direct.to[BUFFER_SIZE - 1] = '\0';
+        direct.message[BUFFER_SIZE - 1] = '\0';
+        if (client->callbacks.onDirect != NULL) {
+            client->callbacks.onDirect(client, &direct);
+        }
+        return;
+    }
+    if (type == BLOB_CHUNK_TYPE) {
+        blob_chunk_header header;
+        memcpy(&header, frame, sizeof header);
+        handle_chunk(client, &header, frame + sizeof header);
+        return;
+    }
+    if (type == GROUP_PAGE_TYPE || type == ROSTER_PAGE_TYPE) {
+        s2c_page_header header;
+        memcpy(&header, frame, sizeof header);
+        if (client->callbacks.onPage != NULL) {
+            client->callbacks.onPage(client, &header, frame + sizeof header);
+        }
+        return;
+    }
+
+    user_message msg;
+    memcpy(&msg, frame, sizeof msg);
+    msg.name[BUFFER_SIZE - 1] = '\0';
+    msg.message[BUFFER_SIZE - 1] = '\0';
+    msg.group[GROUP_NAME_SIZE - 1] = '\0';
+    switch (type) {
+    case ERROR_TYPE:
+        handle_response(client, msg.requestId, 0, msg.message);
+        break;
+    case PRINT_MESSAGE_TYPE:
+        if (msg.seq != 0) {
+            handle_group_message(client, &msg);
+        } else if (client->callbacks.onMessage != NULL) {
+            client->callbacks.onMessage(client, &msg);
+        }
+        break;
+    case HISTORY_MESSAGE_TYPE:
+        history_message(&msg, client);
+        break;
+    default:
+        if (client->callbacks.onMessage != NULL) {
+            client->callbacks.onMessage(client, &msg);
+        }
+        break;
+    }
+}
+
+// Size of the frame starting at buf: frames are sized by their type. Returns
+// the bytes needed so far (more than len while incomplete), 0 if malformed.
+static size_t frame_size(const char *buf, size_t len) {
+    int type;
+    if (len < sizeof type) {
+        return sizeof type;
+    }
+    memcpy(&type, buf, sizeof type);
+    if (type == ACK_TYPE) {
+        return sizeof(s2c_send_ok_ack);
+    }
+    if (type == EVENT_TYPE) {
+        return sizeof(s2c_event);
+    }
+    if (type == DIRECT_MESSAGE_TYPE || type == DIRECT_HISTORY_TYPE) {
+        return sizeof(s2c_direct_message);
+    }
+    if (type == COMPRESSED_TYPE) {
+        s2c_compressed_header header;
+        if (len < sizeof header) {
+            return sizeof header;
+        }
+        memcpy(&header, buf, sizeof header);
+        return (header.length <= COMPRESS_MAX_RAW) ? sizeof header + header.length : 0;
+    }
+    if (type == BATCH_RESPONSE_TYPE) {
+        op_batch_header header;
+        if (len < sizeof header) {
+            return sizeof header;
+        }
+        memcpy(&header, buf, sizeof header);
+        return (header.length <= BATCH_MAX_BYTES) ? sizeof header + header.length : 0;
+    }
+    if (type == BATCH_MESSAGE_TYPE || type == HISTORY_BATCH_TYPE) {
+        s2c_batch_header header;
+        if (len < sizeof header) {
+            return sizeof header;
+        }
+        memcpy(&header, buf, sizeof header);
+        return (header.length <= BATCH_MAX_BYTES) ? sizeof header + header.length : 0;
+    }
+    if (type == GROUP_PAGE_TYPE || type == ROSTER_PAGE_TYPE) {
+        s2c_page_header header;
+        if (len < sizeof header) {
+            return sizeof header;
+        }
+        memcpy(&header, buf, sizeof header);
+        return (header.length <= BATCH_MAX_BYTES) ? sizeof header + header.length : 0;
+    }
+    if (type == BLOB_CHUNK_TYPE) {
+        blob_chunk_header header;
+        if (len < sizeof header) {
+            return sizeof header;
+        }
+        memcpy(&header, buf, sizeof header);
+        return (header.length <= BLOB_CHUNK_SIZE) ? sizeof header + header.length : 0;
+    }
+    return sizeof(user_message);
+}
+
+// A compressed frame: unpack it and handle the frames inside.
+static int handle_compressed(ChatClient *client, const char *frame) {
+    s2c_compressed_header header;
+    memcpy(&header, frame, sizeof header);
+    if (client->inflateBuffer == NULL) {
+        client->inflateBuffer = (char *) malloc(COMPRESS_MAX_RAW);
+        if (client->inflateBuffer == NULL) {
+            perror("Error allocating memory for decompression");
+            return -1;
+        }
+    }
+    int length = decompressFrames(&header, frame + sizeof header, client->inflateBuffer, COMPRESS_MAX_RAW);
+    if (length == -1) {
+        return -1;
+    }
+    size_t pos = 0;
+    while (pos < (size_t) length) {
+        int type;
+        size_t needed = frame_size(client->inflateBuffer + pos, length - pos);
+        if (needed == 0 || needed > length - pos) {
+            return -1;
+        }
+        memcpy(&type, client->inflateBuffer + pos, sizeof type);
+        if (type == COMPRESSED_TYPE) {
+            return -1; // never nested
+        }
+        handle_frame(client, client->inflateBuffer + pos);
+        pos += needed;
+    }
+    return 0;
+}
+
+// Handles every complete frame in the receive buffer.
+static int parse_frames(ChatClient *client) {
+    size_t pos = 0;
+    while (1) {
+        size_t needed = frame_size(client->recvBuffer + pos, client->recvLen - pos);
+        if (needed == 0) {
+            printf("Invalid frame received from server\n");
+            return -1;
+        }
+        if (needed > client->recvLen - pos) {
+            break;
+        }
+        int type;
+        memcpy(&type, client->recvBuffer + pos, sizeof type);
+        if (type != COMPRESSED_TYPE) {
+            handle_frame(client, client->recvBuffer + pos);
+        } else if (handle_compressed(client, client->recvBuffer + pos) == -1) {
+            printf("Invalid compressed frame received from server\n");
+            return -1;
+        }
+        pos += needed;
+    }
+    memmove(client->recvBuffer, client->recvBuffer + pos, client->recvLen - pos);
+    client->recvLen -= pos;
+    return 0;
+}
+
+static int read_frames(ChatClient *client) {
+    while (1) {
+        ssize_t n = net_recv_some(client->fd, client->recvBuffer + client->recvLen,
+                                  CHAT_RECV_BUFFER_SIZE - client->recvLen);
+        if (n > 0) {
+            client->recvLen += n;
+            client->bytesReceived += n;
+            client->recvCalls++;
+            if (parse_frames(client) == -1) {
+                return -1;
+            }
+        } else if (n == 0) {
+            return -1;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+// ======= EVENT LOOP =========== //
+
+/**
+ * return the poll() events the client is waiting for: always POLLIN, plus
+ *        POLLOUT while requests or upload chunks are queued. 0 once closed.
+ */
+short chat_poll_events(ChatClient *client) {
+    if (client->closed) {
+        return 0;
+    }
+    int sending = (client->sendLen > client->sendHead) ||
+                  (client->upload != NULL && client->upload->offset < client->upload->size);
+    return POLLIN | (sending ? POLLOUT : 0);
+}
+
+/**
+ * Does the work poll() reported: writes queued requests and handles
+ * received frames (calling the callbacks).
+ *
+ * param revents The pollfd revents for client->fd (0 just flushes).
+ * return 0 while connected, -1 once the connection is closed.
+ */
+int chat_process(ChatClient *client, short revents) {
+    if (client->closed) {
+        return -1;
+    }
+    int failed = 0;
+    if (client->sendLen > client->sendHead) {
+        failed = flush_queue(client) == -1;
+    }
+    if (!failed) {
+        failed = pump_upload(client) == -1;
+    }
+    if (!failed && (revents & (POLLIN | POLLHUP | POLLERR))) {
+        failed = read_frames(client) == -1;
+        // Callbacks may have queued requests (acks, syncs).
+        if (!failed && client->sendLen > client->sendHead) {
+            failed = flush_queue(client) == -1;
+        }
+    }
+    if (failed) {
+        client->closed = 1;
+        if (client->callbacks.onClose != NULL) {
+            client->callbacks.onClose(client);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * One round of the event loop over many clients: poll() all of them and
+ * process what is ready.
+ *
+ * param timeout_ms poll() timeout.
+ * return number of clients still connected.
+ */
+int chat_run(ChatClient **clients, int count, int timeout_ms) {
+    struct pollfd stack_fds[64];
+    struct pollfd *fds = (count <= 64) ? stack_fds : (struct pollfd *) malloc(count * sizeof(struct pollfd));
+    if (fds == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        fds[i].fd = clients[i]->closed ? -1 : clients[i]->fd;
+        fds[i].events = chat_poll_events(clients[i]);
+        fds[i].revents = 0;
+    }
+    if (poll(fds, count, timeout_ms) == -1 && errno != EINTR) {
+        perror("poll");
+    }
+    int open_clients = 0;
+    for (int i = 0; i < count; i++) {
+        if (fds[i].revents != 0) {
+            chat_process(clients[i], fds[i].revents);
+        }
+        open_clients += !clients[i]->closed;
+    }
+    if (fds != stack_fds) {
+        free(fds);
+    }
+    return open_clients;
+}
+
+static long long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Runs this client's event loop until the answer to a request arrives
+ * (other frames keep going to the callbacks meanwhile). For simple
+ * request/response flows such as logging in.
+ *
+ * return 1 on ACK, 0 on error response, -1 on disconnect or timeout.
+ */
+int chat_wait(ChatClient *client, unsigned int request_id, int timeout_ms) {
+    long long deadline = monotonic_ms() + timeout_ms;
+    client->waitId = request_id;
+    client->waitResult = -1;
+    while (client->waitResult == -1 && !client->closed) {
+        int remaining = (int) (deadline - monotonic_ms());
+        if (remaining <= 0) {
+            break;
+        }
+        chat_run(&client, 1, remaining);
+    }
+    client->waitId = 0;
+    return client->waitResult;
+}
+
+/**
+ * return the seconds an overloaded server asked to wait before retrying
+ *        (BUSY_ERROR), 0 for any other error.
+ */
+int chat_retry_after(const char *error) {
+    int seconds = 0;
+    if (error == NULL || sscanf(error, BUSY_ERROR, &seconds) != 1 || seconds < 0) {
+        return 0;
+    }
+    return seconds;
+}
+
+/**
+ * Closes the connection and frees the client (not the cache).
+ */
+void chat_close(ChatClient *client) {
+    net_close(client->fd);
+    if (client->upload != NULL) {
+        free_transfer(client->upload);
+    }
+    if (client->download != NULL) {
+        free_transfer(client->download); // the part stays, to be resumed
+    }
+    freeSeqTrackerList(&client->trackers);
+    free(client->batch);
+    free(client->sendQueue);
+    free(client->recvBuffer);
+    free(client->inflateBuffer);
+    free(client);
+}
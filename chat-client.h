@@ -0,0 +1,177 @@
+#ifndef CHAT_CLIENT_H
+#define CHAT_CLIENT_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <openssl/evp.h>
+#include "protocol.h"
+#include "seq-tracker.h"
+#include "msg-cache.h"
+#include "wire-compress.h"
+
+/**
+ * Event-driven client library.
+ *
+ * A ChatClient owns one non-blocking connection to the server. Requests are
+ * encoded into a send queue and written as the socket accepts them; incoming
+ * bytes collect in a receive buffer, and every complete frame is handed to
+ * the callbacks. Group messages go through per-group sequence trackers and
+ * are acknowledged in batches, as in the interactive client.
+ *
+ * Nothing blocks except chat_connect() (name lookup, TCP connect, TLS
+ * handshake) and chat_wait(). A single thread can drive any number of
+ * clients: poll() their descriptors for chat_poll_events() and pass the
+ * result to chat_process(), or let chat_run() do both.
+ *
+ * Every request gets a requestId, echoed by the server in the ACK or error
+ * that answers it. Callbacks run on the thread that calls chat_process().
+ *
+ * Compressed frames (chat_enable_compression()) are unpacked before the
+ * frames inside them reach the callbacks.
+ *
+ * Requests made between chat_begin_batch() and chat_end_batch() travel in
+ * one frame and are answered in one frame: a bot that joins twenty groups
+ * or posts a burst pays one round trip instead of one per request.
+ * Answers still reach onResponse one by one.
+ *
+ * Attachments (chat_upload(), chat_download()) travel in chunks between the
+ * other frames, a few at a time, so a large file never holds up chat.
+ */
+
+#define CHAT_RECV_BUFFER_SIZE (sizeof(s2c_compressed_header) + COMPRESS_MAX_RAW) // one whole frame of any type
+#define CHAT_SEND_QUEUE_LIMIT (1 << 20) // queued bytes before requests are refused
+#define CHAT_UPLOAD_WINDOW (4 * BLOB_CHUNK_SIZE) // upload chunks are queued while the queue is shorter
+
+typedef struct CHAT_CLIENT ChatClient;
+
+/**
+ * Struct name: ChatCallbacks
+ * Description: What a ChatClient reports. Any of them may be NULL.
+ *
+ * param onResponse ACK (ok = 1) or error (ok = 0) answering a request. An
+ *                  error with requestId 0 was not caused by a request.
+ * param onMessage  A group message, in sequence order per group (live or
+ *                  from the backlog), or a server notice without a seq.
+ * param onHistory  A message from a history sync (already in the cache, if any).
+ * param onSynced   A history sync of the group finished.
+ * param onClose    The server closed the connection.
+ * param onEvent    Another member is typing or has read a group (best effort,
+ *                  see chat_send_typing()).
+ * param onPage     A page of groups (GROUP_PAGE_TYPE) or of a roster
+ *                  (ROSTER_PAGE_TYPE) answering chat_list_groups() or
+ *                  chat_roster(); unpack it with nextPageGroup() or
+ *                  nextPageMember() (msg-batch.h).
+ * param onDirect   A direct message: live (DIRECT_MESSAGE_TYPE, to either user
+ *                  of the conversation) or from chat_direct_history()
+ *                  (DIRECT_HISTORY_TYPE; seq 0 ends the history).
+ */
+typedef struct CHAT_CALLBACKS {
+    void (*onResponse)(ChatClient *client, unsigned int requestId, int ok, const char *error);
+    void (*onMessage)(ChatClient *client, user_message *msg);
+    void (*onHistory)(ChatClient *client, user_message *msg);
+    void (*onSynced)(ChatClient *client, const char *group);
+    void (*onClose)(ChatClient *client);
+    void (*onEvent)(ChatClient *client, s2c_event *event);
+    void (*onPage)(ChatClient *client, s2c_page_header *header, const char *payload);
+    void (*onDirect)(ChatClient *client, s2c_direct_message *msg);
+} ChatCallbacks;
+
+/**
+ * Struct name: ChatTransfer
+ * Description: An upload or a download in progress (one of each at a time).
+ *
+ * param fd     The local file; a download writes to "<path>.part".
+ * param offset Upload: the next byte to queue. Download: the next byte expected.
+ * param hash   Download: the attachment asked for.
+ * param path   Download: where the file goes once it is complete.
+ * param sha    Download: SHA-256 of the bytes so far, checked against hash.
+ * param failed Download: a chunk was out of place or could not be written.
+ */
+typedef struct CHAT_TRANSFER {
+    int fd;
+    unsigned long long size;
+    unsigned long long offset;
+    unsigned int requestId;
+    char hash[BLOB_HASH_SIZE];
+    char *path;
+    EVP_MD_CTX *sha;
+    int failed;
+} ChatTransfer;
+
+/**
+ * Struct name: ChatClient
+ * Description: One connection and its protocol state.
+ *
+ * param nextPostId Message id of the next post: random at connect, then counting.
+ * param sendQueue Encoded requests not yet written: bytes sendHead..sendLen.
+ * param trackers  Per-group receive state (one tracker per group seen).
+ * param cache     Optional local message cache (chat_set_cache()).
+ * param userData  For the application; the library doesn't touch it.
+ * param batch     Requests collected since chat_begin_batch(), NULL otherwise.
+ * param device    Device name sent with login and registration, "" for none.
+ * param upload, download Attachments in progress, NULL if none.
+ * param inflateBuffer Frames unpacked from a compressed frame (allocated on first use).
+ * param bytesReceived, recvCalls Wire statistics: bytes read from the socket and reads that returned data.
+ */
+struct CHAT_CLIENT {
+    int fd;
+    unsigned int nextRequestId;
+    unsigned long long nextPostId;
+    char *sendQueue;
+    size_t sendHead;
+    size_t sendLen;
+    size_t sendCapacity;
+    char *recvBuffer;
+    size_t recvLen;
+    char *inflateBuffer;
+    unsigned long long bytesReceived;
+    unsigned long recvCalls;
+    SeqTrackerList trackers;
+    MessageCache *cache;
+    struct OP_BATCH *batch;
+    ChatCallbacks callbacks;
+    void *userData;
+    char device[DEVICE_NAME_SIZE];
+    ChatTransfer *upload;
+    ChatTransfer *download;
+    int closed;
+    unsigned int waitId;    // chat_wait(): request being waited for
+    int waitResult;         // and its answer (-1 until it arrives)
+};
+
+// Function prototypes
+ChatClient *chat_connect(const char *hostname, const char *port, int use_tls,
+                         const ChatCallbacks *callbacks, void *user_data);
+void chat_set_cache(ChatClient *client, MessageCache *cache);
+void chat_set_device(ChatClient *client, const char *name);
+unsigned int chat_register(ChatClient *client, const char *email, const char *name, const char *password);
+unsigned int chat_login(ChatClient *client, const char *email, const char *password);
+unsigned int chat_send_message(ChatClient *client, const char *group, const char *text);
+unsigned long long chat_new_post_id(ChatClient *client);
+unsigned int chat_post_message(ChatClient *client, const char *group, const char *text, unsigned long long post_id);
+unsigned int chat_join_group(ChatClient *client, const char *group);
+unsigned int chat_create_group(ChatClient *client, const char *group);
+unsigned int chat_leave_group(ChatClient *client, const char *group);
+unsigned int chat_list_groups(ChatClient *client, unsigned int cursor);
+unsigned int chat_roster(ChatClient *client, const char *group, unsigned int cursor);
+unsigned int chat_send_direct(ChatClient *client, const char *email, const char *text);
+unsigned int chat_direct_history(ChatClient *client, const char *email, unsigned int after_seq);
+unsigned int chat_sync(ChatClient *client, const char *group);
+unsigned int chat_upload(ChatClient *client, const char *group, const char *path);
+unsigned int chat_download(ChatClient *client, const char *hash, const char *path);
+unsigned int chat_enable_compression(ChatClient *client);
+void chat_send_typing(ChatClient *client, const char *group, int typing);
+void chat_send_read(ChatClient *client, const char *group, unsigned int seq);
+int chat_begin_batch(ChatClient *client);
+int chat_end_batch(ChatClient *client);
+void chat_flush_acks(ChatClient *client);
+void chat_exit(ChatClient *client);
+short chat_poll_events(ChatClient *client);
+int chat_process(ChatClient *client, short revents);
+int chat_run(ChatClient **clients, int count, int timeout_ms);
+int chat_wait(ChatClient *client, unsigned int request_id, int timeout_ms);
+int chat_retry_after(const char *error);
+void chat_close(ChatClient *client);
+
+#endif // CHAT_CLIENT_H
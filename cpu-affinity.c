@@ -0,0 +1,116 @@
+#ifndef __FreeBSD__
+#define _GNU_SOURCE // pthread_setaffinity_np(), cpu_set_t
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef __FreeBSD__
+#include <sys/param.h>
+#include <sys/cpuset.h>
+#include <pthread_np.h>
+typedef cpuset_t cpu_set_t;
+#else
+#include <sched.h>
+#endif
+#include "cpu-affinity.h"
+
+#define MAX_NODES 64
+
+/**
+ * Parses a CPU list like "0-7,16-23" (the format of taskset -c and of
+ * /sys/devices/system/node/node0/cpulist).
+ *
+ * return 0 on success, -1 if spec is malformed or names no CPU.
+ */
+int parseCpuList(const char *spec, CpuList *list) {
+    list->cpus = (int *) malloc(CPU_LIST_MAX * sizeof(int));
+    list->count = 0;
+    if (list->cpus == NULL) {
+        perror("Error allocating CPU list");
+        return -1;
+    }
+    const char *p = spec;
+    while (*p != '\0' && *p != '\n') {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p) {
+            break;
+        }
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1) {
+                break;
+            }
+            p = end;
+        }
+        if (first < 0 || last < first || last >= CPU_LIST_MAX || list->count + (last - first) >= CPU_LIST_MAX) {
+            break;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            list->cpus[list->count++] = (int) cpu;
+        }
+        if (*p == ',') {
+            p++;
+        }
+    }
+    if ((*p != '\0' && *p != '\n') || list->count == 0) {
+        freeCpuList(list);
+        return -1;
+    }
+    return 0;
+}
+
+void freeCpuList(CpuList *list) {
+    free(list->cpus);
+    list->cpus = NULL;
+    list->count = 0;
+}
+
+/**
+ * return the NUMA node of cpu, or -1 if unknown (no sysfs, e.g. FreeBSD).
+ */
+int cpuNode(int cpu) {
+    for (int node = 0; node < MAX_NODES; node++) {
+        char path[64];
+        char line[4096];
+        snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *file = fopen(path, "r");
+        if (file == NULL) {
+            continue; // node numbers can have holes
+        }
+        CpuList cpus;
+        int found = 0;
+        if (fgets(line, sizeof line, file) != NULL && parseCpuList(line, &cpus) == 0) {
+            for (int i = 0; i < cpus.count && !found; i++) {
+                found = cpus.cpus[i] == cpu;
+            }
+            freeCpuList(&cpus);
+        }
+        fclose(file);
+        if (found) {
+            return node;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Restricts a thread to one CPU.
+ *
+ * return 0 on success, -1 on failure (e.g. the CPU is offline or not in the
+ *        process's cpuset); the thread then keeps running where it was.
+ */
+int pinThreadToCpu(pthread_t thread, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int error = pthread_setaffinity_np(thread, sizeof set, &set);
+    if (error != 0) {
+        fprintf(stderr, "Error pinning thread to CPU %d: %s\n", cpu, strerror(error));
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,35 @@
+#ifndef CPU_AFFINITY_H
+#define CPU_AFFINITY_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+/**
+ * Thread placement (server -a option).
+ *
+ * Fan-out worker i runs on cpus[i % count]. A connection's thread runs on
+ * the CPU of the worker that serves its partitions (fd % workers), so the
+ * thread that reads a client's requests and the worker that sends to it
+ * share a core and its caches. Threads allocate their buffers after they are
+ * pinned: with the default first-touch policy the pages come from the local
+ * NUMA node, without linking libnuma.
+ */
+
+#define CPU_LIST_MAX 1024 // highest CPU number accepted + 1
+
+/**
+ * Struct name: CpuList
+ * Description: CPUs to place threads on, in the order given.
+ */
+typedef struct CPU_LIST {
+    int *cpus;
+    int count;
+} CpuList;
+
+// Function prototypes
+int parseCpuList(const char *spec, CpuList *list);
+void freeCpuList(CpuList *list);
+int cpuNode(int cpu);
+int pinThreadToCpu(pthread_t thread, int cpu);
+
+#endif // CPU_AFFINITY_H
@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dedup-window.h"
+
+#define INDEX_MASK (DEDUP_INDEX_SIZE - 1)
+
+static unsigned int id_slot(unsigned long long id) {
+    return (unsigned int) ((id * 0x9E3779B97F4A7C15ULL) >> 32) & INDEX_MASK;
+}
+
+// Index slot of an id, or of the empty slot where it would go.
+static unsigned int find_slot(DedupWindow *window, unsigned long long id) {
+    unsigned int i = id_slot(id);
+    while (window->slots[i] != 0 && window->ids[window->slots[i] - 1] != id) {
+        i = (i + 1) & INDEX_MASK;
+    }
+    return i;
+}
+
+// Takes ring position pos out of the index, moving later entries of its
+// cluster back so lookups never stop early at the hole.
+static void unindex(DedupWindow *window, unsigned int pos) {
+    unsigned int i = id_slot(window->ids[pos]);
+    while (window->slots[i] != 0 && window->slots[i] != pos + 1) {
+        i = (i + 1) & INDEX_MASK;
+    }
+    if (window->slots[i] == 0) {
+        return; // forgotten already
+    }
+    unsigned int j = i;
+    while (1) {
+        j = (j + 1) & INDEX_MASK;
+        if (window->slots[j] == 0) {
+            break;
+        }
+        unsigned int home = id_slot(window->ids[window->slots[j] - 1]);
+        // The entry at j may fill the hole at i unless its home lies
+        // (cyclically) after i and no later than j.
+        int stays = (i <= j) ? (home > i && home <= j) : (home > i || home <= j);
+        if (!stays) {
+            window->slots[i] = window->slots[j];
+            i = j;
+        }
+    }
+    window->slots[i] = 0;
+}
+
+/**
+ * Checks a post's id against the window and remembers it if it is new.
+ *
+ * param window The user's window, allocated here with the first id.
+ * return 1 if the id was posted already, 0 if it is new (remembered now),
+ *        -1 if memory ran out (the post goes ahead without the check).
+ */
+int rememberPostId(DedupWindow **window, unsigned long long id) {
+    if (*window == NULL) {
+        *window = (DedupWindow *) calloc(1, sizeof(DedupWindow));
+        if (*window == NULL) {
+            perror("Error allocating dedup window");
+            return -1;
+        }
+    }
+    DedupWindow *w = *window;
+    unsigned int slot = find_slot(w, id);
+    if (w->slots[slot] != 0) {
+        return 1;
+    }
+    if (w->count == DEDUP_WINDOW_SIZE) {
+        unindex(w, w->next); // the oldest goes
+        slot = find_slot(w, id);
+    } else {
+        w->count++;
+    }
+    w->ids[w->next] = id;
+    w->slots[slot] = (unsigned short) (w->next + 1);
+    w->next = (w->next + 1) % DEDUP_WINDOW_SIZE;
+    return 0;
+}
+
+/**
+ * Forgets an id remembered for a post that then couldn't be stored, so the
+ * client's retry is stored.
+ */
+void forgetPostId(DedupWindow *window, unsigned long long id) {
+    if (window == NULL) {
+        return;
+    }
+    unsigned int slot = find_slot(window, id);
+    if (window->slots[slot] != 0) {
+        unindex(window, window->slots[slot] - 1);
+    }
+}
+
+void freeDedupWindow(DedupWindow *window) {
+    free(window);
+}
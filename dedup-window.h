@@ -0,0 +1,40 @@
+#ifndef DEDUP_WINDOW_H
+#define DEDUP_WINDOW_H
+#include <stdio.h>
+#include <stdlib.h>
+#include "protocol.h"
+
+/**
+ * The ids of a user's latest posts (POST_TYPE), so a post the client sends
+ * again after a lost ACK is acknowledged without being stored or fanned out
+ * a second time.
+ *
+ * A window holds the last DEDUP_WINDOW_SIZE ids: a ring in posting order
+ * (the oldest is forgotten first) and an open-addressing index into the
+ * ring, about 3 KB in all. It is allocated with the user's first post and
+ * guarded by the user's lock. Windows live in memory only: a post retried
+ * across a server restart is stored again.
+ */
+
+#define DEDUP_WINDOW_SIZE 256                     // ids remembered per user
+#define DEDUP_INDEX_SIZE (2 * DEDUP_WINDOW_SIZE)  // index slots (power of two)
+
+/**
+ * Struct name: DedupWindow
+ *
+ * param ids   Ring of remembered ids; next is where the next one goes.
+ * param slots Index by id: position in ids + 1, 0 for an empty slot.
+ */
+typedef struct DEDUP_WINDOW {
+    unsigned long long ids[DEDUP_WINDOW_SIZE];
+    unsigned short slots[DEDUP_INDEX_SIZE];
+    unsigned int next;
+    unsigned int count;
+} DedupWindow;
+
+// Function prototypes
+int rememberPostId(DedupWindow **window, unsigned long long id);
+void forgetPostId(DedupWindow *window, unsigned long long id);
+void freeDedupWindow(DedupWindow *window);
+
+#endif // DEDUP_WINDOW_H
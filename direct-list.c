@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "protocol.h"
+#include "direct-list.h"
+
+#define INITIAL_CONVERSATION_CAPACITY 16
+#define INITIAL_DIRECT_INDEX_CAPACITY 64
+
+void initDirectList(DirectList *directList) {
+    directList->index = NULL;
+    directList->indexCapacity = 0;
+    directList->count = 0;
+    directList->nextId = 0;
+    pthread_mutex_init(&directList->lock, NULL);
+}
+
+// Users live as long as the server, so the pair of pointers is the key.
+static unsigned int hashPair(User *first, User *second) {
+    uint64_t hash = (uint64_t) (uintptr_t) first * 0x9E3779B97F4A7C15ull;
+    hash ^= (uint64_t) (uintptr_t) second + 0x632BE59BD9B4E019ull + (hash << 6) + (hash >> 2);
+    return (unsigned int) (hash ^ (hash >> 32));
+}
+
+// The two users in email order, so both directions find the same conversation.
+static void orderPair(User **a, User **b) {
+    if (strcmp((*a)->email, (*b)->email) > 0) {
+        User *temp = *a;
+        *a = *b;
+        *b = temp;
+    }
+}
+
+static void indexInsert(Conversation **index, unsigned int capacity, Conversation *conversation) {
+    unsigned int slot = hashPair(conversation->first, conversation->second) & (capacity - 1);
+    while (index[slot] != NULL) {
+        slot = (slot + 1) & (capacity - 1);
+    }
+    index[slot] = conversation;
+}
+
+// Keeps the index at most half full. Called with the lock held.
+static int reserveConversation(DirectList *directList) {
+    if ((unsigned long) (directList->count + 1) * 2 <= directList->indexCapacity) {
+        return 0;
+    }
+    unsigned int capacity = directList->indexCapacity ? directList->indexCapacity * 2 : INITIAL_DIRECT_INDEX_CAPACITY;
+    Conversation **index = (Conversation **) calloc(capacity, sizeof(Conversation *));
+    if (index == NULL) {
+        perror("Error allocating memory for conversation index");
+        return -1;
+    }
+    for (unsigned int i = 0; i < directList->indexCapacity; i++) {
+        if (directList->index[i] != NULL) {
+            indexInsert(index, capacity, directList->index[i]);
+        }
+    }
+    free(directList->index);
+    directList->index = index;
+    directList->indexCapacity = capacity;
+    return 0;
+}
+
+static Conversation *lookup(DirectList *directList, User *first, User *second) {
+    if (directList->index == NULL) {
+        return NULL;
+    }
+    unsigned int slot = hashPair(first, second) & (directList->indexCapacity - 1);
+    while (directList->index[slot] != NULL) {
+        Conversation *conversation = directList->index[slot];
+        if (conversation->first == first && conversation->second == second) {
+            return conversation;
+        }
+        slot = (slot + 1) & (directList->indexCapacity - 1);
+    }
+    return NULL;
+}
+
+/**
+ * Looks up the conversation of two users in O(1), in either order.
+ *
+ * return the conversation, or NULL if they never wrote to each other.
+ */
+Conversation *findConversation(DirectList *directList, User *a, User *b) {
+    orderPair(&a, &b);
+    pthread_mutex_lock(&directList->lock);
+    Conversation *conversation = lookup(directList, a, b);
+    pthread_mutex_unlock(&directList->lock);
+    return conversation;
+}
+
+/**
+ * Looks up the conversation of two users, creating it if needed.
+ *
+ * param id The id of a conversation being loaded from its log, or 0 for a new
+ *          one, which gets the next free id.
+ * return the conversation, or NULL if memory ran out.
+ */
+Conversation *getOrCreateConversation(DirectList *directList, User *a, User *b, unsigned int id) {
+    orderPair(&a, &b);
+    pthread_mutex_lock(&directList->lock);
+    Conversation *conversation = lookup(directList, a, b);
+    if (conversation == NULL) {
+        conversation = (Conversation *) calloc(1, sizeof(Conversation));
+        if (conversation == NULL || reserveConversation(directList) == -1) {
+            perror("Error allocating memory for conversation");
+            free(conversation);
+            pthread_mutex_unlock(&directList->lock);
+            return NULL;
+        }
+        conversation->first = a;
+        conversation->second = b;
+        if (id == 0) {
+            id = ++directList->nextId;
+        } else if (id > directList->nextId) {
+            directList->nextId = id;
+        }
+        conversation->id = id;
+        conversation->fd = -1;
+        pthread_mutex_init(&conversation->lock, NULL);
+        indexInsert(directList->index, directList->indexCapacity, conversation);
+        directList->count++;
+    }
+    pthread_mutex_unlock(&directList->lock);
+    return conversation;
+}
+
+/**
+ * return the other user of the conversation.
+ */
+User *conversationPeer(Conversation *conversation, User *user) {
+    return (conversation->first == user) ? conversation->second : conversation->first;
+}
+
+/**
+ * Gives the message the conversation's next sequence number and indexes
+ * it. The caller holds conversation->lock.
+ *
+ * return the assigned sequence number, or 0 if memory ran out.
+ */
+unsigned int appendDirectMessage(Conversation *conversation, Message *message) {
+    if (conversation->lastSeq == conversation->capacity) {
+        unsigned int capacity = conversation->capacity ? conversation->capacity * 2 : INITIAL_CONVERSATION_CAPACITY;
+        Message **messages = (Message **) realloc(conversation->messages, capacity * sizeof(Message *));
+        if (messages == NULL) {
+            perror("Error growing conversation index");
+            return 0;
+        }
+        conversation->messages = messages;
+        conversation->capacity = capacity;
+    }
+    conversation->messages[conversation->lastSeq] = message;
+    conversation->lastSeq++;
+    message->seq = conversation->lastSeq;
+    return message->seq;
+}
+
+/**
+ * return the message with the given sequence number, or NULL if out of range.
+ */
+Message *getDirectMessage(Conversation *conversation, unsigned int seq) {
+    if (seq == 0 || seq > conversation->lastSeq) {
+        return NULL;
+    }
+    return conversation->messages[seq - 1];
+}
+
+/**
+ * Frees every conversation with its messages (direct messages are not in
+ * the MessageList).
+ */
+void freeDirectList(DirectList *directList) {
+    for (unsigned int i = 0; i < directList->indexCapacity; i++) {
+        Conversation *conversation = directList->index[i];
+        if (conversation == NULL) {
+            continue;
+        }
+        for (unsigned int seq = 0; seq < conversation->lastSeq; seq++) {
+            if (conversation->messages[seq] != NULL) {
+                free(conversation->messages[seq]->message);
+                free(conversation->messages[seq]);
+            }
+        }
+        pthread_mutex_destroy(&conversation->lock);
+        free(conversation->messages);
+        free(conversation);
+    }
+    free(directList->index);
+    directList->index = NULL;
+    directList->indexCapacity = 0;
+    directList->count = 0;
+}
@@ -0,0 +1,17 @@
+#ifndef DIRECT_LIST_H
+#define DIRECT_LIST_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "protocol.h"
+
+// Function prototypes
+void initDirectList(DirectList *directList);
+Conversation *findConversation(DirectList *directList, User *a, User *b);
+Conversation *getOrCreateConversation(DirectList *directList, User *a, User *b, unsigned int id);
+User *conversationPeer(Conversation *conversation, User *user);
+unsigned int appendDirectMessage(Conversation *conversation, Message *message);
+Message *getDirectMessage(Conversation *conversation, unsigned int seq);
+void freeDirectList(DirectList *directList);
+
+#endif // DIRECT_LIST_H
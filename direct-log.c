@@ -0,0 +1,400 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "protocol.h"
+#include "user-list.h"
+#include "msg-list.h"
+#include "direct-list.h"
+#include "direct-log.h"
+
+#define MAX_RECORD_PAYLOAD (2 * BUFFER_SIZE)
+
+// Payload: sender email and text, each NUL-terminated. The first record of
+// a file has seq 0 and holds the two users' emails instead.
+typedef struct {
+    uint32_t length;        // payload bytes
+    uint32_t checksum;      // FNV-1a of seq, timestamp and payload
+    uint32_t seq;
+    uint32_t reserved;
+    int64_t timestamp;
+} DirectRecord;
+
+static uint32_t fnv1a(uint32_t hash, const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *) data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t recordChecksum(DirectRecord *record, const char *payload) {
+    uint32_t hash = fnv1a(2166136261u, &record->seq, sizeof(record->seq));
+    hash = fnv1a(hash, &record->timestamp, sizeof(record->timestamp));
+    return fnv1a(hash, payload, record->length);
+}
+
+// Packs a record with two strings at out; returns its size.
+static size_t packRecord(char *out, unsigned int seq, long long timestamp, const char *a, const char *b) {
+    DirectRecord *header = (DirectRecord *) out;
+    char *payload = out + sizeof(DirectRecord);
+    const char *strings[2] = { a, b };
+    size_t len = 0;
+    for (int i = 0; i < 2; i++) {
+        size_t n = strnlen(strings[i], BUFFER_SIZE - 1);
+        memcpy(payload + len, strings[i], n);
+        payload[len + n] = '\0';
+        len += n + 1;
+    }
+    header->length = len;
+    header->seq = seq;
+    header->reserved = 0;
+    header->timestamp = timestamp;
+    header->checksum = recordChecksum(header, payload);
+    return sizeof(DirectRecord) + len;
+}
+
+static char *log_path(DirectLog *log, unsigned int id) {
+    size_t len = strlen(log->dir) + 32;
+    char *path = (char *) malloc(len);
+    if (path != NULL) {
+        snprintf(path, len, "%s/%u.log", log->dir, id);
+    }
+    return path;
+}
+
+// Reads the next record; returns 1, or 0 at the end or at a torn or corrupt record.
+static int readRecord(FILE *fp, DirectRecord *record, char *payload) {
+    if (fread(record, sizeof(DirectRecord), 1, fp) != 1 ||
+        record->length == 0 || record->length > MAX_RECORD_PAYLOAD ||
+        fread(payload, 1, record->length, fp) != record->length ||
+        recordChecksum(record, payload) != record->checksum || payload[record->length - 1] != '\0') {
+        return 0;
+    }
+    payload[record->length] = '\0';
+    return 1;
+}
+
+/**
+ * Reads one conversation's file back. A torn or corrupt tail ends the
+ * replay and is cut off.
+ *
+ * return number of messages replayed.
+ */
+static long replayFile(const char *path, unsigned int id, UserList *userList, DirectList *directList) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        perror("Error opening conversation log");
+        return 0;
+    }
+    DirectRecord record;
+    char payload[MAX_RECORD_PAYLOAD + 1];
+    if (!readRecord(fp, &record, payload) || record.seq != 0 || strlen(payload) + 1 >= record.length) {
+        printf("Direct log: %s has no header, skipping it\n", path);
+        fclose(fp);
+        return 0;
+    }
+    User *first = findUser(userList, payload);
+    User *second = findUser(userList, payload + strlen(payload) + 1);
+    Conversation *conversation = (first != NULL && second != NULL && first != second)
+                                 ? getOrCreateConversation(directList, first, second, id) : NULL;
+    if (conversation == NULL) {
+        printf("Direct log: %s is between unknown users, skipping it\n", path);
+        fclose(fp);
+        return 0;
+    }
+
+    long records = 0;
+    off_t good = sizeof record + record.length;
+    while (readRecord(fp, &record, payload)) {
+        good += sizeof record + record.length;
+        char *text = payload + strlen(payload) + 1;
+        User *sender = (strcmp(payload, first->email) == 0) ? first
+                     : (strcmp(payload, second->email) == 0) ? second : NULL;
+        if (text >= payload + record.length || sender == NULL || record.seq <= conversation->lastSeq) {
+            continue;
+        }
+        Message *msg = createMessage(strdup(text), sender);
+        if (msg == NULL) {
+            continue;
+        }
+        msg->timestamp = record.timestamp;
+        appendDirectMessage(conversation, msg);
+        records++;
+    }
+    if (!feof(fp) || ftello(fp) != good) {
+        printf("Direct log: discarding damaged tail of %s at byte %lld\n", path, (long long) good);
+        if (truncate(path, good) == -1) {
+            perror("Error truncating conversation log");
+        }
+    }
+    fclose(fp);
+    return records;
+}
+
+static int fsync_path(const char *path, int flags) {
+    int fd = open(path, flags);
+    if (fd == -1) {
+        return -1;
+    }
+    int result = (flags == O_RDONLY) ? fsync(fd) : fdatasync(fd);
+    close(fd);
+    return result;
+}
+
+// Syncs the files written since the last call (and the directory, if files were created).
+static void syncDirty(DirectLog *log) {
+    pthread_mutex_lock(&log->mutex);
+    int count = log->dirtyCount;
+    Conversation **dirty = NULL;
+    int *fds = NULL;
+    if (count > 0) {
+        dirty = (Conversation **) malloc(count * sizeof(Conversation *));
+        fds = (int *) malloc(count * sizeof(int));
+        if (dirty == NULL || fds == NULL) {
+            pthread_mutex_unlock(&log->mutex);
+            free(dirty);
+            free(fds);
+            return; // retried next time
+        }
+        memcpy(dirty, log->dirty, count * sizeof(Conversation *));
+        for (int i = 0; i < count; i++) {
+            dirty[i]->dirty = 0;
+            fds[i] = dirty[i]->fd;
+        }
+    }
+    log->dirtyCount = 0;
+    int newFiles = log->newFiles;
+    log->newFiles = 0;
+    pthread_mutex_unlock(&log->mutex);
+
+    for (int i = 0; i < count; i++) {
+        if (fds[i] != -1) {
+            if (fdatasync(fds[i]) == -1) {
+                perror("Error syncing conversation log");
+            }
+            continue;
+        }
+        char *path = log_path(log, dirty[i]->id);
+        if (path == NULL || fsync_path(path, O_WRONLY) == -1) {
+            perror("Error syncing conversation log");
+        }
+        free(path);
+    }
+    if (newFiles && fsync_path(log->dir, O_RDONLY) == -1) {
+        perror("Error syncing conversation log directory");
+    }
+    free(dirty);
+    free(fds);
+}
+
+static void *syncThread(void *arg) {
+    DirectLog *log = (DirectLog *) arg;
+    struct timespec interval = { 0, DIRECT_LOG_SYNC_MS * 1000000L };
+    while (1) {
+        nanosleep(&interval, NULL);
+        pthread_mutex_lock(&log->mutex);
+        int stop = log->stopSync;
+        pthread_mutex_unlock(&log->mutex);
+        if (stop) {
+            break; // closeDirectLog() does the last sync
+        }
+        syncDirty(log);
+    }
+    return NULL;
+}
+
+/**
+ * Opens (creating if needed) the conversation logs in dir and replays them
+ * into the empty conversation list. Call after the users are loaded, since
+ * conversations refer to their users by email.
+ *
+ * return 0 on success, -1 on error.
+ */
+int openDirectLog(DirectLog *log, const char *dir, UserList *userList, DirectList *directList) {
+    memset(log, 0, sizeof(DirectLog));
+    pthread_mutex_init(&log->mutex, NULL);
+
+    size_t len = strlen(dir) + strlen(DIRECT_LOG_DIR) + 2;
+    log->dir = (char *) malloc(len);
+    if (log->dir == NULL) {
+        return -1;
+    }
+    snprintf(log->dir, len, "%s/%s", dir, DIRECT_LOG_DIR);
+    log->files = (int *) malloc(DIRECT_LOG_OPEN_FILES * sizeof(int));
+    if (log->files == NULL) {
+        return -1;
+    }
+    if (mkdir(log->dir, 0700) == -1 && errno != EEXIST) {
+        perror("Error creating conversation log directory");
+        return -1;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    DIR *entries = opendir(log->dir);
+    if (entries == NULL) {
+        perror("Error reading conversation log directory");
+        return -1;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(entries)) != NULL) {
+        unsigned int id;
+        char suffix[8];
+        if (sscanf(entry->d_name, "%u%7s", &id, suffix) != 2 || strcmp(suffix, ".log") != 0 || id == 0) {
+            continue;
+        }
+        char *path = log_path(log, id);
+        if (path != NULL) {
+            log->records += replayFile(path, id, userList, directList);
+            free(path);
+        }
+    }
+    closedir(entries);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("Direct log: %ld messages in %d conversations in %.1f ms\n", log->records, directList->count,
+           (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+
+    if (pthread_create(&log->syncThread, NULL, syncThread, log) != 0) {
+        perror("Error creating direct log thread");
+        return -1;
+    }
+    log->syncThreadRunning = 1;
+    return 0;
+}
+
+/**
+ * Opens the conversation's file for appending. Up to DIRECT_LOG_OPEN_FILES
+ * files stay open (in conversation->fd) until closeDirectLog(); past that
+ * the caller closes the returned fd after its write.
+ *
+ * param size Set to the file's size.
+ * return the fd, or -1 on error.
+ */
+static int open_log_file(DirectLog *log, Conversation *conversation, long long *size) {
+    if (conversation->fd != -1) {
+        *size = conversation->logSize;
+        return conversation->fd;
+    }
+    char *path = log_path(log, conversation->id);
+    int fd = (path != NULL) ? open(path, O_WRONLY | O_CREAT | O_APPEND, 0600) : -1;
+    free(path);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror("Error opening conversation log");
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    *size = st.st_size;
+
+    pthread_mutex_lock(&log->mutex);
+    if (log->fileCount < DIRECT_LOG_OPEN_FILES) {
+        log->files[log->fileCount++] = fd;
+        conversation->fd = fd;
+        conversation->logSize = st.st_size;
+    }
+    pthread_mutex_unlock(&log->mutex);
+    return fd;
+}
+
+/**
+ * Appends a message that was just given its sequence number to its
+ * conversation's file, creating the file with its header on the first
+ * message. Called with the conversation's lock held, so the records stay
+ * in sequence order.
+ *
+ * return 0 on success, -1 on error.
+ */
+int logDirectMessage(DirectLog *log, Conversation *conversation, Message *msg) {
+    char record[2 * (sizeof(DirectRecord) + MAX_RECORD_PAYLOAD)];
+    long long size;
+    int fd = open_log_file(log, conversation, &size);
+    if (fd == -1) {
+        return -1;
+    }
+
+    // Header and first message go out in one write, so a file never
+    // exists without its header.
+    size_t len = 0;
+    int created = size == 0;
+    if (created) {
+        len = packRecord(record, 0, 0, conversation->first->email, conversation->second->email);
+    }
+    len += packRecord(record + len, msg->seq, msg->timestamp, msg->sender->email, msg->message);
+    ssize_t written = write(fd, record, len);
+    if (written == (ssize_t) len) {
+        size += len;
+    } else if (written > 0 && ftruncate(fd, size) == -1) {
+        // A torn record would end the next replay there, dropping the
+        // messages written after it: it is cut off right away.
+        perror("Error truncating conversation log");
+    }
+    if (fd == conversation->fd) {
+        conversation->logSize = size;
+    } else {
+        close(fd);
+    }
+    if (written != (ssize_t) len) {
+        if (written >= 0) {
+            printf("Error writing conversation log: wrote %zd of %zu bytes\n", written, len);
+        } else {
+            perror("Error writing conversation log");
+        }
+        return -1;
+    }
+
+    pthread_mutex_lock(&log->mutex);
+    log->records++;
+    log->newFiles |= created;
+    if (!conversation->dirty) {
+        if (log->dirtyCount == log->dirtyCapacity) {
+            int capacity = log->dirtyCapacity ? log->dirtyCapacity * 2 : 64;
+            Conversation **dirty = (Conversation **) realloc(log->dirty, capacity * sizeof(Conversation *));
+            if (dirty != NULL) {
+                log->dirty = dirty;
+                log->dirtyCapacity = capacity;
+            }
+        }
+        if (log->dirtyCount < log->dirtyCapacity) {
+            log->dirty[log->dirtyCount++] = conversation;
+            conversation->dirty = 1;
+        }
+    }
+    pthread_mutex_unlock(&log->mutex);
+    return 0;
+}
+
+/**
+ * Stops the sync thread, then syncs what was written since its last round.
+ */
+void closeDirectLog(DirectLog *log) {
+    if (log->syncThreadRunning) {
+        pthread_mutex_lock(&log->mutex);
+        log->stopSync = 1;
+        pthread_mutex_unlock(&log->mutex);
+        pthread_join(log->syncThread, NULL);
+        log->syncThreadRunning = 0;
+    }
+    if (log->dir != NULL) {
+        syncDirty(log);
+    }
+    for (int i = 0; i < log->fileCount; i++) {
+        close(log->files[i]);
+    }
+    pthread_mutex_destroy(&log->mutex);
+    free(log->files);
+    free(log->dirty);
+    free(log->dir);
+    log->dirty = NULL;
+    log->dir = NULL;
+}
@@ -0,0 +1,57 @@
+#ifndef DIRECT_LOG_H
+#define DIRECT_LOG_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "protocol.h"
+
+/**
+ * Durable log of direct messages: one file per conversation,
+ * direct/<id>.log in the data directory, so a conversation is stored (and
+ * read back) without touching anyone else's messages.
+ *
+ * A file starts with a record naming the two users, followed by the
+ * conversation's messages in sequence order (the append happens under the
+ * conversation's lock). Writes go to the page cache right away; a
+ * background thread fdatasync()s the files written in the last
+ * DIRECT_LOG_SYNC_MS, as for the message log. At startup every file is
+ * replayed into the conversation list, after the users are loaded.
+ */
+
+#define DIRECT_LOG_DIR "direct"
+#define DIRECT_LOG_SYNC_MS 200
+#define DIRECT_LOG_OPEN_FILES 1024 // files kept open; past it a file is opened per write
+
+/**
+ * Struct name: DirectLog
+ * Description: The open conversation logs.
+ *
+ * param dirty      Conversations written since the last sync (each at most
+ *                  once: see Conversation.dirty, guarded by mutex).
+ * param newFiles   Files were created since the last sync (the directory is synced too).
+ * param files      The files kept open (Conversation.fd), up to DIRECT_LOG_OPEN_FILES,
+ *                  closed by closeDirectLog(); guarded by mutex.
+ * param stopSync   Set by closeDirectLog() to end the sync thread.
+ */
+typedef struct DIRECT_LOG {
+    char *dir;
+    long records;
+    Conversation **dirty;
+    int dirtyCount;
+    int dirtyCapacity;
+    int newFiles;
+    int *files;
+    int fileCount;
+    pthread_t syncThread;
+    int syncThreadRunning;
+    int stopSync;
+    pthread_mutex_t mutex;
+} DirectLog;
+
+// Function prototypes
+int openDirectLog(DirectLog *log, const char *dir, UserList *userList, DirectList *directList);
+int logDirectMessage(DirectLog *log, Conversation *conversation, Message *msg);
+void closeDirectLog(DirectLog *log);
+
+#endif // DIRECT_LOG_H
@@ -0,0 +1,734 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include "protocol.h"
+#include "tls-transport.h"
+#include "wire-compress.h"
+#include "fanout.h"
+
+// ======= PARTITIONS =========== //
+
+// A group's partitions are created the first time someone comes online in
+// it, and never move after that. Workers read the pointer without a lock.
+static FanoutPartition *get_partitions(FanoutPool *pool, GroupInfo *group) {
+    FanoutPartition *partitions = __atomic_load_n(&group->partitions, __ATOMIC_ACQUIRE);
+    if (partitions != NULL) {
+        return partitions;
+    }
+    pthread_mutex_lock(&pool->partitionsLock);
+    partitions = group->partitions;
+    if (partitions == NULL) {
+        partitions = (FanoutPartition *) calloc(pool->count, sizeof(FanoutPartition));
+        if (partitions != NULL) {
+            for (int i = 0; i < pool->count; i++) {
+                pthread_mutex_init(&partitions[i].lock, NULL);
+            }
+            __atomic_store_n(&group->partitions, partitions, __ATOMIC_RELEASE);
+        } else {
+            perror("Error allocating fan-out partitions");
+        }
+    }
+    pthread_mutex_unlock(&pool->partitionsLock);
+    return partitions;
+}
+
+/**
+ * Makes one of a user's devices a target of the group's fan-out (on login,
+ * or on joining while online). Call with group->lock held, after sending
+ * the device everything up to the group's head: every message published
+ * later reaches it through the fan-out, and nothing is sent twice.
+ *
+ * param cursor The device's position in the group.
+ * param fd     The device's connection.
+ * return 0 on success, -1 if memory ran out.
+ */
+int addOnlineMember(FanoutPool *pool, GroupInfo *group, User *user, DeviceCursor *cursor, int fd) {
+    FanoutPartition *partitions = get_partitions(pool, group);
+    if (partitions == NULL) {
+        return -1;
+    }
+    FanoutPartition *partition = &partitions[fd % pool->count];
+    pthread_mutex_lock(&partition->lock);
+    if (partition->count == partition->capacity) {
+        int capacity = partition->capacity ? partition->capacity * 2 : 8;
+        FanoutMember *members = (FanoutMember *) realloc(partition->members, capacity * sizeof(FanoutMember));
+        if (members == NULL) {
+            pthread_mutex_unlock(&partition->lock);
+            perror("Error growing fan-out partition");
+            return -1;
+        }
+        partition->members = members;
+        partition->capacity = capacity;
+    }
+    partition->members[partition->count].user = user;
+    partition->members[partition->count].cursor = cursor;
+    partition->members[partition->count].fd = fd;
+    partition->count++;
+    pthread_mutex_unlock(&partition->lock);
+    return 0;
+}
+
+/**
+ * Stops delivering the group's messages to one of a user's connections
+ * (logout, disconnect, leaving the group). When it returns no worker is sending to fd any more, so
+ * the descriptor can be closed. Messages still queued are not sent to it.
+ */
+void removeOnlineMember(FanoutPool *pool, GroupInfo *group, User *user, int fd) {
+    FanoutPartition *partitions = __atomic_load_n(&group->partitions, __ATOMIC_ACQUIRE);
+    if (partitions == NULL || fd < 0) {
+        return;
+    }
+    FanoutPartition *partition = &partitions[fd % pool->count];
+    pthread_mutex_lock(&partition->lock);
+    for (int i = 0; i < partition->count; i++) {
+        if (partition->members[i].user == user && partition->members[i].fd == fd) {
+            partition->members[i] = partition->members[partition->count - 1];
+            partition->count--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&partition->lock);
+}
+
+// ======= DELIVERY =========== //
+
+static void release_broadcast(Broadcast *broadcast) {
+    if (__atomic_sub_fetch(&broadcast->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_destroy(&broadcast->lock);
+        free(broadcast->packed);
+        free(broadcast);
+    }
+}
+
+// The compressed frame, made once by whichever worker needs it first.
+static int get_packed(FanoutWorker *worker, Broadcast *broadcast) {
+    pthread_mutex_lock(&broadcast->lock);
+    if (broadcast->packState == 0) {
+        broadcast->packState = -1;
+        if (worker->scratch != NULL &&
+            compressFrames(worker->scratch, &broadcast->frame, sizeof(user_message)) == 0) {
+            size_t size = compressedFrameSize(worker->scratch);
+            broadcast->packed = (char *) malloc(size);
+            if (broadcast->packed != NULL) {
+                memcpy(broadcast->packed, worker->scratch, size);
+                broadcast->packedSize = size;
+                broadcast->packState = 1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&broadcast->lock);
+    return broadcast->packState == 1;
+}
+
+static int grow_batch(FanoutWorker *worker, int count) {
+    if (count <= worker->batchCapacity) {
+        return 0;
+    }
+    int capacity = (count > 2 * worker->batchCapacity) ? count : 2 * worker->batchCapacity;
+    int *fds = (int *) realloc(worker->fds, capacity * sizeof(int));
+    if (fds != NULL) {
+        worker->fds = fds;
+    }
+    int *members = (int *) realloc(worker->members, capacity * sizeof(int));
+    if (members != NULL) {
+        worker->members = members;
+    }
+    int *results = (int *) realloc(worker->results, capacity * sizeof(int));
+    if (results != NULL) {
+        worker->results = results;
+    }
+    if (fds == NULL || members == NULL || results == NULL) {
+        return -1;
+    }
+    worker->batchCapacity = capacity;
+    return 0;
+}
+
+static void set_flush_due(FanoutWorker *worker) {
+    clock_gettime(CLOCK_REALTIME, &worker->flushDue);
+    worker->flushDue.tv_nsec += FANOUT_FLUSH_MS * 1000000L;
+    if (worker->flushDue.tv_nsec >= 1000000000L) {
+        worker->flushDue.tv_sec++;
+        worker->flushDue.tv_nsec -= 1000000000L;
+    }
+}
+
+// Remembers a connection whose queue just started holding bytes, so the
+// worker pushes them out even if no further message comes for it.
+static void add_waiting(FanoutWorker *worker, int fd) {
+    for (int i = 0; i < worker->waitingCount; i++) {
+        if (worker->waiting[i] == fd) {
+            return;
+        }
+    }
+    if (worker->waitingCount == worker->waitingCapacity) {
+        int capacity = worker->waitingCapacity ? worker->waitingCapacity * 2 : 16;
+        int *waiting = (int *) realloc(worker->waiting, capacity * sizeof(int));
+        if (waiting == NULL) {
+            return; // the bytes go out ahead of the connection's next frame
+        }
+        worker->waiting = waiting;
+        worker->waitingCapacity = capacity;
+    }
+    if (worker->waitingCount == 0) {
+        set_flush_due(worker);
+    }
+    worker->waiting[worker->waitingCount++] = fd;
+}
+
+// Hands a frame to the member's connection without waiting for it.
+static void queue_frame(FanoutWorker *worker, FanoutMember *member, const void *buf, size_t len, unsigned int seq) {
+    int result = net_queue(member->fd, buf, len);
+    if (result == -1) {
+        if (errno == ENOBUFS) {
+            printf("Connection %d isn't reading its messages, closing it\n", member->fd);
+        } else {
+            perror("Error sending message to client\n");
+        }
+        return;
+    }
+    member->cursor->sentSeq = seq;
+    if (result == 1) {
+        add_waiting(worker, member->fd); // 2: it is waiting already
+    }
+}
+
+// Pushes out what the waiting connections still hold, and forgets the ones
+// that are done (or gone).
+static void flush_waiting(FanoutWorker *worker) {
+    for (int i = 0; i < worker->waitingCount;) {
+        if (net_flush(worker->waiting[i]) == 1) {
+            i++;
+        } else {
+            worker->waiting[i] = worker->waiting[--worker->waitingCount];
+        }
+    }
+    if (worker->waitingCount > 0) {
+        set_flush_due(worker);
+    }
+}
+
+// Before a stopping worker exits: the waiting connections get until
+// FANOUT_STOP_DRAIN_MS, all together, to take what is queued on them, so
+// closing them doesn't drop frames (or cut one in half).
+static void drain_waiting(FanoutWorker *worker) {
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int left_behind = 0;
+    for (int i = 0; i < worker->waitingCount; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long elapsed = (now.tv_sec - start.tv_sec) * 1000L + (now.tv_nsec - start.tv_nsec) / 1000000L;
+        long left = (elapsed < FANOUT_STOP_DRAIN_MS) ? FANOUT_STOP_DRAIN_MS - elapsed : 0;
+        if (net_drain(worker->waiting[i], (int) left) == -1) {
+            left_behind++;
+        }
+    }
+    if (left_behind > 0) {
+        printf("Fan-out worker %d: %d connections didn't take their queued messages\n", worker->index,
+               left_behind);
+    }
+    worker->waitingCount = 0;
+}
+
+// io_uring delivery: the plain sockets that take the same bytes (compressed
+// or not) go out in one submission, TLS sockets through net_queue().
+static int deliver_batched(FanoutWorker *worker, Broadcast *broadcast, FanoutPartition *partition) {
+    unsigned int seq = broadcast->frame.seq;
+    if (grow_batch(worker, partition->count) == -1) {
+        return -1;
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        int count = 0;
+        for (int i = 0; i < partition->count; i++) {
+            FanoutMember *member = &partition->members[i];
+            if (member->cursor->sentSeq >= seq) {
+                continue;
+            }
+            int packed = compress_enabled(member->fd) && get_packed(worker, broadcast);
+            if (packed != (pass == 0)) {
+                continue; // pass 0: compressed copy, pass 1: the frame itself
+            }
+            if (net_claim_plain(member->fd) == 0) {
+                worker->fds[count] = member->fd;
+                worker->members[count] = i;
+                count++;
+            } else {
+                queue_frame(worker, member, packed ? (void *) broadcast->packed : (void *) &broadcast->frame,
+                            packed ? broadcast->packedSize : sizeof(user_message), seq);
+            }
+        }
+        if (count == 0) {
+            continue;
+        }
+        const void *buf = (pass == 0) ? (void *) broadcast->packed : (void *) &broadcast->frame;
+        size_t len = (pass == 0) ? broadcast->packedSize : sizeof(user_message);
+        if (uringSendMany(worker->ring, worker->fds, count, buf, len, worker->results) == -1) {
+            perror("Error sending with io_uring, falling back to send()");
+        }
+        for (int k = 0; k < count; k++) {
+            FanoutMember *member = &partition->members[worker->members[k]];
+            int taken = worker->results[k];
+            if (taken == (int) len) {
+                net_release(worker->fds[k]);
+                member->cursor->sentSeq = seq;
+            } else if (taken >= 0) {
+                // The socket was full: the rest waits in the connection's queue.
+                if (net_release_queue(worker->fds[k], (const char *) buf + taken, len - taken) == -1) {
+                    printf("Connection %d isn't reading its messages, closing it\n", worker->fds[k]);
+                } else {
+                    member->cursor->sentSeq = seq;
+                    add_waiting(worker, worker->fds[k]);
+                }
+            } else {
+                net_release(worker->fds[k]);
+                if (taken == -2) {
+                    queue_frame(worker, member, buf, len, seq); // the ring broke before this one
+                } else {
+                    perror("Error sending message to client\n");
+                }
+            }
+        }
+    }
+    if (worker->ring->broken) {
+        freeUring(worker->ring);
+        free(worker->ring);
+        worker->ring = NULL;
+    }
+    return 0;
+}
+
+// Sends a broadcast to the members of this worker's partition.
+static void deliver(FanoutWorker *worker, Broadcast *broadcast) {
+    FanoutPartition *partitions = __atomic_load_n(&broadcast->group->partitions, __ATOMIC_ACQUIRE);
+    if (partitions == NULL) {
+        return; // nobody was ever online in the group
+    }
+    unsigned int seq = broadcast->frame.seq;
+    FanoutPartition *partition = &partitions[worker->index];
+    pthread_mutex_lock(&partition->lock);
+    if (worker->ring != NULL && deliver_batched(worker, broadcast, partition) == 0) {
+        pthread_mutex_unlock(&partition->lock);
+        return;
+    }
+    for (int i = 0; i < partition->count; i++) {
+        FanoutMember *member = &partition->members[i];
+        if (member->cursor->sentSeq >= seq) {
+            continue; // joined after this was queued, and got it with the catch-up
+        }
+        if (compress_enabled(member->fd) && get_packed(worker, broadcast)) {
+            queue_frame(worker, member, broadcast->packed, broadcast->packedSize, seq);
+        } else {
+            queue_frame(worker, member, &broadcast->frame, sizeof(user_message), seq);
+        }
+    }
+    pthread_mutex_unlock(&partition->lock);
+}
+
+// ======= EVENTS =========== //
+
+// Typing and stopped-typing replace each other; read receipts are separate.
+static int same_event(FanoutEvent *event, User *sender, GroupInfo *group, int kind) {
+    return event->sender == sender && event->group == group &&
+           (event->frame.kind == EVENT_READ) == (kind == EVENT_READ);
+}
+
+// A message from sender ends its typing: pending typing events would arrive after it.
+static void drop_typing(FanoutWorker *worker, User *sender, GroupInfo *group) {
+    for (int i = 0; i < worker->eventCount; i++) {
+        if (same_event(&worker->events[i], sender, group, EVENT_TYPING)) {
+            worker->events[i] = worker->events[--worker->eventCount];
+            break;
+        }
+    }
+}
+
+// Has a message been queued since the worker took its queue?
+static int messages_waiting(FanoutWorker *worker) {
+    pthread_mutex_lock(&worker->lock);
+    int waiting = worker->head != NULL;
+    pthread_mutex_unlock(&worker->lock);
+    return waiting;
+}
+
+// Sends the events taken from the lane, giving way to messages.
+static void send_events(FanoutWorker *worker, int count) {
+    for (int e = 0; e < count && !messages_waiting(worker); e++) {
+        FanoutEvent *event = &worker->sending[e];
+        FanoutPartition *partitions = __atomic_load_n(&event->group->partitions, __ATOMIC_ACQUIRE);
+        if (partitions == NULL) {
+            continue;
+        }
+        FanoutPartition *partition = &partitions[worker->index];
+        pthread_mutex_lock(&partition->lock);
+        for (int i = 0; i < partition->count; i++) {
+            FanoutMember *member = &partition->members[i];
+            if (member->user != event->sender) {
+                // A full socket loses the event rather than making the worker wait.
+                if (net_send_if_room(member->fd, &event->frame, sizeof(s2c_event)) == 1) {
+                    add_waiting(worker, member->fd); // the socket took only part of it
+                }
+            }
+        }
+        pthread_mutex_unlock(&partition->lock);
+    }
+}
+
+static int window_over(struct timespec *due) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec > due->tv_sec || (now.tv_sec == due->tv_sec && now.tv_nsec >= due->tv_nsec);
+}
+
+// The earlier of the event window's end and the next flush of queued bytes.
+static struct timespec *next_due(FanoutWorker *worker) {
+    if (worker->eventCount == 0) {
+        return &worker->flushDue;
+    }
+    if (worker->waitingCount == 0) {
+        return &worker->eventsDue;
+    }
+    struct timespec *events = &worker->eventsDue;
+    struct timespec *flush = &worker->flushDue;
+    return (flush->tv_sec < events->tv_sec || (flush->tv_sec == events->tv_sec && flush->tv_nsec < events->tv_nsec))
+           ? flush : events;
+}
+
+/**
+ * Queues an ephemeral event for the group's online members other than
+ * sender, on every worker's low-priority lane. It replaces a pending event
+ * of the same sender, group and kind (a read receipt keeps the higher seq),
+ * and is dropped if a lane is full. Nothing waits for it.
+ *
+ * param frame The EVENT_TYPE frame to deliver (copied).
+ */
+void publishEvent(FanoutPool *pool, GroupInfo *group, User *sender, s2c_event *frame) {
+    if (__atomic_load_n(&group->partitions, __ATOMIC_ACQUIRE) == NULL) {
+        return; // nobody was ever online in the group
+    }
+    for (int w = 0; w < pool->count; w++) {
+        FanoutWorker *worker = &pool->workers[w];
+        pthread_mutex_lock(&worker->lock);
+        FanoutEvent *event = NULL;
+        for (int i = 0; i < worker->eventCount; i++) {
+            if (same_event(&worker->events[i], sender, group, frame->kind)) {
+                event = &worker->events[i];
+                break;
+            }
+        }
+        if (event != NULL) {
+            if (frame->kind != EVENT_READ || frame->seq > event->frame.seq) {
+                memcpy(&event->frame, frame, sizeof(s2c_event));
+            }
+        } else if (worker->eventCount < FANOUT_EVENT_LANE) {
+            if (worker->eventCount == 0) {
+                clock_gettime(CLOCK_REALTIME, &worker->eventsDue);
+                worker->eventsDue.tv_nsec += FANOUT_EVENT_WINDOW_MS * 1000000L;
+                if (worker->eventsDue.tv_nsec >= 1000000000L) {
+                    worker->eventsDue.tv_sec++;
+                    worker->eventsDue.tv_nsec -= 1000000000L;
+                }
+                pthread_cond_signal(&worker->ready);
+            }
+            event = &worker->events[worker->eventCount++];
+            event->sender = sender;
+            event->group = group;
+            memcpy(&event->frame, frame, sizeof(s2c_event));
+        }
+        pthread_mutex_unlock(&worker->lock);
+    }
+}
+
+// ======= WORKERS =========== //
+
+/**
+ * Has the worker that serves fd push out the bytes queued on it (by a
+ * catch-up written with net_queue()), as it does for its own frames.
+ */
+void flushFanoutLater(FanoutPool *pool, int fd) {
+    if (fd < 0) {
+        return;
+    }
+    FanoutWorker *worker = &pool->workers[fd % pool->count];
+    pthread_mutex_lock(&worker->lock);
+    if (worker->handedCount == worker->handedCapacity) {
+        int capacity = worker->handedCapacity ? worker->handedCapacity * 2 : 16;
+        int *handed = (int *) realloc(worker->handed, capacity * sizeof(int));
+        if (handed == NULL) {
+            pthread_mutex_unlock(&worker->lock);
+            return; // the bytes go out ahead of the connection's next frame
+        }
+        worker->handed = handed;
+        worker->handedCapacity = capacity;
+    }
+    worker->handed[worker->handedCount++] = fd;
+    pthread_cond_signal(&worker->ready);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+static void *fanout_worker(void *arg) {
+    FanoutWorker *worker = (FanoutWorker *) arg;
+    int index = worker->index;
+    // Pin first, so the scratch buffer (and the zlib stream) come from this CPU's node.
+    if (worker->cpu >= 0) {
+        pinThreadToCpu(pthread_self(), worker->cpu);
+    }
+    worker->scratch = (CompressedFrame *) malloc(sizeof(CompressedFrame));
+    if (worker->scratch == NULL) {
+        perror("Error allocating fan-out buffer"); // members get uncompressed frames
+    }
+    if (worker->pool->useUring) {
+        worker->ring = (Uring *) malloc(sizeof(Uring));
+        if (worker->ring != NULL && initUring(worker->ring, URING_ENTRIES) == -1) {
+            perror("Error setting up io_uring, fan-out uses send()");
+            free(worker->ring);
+            worker->ring = NULL;
+        }
+    }
+    pthread_mutex_lock(&worker->lock);
+    while (1) {
+        while (worker->handedCount > 0) {
+            add_waiting(worker, worker->handed[--worker->handedCount]);
+        }
+        if (worker->head != NULL) {
+            // Take the whole queue: one lock round trip per burst, not per message.
+            Broadcast *broadcast = worker->head;
+            worker->head = NULL;
+            worker->tail = NULL;
+            pthread_mutex_unlock(&worker->lock);
+            while (broadcast != NULL) {
+                Broadcast *next = broadcast->next[index];
+                if (!__atomic_load_n(&worker->pool->abandon, __ATOMIC_RELAXED)) {
+                    deliver(worker, broadcast);
+                }
+                release_broadcast(broadcast);
+                __atomic_fetch_sub(&worker->pending, 1, __ATOMIC_RELAXED);
+                broadcast = next;
+            }
+            pthread_mutex_lock(&worker->lock);
+        } else if (worker->stop) {
+            break; // queue delivered; pending events are dropped
+        } else if (worker->waitingCount > 0 && window_over(&worker->flushDue)) {
+            pthread_mutex_unlock(&worker->lock);
+            flush_waiting(worker);
+            pthread_mutex_lock(&worker->lock);
+        } else if (worker->eventCount == 0 && worker->waitingCount == 0) {
+            pthread_cond_wait(&worker->ready, &worker->lock);
+        } else if (worker->eventCount == 0 || !window_over(&worker->eventsDue)) {
+            pthread_cond_timedwait(&worker->ready, &worker->lock, next_due(worker));
+        } else {
+            // Messages are all out: send the lane, while new events collect in the other array.
+            FanoutEvent *events = worker->events;
+            int count = worker->eventCount;
+            worker->events = worker->sending;
+            worker->sending = events;
+            worker->eventCount = 0;
+            pthread_mutex_unlock(&worker->lock);
+            send_events(worker, count);
+            pthread_mutex_lock(&worker->lock);
+        }
+    }
+    pthread_mutex_unlock(&worker->lock);
+    drain_waiting(worker);
+    if (worker->ring != NULL) {
+        freeUring(worker->ring);
+        free(worker->ring);
+    }
+    free(worker->fds);
+    free(worker->members);
+    free(worker->results);
+    free(worker->waiting);
+    free(worker->scratch);
+    return NULL;
+}
+
+/**
+ * Queues a message for delivery to every online member of its group. Call
+ * with group->lock held, right after the message got its sequence number,
+ * so the queues stay in sequence order. The sender is not waited for.
+ *
+ * param sender The user who posted it: their pending typing event in the
+ *              group is dropped.
+ * param frame  The PRINT_MESSAGE_TYPE frame to deliver (copied).
+ * return 0 on success, -1 if memory ran out.
+ */
+int publishMessage(FanoutPool *pool, GroupInfo *group, User *sender, user_message *frame) {
+    Broadcast *broadcast = (Broadcast *) malloc(sizeof(Broadcast) + pool->count * sizeof(Broadcast *));
+    if (broadcast == NULL) {
+        perror("Error allocating broadcast");
+        return -1;
+    }
+    memcpy(&broadcast->frame, frame, sizeof(user_message));
+    broadcast->group = group;
+    broadcast->refs = pool->count;
+    pthread_mutex_init(&broadcast->lock, NULL);
+    broadcast->packState = 0;
+    broadcast->packed = NULL;
+    broadcast->packedSize = 0;
+    broadcast->next = (Broadcast **) (broadcast + 1);
+
+    for (int i = 0; i < pool->count; i++) {
+        FanoutWorker *worker = &pool->workers[i];
+        broadcast->next[i] = NULL;
+        pthread_mutex_lock(&worker->lock);
+        if (worker->eventCount > 0) {
+            drop_typing(worker, sender, group);
+        }
+        if (worker->tail == NULL) {
+            worker->head = broadcast;
+            pthread_cond_signal(&worker->ready); // was idle
+        } else {
+            worker->tail->next[i] = broadcast;
+        }
+        worker->tail = broadcast;
+        __atomic_fetch_add(&worker->pending, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&worker->lock);
+    }
+    return 0;
+}
+
+// ======= POOL =========== //
+
+/**
+ * return the CPU of the worker that delivers to connection fd, where the
+ * connection's own thread should run too; -1 if the workers aren't pinned.
+ */
+int fanoutCpu(FanoutPool *pool, int fd) {
+    if (!pool->pinned || fd < 0) {
+        return -1;
+    }
+    return pool->workers[fd % pool->count].cpu;
+}
+
+/**
+ * Counts a group's connected devices, one partition lock at a time (the
+ * count may be a moment old, but nothing waits for it).
+ */
+int countOnlineMembers(FanoutPool *pool, GroupInfo *group) {
+    FanoutPartition *partitions = __atomic_load_n(&group->partitions, __ATOMIC_ACQUIRE);
+    int online = 0;
+    for (int i = 0; partitions != NULL && i < pool->count; i++) {
+        pthread_mutex_lock(&partitions[i].lock);
+        online += partitions[i].count;
+        pthread_mutex_unlock(&partitions[i].lock);
+    }
+    return online;
+}
+
+/**
+ * Reports how far behind a worker is.
+ *
+ * param messages Receives the messages queued to it and not delivered yet.
+ * param events   Receives its pending events.
+ */
+void getFanoutDepth(FanoutPool *pool, int worker, unsigned long long *messages, int *events) {
+    *messages = __atomic_load_n(&pool->workers[worker].pending, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&pool->workers[worker].lock);
+    *events = pool->workers[worker].eventCount;
+    pthread_mutex_unlock(&pool->workers[worker].lock);
+}
+
+/**
+ * Starts the fan-out workers.
+ *
+ * param workers  Number of threads (and partitions per group), 1..FANOUT_MAX_WORKERS.
+ * param cpus     Worker i is pinned to cpus[i % count]; NULL leaves placement to the scheduler.
+ * param useUring Send with io_uring where the kernel has it.
+ * return 0 on success, -1 on failure.
+ */
+int startFanoutPool(FanoutPool *pool, int workers, CpuList *cpus, int useUring) {
+    if (workers < 1) {
+        workers = 1;
+    }
+    if (workers > FANOUT_MAX_WORKERS) {
+        workers = FANOUT_MAX_WORKERS;
+    }
+    pool->workers = (FanoutWorker *) calloc(workers, sizeof(FanoutWorker));
+    if (pool->workers == NULL) {
+        perror("Error allocating fan-out workers");
+        return -1;
+    }
+    pool->count = workers;
+    pool->pinned = cpus != NULL;
+    pool->useUring = useUring;
+    pool->abandon = 0;
+    pthread_mutex_init(&pool->partitionsLock, NULL);
+    for (int i = 0; i < workers; i++) {
+        FanoutWorker *worker = &pool->workers[i];
+        worker->index = i;
+        worker->cpu = (cpus != NULL) ? cpus->cpus[i % cpus->count] : -1;
+        worker->pool = pool;
+        worker->events = (FanoutEvent *) malloc(FANOUT_EVENT_LANE * sizeof(FanoutEvent));
+        worker->sending = (FanoutEvent *) malloc(FANOUT_EVENT_LANE * sizeof(FanoutEvent));
+        if (worker->events == NULL || worker->sending == NULL) {
+            perror("Error allocating fan-out event lane");
+            free(worker->events);
+            free(worker->sending);
+            pool->count = i;
+            stopFanoutPool(pool, NULL);
+            return -1;
+        }
+        pthread_mutex_init(&worker->lock, NULL);
+        pthread_cond_init(&worker->ready, NULL);
+        if (pthread_create(&worker->thread, NULL, fanout_worker, worker) != 0) {
+            perror("Error creating fan-out worker");
+            pthread_mutex_destroy(&worker->lock);
+            pthread_cond_destroy(&worker->ready);
+            free(worker->events);
+            free(worker->sending);
+            pool->count = i;
+            stopFanoutPool(pool, NULL);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Makes the workers drop what is queued instead of delivering it, before a
+ * hot restart: every device's sentSeq says exactly what it got, and the next
+ * server sends them the rest in batches.
+ */
+void abandonFanoutQueues(FanoutPool *pool) {
+    __atomic_store_n(&pool->abandon, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Delivers what is queued (unless abandonFanoutQueues() was called), waits
+ * up to FANOUT_STOP_DRAIN_MS for slow connections to take the frames queued
+ * on them, stops the workers and frees the groups' partitions (groupList may
+ * be NULL if there are none).
+ */
+void stopFanoutPool(FanoutPool *pool, GroupList *groupList) {
+    for (int i = 0; i < pool->count; i++) {
+        pthread_mutex_lock(&pool->workers[i].lock);
+        pool->workers[i].stop = 1;
+        pthread_cond_signal(&pool->workers[i].ready);
+        pthread_mutex_unlock(&pool->workers[i].lock);
+    }
+    for (int i = 0; i < pool->count; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+        pthread_mutex_destroy(&pool->workers[i].lock);
+        pthread_cond_destroy(&pool->workers[i].ready);
+        free(pool->workers[i].events);
+        free(pool->workers[i].sending);
+        free(pool->workers[i].handed);
+    }
+    for (int g = 0; groupList != NULL && g < groupList->count; g++) {
+        GroupInfo *group = groupList->groups[g];
+        if (group->partitions != NULL) {
+            for (int i = 0; i < pool->count; i++) {
+                pthread_mutex_destroy(&group->partitions[i].lock);
+                free(group->partitions[i].members);
+            }
+            free(group->partitions);
+            group->partitions = NULL;
+        }
+    }
+    free(pool->workers);
+    pool->workers = NULL;
+    pool->count = 0;
+}
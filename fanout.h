@@ -0,0 +1,161 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "protocol.h"
+#include "wire-compress.h"
+#include "cpu-affinity.h"
+#include "uring-io.h"
+
+/**
+ * Broadcast engine: delivers group messages to online members on a pool of
+ * worker threads, so posting to a group of any size costs the sender one
+ * enqueue instead of one send per member.
+ *
+ * Every group keeps its online members split into one partition per
+ * worker, by connection (fd % workers). A published message is queued once
+ * to every worker; each worker sends it to the members of its own partition.
+ * Messages are published under the group lock, so every worker queue holds a
+ * group's messages in sequence order, and a member (always served by the
+ * same worker) receives them in order.
+ *
+ * The queues are per worker, so handing a message to another core never goes
+ * through a shared list. With a CpuList the workers are pinned (see
+ * cpu-affinity.h) and fanoutCpu() tells a connection's thread where to run.
+ * With io_uring each worker sends a message to all plain sockets of its
+ * partition in one submission (see uring-io.h).
+ *
+ * Workers never wait on a socket: a member whose connection is full gets the
+ * frame queued on it (net_queue()), and the worker retries those connections
+ * every FANOUT_FLUSH_MS. A member that stops reading costs its own queue, up
+ * to NET_QUEUE_LIMIT, and is then disconnected; the rest of the partition,
+ * and every other group the worker serves, keep going.
+ *
+ * Ephemeral events (typing, read receipts) take a second, low-priority lane
+ * per worker. They are never stored. An event replaces the pending one of
+ * the same user, group and kind, and a worker sends its pending events at
+ * most once per FANOUT_EVENT_WINDOW_MS, and only when no message is queued.
+ * Under load they are dropped first: when the lane is full, when messages
+ * arrive while they go out, and for members whose socket is full.
+ */
+
+#define FANOUT_MAX_WORKERS 64
+#define FANOUT_EVENT_WINDOW_MS 200 // events of a user and group within this are coalesced
+#define FANOUT_EVENT_LANE 256      // pending events per worker; more are dropped
+#define FANOUT_FLUSH_MS 20         // retry of connections that still hold queued frames
+#define FANOUT_STOP_DRAIN_MS 2000  // how long a stopping worker waits for its connections to take their queues
+
+/**
+ * Struct name: FanoutMember
+ * Description: One connected device of a member of a group, as seen by one
+ *              worker. A user with several devices is in the partitions once
+ *              per device; every device gets the same encoded frame.
+ *
+ * param cursor The device's position in the group; its sentSeq is advanced.
+ * param fd     The device's connection.
+ */
+typedef struct FANOUT_MEMBER {
+    User *user;
+    DeviceCursor *cursor;
+    int fd;
+} FanoutMember;
+
+/**
+ * Struct name: FanoutPartition
+ * Description: The online members of a group served by one worker.
+ *              lock guards the array against logins and logouts while the
+ *              worker walks it.
+ */
+typedef struct FANOUT_PARTITION {
+    pthread_mutex_t lock;
+    FanoutMember *members;
+    int count;
+    int capacity;
+} FanoutPartition;
+
+/**
+ * Struct name: Broadcast
+ * Description: One published message, shared by every worker queue it is in.
+ *              The last worker done with it frees it.
+ *
+ * param packed Compressed copy of frame, made by the first worker that has a
+ *              compressing member (packState 1; -1: not worth it; 0: not tried).
+ */
+typedef struct BROADCAST {
+    user_message frame;
+    GroupInfo *group;
+    int refs;
+    pthread_mutex_t lock;
+    int packState;
+    char *packed;
+    size_t packedSize;
+    struct BROADCAST **next; // next[i]: the following broadcast in worker i's queue
+} Broadcast;
+
+/**
+ * Struct name: FanoutEvent
+ * Description: A pending ephemeral event. It goes to the online members of
+ *              group except its sender.
+ */
+typedef struct FANOUT_EVENT {
+    User *sender;
+    GroupInfo *group;
+    s2c_event frame;
+} FanoutEvent;
+
+typedef struct FANOUT_WORKER {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    Broadcast *head;
+    Broadcast *tail;
+    unsigned long long pending; // messages queued and not delivered yet (atomic)
+    FanoutEvent *events;      // low-priority lane: eventCount pending events
+    FanoutEvent *sending;     // the lane's previous contents, being sent
+    int eventCount;
+    struct timespec eventsDue; // end of the window of the pending events
+    int index;
+    int cpu;                  // pinned to, -1 if not pinned
+    int stop;
+    CompressedFrame *scratch; // allocated by the worker, on its own node
+    Uring *ring;              // NULL: one send() per member
+    int *fds;                 // sockets of one io_uring submission
+    int *members;             // their index in the partition
+    int *results;
+    int batchCapacity;
+    int *waiting;             // connections still holding queued frames
+    int waitingCount;
+    int waitingCapacity;
+    struct timespec flushDue; // next retry of the waiting connections
+    int *handed;              // connections queued on by others (flushFanoutLater()), under lock
+    int handedCount;
+    int handedCapacity;
+    struct FANOUT_POOL *pool;
+} FanoutWorker;
+
+typedef struct FANOUT_POOL {
+    FanoutWorker *workers;
+    int count;
+    int pinned;
+    int useUring;
+    int abandon;                    // drop queued messages (abandonFanoutQueues())
+    pthread_mutex_t partitionsLock; // creating a group's partitions
+} FanoutPool;
+
+// Function prototypes
+int startFanoutPool(FanoutPool *pool, int workers, CpuList *cpus, int useUring);
+void stopFanoutPool(FanoutPool *pool, GroupList *groupList);
+void abandonFanoutQueues(FanoutPool *pool);
+int publishMessage(FanoutPool *pool, GroupInfo *group, User *sender, user_message *frame);
+void publishEvent(FanoutPool *pool, GroupInfo *group, User *sender, s2c_event *frame);
+int addOnlineMember(FanoutPool *pool, GroupInfo *group, User *user, DeviceCursor *cursor, int fd);
+void removeOnlineMember(FanoutPool *pool, GroupInfo *group, User *user, int fd);
+void flushFanoutLater(FanoutPool *pool, int fd);
+int fanoutCpu(FanoutPool *pool, int fd);
+int countOnlineMembers(FanoutPool *pool, GroupInfo *group);
+void getFanoutDepth(FanoutPool *pool, int worker, unsigned long long *messages, int *events);
+
+#endif // FANOUT_H
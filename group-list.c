@@ -0,0 +1,267 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include "protocol.h"
+#include "group-list.h"
+
+#define INITIAL_GROUP_CAPACITY 64
+#define INITIAL_REGISTRY_CAPACITY 64
+#define INITIAL_MEMBER_CAPACITY 8
+
+void initGroupList(GroupList *groupList) {
+    groupList->groups = NULL;
+    groupList->count = 0;
+    groupList->capacity = 0;
+    groupList->index = NULL;
+    groupList->indexCapacity = 0;
+    pthread_mutex_init(&groupList->lock, NULL);
+}
+
+// FNV-1a hash of a group name.
+static unsigned int hashName(const char *name) {
+    unsigned int hash = 2166136261u;
+    while (*name) {
+        hash ^= (unsigned char) *name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void indexInsert(GroupInfo **index, unsigned int capacity, GroupInfo *group) {
+    unsigned int slot = hashName(group->name) & (capacity - 1);
+    while (index[slot] != NULL) {
+        slot = (slot + 1) & (capacity - 1);
+    }
+    index[slot] = group;
+}
+
+// Makes room for one more group: the registry array and the name index
+// (kept at most half full so probes stay short). Called with the lock held.
+static int reserveGroup(GroupList *groupList) {
+    unsigned int count = groupList->count + 1;
+    if (count > groupList->capacity) {
+        unsigned int capacity = groupList->capacity ? groupList->capacity * 2 : INITIAL_REGISTRY_CAPACITY;
+        GroupInfo **groups = (GroupInfo **) realloc(groupList->groups, capacity * sizeof(GroupInfo *));
+        if (groups == NULL) {
+            perror("Error growing group registry");
+            return -1;
+        }
+        groupList->groups = groups;
+        groupList->capacity = capacity;
+    }
+    if ((unsigned long) count * 2 > groupList->indexCapacity) {
+        unsigned int capacity = groupList->indexCapacity ? groupList->indexCapacity * 2 : 2 * INITIAL_REGISTRY_CAPACITY;
+        GroupInfo **index = (GroupInfo **) calloc(capacity, sizeof(GroupInfo *));
+        if (index == NULL) {
+            perror("Error allocating memory for group index");
+            return -1;
+        }
+        for (unsigned int i = 0; i < groupList->indexCapacity; i++) {
+            if (groupList->index[i] != NULL) {
+                indexInsert(index, capacity, groupList->index[i]);
+            }
+        }
+        free(groupList->index);
+        groupList->index = index;
+        groupList->indexCapacity = capacity;
+    }
+    return 0;
+}
+
+static GroupInfo *lookup(GroupList *groupList, const char *name) {
+    if (groupList->index == NULL) {
+        return NULL;
+    }
+    unsigned int slot = hashName(name) & (groupList->indexCapacity - 1);
+    while (groupList->index[slot] != NULL) {
+        if (strcmp(groupList->index[slot]->name, name) == 0) {
+            return groupList->index[slot];
+        }
+        slot = (slot + 1) & (groupList->indexCapacity - 1);
+    }
+    return NULL;
+}
+
+/**
+ * Looks up a group by name in O(1).
+ *
+ * return the group, or NULL if there is no group of that name.
+ */
+GroupInfo *findGroup(GroupList *groupList, const char *name) {
+    pthread_mutex_lock(&groupList->lock);
+    GroupInfo *ptr = lookup(groupList, name);
+    pthread_mutex_unlock(&groupList->lock);
+    return ptr;
+}
+
+/**
+ * Looks up a group by name, creating it (empty, with no members) if needed.
+ *
+ * param created Set to 1 if the group was created by this call (may be NULL).
+ * return the group, or NULL if memory ran out.
+ */
+GroupInfo *getOrCreateGroup(GroupList *groupList, const char *name, int *created) {
+    pthread_mutex_lock(&groupList->lock);
+    GroupInfo *ptr = lookup(groupList, name);
+    if (created != NULL) {
+        *created = (ptr == NULL);
+    }
+    if (ptr == NULL) {
+        ptr = (GroupInfo *) calloc(1, sizeof(GroupInfo));
+        if (ptr == NULL || reserveGroup(groupList) == -1 || (ptr->name = strdup(name)) == NULL) {
+            perror("Error allocating memory for group info");
+            free(ptr);
+            pthread_mutex_unlock(&groupList->lock);
+            return NULL;
+        }
+        pthread_mutex_init(&ptr->lock, NULL);
+        ptr->id = groupList->count;
+        groupList->groups[groupList->count++] = ptr;
+        indexInsert(groupList->index, groupList->indexCapacity, ptr);
+    }
+    pthread_mutex_unlock(&groupList->lock);
+    return ptr;
+}
+
+/**
+ * return the group with the given id (stored messages refer to their group
+ * by id), or NULL if there is none.
+ */
+GroupInfo *getGroupById(GroupList *groupList, unsigned int id) {
+    pthread_mutex_lock(&groupList->lock);
+    GroupInfo *ptr = (id < (unsigned int) groupList->count) ? groupList->groups[id] : NULL;
+    pthread_mutex_unlock(&groupList->lock);
+    return ptr;
+}
+
+/**
+ * Copies up to max registry entries, starting at position cursor (creation
+ * order), so a page can be built without holding the registry lock.
+ *
+ * param total Set to the number of groups.
+ * return the number of groups copied into out.
+ */
+unsigned int getGroupRange(GroupList *groupList, unsigned int cursor, unsigned int max,
+                           GroupInfo **out, unsigned int *total) {
+    unsigned int copied = 0;
+    pthread_mutex_lock(&groupList->lock);
+    *total = groupList->count;
+    while (cursor + copied < (unsigned int) groupList->count && copied < max) {
+        out[copied] = groupList->groups[cursor + copied];
+        copied++;
+    }
+    pthread_mutex_unlock(&groupList->lock);
+    return copied;
+}
+
+// ======= MEMBERS =========== //
+
+/**
+ * Adds a membership node to its group's members (join, registration, load).
+ * Takes group->lock: don't hold it.
+ *
+ * return 0 on success, -1 if memory ran out.
+ */
+int addGroupMember(GroupInfo *group, Group *membership) {
+    pthread_mutex_lock(&group->lock);
+    if (group->memberCount == group->memberCapacity) {
+        unsigned int capacity = group->memberCapacity ? group->memberCapacity * 2 : INITIAL_MEMBER_CAPACITY;
+        Group **members = (Group **) realloc(group->members, capacity * sizeof(Group *));
+        if (members == NULL) {
+            pthread_mutex_unlock(&group->lock);
+            perror("Error growing group members");
+            return -1;
+        }
+        group->members = members;
+        group->memberCapacity = capacity;
+    }
+    membership->info = group;
+    membership->memberIndex = group->memberCount;
+    group->members[group->memberCount++] = membership;
+    pthread_mutex_unlock(&group->lock);
+    return 0;
+}
+
+/**
+ * Removes a membership node from its group's members in O(1): the last
+ * member takes its slot. Takes group->lock: don't hold it.
+ */
+void removeGroupMember(Group *membership) {
+    GroupInfo *group = membership->info;
+    if (group == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&group->lock);
+    unsigned int index = membership->memberIndex;
+    if (index < group->memberCount && group->members[index] == membership) {
+        Group *last = group->members[--group->memberCount];
+        group->members[index] = last;
+        last->memberIndex = index;
+    }
+    membership->info = NULL;
+    pthread_mutex_unlock(&group->lock);
+}
+
+/**
+ * Gives a message the group's next sequence number and indexes it.
+ * The caller holds group->lock, which keeps sequence numbers in the same
+ * order as the fan-out.
+ *
+ * param position The message's position in the MessageList.
+ * return the assigned sequence number, or 0 if memory ran out.
+ */
+unsigned int appendGroupMessage(GroupInfo *group, unsigned int position) {
+    if (group->lastSeq >= group->capacity) {
+        unsigned int capacity = group->capacity ? group->capacity : INITIAL_GROUP_CAPACITY;
+        while (capacity <= group->lastSeq) {
+            capacity *= 2;
+        }
+        unsigned int *messages = (unsigned int *) realloc(group->messages, capacity * sizeof(unsigned int));
+        if (messages == NULL) {
+            perror("Error growing group message index");
+            return 0;
+        }
+        // Sequence numbers skipped by a damaged log have no message.
+        memset(messages + group->capacity, 0xFF, (capacity - group->capacity) * sizeof(unsigned int));
+        group->messages = messages;
+        group->capacity = capacity;
+    }
+    group->messages[group->lastSeq] = position;
+    group->lastSeq++;
+    return group->lastSeq;
+}
+
+/**
+ * return the MessageList position of the message with the given sequence
+ * number, or MESSAGE_NONE if out of range.
+ */
+unsigned int getGroupMessage(GroupInfo *group, unsigned int seq) {
+    if (seq == 0 || seq > group->lastSeq) {
+        return MESSAGE_NONE;
+    }
+    return group->messages[seq - 1];
+}
+
+/**
+ * Frees the registry. The messages themselves belong to the MessageList,
+ * the membership nodes to their users.
+ */
+void freeGroupList(GroupList *groupList) {
+    for (int i = 0; i < groupList->count; i++) {
+        GroupInfo *temp = groupList->groups[i];
+        pthread_mutex_destroy(&temp->lock);
+        free(temp->messages);
+        free(temp->members);
+        free(temp->name);
+        free(temp);
+    }
+    free(groupList->groups);
+    free(groupList->index);
+    groupList->groups = NULL;
+    groupList->count = 0;
+    groupList->capacity = 0;
+    groupList->index = NULL;
+    groupList->indexCapacity = 0;
+}
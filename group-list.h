@@ -0,0 +1,21 @@
+#ifndef GROUP_LIST_H
+#define GROUP_LIST_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "protocol.h"
+
+// Function prototypes
+void initGroupList(GroupList *groupList);
+GroupInfo *findGroup(GroupList *groupList, const char *name);
+GroupInfo *getOrCreateGroup(GroupList *groupList, const char *name, int *created);
+GroupInfo *getGroupById(GroupList *groupList, unsigned int id);
+unsigned int getGroupRange(GroupList *groupList, unsigned int cursor, unsigned int max,
+                           GroupInfo **out, unsigned int *total);
+int addGroupMember(GroupInfo *group, Group *membership);
+void removeGroupMember(Group *membership);
+unsigned int appendGroupMessage(GroupInfo *group, unsigned int position);
+unsigned int getGroupMessage(GroupInfo *group, unsigned int seq);
+void freeGroupList(GroupList *groupList);
+
+#endif // GROUP_LIST_H
@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "hot-restart.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static int handoff_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        printf("Handoff socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/**
+ * Listens for the next server on path, replacing whatever socket file is
+ * there (a previous server's, which stopped listening when it handed off).
+ *
+ * return the listening socket, or -1 on failure.
+ */
+int listenHandoff(const char *path) {
+    struct sockaddr_un addr;
+    if (handoff_address(path, &addr) == -1) {
+        return -1;
+    }
+    int channel = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (channel == -1) {
+        perror("Error creating handoff socket");
+        return -1;
+    }
+    unlink(path);
+    if (bind(channel, (struct sockaddr *) &addr, sizeof addr) == -1 || listen(channel, 1) == -1) {
+        perror("Error listening for a handoff");
+        close(channel);
+        return -1;
+    }
+    return channel;
+}
+
+/**
+ * Connects to the server listening for a successor on path.
+ *
+ * return the channel, or -1 if no server is listening there.
+ */
+int connectHandoff(const char *path) {
+    struct sockaddr_un addr;
+    if (handoff_address(path, &addr) == -1) {
+        return -1;
+    }
+    int channel = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (channel == -1) {
+        perror("Error creating handoff socket");
+        return -1;
+    }
+    if (connect(channel, (struct sockaddr *) &addr, sizeof addr) == -1) {
+        if (errno != ENOENT && errno != ECONNREFUSED) {
+            perror("Error connecting to the running server");
+        }
+        close(channel);
+        return -1;
+    }
+    return channel;
+}
+
+/**
+ * Sends one record, with a descriptor attached unless fd is -1. The
+ * descriptor stays open here; the receiver gets its own copy.
+ *
+ * return 0 on success, -1 on failure.
+ */
+int sendHandoffRecord(int channel, int fd, const void *record, size_t length) {
+    struct iovec iov;
+    struct msghdr msg;
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    iov.iov_base = (void *) record;
+    iov.iov_len = length;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd != -1) {
+        memset(&control, 0, sizeof control);
+        msg.msg_control = control.space;
+        msg.msg_controllen = sizeof control.space;
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    ssize_t sent;
+    while ((sent = sendmsg(channel, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR) {
+    }
+    if (sent != (ssize_t) length) {
+        perror("Error sending handoff record");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Receives one record and the descriptor sent with it.
+ *
+ * param fd Set to the received descriptor, or -1 if none came with the record.
+ * return the record's length, 0 if the other side closed the channel, -1 on
+ *        failure (including a record longer than length).
+ */
+ssize_t receiveHandoffRecord(int channel, int *fd, void *record, size_t length) {
+    struct iovec iov;
+    struct msghdr msg;
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    *fd = -1;
+    iov.iov_base = record;
+    iov.iov_len = length;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.space;
+    msg.msg_controllen = sizeof control.space;
+    ssize_t received;
+    while ((received = recvmsg(channel, &msg, 0)) == -1 && errno == EINTR) {
+    }
+    if (received <= 0) {
+        if (received == -1) {
+            perror("Error receiving handoff record");
+        }
+        return received;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+        printf("Handoff record truncated\n");
+        if (*fd != -1) {
+            close(*fd);
+            *fd = -1;
+        }
+        return -1;
+    }
+    return received;
+}
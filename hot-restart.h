@@ -0,0 +1,82 @@
+#ifndef HOT_RESTART_H
+#define HOT_RESTART_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "protocol.h"
+
+/**
+ * Socket handoff between a running server and its replacement (server -H).
+ *
+ * A server started with -H <path> listens for its successor on a Unix
+ * socket at path. A new server started with the same -H first connects
+ * there. The old server then stops accepting, lets every connection finish
+ * the request it is in, delivers what the fan-out still has queued and
+ * writes its state to the data directory. Then it sends over the channel:
+ *
+ *   HandoffHeader      with the listening socket attached
+ *   HandoffConnection  one per connection, with the client's socket attached
+ *
+ * The new server answers with one byte once it has everything, and the old
+ * one exits. The new server then loads the data directory and serves the
+ * inherited connections from their next request on: clients don't notice.
+ * TLS sessions live in the old process and can't move; those connections
+ * are closed and their clients reconnect.
+ *
+ * The channel is a SOCK_SEQPACKET socket: every record is one message, and
+ * its descriptor travels with it (SCM_RIGHTS).
+ */
+
+#define HANDOFF_MAGIC "CHATHOT2"
+#define HANDOFF_MAX_GROUPS 64 // memberships whose delivery position moves with a connection
+
+/**
+ * Struct name: HandoffHeader
+ * Description: First record; carries the listening socket.
+ *
+ * param connections Number of HandoffConnection records that follow.
+ */
+typedef struct {
+    char magic[8];
+    unsigned int connections;
+} HandoffHeader;
+
+/**
+ * Struct name: HandoffGroup
+ * Description: How far a connection's device got in one group: messages up
+ *              to sentSeq are already on their way to the client.
+ */
+typedef struct {
+    char name[GROUP_NAME_SIZE];
+    unsigned int sentSeq;
+} HandoffGroup;
+
+/**
+ * Struct name: HandoffConnection
+ * Description: State of one connection, sent with its socket. Only the
+ *              first groupCount entries of groups go over the channel;
+ *              memberships beyond HANDOFF_MAX_GROUPS resume from the device's
+ *              acknowledged cursor (the client drops what it already has).
+ *
+ * param email      The logged-in user, "" if nobody logged in yet.
+ * param device     The name of the connection's device, "" if it has none.
+ * param compressed The client negotiated compression.
+ */
+typedef struct {
+    char email[BUFFER_SIZE];
+    char device[DEVICE_NAME_SIZE];
+    unsigned int compressed;
+    unsigned int groupCount;
+    HandoffGroup groups[HANDOFF_MAX_GROUPS];
+} HandoffConnection;
+
+// Size of a HandoffConnection record with count groups
+#define handoffConnectionSize(count) (sizeof(HandoffConnection) - (HANDOFF_MAX_GROUPS - (count)) * sizeof(HandoffGroup))
+
+// Function prototypes
+int listenHandoff(const char *path);
+int connectHandoff(const char *path);
+int sendHandoffRecord(int channel, int fd, const void *record, size_t length);
+ssize_t receiveHandoffRecord(int channel, int *fd, void *record, size_t length);
+
+#endif // HOT_RESTART_H
@@ -0,0 +1,339 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include "protocol.h"
+#include "msg-batch.h"
+
+/**
+ * Starts an empty batch for a group.
+ *
+ * param type     BATCH_MESSAGE_TYPE or HISTORY_BATCH_TYPE.
+ * param afterSeq The receiver's cursor; the first entry will be after it.
+ */
+void initBatch(MessageBatch *batch, int type, const char *group, unsigned int afterSeq) {
+    memset(&batch->header, 0, sizeof(s2c_batch_header));
+    batch->header.type = type;
+    strncpy(batch->header.group, group, GROUP_NAME_SIZE - 1);
+    batch->header.afterSeq = afterSeq;
+}
+
+/**
+ * Packs one message into the batch. Name and text are cut to what a
+ * user_message can carry.
+ *
+ * return 0 on success, -1 if the batch is full (send it and start another).
+ */
+int addBatchMessage(MessageBatch *batch, const char *name, const char *text, unsigned int seq, long long timestamp) {
+    uint16_t nameLen = strnlen(name, BUFFER_SIZE - 1);
+    uint16_t textLen = strnlen(text, BUFFER_SIZE - 1);
+    int64_t ts = timestamp;
+    uint32_t seq32 = seq;
+    size_t needed = BATCH_ENTRY_HEADER_SIZE + nameLen + textLen;
+    if (batch->header.length + needed > BATCH_MAX_BYTES) {
+        return -1;
+    }
+    char *p = batch->payload + batch->header.length;
+    memcpy(p, &seq32, 4);
+    memcpy(p + 4, &ts, 8);
+    memcpy(p + 12, &nameLen, 2);
+    memcpy(p + 14, &textLen, 2);
+    memcpy(p + 16, name, nameLen);
+    memcpy(p + 16 + nameLen, text, textLen);
+    batch->header.length += needed;
+    batch->header.count++;
+    return 0;
+}
+
+/**
+ * return bytes to send for this batch (header plus used payload).
+ */
+size_t batchFrameSize(MessageBatch *batch) {
+    return sizeof(s2c_batch_header) + batch->header.length;
+}
+
+/**
+ * Unpacks a received batch, calling callback once per entry with a
+ * PRINT_MESSAGE_TYPE user_message.
+ *
+ * return number of entries decoded, -1 if the payload is malformed.
+ */
+int decodeBatch(s2c_batch_header *header, const char *payload,
+                void (*callback)(user_message *msg, void *arg), void *arg) {
+    size_t pos = 0;
+    user_message msg;
+    for (unsigned int i = 0; i < header->count; i++) {
+        uint32_t seq;
+        int64_t ts;
+        uint16_t nameLen, textLen;
+        if (pos + BATCH_ENTRY_HEADER_SIZE > header->length) {
+            return -1;
+        }
+        memcpy(&seq, payload + pos, 4);
+        memcpy(&ts, payload + pos + 4, 8);
+        memcpy(&nameLen, payload + pos + 12, 2);
+        memcpy(&textLen, payload + pos + 14, 2);
+        pos += BATCH_ENTRY_HEADER_SIZE;
+        if (nameLen >= BUFFER_SIZE || textLen >= BUFFER_SIZE || pos + nameLen + textLen > header->length) {
+            return -1;
+        }
+        memset(&msg, 0, sizeof msg);
+        msg.type = PRINT_MESSAGE_TYPE;
+        memcpy(msg.name, payload + pos, nameLen);
+        memcpy(msg.message, payload + pos + nameLen, textLen);
+        memcpy(msg.group, header->group, GROUP_NAME_SIZE);
+        msg.group[GROUP_NAME_SIZE - 1] = '\0';
+        msg.seq = seq;
+        msg.timestamp = ts;
+        pos += nameLen + textLen;
+        callback(&msg, arg);
+    }
+    return header->count;
+}
+
+// ======= REQUEST BATCHES =========== //
+
+/**
+ * Starts an empty request batch (BATCH_REQUEST_TYPE) or combined answer
+ * (BATCH_RESPONSE_TYPE).
+ */
+void initOpBatch(OpBatch *batch, int type) {
+    batch->header.type = type;
+    batch->header.count = 0;
+    batch->header.length = 0;
+}
+
+// Appends one entry: two 32-bit fields and a length-prefixed string.
+static int add_op_entry(OpBatch *batch, uint32_t first, uint32_t second, const char *text) {
+    uint16_t textLen = (text != NULL) ? strnlen(text, BUFFER_SIZE - 1) : 0;
+    size_t needed = OP_ENTRY_HEADER_SIZE + textLen;
+    if (batch->header.length + needed > BATCH_MAX_BYTES) {
+        return -1;
+    }
+    char *p = batch->payload + batch->header.length;
+    memcpy(p, &first, 4);
+    memcpy(p + 4, &second, 4);
+    memcpy(p + 8, &textLen, 2);
+    memcpy(p + 10, text, textLen);
+    batch->header.length += needed;
+    batch->header.count++;
+    return 0;
+}
+
+/**
+ * Packs one request, as it would be sent in a c2s_send_message.
+ *
+ * return 0 on success, -1 if the batch is full (send it and start another).
+ */
+int addBatchRequest(OpBatch *batch, int type, unsigned int requestId, const char *text) {
+    return add_op_entry(batch, (uint32_t) type, requestId, text);
+}
+
+/**
+ * Packs the answer to one request.
+ *
+ * param ok    1 for an ACK, 0 for an error.
+ * param error The error message (ignored for an ACK).
+ * return 0 on success, -1 if the batch is full (send it and start another).
+ */
+int addBatchResponse(OpBatch *batch, unsigned int requestId, int ok, const char *error) {
+    return add_op_entry(batch, requestId, ok ? ACK_TYPE : ERROR_TYPE, ok ? NULL : error);
+}
+
+/**
+ * return bytes to send for this batch (header plus used payload).
+ */
+size_t opBatchFrameSize(OpBatch *batch) {
+    return sizeof(op_batch_header) + batch->header.length;
+}
+
+// Reads the entry at *offset. Returns 1 and advances, 0 at the end, -1 if malformed.
+static int next_op_entry(op_batch_header *header, const char *payload, size_t *offset,
+                         uint32_t *first, uint32_t *second, char *text) {
+    uint16_t textLen;
+    if (*offset == header->length) {
+        return 0;
+    }
+    if (*offset + OP_ENTRY_HEADER_SIZE > header->length) {
+        return -1;
+    }
+    const char *p = payload + *offset;
+    memcpy(first, p, 4);
+    memcpy(second, p + 4, 4);
+    memcpy(&textLen, p + 8, 2);
+    if (textLen >= BUFFER_SIZE || *offset + OP_ENTRY_HEADER_SIZE + textLen > header->length) {
+        return -1;
+    }
+    memcpy(text, p + 10, textLen);
+    text[textLen] = '\0';
+    *offset += OP_ENTRY_HEADER_SIZE + textLen;
+    return 1;
+}
+
+/**
+ * Unpacks the next request of a received batch.
+ *
+ * param offset Start at 0; advanced past the request.
+ * param out    The request, as if it had come in its own frame.
+ * return 1 for a request, 0 after the last one, -1 if the payload is malformed.
+ */
+int nextBatchRequest(op_batch_header *header, const char *payload, size_t *offset, c2s_send_message *out) {
+    uint32_t type;
+    memset(out, 0, sizeof(c2s_send_message));
+    int result = next_op_entry(header, payload, offset, &type, &out->requestId, out->message);
+    if (result == 1) {
+        out->type = (int) type;
+        out->length = strlen(out->message) + 1;
+    }
+    return result;
+}
+
+/**
+ * Unpacks the next answer of a received combined response.
+ *
+ * param error Receives the error message (empty for an ACK); BUFFER_SIZE bytes.
+ * return 1 for an answer, 0 after the last one, -1 if the payload is malformed.
+ */
+int nextBatchResponse(op_batch_header *header, const char *payload, size_t *offset,
+                      unsigned int *requestId, int *ok, char *error) {
+    uint32_t status;
+    int result = next_op_entry(header, payload, offset, requestId, &status, error);
+    if (result == 1) {
+        *ok = (status == ACK_TYPE);
+    }
+    return result;
+}
+
+// ======= PAGES =========== //
+
+/**
+ * Starts an empty page.
+ *
+ * param type  GROUP_PAGE_TYPE or ROSTER_PAGE_TYPE.
+ * param total Number of groups (or members) in all pages.
+ */
+void initPage(Page *page, int type, unsigned int requestId, unsigned int total) {
+    memset(&page->header, 0, sizeof(s2c_page_header));
+    page->header.type = type;
+    page->header.requestId = requestId;
+    page->header.total = total;
+}
+
+/**
+ * Packs one group of the registry.
+ *
+ * return 0 on success, -1 if the page is full.
+ */
+int addPageGroup(Page *page, const char *name, unsigned int members, unsigned int lastSeq) {
+    uint16_t nameLen = strnlen(name, GROUP_NAME_SIZE - 1);
+    uint32_t members32 = members;
+    uint32_t seq32 = lastSeq;
+    size_t needed = GROUP_ENTRY_HEADER_SIZE + nameLen;
+    if (page->header.length + needed > BATCH_MAX_BYTES) {
+        return -1;
+    }
+    char *p = page->payload + page->header.length;
+    memcpy(p, &members32, 4);
+    memcpy(p + 4, &seq32, 4);
+    memcpy(p + 8, &nameLen, 2);
+    memcpy(p + 10, name, nameLen);
+    page->header.length += needed;
+    page->header.count++;
+    return 0;
+}
+
+/**
+ * Packs one member of a roster.
+ *
+ * return 0 on success, -1 if the page is full.
+ */
+int addPageMember(Page *page, const char *name, const char *email, int online) {
+    uint16_t online16 = online ? 1 : 0;
+    uint16_t nameLen = strnlen(name, BUFFER_SIZE - 1);
+    uint16_t emailLen = strnlen(email, BUFFER_SIZE - 1);
+    size_t needed = MEMBER_ENTRY_HEADER_SIZE + nameLen + emailLen;
+    if (page->header.length + needed > BATCH_MAX_BYTES) {
+        return -1;
+    }
+    char *p = page->payload + page->header.length;
+    memcpy(p, &online16, 2);
+    memcpy(p + 2, &nameLen, 2);
+    memcpy(p + 4, &emailLen, 2);
+    memcpy(p + 6, name, nameLen);
+    memcpy(p + 6 + nameLen, email, emailLen);
+    page->header.length += needed;
+    page->header.count++;
+    return 0;
+}
+
+/**
+ * return bytes to send for this page (header plus used payload).
+ */
+size_t pageFrameSize(Page *page) {
+    return sizeof(s2c_page_header) + page->header.length;
+}
+
+/**
+ * Unpacks the next group of a received GROUP_PAGE_TYPE.
+ *
+ * param offset Start at 0; advanced past the entry.
+ * param name   Receives the group name; GROUP_NAME_SIZE bytes.
+ * return 1 for a group, 0 after the last one, -1 if the payload is malformed.
+ */
+int nextPageGroup(s2c_page_header *header, const char *payload, size_t *offset,
+                  char *name, unsigned int *members, unsigned int *lastSeq) {
+    uint32_t members32, seq32;
+    uint16_t nameLen;
+    if (*offset == header->length) {
+        return 0;
+    }
+    if (*offset + GROUP_ENTRY_HEADER_SIZE > header->length) {
+        return -1;
+    }
+    const char *p = payload + *offset;
+    memcpy(&members32, p, 4);
+    memcpy(&seq32, p + 4, 4);
+    memcpy(&nameLen, p + 8, 2);
+    if (nameLen >= GROUP_NAME_SIZE || *offset + GROUP_ENTRY_HEADER_SIZE + nameLen > header->length) {
+        return -1;
+    }
+    memcpy(name, p + 10, nameLen);
+    name[nameLen] = '\0';
+    *members = members32;
+    *lastSeq = seq32;
+    *offset += GROUP_ENTRY_HEADER_SIZE + nameLen;
+    return 1;
+}
+
+/**
+ * Unpacks the next member of a received ROSTER_PAGE_TYPE.
+ *
+ * param name, email Receive the member's name and email; BUFFER_SIZE bytes each.
+ * return 1 for a member, 0 after the last one, -1 if the payload is malformed.
+ */
+int nextPageMember(s2c_page_header *header, const char *payload, size_t *offset,
+                   char *name, char *email, int *online) {
+    uint16_t online16, nameLen, emailLen;
+    if (*offset == header->length) {
+        return 0;
+    }
+    if (*offset + MEMBER_ENTRY_HEADER_SIZE > header->length) {
+        return -1;
+    }
+    const char *p = payload + *offset;
+    memcpy(&online16, p, 2);
+    memcpy(&nameLen, p + 2, 2);
+    memcpy(&emailLen, p + 4, 2);
+    if (nameLen >= BUFFER_SIZE || emailLen >= BUFFER_SIZE ||
+        *offset + MEMBER_ENTRY_HEADER_SIZE + nameLen + emailLen > header->length) {
+        return -1;
+    }
+    memcpy(name, p + 6, nameLen);
+    name[nameLen] = '\0';
+    memcpy(email, p + 6 + nameLen, emailLen);
+    email[emailLen] = '\0';
+    *online = online16;
+    *offset += MEMBER_ENTRY_HEADER_SIZE + nameLen + emailLen;
+    return 1;
+}
@@ -0,0 +1,67 @@
+#ifndef MSG_BATCH_H
+#define MSG_BATCH_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "protocol.h"
+
+#define BATCH_ENTRY_HEADER_SIZE 16 // seq + timestamp + two lengths
+#define OP_ENTRY_HEADER_SIZE 10    // type/requestId + requestId/status + length
+#define GROUP_ENTRY_HEADER_SIZE 10 // members + lastSeq + name length
+#define MEMBER_ENTRY_HEADER_SIZE 6 // online + name length + email length
+
+/**
+ * Struct name: MessageBatch
+ * Description: A batch frame being built: the header followed directly by
+ *              the packed entries, so the whole frame goes out in one send.
+ */
+typedef struct {
+    s2c_batch_header header;
+    char payload[BATCH_MAX_BYTES];
+} MessageBatch;
+
+/**
+ * Struct name: OpBatch
+ * Description: A batch of requests, or the combined answer to one, being
+ *              built: the header followed directly by the packed entries.
+ */
+typedef struct OP_BATCH {
+    op_batch_header header;
+    char payload[BATCH_MAX_BYTES];
+} OpBatch;
+
+/**
+ * Struct name: Page
+ * Description: A page of the group registry or of a roster being built:
+ *              the header followed directly by the packed entries.
+ */
+typedef struct {
+    s2c_page_header header;
+    char payload[BATCH_MAX_BYTES];
+} Page;
+
+// Function prototypes
+void initBatch(MessageBatch *batch, int type, const char *group, unsigned int afterSeq);
+int addBatchMessage(MessageBatch *batch, const char *name, const char *text, unsigned int seq, long long timestamp);
+size_t batchFrameSize(MessageBatch *batch);
+int decodeBatch(s2c_batch_header *header, const char *payload,
+                void (*callback)(user_message *msg, void *arg), void *arg);
+
+void initOpBatch(OpBatch *batch, int type);
+int addBatchRequest(OpBatch *batch, int type, unsigned int requestId, const char *text);
+int addBatchResponse(OpBatch *batch, unsigned int requestId, int ok, const char *error);
+size_t opBatchFrameSize(OpBatch *batch);
+int nextBatchRequest(op_batch_header *header, const char *payload, size_t *offset, c2s_send_message *out);
+int nextBatchResponse(op_batch_header *header, const char *payload, size_t *offset,
+                      unsigned int *requestId, int *ok, char *error);
+
+void initPage(Page *page, int type, unsigned int requestId, unsigned int total);
+int addPageGroup(Page *page, const char *name, unsigned int members, unsigned int lastSeq);
+int addPageMember(Page *page, const char *name, const char *email, int online);
+size_t pageFrameSize(Page *page);
+int nextPageGroup(s2c_page_header *header, const char *payload, size_t *offset,
+                  char *name, unsigned int *members, unsigned int *lastSeq);
+int nextPageMember(s2c_page_header *header, const char *payload, size_t *offset,
+                   char *name, char *email, int *online);
+
+#endif // MSG_BATCH_H
@@ -0,0 +1,334 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "protocol.h"
+#include "msg-cache.h"
+
+#define CACHE_MAGIC 0x43434347u // "GCCC"
+#define CACHE_VERSION 1
+#define INITIAL_OFFSETS 64
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t used;          // bytes in use, header included
+} CacheHeader;
+
+// Followed by the group, name and text bytes (no terminators), padded to 8.
+typedef struct {
+    uint32_t length;        // whole record, padding included
+    uint32_t seq;
+    int64_t timestamp;
+    uint16_t groupLen;
+    uint16_t nameLen;
+    uint16_t textLen;
+    uint16_t reserved;
+} CacheRecord;
+
+static CacheHeader *cacheHeader(MessageCache *cache) {
+    return (CacheHeader *) cache->map;
+}
+
+/**
+ * Finds a group's index, creating an empty one if needed. Caller holds
+ * cache->mutex.
+ *
+ * return the group, or NULL if memory ran out.
+ */
+CacheGroup *getCacheGroup(MessageCache *cache, const char *group) {
+    CacheGroup *ptr = cache->groups;
+    while (ptr != NULL && strcmp(ptr->name, group) != 0) {
+        ptr = ptr->next;
+    }
+    if (ptr == NULL) {
+        ptr = (CacheGroup *) calloc(1, sizeof(CacheGroup));
+        if (ptr == NULL) {
+            perror("Error allocating memory for cache group");
+            return NULL;
+        }
+        ptr->name = strdup(group);
+        ptr->next = cache->groups;
+        cache->groups = ptr;
+    }
+    return ptr;
+}
+
+// return the record offset of a message, 0 if it is not cached.
+static uint64_t cachedOffset(CacheGroup *group, unsigned int seq) {
+    if (seq < group->baseSeq || seq - group->baseSeq >= group->capacity) {
+        return 0;
+    }
+    return group->offsets[seq - group->baseSeq];
+}
+
+// Grows the contiguous run firstSeq..syncedSeq over the messages next to it.
+static void extendRun(CacheGroup *group) {
+    while (cachedOffset(group, group->syncedSeq + 1) != 0) {
+        group->syncedSeq++;
+    }
+    while (group->firstSeq > 0 && cachedOffset(group, group->firstSeq) != 0) {
+        group->firstSeq--;
+    }
+}
+
+/**
+ * Records where a message is. The index covers baseSeq up to the highest
+ * seq cached, so it is sized by the group's cached range, not by how far
+ * its seqs go; a seq that would stretch it past CACHE_MAX_SPAN (or 0) is
+ * refused, which also stops loadRecords() at a corrupt record.
+ *
+ * return 0 on success, -1 if the message was not indexed.
+ */
+static int indexRecord(CacheGroup *group, unsigned int seq, uint64_t offset) {
+    unsigned int low = seq;
+    uint64_t high = seq;
+    unsigned int used = group->capacity; // slots kept when the index moves
+    if (group->capacity > 0 && seq < group->baseSeq) {
+        // Older messages: only the cached part above has to fit, not its spare slots.
+        while (group->offsets[used - 1] == 0) {
+            used--;
+        }
+        high = (uint64_t) group->baseSeq + used - 1;
+    } else if (group->capacity > 0) {
+        low = group->baseSeq;
+        uint64_t top = (uint64_t) group->baseSeq + group->capacity - 1;
+        high = (seq > top) ? seq : top;
+    }
+    uint64_t span = high - low + 1;
+    if (seq == 0 || span > CACHE_MAX_SPAN) {
+        printf("Message cache: ignoring message #%u of %s\n", seq, group->name);
+        return -1;
+    }
+    if (group->capacity == 0 || seq < group->baseSeq || span > group->capacity) {
+        unsigned int shift = (group->capacity > 0) ? group->baseSeq - low : 0;
+        unsigned int capacity = group->capacity ? group->capacity : INITIAL_OFFSETS;
+        while (capacity < span) {
+            capacity *= 2; // span <= CACHE_MAX_SPAN, so this can't wrap
+        }
+        uint64_t *offsets = (uint64_t *) realloc(group->offsets, capacity * sizeof(uint64_t));
+        if (offsets == NULL) {
+            perror("Error growing cache index");
+            return -1;
+        }
+        // Older messages go in front: the entries move up by shift.
+        memmove(offsets + shift, offsets, used * sizeof(uint64_t));
+        memset(offsets, 0, shift * sizeof(uint64_t));
+        memset(offsets + shift + used, 0, (capacity - shift - used) * sizeof(uint64_t));
+        group->offsets = offsets;
+        group->baseSeq = low;
+        group->capacity = capacity;
+    }
+    group->offsets[seq - group->baseSeq] = offset;
+    extendRun(group);
+    return 0;
+}
+
+/**
+ * Starts the group's contiguous run at seq (the device's cursor, or where
+ * it joined) if the cache is behind it, so later syncs continue from there
+ * and the messages up to seq are only fetched when the history is asked
+ * for. Caller holds cache->mutex.
+ */
+void seedCacheGroup(CacheGroup *group, unsigned int seq) {
+    if (group->syncedSeq < seq) {
+        group->firstSeq = seq;
+        group->syncedSeq = seq;
+        extendRun(group);
+    }
+}
+
+static int mapCache(MessageCache *cache, size_t size) {
+    if (cache->map != NULL) {
+        munmap(cache->map, cache->mapSize);
+        cache->map = NULL;
+    }
+    if (ftruncate(cache->fd, size) == -1) {
+        perror("Error sizing message cache");
+        return -1;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, cache->fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Error mapping message cache");
+        return -1;
+    }
+    cache->map = (char *) map;
+    cache->mapSize = size;
+    return 0;
+}
+
+// Rebuilds the in-memory index from the records. Stops at the first bad one.
+static void loadRecords(MessageCache *cache) {
+    CacheHeader *header = cacheHeader(cache);
+    uint64_t pos = sizeof(CacheHeader);
+    while (pos + sizeof(CacheRecord) <= header->used) {
+        CacheRecord record;
+        memcpy(&record, cache->map + pos, sizeof record);
+        size_t needed = sizeof record + record.groupLen + record.nameLen + record.textLen;
+        if (record.length < needed || pos + record.length > header->used ||
+            record.groupLen == 0 || record.groupLen >= GROUP_NAME_SIZE || record.seq == 0) {
+            break;
+        }
+        char group[GROUP_NAME_SIZE];
+        memcpy(group, cache->map + pos + sizeof record, record.groupLen);
+        group[record.groupLen] = '\0';
+        CacheGroup *cacheGroup = getCacheGroup(cache, group);
+        if (cacheGroup == NULL || indexRecord(cacheGroup, record.seq, pos) == -1) {
+            break;
+        }
+        cache->count++;
+        pos += record.length;
+    }
+    header->used = pos;
+}
+
+/**
+ * Opens (creating if needed) the cache file of a user and indexes it.
+ *
+ * param dir   Cache directory, created if missing.
+ * param email The user's email; names the file.
+ * return 0 on success, -1 on error (the client then runs without a cache).
+ */
+int openMessageCache(MessageCache *cache, const char *dir, const char *email) {
+    memset(cache, 0, sizeof(MessageCache));
+    cache->fd = -1;
+    pthread_mutex_init(&cache->mutex, NULL);
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+        perror("Error creating cache directory");
+        return -1;
+    }
+
+    size_t len = strlen(dir) + strlen(email) + 16;
+    char *path = (char *) malloc(len);
+    if (path == NULL) {
+        return -1;
+    }
+    snprintf(path, len, "%s/%s.cache", dir, email);
+    for (char *p = path + strlen(dir) + 1; *p != '\0'; p++) {
+        if (*p == '/') {
+            *p = '_';
+        }
+    }
+    cache->fd = open(path, O_RDWR | O_CREAT, 0600);
+    free(path);
+    if (cache->fd == -1) {
+        perror("Error opening message cache");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(cache->fd, &st) == -1) {
+        return -1;
+    }
+    size_t size = (st.st_size >= CACHE_INITIAL_SIZE) ? (size_t) st.st_size : CACHE_INITIAL_SIZE;
+    if (mapCache(cache, size) == -1) {
+        return -1;
+    }
+    CacheHeader *header = cacheHeader(cache);
+    if (header->magic != CACHE_MAGIC || header->version != CACHE_VERSION || header->used > cache->mapSize) {
+        // New or unreadable: start empty.
+        header->magic = CACHE_MAGIC;
+        header->version = CACHE_VERSION;
+        header->used = sizeof(CacheHeader);
+    }
+    loadRecords(cache);
+    return 0;
+}
+
+/**
+ * Adds a received group message to the cache (if not cached already).
+ *
+ * return 0 on success, -1 on error.
+ */
+int cacheMessage(MessageCache *cache, user_message *msg) {
+    if (cache->map == NULL || msg->seq == 0) {
+        return -1;
+    }
+    CacheRecord record;
+    memset(&record, 0, sizeof record);
+    record.seq = msg->seq;
+    record.timestamp = msg->timestamp;
+    record.groupLen = strnlen(msg->group, GROUP_NAME_SIZE - 1);
+    record.nameLen = strnlen(msg->name, BUFFER_SIZE - 1);
+    record.textLen = strnlen(msg->message, BUFFER_SIZE - 1);
+    record.length = (sizeof record + record.groupLen + record.nameLen + record.textLen + 7) & ~7u;
+    if (record.groupLen == 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&cache->mutex);
+    CacheGroup *group = getCacheGroup(cache, msg->group);
+    if (group == NULL || cachedOffset(group, msg->seq) != 0) {
+        pthread_mutex_unlock(&cache->mutex);
+        return (group == NULL) ? -1 : 0;
+    }
+    uint64_t pos = cacheHeader(cache)->used;
+    if ((pos + record.length > cache->mapSize && mapCache(cache, cache->mapSize * 2) == -1) ||
+        indexRecord(group, msg->seq, pos) == -1) {
+        pthread_mutex_unlock(&cache->mutex);
+        return -1;
+    }
+    char *p = cache->map + pos;
+    memcpy(p, &record, sizeof record);
+    p += sizeof record;
+    memcpy(p, msg->group, record.groupLen);
+    memcpy(p + record.groupLen, msg->name, record.nameLen);
+    memcpy(p + record.groupLen + record.nameLen, msg->message, record.textLen);
+    // The record is complete before it is counted (a refused seq never is,
+    // so the next load doesn't stop at it).
+    cacheHeader(cache)->used = pos + record.length;
+    cache->count++;
+    pthread_mutex_unlock(&cache->mutex);
+    return 0;
+}
+
+/**
+ * Reads a cached message back as a PRINT_MESSAGE_TYPE frame. Caller holds
+ * cache->mutex.
+ *
+ * return 0 if found, -1 if that message is not cached.
+ */
+int getCachedMessage(MessageCache *cache, CacheGroup *group, unsigned int seq, user_message *out) {
+    uint64_t offset = cachedOffset(group, seq);
+    if (offset == 0) {
+        return -1;
+    }
+    CacheRecord record;
+    const char *p = cache->map + offset;
+    memcpy(&record, p, sizeof record);
+    p += sizeof record;
+    memset(out, 0, sizeof(user_message));
+    out->type = PRINT_MESSAGE_TYPE;
+    memcpy(out->group, p, record.groupLen);
+    memcpy(out->name, p + record.groupLen, record.nameLen);
+    memcpy(out->message, p + record.groupLen + record.nameLen, record.textLen);
+    out->seq = record.seq;
+    out->timestamp = record.timestamp;
+    return 0;
+}
+
+void closeMessageCache(MessageCache *cache) {
+    if (cache->map != NULL) {
+        munmap(cache->map, cache->mapSize);
+    }
+    if (cache->fd != -1) {
+        close(cache->fd);
+    }
+    CacheGroup *ptr = cache->groups;
+    while (ptr != NULL) {
+        CacheGroup *temp = ptr;
+        ptr = ptr->next;
+        free(temp->name);
+        free(temp->offsets);
+        free(temp);
+    }
+    pthread_mutex_destroy(&cache->mutex);
+    memset(cache, 0, sizeof(MessageCache));
+    cache->fd = -1;
+}
@@ -0,0 +1,66 @@
+#ifndef MSG_CACHE_H
+#define MSG_CACHE_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "protocol.h"
+
+/**
+ * Client-side cache of received group messages, keyed by group and
+ * sequence number, kept in one memory-mapped file per user:
+ *
+ *   <dir>/<email>.cache   header, then the messages as appended records
+ *
+ * The file is mapped MAP_SHARED and records are copied straight into the
+ * mapping, so the cache survives restarts without explicit writes. It is
+ * only a cache: a lost tail (power failure) is fetched again by the next sync.
+ */
+
+#define CACHE_INITIAL_SIZE (1 << 20)
+#define CACHE_MAX_SPAN (1u << 24) // widest range of seqs indexed per group
+
+/**
+ * Struct name: CacheGroup
+ * Description: Index of one group's cached messages.
+ *
+ * param firstSeq    0 if the history is cached from its start; else the point the
+ *                   cache was seeded at (seedCacheGroup()), whose older
+ *                   messages are only fetched on demand.
+ * param syncedSeq   Every message firstSeq+1..syncedSeq is cached; a sync asks for what follows.
+ * param offsets     Record offset in the mapping by seq - baseSeq, 0 if not cached.
+ * param baseSeq     Seq of offsets[0]: the lowest seq cached.
+ * param syncPending A SYNC request is outstanding (set and cleared by the client).
+ * param showSynced  Print the group's history once the outstanding sync completes.
+ */
+typedef struct CACHE_GROUP {
+    char *name;
+    unsigned int firstSeq;
+    unsigned int syncedSeq;
+    uint64_t *offsets;
+    unsigned int baseSeq;
+    unsigned int capacity;
+    int syncPending;
+    int showSynced;
+    struct CACHE_GROUP *next;
+} CacheGroup;
+
+typedef struct MESSAGE_CACHE {
+    int fd;
+    char *map;
+    size_t mapSize;
+    long count;
+    CacheGroup *groups;
+    pthread_mutex_t mutex;
+} MessageCache;
+
+// Function prototypes
+int openMessageCache(MessageCache *cache, const char *dir, const char *email);
+CacheGroup *getCacheGroup(MessageCache *cache, const char *group);
+void seedCacheGroup(CacheGroup *group, unsigned int seq);
+int cacheMessage(MessageCache *cache, user_message *msg);
+int getCachedMessage(MessageCache *cache, CacheGroup *group, unsigned int seq, user_message *out);
+void closeMessageCache(MessageCache *cache);
+
+#endif // MSG_CACHE_H
@@ -0,0 +1,392 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "msg-filter.h"
+
+#define NO_STATE (~0u) // a trie edge not taken by any pattern
+
+static unsigned char fold(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') ? (unsigned char) (c - 'A' + 'a') : c;
+}
+
+// Letters, digits, '_' and the bytes of non-ASCII characters make up words.
+static int word_byte(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+           c == '_' || c >= 0x80;
+}
+
+// The positions a rule matches in: a plain word only between non-word
+// characters, a '*' edge next to anything.
+static unsigned char rule_edges(int open_start, int open_end) {
+    unsigned char edges = 0;
+    for (int start_free = 0; start_free <= 1; start_free++) {
+        for (int end_free = 0; end_free <= 1; end_free++) {
+            if ((start_free || open_start) && (end_free || open_end)) {
+                edges |= FILTER_EDGES(start_free, end_free);
+            }
+        }
+    }
+    return edges;
+}
+
+// Whether pattern p, found ending just before text[end], counts there.
+static int edges_match(FilterAutomaton *automaton, int p, const unsigned char *text, size_t len, size_t end) {
+    size_t start = end - automaton->length[p];
+    int start_free = start == 0 || !word_byte(text[start - 1]);
+    int end_free = end == len || !word_byte(text[end]);
+    return (automaton->edges[p] & FILTER_EDGES(start_free, end_free)) != 0;
+}
+
+/**
+ * Compiles patterns (as written in the rule file, '*' edges included).
+ * Patterns left empty by their '*'s are skipped.
+ *
+ * return The automaton, NULL if memory ran out.
+ */
+FilterAutomaton *compileFilter(char **patterns, int count) {
+    FilterAutomaton *automaton = (FilterAutomaton *) calloc(1, sizeof(FilterAutomaton));
+    if (automaton == NULL) {
+        perror("Error allocating filter");
+        return NULL;
+    }
+    unsigned int *queue = NULL; // states in breadth-first order
+    unsigned int *links = NULL; // failure state of every state
+
+    // Edge '*'s become edge rules; a '*' inside a pattern is an ordinary byte.
+    const char **texts = (const char **) calloc(count > 0 ? count : 1, sizeof(char *));
+    size_t *lengths = (size_t *) calloc(count > 0 ? count : 1, sizeof(size_t));
+    automaton->length = (unsigned short *) calloc(count > 0 ? count : 1, sizeof(unsigned short));
+    automaton->edges = (unsigned char *) calloc(count > 0 ? count : 1, 1);
+    if (texts == NULL || lengths == NULL || automaton->length == NULL || automaton->edges == NULL) {
+        goto out_of_memory;
+    }
+    size_t total = 0;
+    for (int p = 0; p < count; p++) {
+        const char *text = patterns[p];
+        size_t len = strlen(text);
+        int open_start = len > 0 && text[0] == '*';
+        text += open_start;
+        len -= open_start;
+        int open_end = len > 0 && text[len - 1] == '*';
+        len -= open_end;
+        texts[p] = text;
+        lengths[p] = len;
+        automaton->edges[p] = rule_edges(open_start, open_end); // by rule for now, by pattern below
+        total += len;
+    }
+
+    // Every byte (either case) that appears in a pattern gets a class.
+    automaton->classes = 1;
+    for (int p = 0; p < count; p++) {
+        for (size_t i = 0; i < lengths[p]; i++) {
+            unsigned char f = fold((unsigned char) texts[p][i]);
+            if (automaton->classOf[f] != 0) {
+                continue;
+            }
+            automaton->classOf[f] = (unsigned char) automaton->classes++;
+            if (f >= 'a' && f <= 'z') {
+                automaton->classOf[f - 'a' + 'A'] = automaton->classOf[f];
+            }
+        }
+    }
+    unsigned int classes = automaton->classes;
+    unsigned int max_states = (unsigned int) total + 1;
+    queue = (unsigned int *) malloc(max_states * sizeof(unsigned int));
+    links = (unsigned int *) malloc(max_states * sizeof(unsigned int));
+    automaton->delta = (unsigned int *) malloc((size_t) max_states * classes * sizeof(unsigned int));
+    automaton->output = (int *) malloc(max_states * sizeof(int));
+    automaton->dictLink = (int *) malloc(max_states * sizeof(int));
+    if (queue == NULL || links == NULL || automaton->delta == NULL || automaton->output == NULL ||
+        automaton->dictLink == NULL) {
+        goto out_of_memory;
+    }
+
+    // The trie, in delta (NO_STATE where no pattern goes on).
+    automaton->states = 1;
+    memset(automaton->delta, 0xff, (size_t) classes * sizeof(unsigned int));
+    automaton->output[0] = -1;
+    for (int p = 0; p < count; p++) {
+        const char *pattern = texts[p];
+        size_t len = lengths[p];
+        unsigned char edges = automaton->edges[p];
+        automaton->edges[p] = 0;
+        if (len == 0) {
+            continue;
+        }
+        unsigned int state = 0;
+        for (size_t i = 0; i < len; i++) {
+            unsigned int *next = &automaton->delta[state * classes + automaton->classOf[(unsigned char) pattern[i]]];
+            if (*next == NO_STATE) {
+                *next = automaton->states++;
+                memset(&automaton->delta[*next * classes], 0xff, (size_t) classes * sizeof(unsigned int));
+                automaton->output[*next] = -1;
+            }
+            state = *next;
+        }
+        if (automaton->output[state] >= 0) {
+            // The same word twice: it matches where either rule lets it.
+            automaton->edges[automaton->output[state]] |= edges;
+            continue;
+        }
+        automaton->output[state] = (int) automaton->patterns;
+        automaton->length[automaton->patterns] = (unsigned short) len;
+        automaton->edges[automaton->patterns] = edges;
+        automaton->patterns++;
+    }
+
+    // Breadth first, so the failure state of every state is complete when
+    // the state is reached: the missing edges of a state are those of its
+    // failure state.
+    unsigned int head = 0, tail = 0;
+    links[0] = 0;
+    automaton->dictLink[0] = -1;
+    for (unsigned int c = 0; c < classes; c++) {
+        unsigned int child = automaton->delta[c];
+        if (child == NO_STATE) {
+            automaton->delta[c] = 0;
+        } else {
+            links[child] = 0;
+            automaton->dictLink[child] = -1;
+            queue[tail++] = child;
+            automaton->starts[c] = 1; // by class for now
+        }
+    }
+    while (head < tail) {
+        unsigned int state = queue[head++];
+        unsigned int link = links[state];
+        for (unsigned int c = 0; c < classes; c++) {
+            unsigned int *next = &automaton->delta[state * classes + c];
+            if (*next == NO_STATE) {
+                *next = automaton->delta[link * classes + c];
+                continue;
+            }
+            unsigned int child = *next;
+            unsigned int child_link = automaton->delta[link * classes + c];
+            links[child] = child_link;
+            automaton->dictLink[child] = (automaton->output[child_link] >= 0) ? (int) child_link
+                                                                                : automaton->dictLink[child_link];
+            queue[tail++] = child;
+        }
+    }
+    free(links);
+    free(queue);
+    free(texts);
+    free(lengths);
+
+    unsigned char start_classes[256];
+    memcpy(start_classes, automaton->starts, sizeof start_classes);
+    for (int b = 0; b < 256; b++) {
+        automaton->starts[b] = automaton->classOf[b] != 0 && start_classes[automaton->classOf[b]];
+    }
+    return automaton;
+
+out_of_memory:
+    perror("Error allocating filter");
+    free(queue);
+    free(links);
+    free(texts);
+    free(lengths);
+    freeFilterAutomaton(automaton);
+    return NULL;
+}
+
+/**
+ * Scans a message.
+ *
+ * return 1 if a pattern matches, 0 if not.
+ */
+int scanFilter(FilterAutomaton *automaton, const char *text, size_t len) {
+    const unsigned char *bytes = (const unsigned char *) text;
+    const unsigned int *delta = automaton->delta;
+    unsigned int classes = automaton->classes;
+    unsigned int state = 0;
+    size_t i = 0;
+    while (i < len) {
+        if (state == 0) {
+            while (i < len && !automaton->starts[bytes[i]]) {
+                i++;
+            }
+            if (i == len) {
+                break;
+            }
+        }
+        state = delta[state * classes + automaton->classOf[bytes[i++]]];
+        int s = (automaton->output[state] >= 0) ? (int) state : automaton->dictLink[state];
+        while (s >= 0) {
+            if (edges_match(automaton, automaton->output[s], bytes, len, i)) {
+                return 1;
+            }
+            s = automaton->dictLink[s];
+        }
+    }
+    return 0;
+}
+
+void freeFilterAutomaton(FilterAutomaton *automaton) {
+    if (automaton == NULL) {
+        return;
+    }
+    free(automaton->delta);
+    free(automaton->output);
+    free(automaton->dictLink);
+    free(automaton->length);
+    free(automaton->edges);
+    free(automaton);
+}
+
+// Reads and compiles the rule file. Returns NULL if it can't be read.
+static FilterAutomaton *load_rules(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror("Error opening filter rules");
+        return NULL;
+    }
+    char **patterns = NULL;
+    int count = 0, capacity = 0;
+    char line[FILTER_MAX_PATTERN + 4];
+    int number = 0;
+    FilterAutomaton *automaton = NULL;
+    while (fgets(line, sizeof line, file) != NULL) {
+        number++;
+        size_t len = strlen(line);
+        if (len == sizeof line - 1 && line[len - 1] != '\n') {
+            printf("Filter rules line %d: pattern longer than %d bytes, skipped\n", number, FILTER_MAX_PATTERN);
+            int c;
+            while ((c = fgetc(file)) != EOF && c != '\n') {
+            }
+            continue;
+        }
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' ||
+                           line[len - 1] == ' ' || line[len - 1] == '\t')) {
+            line[--len] = '\0';
+        }
+        char *start = line;
+        while (*start == ' ' || *start == '\t') {
+            start++;
+        }
+        if (*start == '\0' || *start == '#') {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = (capacity == 0) ? 64 : 2 * capacity;
+            char **grown = (char **) realloc(patterns, capacity * sizeof(char *));
+            if (grown == NULL) {
+                perror("Error reading filter rules");
+                goto done;
+            }
+            patterns = grown;
+        }
+        if ((patterns[count] = strdup(start)) == NULL) {
+            perror("Error reading filter rules");
+            goto done;
+        }
+        count++;
+    }
+    automaton = compileFilter(patterns, count);
+    if (automaton != NULL) {
+        printf("Filter: %u patterns from %s (%u states, %u byte classes)\n",
+               automaton->patterns, path, automaton->states, automaton->classes);
+    }
+
+done:
+    for (int p = 0; p < count; p++) {
+        free(patterns[p]);
+    }
+    free(patterns);
+    fclose(file);
+    return automaton;
+}
+
+/**
+ * Loads the rule file.
+ *
+ * return 0 on success, -1 if it can't be read.
+ */
+int openMessageFilter(MessageFilter *filter, const char *path) {
+    memset(filter, 0, sizeof *filter);
+    filter->automaton = load_rules(path);
+    if (filter->automaton == NULL || (filter->path = strdup(path)) == NULL) {
+        freeFilterAutomaton(filter->automaton);
+        return -1;
+    }
+    pthread_mutex_init(&filter->reloadLock, NULL);
+    return 0;
+}
+
+/**
+ * Reads the rule file again. If it can't be read, the rules in force stay.
+ *
+ * return 0 on success, -1 on error.
+ */
+int reloadMessageFilter(MessageFilter *filter) {
+    pthread_mutex_lock(&filter->reloadLock);
+    printFilterStats(filter, stdout);
+    FilterAutomaton *automaton = load_rules(filter->path);
+    if (automaton == NULL) {
+        printf("Filter: keeping the previous rules\n");
+        pthread_mutex_unlock(&filter->reloadLock);
+        return -1;
+    }
+    automaton->retired = filter->automaton;
+    __atomic_store_n(&filter->automaton, automaton, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&filter->reloadLock);
+    return 0;
+}
+
+/**
+ * Checks a message against the rules in force.
+ *
+ * return 1 if it must be refused, 0 if not.
+ */
+int filterMessage(MessageFilter *filter, const char *text, size_t len) {
+    FilterAutomaton *automaton = __atomic_load_n(&filter->automaton, __ATOMIC_ACQUIRE);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int blocked = scanFilter(automaton, text, len);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    unsigned long long ns = (unsigned long long) ((end.tv_sec - start.tv_sec) * 1000000000LL +
+                                                  (end.tv_nsec - start.tv_nsec));
+
+    FilterStats *stats = &filter->stats;
+    __atomic_fetch_add(&stats->scanned, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->blocked, (unsigned long long) blocked, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->bytes, (unsigned long long) len, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->totalNs, ns, __ATOMIC_RELAXED);
+    unsigned long long max = __atomic_load_n(&stats->maxNs, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&stats->maxNs, &max, ns, 0,
+                                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    return blocked;
+}
+
+void printFilterStats(MessageFilter *filter, FILE *out) {
+    FilterStats stats;
+    stats.scanned = __atomic_load_n(&filter->stats.scanned, __ATOMIC_RELAXED);
+    stats.blocked = __atomic_load_n(&filter->stats.blocked, __ATOMIC_RELAXED);
+    stats.bytes = __atomic_load_n(&filter->stats.bytes, __ATOMIC_RELAXED);
+    stats.totalNs = __atomic_load_n(&filter->stats.totalNs, __ATOMIC_RELAXED);
+    stats.maxNs = __atomic_load_n(&filter->stats.maxNs, __ATOMIC_RELAXED);
+    if (stats.scanned == 0) {
+        fprintf(out, "Filter: no messages scanned\n");
+        return;
+    }
+    fprintf(out, "Filter: %llu messages scanned (%llu bytes), %llu blocked, %.0f ns average, %llu ns max\n",
+                 stats.scanned, stats.bytes, stats.blocked, (double) stats.totalNs / stats.scanned, stats.maxNs);
+}
+
+// Frees the rules, those replaced by reloads included. No thread may be scanning.
+void closeMessageFilter(MessageFilter *filter) {
+    printFilterStats(filter, stdout);
+    FilterAutomaton *automaton = filter->automaton;
+    while (automaton != NULL) {
+        FilterAutomaton *retired = automaton->retired;
+        freeFilterAutomaton(automaton);
+        automaton = retired;
+    }
+    filter->automaton = NULL;
+    free(filter->path);
+    filter->path = NULL;
+    pthread_mutex_destroy(&filter->reloadLock);
+}
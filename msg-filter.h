@@ -0,0 +1,90 @@
+#ifndef MSG_FILTER_H
+#define MSG_FILTER_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+/**
+ * Moderation of posts (server -F rules): group and direct messages, and
+ * the names of attachments, are checked against a blocklist before they
+ * are stored or fanned out. A message that matches is refused with an error.
+ *
+ * The rule file has one pattern per line ('#' starts a comment). Matching
+ * ignores ASCII case. A plain pattern only matches a whole word ("spam"
+ * blocks "Spam!" but not "spamalot"); a '*' at either end lets the match
+ * run into a word on that side ("*spam*", "http*").
+ *
+ * The patterns are compiled into one Aho-Corasick automaton, turned into a
+ * table indexed by state and byte class (bytes that appear in no pattern
+ * share class 0), so a message is scanned once, one lookup per byte,
+ * whatever the number of patterns. While the automaton is at its root it
+ * skips ahead to the next byte that can start a pattern.
+ *
+ * SIGHUP reloads the file. The new automaton replaces the old one
+ * atomically; the old one is kept until the server exits, since a
+ * connection thread may still be scanning with it. Every scan is timed
+ * (FilterStats); the numbers are printed on reload and at exit.
+ */
+
+#define FILTER_MAX_PATTERN 128 // longest pattern, in bytes
+
+/**
+ * Struct name: FilterAutomaton
+ * Description: One compiled rule file.
+ *
+ * param classOf  Byte class of every byte (case folded).
+ * param starts   starts[b] is 1 if byte b can start a pattern.
+ * param delta    Next state: delta[state * classes + class].
+ * param output   First pattern ending in a state, -1 if none; dictLink
+ *                leads to the next state with an output (-1: none).
+ * param length   Length of every pattern.
+ * param edges    Where every pattern counts: bit FILTER_EDGES(start, end) is
+ *                set if it does when the text before it (start) and after it
+ *                (end) is, or isn't (0), free of word characters.
+ */
+typedef struct FILTER_AUTOMATON {
+    unsigned char classOf[256];
+    unsigned char starts[256];
+    unsigned int classes;
+    unsigned int states;
+    unsigned int *delta;
+    int *output;
+    int *dictLink;
+    unsigned int patterns;
+    unsigned short *length;
+    unsigned char *edges;
+    struct FILTER_AUTOMATON *retired; // the automaton this one replaced
+} FilterAutomaton;
+
+#define FILTER_EDGES(start_free, end_free) (1 << ((start_free) | (end_free) << 1))
+
+/**
+ * Struct name: FilterStats
+ * Description: Counters of the scans (updated atomically by every thread).
+ */
+typedef struct FILTER_STATS {
+    unsigned long long scanned;
+    unsigned long long blocked;
+    unsigned long long bytes;
+    unsigned long long totalNs;
+    unsigned long long maxNs;
+} FilterStats;
+
+typedef struct MESSAGE_FILTER {
+    char *path;
+    FilterAutomaton *automaton; // current rules, swapped by reloadMessageFilter()
+    FilterStats stats;
+    pthread_mutex_t reloadLock;
+} MessageFilter;
+
+// Function prototypes
+int openMessageFilter(MessageFilter *filter, const char *path);
+int reloadMessageFilter(MessageFilter *filter);
+int filterMessage(MessageFilter *filter, const char *text, size_t len);
+void printFilterStats(MessageFilter *filter, FILE *out);
+void closeMessageFilter(MessageFilter *filter);
+FilterAutomaton *compileFilter(char **patterns, int count);
+int scanFilter(FilterAutomaton *automaton, const char *text, size_t len);
+void freeFilterAutomaton(FilterAutomaton *automaton);
+
+#endif // MSG_FILTER_H
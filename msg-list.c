@@ -1,28 +1,150 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
 #include "protocol.h"
 #include "msg-list.h"
+#include "user-list.h"
+#include "group-list.h"
 
 // Added By: Daniel
 // Edited By: Omi
 
 void initMessageList(MessageList *msgList) {
-   msgList->first = NULL;
-   msgList->last = NULL;
+   msgList->blocks = NULL;
    msgList->count = 0;
+   msgList->bytes = 0;
+   msgList->bodyFd = -1;
+   msgList->arena = NULL;
+   msgList->arenaChunks = 0;
+   msgList->arenaUsed = 0;
 }
 
-void appendMessage(MessageList *msgList, Message *message) {
-   if (msgList->first == NULL) {
-      msgList->first = message;
-      msgList->last = message;
+// Copies a text (with its terminator) into the arena.
+// return its arena offset, or -1 if memory ran out.
+static long long arenaStore(MessageList *msgList, const char *text, size_t len) {
+   if (msgList->arena == NULL &&
+       (msgList->arena = (char **) calloc(MESSAGE_ARENA_CHUNKS, sizeof(char *))) == NULL) {
+      return -1;
    }
-   else {
-      msgList->last->next = message;
-      msgList->last = message;
+   if (msgList->arenaChunks == 0 || msgList->arenaUsed + len + 1 > MESSAGE_ARENA_CHUNK) {
+      if (msgList->arenaChunks == MESSAGE_ARENA_CHUNKS) {
+         return -1;
+      }
+      char *chunk = (char *) malloc(MESSAGE_ARENA_CHUNK);
+      if (chunk == NULL) {
+         return -1;
+      }
+      msgList->arena[msgList->arenaChunks++] = chunk;
+      msgList->arenaUsed = 0;
    }
+   long long offset = (long long) (msgList->arenaChunks - 1) * MESSAGE_ARENA_CHUNK + msgList->arenaUsed;
+   memcpy(msgList->arena[msgList->arenaChunks - 1] + msgList->arenaUsed, text, len);
+   msgList->arena[msgList->arenaChunks - 1][msgList->arenaUsed + len] = '\0';
+   msgList->arenaUsed += len + 1;
+   return offset;
+}
+
+/**
+ * Stores a message's header at the end of the list. Called with
+ * messageList_mutex held (and the group's lock, which orders a group's
+ * messages in the list).
+ *
+ * param header    seq, groupId, senderId and timestamp filled in; length and
+ *                 body are set here.
+ * param text      The message's text.
+ * param logOffset Where logMessage() put the text in the log, or -1 if it
+ *                 isn't there: it is copied into the arena then.
+ * return the message's position in the list, or MESSAGE_NONE if memory ran out.
+ */
+unsigned int appendMessage(MessageList *msgList, MessageHeader *header, const char *text, long long logOffset) {
+   unsigned int position = (unsigned int) msgList->count;
+   if (position / MESSAGE_BLOCK >= MESSAGE_BLOCKS) {
+      return MESSAGE_NONE;
+   }
+   if (msgList->blocks == NULL &&
+       (msgList->blocks = (MessageHeader **) calloc(MESSAGE_BLOCKS, sizeof(MessageHeader *))) == NULL) {
+      perror("Error allocating memory for message list");
+      return MESSAGE_NONE;
+   }
+   MessageHeader *block = msgList->blocks[position / MESSAGE_BLOCK];
+   if (block == NULL) {
+      block = (MessageHeader *) malloc(MESSAGE_BLOCK * sizeof(MessageHeader));
+      if (block == NULL) {
+         perror("Error allocating memory for message list");
+         return MESSAGE_NONE;
+      }
+      msgList->blocks[position / MESSAGE_BLOCK] = block;
+   }
+
+   header->length = strnlen(text, BUFFER_SIZE - 1);
+   if (logOffset >= 0) {
+      header->body = (unsigned long long) logOffset;
+   } else {
+      long long offset = arenaStore(msgList, text, header->length);
+      if (offset == -1) {
+         perror("Error allocating memory for message");
+         return MESSAGE_NONE;
+      }
+      header->body = MESSAGE_IN_ARENA | (unsigned long long) offset;
+   }
+   block[position % MESSAGE_BLOCK] = *header;
    msgList->count++;
+   msgList->bytes += header->length;
+   return position;
+}
+
+/**
+ * return the header at a position in the list, or NULL for MESSAGE_NONE.
+ * Positions come from the group index (under the group's lock) or below a
+ * count read under messageList_mutex: the header is in place by then and
+ * never changes, so it is read without the lock.
+ */
+MessageHeader *getMessageHeader(MessageList *msgList, unsigned int position) {
+   if (position == MESSAGE_NONE) {
+      return NULL;
+   }
+   return &msgList->blocks[position / MESSAGE_BLOCK][position % MESSAGE_BLOCK];
+}
+
+/**
+ * Fetches a message's text: from the arena, from the reader's window of
+ * the log, or with one pread() of the next MESSAGE_READ_AHEAD bytes of the
+ * log into the window. Walking a group's messages in order mostly stays in
+ * the window.
+ *
+ * return the text (NUL-terminated), valid until the reader is used again;
+ *        "" if it couldn't be read (the error is printed).
+ */
+const char *readMessageBody(MessageList *msgList, MessageHeader *header, BodyReader *reader) {
+   if (header->body & MESSAGE_IN_ARENA) {
+      unsigned long long offset = header->body & ~MESSAGE_IN_ARENA;
+      return msgList->arena[offset / MESSAGE_ARENA_CHUNK] + offset % MESSAGE_ARENA_CHUNK;
+   }
+   if (header->body < reader->start || header->body + header->length >= reader->start + reader->length) {
+      ssize_t n = pread(msgList->bodyFd, reader->buffer, MESSAGE_READ_AHEAD, (off_t) header->body);
+      if (n < 0) {
+         perror("Error reading message log");
+         n = 0;
+      }
+      reader->start = header->body;
+      reader->length = (size_t) n;
+   }
+   const char *text = reader->buffer + (header->body - reader->start);
+   if (header->body + header->length >= reader->start + reader->length || text[header->length] != '\0') {
+      printf("Message log: text of message #%u not found at byte %llu\n", header->seq, header->body);
+      reader->length = 0;
+      return "";
+   }
+   return text;
+}
+
+/**
+ * return the name of a message's sender, "?" if the id is unknown.
+ */
+const char *getSenderName(UserList *userList, MessageHeader *header) {
+   User *sender = getUserById(userList, header->senderId);
+   return (sender != NULL) ? sender->name : "?";
 }
 
 Message *createMessage(char* msgString, User *sender) {
@@ -34,16 +156,31 @@ Message *createMessage(char* msgString, User *sender) {
    }
    msg->message = msgString;
    msg->sender = sender;
+   msg->group = NULL;
+   msg->seq = 0;
+   msg->timestamp = 0;
    msg->next = NULL;
    return msg;
 }
 
-void printMessageList(MessageList *msgList) {
-   Message *ptr = msgList->first;
+/**
+ * Prints the messages, oldest first. msgList may be a copy made under
+ * messageList_mutex (only count messages are read).
+ */
+void printMessageList(MessageList *msgList, UserList *userList, GroupList *groupList, FILE *out) {
+   BodyReader *reader = (BodyReader *) malloc(sizeof(BodyReader));
+   if (reader == NULL) {
+      perror("Error allocating memory for message reader");
+      return;
+   }
+   reader->length = 0;
    for (int i = 0; i < msgList->count; i++) {
-      printf("Message from user (%s): %s\n", ptr->sender->name, ptr->message);
-      ptr = ptr->next;
+      MessageHeader *header = getMessageHeader(msgList, (unsigned int) i);
+      GroupInfo *group = getGroupById(groupList, header->groupId);
+      fprintf(out, "Message from user (%s) in %s #%u: %s\n", getSenderName(userList, header),
+              group != NULL ? group->name : "?", header->seq, readMessageBody(msgList, header, reader));
    }
+   free(reader);
 }
 
 // Added By: Daniel
@@ -53,14 +190,16 @@ void printMessageList(MessageList *msgList) {
  * param msgList A pointer to a list of messages.
  */
 void freeMessageList(MessageList *msgList) {
-    Message *ptr = msgList->first;
-    for (int i = 0; i < msgList->count; i++) {
-        Message *temp = ptr;
-        ptr = ptr->next;
-        free(temp->message);
-        free(temp);
+    for (int b = 0; msgList->blocks != NULL && b < MESSAGE_BLOCKS; b++) {
+        free(msgList->blocks[b]);
+    }
+    for (unsigned int c = 0; c < msgList->arenaChunks; c++) {
+        free(msgList->arena[c]);
+    }
+    free(msgList->blocks);
+    free(msgList->arena);
+    if (msgList->bodyFd != -1) {
+        close(msgList->bodyFd);
     }
-    msgList->first = NULL;
-    msgList->last = NULL;
-    msgList->count = 0;
+    initMessageList(msgList);
 }
@@ -8,11 +8,43 @@
 // Added By: Daniel
 // Edited By: Omi
 
+/**
+ * The group history is kept as MessageHeaders: 32 bytes a message, with
+ * the group and sender by id, in blocks that never move. The texts stay in
+ * the message log (msg-log.c) and are read with pread() when a client
+ * fetches them: a history, a backlog, a retransmission. Live delivery
+ * never reads them back, since the fan-out frame is built at post time.
+ * A text the log doesn't hold (no log, a failed write) goes to an arena of
+ * chunks in memory instead.
+ */
+
+#define MESSAGE_BLOCK 65536            // headers per block
+#define MESSAGE_BLOCKS 65536           // blocks in the list (so at most 2^32 messages)
+#define MESSAGE_ARENA_CHUNK (1 << 20)  // bytes per arena chunk
+#define MESSAGE_ARENA_CHUNKS 65536     // chunks in the arena
+#define MESSAGE_IN_ARENA (1ULL << 63)  // set in MessageHeader.body: the offset is in the arena
+#define MESSAGE_READ_AHEAD 16384       // bytes of the log read at once
+
+/**
+ * Struct name: BodyReader
+ * Description: A window of the message log read by readMessageBody(), so
+ *              the texts of nearby messages (a group's history is mostly
+ *              posted together) come from one read. Start with length 0.
+ */
+typedef struct BODY_READER {
+    unsigned long long start; // log offset of buffer[0]
+    size_t length;            // bytes in buffer
+    char buffer[MESSAGE_READ_AHEAD];
+} BodyReader;
+
 // Function prototypes
 void initMessageList(MessageList *msgList);
-void appendMessage(MessageList *msgList, Message *message);
+unsigned int appendMessage(MessageList *msgList, MessageHeader *header, const char *text, long long logOffset);
+MessageHeader *getMessageHeader(MessageList *msgList, unsigned int position);
+const char *readMessageBody(MessageList *msgList, MessageHeader *header, BodyReader *reader);
+const char *getSenderName(UserList *userList, MessageHeader *header);
 Message *createMessage(char* msgString, User *sender);
-void printMessageList(MessageList *msgList);
+void printMessageList(MessageList *msgList, UserList *userList, GroupList *groupList, FILE *out);
 void freeMessageList(MessageList *msgList);
 
 #endif // MSG_LIST_H
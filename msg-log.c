@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include "protocol.h"
+#include "user-list.h"
+#include "msg-list.h"
+#include "group-list.h"
+#include "msg-log.h"
+
+#define MAX_RECORD_PAYLOAD (GROUP_NAME_SIZE + 2 * BUFFER_SIZE)
+
+// Payload: group, sender email and text, each NUL-terminated.
+typedef struct {
+    uint32_t length;        // payload bytes
+    uint32_t checksum;      // FNV-1a of seq, timestamp and payload
+    uint32_t seq;
+    uint32_t reserved;
+    int64_t timestamp;
+} MessageRecord;
+
+static uint32_t fnv1a(uint32_t hash, const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *) data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t recordChecksum(MessageRecord *record, const char *payload) {
+    uint32_t hash = fnv1a(2166136261u, &record->seq, sizeof(record->seq));
+    hash = fnv1a(hash, &record->timestamp, sizeof(record->timestamp));
+    return fnv1a(hash, payload, record->length);
+}
+
+// offset: where the record starts in the log. The text stays there; the
+// message list gets its header.
+static void replayRecord(MessageRecord *record, char *payload, off_t offset, UserList *userList,
+                         MessageList *msgList, GroupList *groupList) {
+    char *groupName = payload;
+    char *email = groupName + strlen(groupName) + 1;
+    char *text = email + strlen(email) + 1;
+    if (text >= payload + record->length || strlen(groupName) >= GROUP_NAME_SIZE) {
+        return;
+    }
+    User *sender = findUser(userList, email);
+    GroupInfo *group = getOrCreateGroup(groupList, groupName, NULL);
+    if (sender == NULL || group == NULL) {
+        printf("Message log: dropping %s #%u from unknown user %s\n", groupName, record->seq, email);
+        return;
+    }
+    if (record->seq <= group->lastSeq) {
+        return; // already replayed
+    }
+    if (record->seq != group->lastSeq + 1) {
+        printf("Message log: %s jumps from #%u to #%u\n", groupName, group->lastSeq, record->seq);
+        group->lastSeq = record->seq - 1;
+    }
+    MessageHeader header;
+    header.seq = record->seq;
+    header.groupId = group->id;
+    header.senderId = sender->id;
+    header.timestamp = record->timestamp;
+    unsigned int position = appendMessage(msgList, &header, text,
+                                          (long long) (offset + sizeof(MessageRecord) + (text - payload)));
+    if (position != MESSAGE_NONE) {
+        appendGroupMessage(group, position);
+    }
+}
+
+// Reads the log back. A torn or corrupt tail ends the replay and is cut off.
+static long replayLog(const char *path, UserList *userList, MessageList *msgList, GroupList *groupList) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    static char buffer[1 << 20];
+    setvbuf(fp, buffer, _IOFBF, sizeof buffer);
+
+    long records = 0;
+    off_t good = 0;
+    MessageRecord record;
+    char payload[MAX_RECORD_PAYLOAD + 1];
+    while (fread(&record, sizeof record, 1, fp) == 1) {
+        if (record.length == 0 || record.length > MAX_RECORD_PAYLOAD ||
+            fread(payload, 1, record.length, fp) != record.length) {
+            break;
+        }
+        if (recordChecksum(&record, payload) != record.checksum || payload[record.length - 1] != '\0') {
+            break;
+        }
+        payload[record.length] = '\0';
+        replayRecord(&record, payload, good, userList, msgList, groupList);
+        records++;
+        good += sizeof record + record.length;
+    }
+    if (!feof(fp) || ftello(fp) != good) {
+        printf("Message log: discarding damaged tail at byte %lld\n", (long long) good);
+        if (truncate(path, good) == -1) {
+            perror("Error truncating message log");
+        }
+    }
+    fclose(fp);
+    return records;
+}
+
+static void *syncThread(void *arg) {
+    MessageLog *log = (MessageLog *) arg;
+    struct timespec interval = { 0, MESSAGE_LOG_SYNC_MS * 1000000L };
+    while (1) {
+        nanosleep(&interval, NULL);
+        pthread_mutex_lock(&log->mutex);
+        if (log->stopSync) {
+            pthread_mutex_unlock(&log->mutex);
+            break; // closeMessageLog() does the last sync
+        }
+        long dirty = log->dirty;
+        log->dirty = 0;
+        pthread_mutex_unlock(&log->mutex);
+        if (dirty > 0 && fdatasync(log->fd) == -1) {
+            perror("Error syncing message log");
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Opens (creating if needed) the message log in dir and replays it into
+ * the empty message list and group list. Call after the users are loaded,
+ * since messages refer to their senders by email. The message list keeps
+ * only headers and reads the texts from the log (msgList->bodyFd).
+ *
+ * return 0 on success, -1 on error.
+ */
+int openMessageLog(MessageLog *log, const char *dir, UserList *userList,
+                   MessageList *msgList, GroupList *groupList) {
+    memset(log, 0, sizeof(MessageLog));
+    log->fd = -1;
+    pthread_mutex_init(&log->mutex, NULL);
+
+    size_t len = strlen(dir) + strlen(MESSAGE_LOG_FILE) + 2;
+    char *path = (char *) malloc(len);
+    if (path == NULL) {
+        return -1;
+    }
+    snprintf(path, len, "%s/%s", dir, MESSAGE_LOG_FILE);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    log->records = replayLog(path, userList, msgList, groupList);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    log->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    msgList->bodyFd = open(path, O_RDONLY);
+    free(path);
+    if (log->fd == -1 || msgList->bodyFd == -1) {
+        perror("Error opening message log");
+        return -1;
+    }
+    log->size = lseek(log->fd, 0, SEEK_END);
+    printf("Message log: %ld messages in %d groups in %.1f ms\n", log->records, groupList->count,
+           (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+
+    if (pthread_create(&log->syncThread, NULL, syncThread, log) != 0) {
+        perror("Error creating message log thread");
+        return -1;
+    }
+    log->syncThreadRunning = 1;
+    return 0;
+}
+
+/**
+ * Appends a message that is being given its sequence number. Called with
+ * the group's lock held, so each group's records stay in sequence order.
+ *
+ * param header The message's seq and timestamp.
+ * return where the text went in the log (MessageHeader.body), or -1 on error.
+ */
+long long logMessage(MessageLog *log, MessageHeader *header, const char *group, const char *email,
+                     const char *text) {
+    char record[sizeof(MessageRecord) + MAX_RECORD_PAYLOAD];
+    MessageRecord *head = (MessageRecord *) record;
+    char *payload = record + sizeof(MessageRecord);
+    const char *strings[3] = { group, email, text };
+    size_t len = 0;
+    size_t textAt = 0;
+
+    for (int i = 0; i < 3; i++) {
+        size_t n = strnlen(strings[i], BUFFER_SIZE - 1);
+        textAt = len;
+        memcpy(payload + len, strings[i], n);
+        payload[len + n] = '\0';
+        len += n + 1;
+    }
+    head->length = len;
+    head->seq = header->seq;
+    head->reserved = 0;
+    head->timestamp = header->timestamp;
+    head->checksum = recordChecksum(head, payload);
+
+    pthread_mutex_lock(&log->mutex);
+    long long offset = log->size + sizeof(MessageRecord) + textAt;
+    ssize_t written = write(log->fd, record, sizeof(MessageRecord) + len);
+    if (written == (ssize_t) (sizeof(MessageRecord) + len)) {
+        log->records++;
+        log->dirty++;
+        log->size += written;
+    } else if (written > 0 && ftruncate(log->fd, log->size) == -1) {
+        // A torn record would end the next replay there, dropping every
+        // record written after it: it is cut off right away.
+        perror("Error truncating message log");
+    }
+    pthread_mutex_unlock(&log->mutex);
+
+    if (written != (ssize_t) (sizeof(MessageRecord) + len)) {
+        if (written >= 0) {
+            printf("Error writing message log: wrote %zd of %zu bytes\n", written, sizeof(MessageRecord) + len);
+        } else {
+            perror("Error writing message log");
+        }
+        return -1;
+    }
+    return offset;
+}
+
+/**
+ * Stops the sync thread, then syncs and closes the log.
+ */
+void closeMessageLog(MessageLog *log) {
+    if (log->syncThreadRunning) {
+        pthread_mutex_lock(&log->mutex);
+        log->stopSync = 1;
+        pthread_mutex_unlock(&log->mutex);
+        pthread_join(log->syncThread, NULL);
+        log->syncThreadRunning = 0;
+    }
+    if (log->fd != -1) {
+        fdatasync(log->fd);
+        close(log->fd);
+    }
+    pthread_mutex_destroy(&log->mutex);
+    log->fd = -1;
+}
@@ -0,0 +1,52 @@
+#ifndef MSG_LOG_H
+#define MSG_LOG_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "protocol.h"
+
+/**
+ * Durable log of every group message, so history and offline users'
+ * backlogs survive a restart.
+ *
+ * Messages are appended in sequence order per group (the append happens
+ * under the group lock) to messages.log in the data directory. The write
+ * goes to the page cache right away; a background thread fdatasync()s the
+ * file every MESSAGE_LOG_SYNC_MS, so a server crash loses nothing and a
+ * power failure at most that window. At startup the log is replayed into
+ * the message list and the group indexes, after the users are loaded.
+ * The texts aren't loaded: the message list reads them from the file when
+ * a client fetches them (msg-list.h).
+ */
+
+#define MESSAGE_LOG_FILE "messages.log"
+#define MESSAGE_LOG_SYNC_MS 200
+
+/**
+ * Struct name: MessageLog
+ * Description: The open message log.
+ *
+ * param size     Bytes in the file: where the next record goes.
+ * param dirty    Records written since the last fdatasync().
+ * param stopSync Set by closeMessageLog() to end the sync thread.
+ */
+typedef struct MESSAGE_LOG {
+    int fd;
+    long records;
+    long long size;
+    long dirty;
+    pthread_t syncThread;
+    int syncThreadRunning;
+    int stopSync;
+    pthread_mutex_t mutex;
+} MessageLog;
+
+// Function prototypes
+int openMessageLog(MessageLog *log, const char *dir, UserList *userList,
+                   MessageList *msgList, GroupList *groupList);
+long long logMessage(MessageLog *log, MessageHeader *header, const char *group, const char *email,
+                     const char *text);
+void closeMessageLog(MessageLog *log);
+
+#endif // MSG_LOG_H
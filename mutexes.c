@@ -1,11 +1,22 @@
+#include <stdint.h>
 #include "mutexes.h"
 
 // Mutexes
 pthread_mutex_t userList_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t messageList_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// A user's devices and group list are guarded by one of these, picked by
+// the user's address: a lock per user without a mutex in every User.
+static pthread_mutex_t user_locks[USER_LOCK_STRIPES] = {
+    [0 ... USER_LOCK_STRIPES - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+pthread_mutex_t *user_lock(User *user) {
+    return &user_locks[((uintptr_t) user / sizeof(User)) % USER_LOCK_STRIPES];
+}
+
 // Destory mutexes
 void destroy_mutexes() {
     pthread_mutex_destroy(&userList_mutex);
     pthread_mutex_destroy(&messageList_mutex);
-}
\ No newline at end of file
+}
@@ -1,10 +1,17 @@
+#ifndef MUTEXES_H
 #define MUTEXES_H
 
 #include <pthread.h>
+#include "protocol.h"
+
+#define USER_LOCK_STRIPES 64
 
 // Function prototypes
 void destroy_mutexes();
+pthread_mutex_t *user_lock(User *user);
 
 // Mutexes for thread synchronization
 extern pthread_mutex_t userList_mutex;
-extern pthread_mutex_t messageList_mutex;
\ No newline at end of file
+extern pthread_mutex_t messageList_mutex;
+
+#endif // MUTEXES_H
@@ -1,268 +1,429 @@
 #include "client-helper.h"
 #include "protocol.h"
 #include <pthread.h>
-#include "msg-list.h"
-#include "user-list.h"
+#include <poll.h>
 #include "auth-client.h"
+#include "tls-transport.h"
+#include "msg-cache.h"
+#include "chat-client.h"
+#include "msg-batch.h"
 
 /**
  * Program name: my-client.c
- * Description:  This client program connects to a server to send messages, receive acknowledgments, 
- *               and exit the connection.
- * Compile:      gcc -o client my-client.c client-helper.c
- * Run:          ./client <hostname> <port>
+ * Description:  This client program connects to a server to send messages, receive acknowledgments,
+ *               and exit the connection. It is a terminal front end for the chat-client library:
+ *               one thread polls both the keyboard and the connection.
+ * Compile:      gcc -o client my-client.c client-helper.c auth-client.c tls-transport.c chat-client.c \
+ *                   seq-tracker.c msg-batch.c msg-cache.c wire-compress.c -lssl -lcrypto -lz -pthread
+ * Run:          ./client [-t] [-A ca.pem] [-c cachedir] <hostname> <port>
+ *               -t connects over TLS; -A names the CA (or self-signed server
+ *               certificate) to trust instead of the system store.
+ *               Received messages are cached in cachedir (default: ~/.chat-cache).
  */
 
+#define RESPONSE_TIMEOUT_MS 10000
+
+// Where the menu is waiting for input
+#define MENU_CHOICE 0
+#define MENU_GROUP 1
+#define MENU_MESSAGE 2
+#define MENU_JOIN 3
+#define MENU_CREATE 4
+#define MENU_LEAVE 5
+#define MENU_ROSTER 6
+#define MENU_DIRECT_TO 7
+#define MENU_DIRECT_TEXT 8
+#define MENU_DIRECT_HISTORY 9
+#define MENU_UPLOAD_GROUP 10
+#define MENU_UPLOAD_PATH 11
+#define MENU_DOWNLOAD_HASH 12
+#define MENU_DOWNLOAD_PATH 13
+
 // Function prototypes
-void send_registration(int server_socket, char *email, char *name, char *password); // Omi
-void receive_ack(int server_socket);
-void send_exit_message(int server_socket);
-void request_all_messages(int server_socket); // Omi
-void send_login(int server_socket, char *email, char *password); // Omi
-void send_messege(int server_socket, char *message, char *group_name);
-
-void send_login(int server_socket, char *email, char *password) {
-    c2s_send_message login_msg;
-    login_msg.type = LOGIN_TYPE;
-    snprintf(login_msg.message, BUFFER_SIZE, "%s %s", email, password);
-    login_msg.length = strlen(login_msg.message) + 1;
-
-    if (send(server_socket, &login_msg, sizeof(c2s_send_message), 0) == -1) {
-        perror("Error sending login to server\n");
+void on_response(ChatClient *client, unsigned int request_id, int ok, const char *error);
+void on_message(ChatClient *client, user_message *msg);
+void on_history(ChatClient *client, user_message *msg);
+void on_synced(ChatClient *client, const char *group);
+void on_close(ChatClient *client);
+void on_event(ChatClient *client, s2c_event *event);
+void on_page(ChatClient *client, s2c_page_header *header, const char *payload);
+void on_direct(ChatClient *client, s2c_direct_message *msg);
+void print_group_message(user_message *msg);
+void send_read_receipt(ChatClient *client, const char *group);
+void print_menu(void);
+void request_history(ChatClient *client);
+int handle_input_line(ChatClient *client, char *line);
+void run_session(ChatClient *client);
+
+// Local copy of every group message received, kept across runs.
+MessageCache cache;
+int cache_open = 0;
+
+// The compression request is answered quietly.
+unsigned int compress_request = 0;
+
+// Seconds the server asked to wait before retrying the last refused request
+int busy_retry = 0;
+
+// Menu state between input lines
+int menu_state = MENU_CHOICE;
+char pending_group[BUFFER_SIZE];
+char pending_email[BUFFER_SIZE];
+char pending_hash[BLOB_HASH_SIZE];
+// Group whose roster is being shown (further pages are asked for it)
+char roster_group[BUFFER_SIZE];
+
+void on_response(ChatClient *client, unsigned int request_id, int ok, const char *error) {
+    if (request_id != 0 && request_id == compress_request) {
+        return;
+    }
+    busy_retry = ok ? 0 : chat_retry_after(error);
+    if (ok) {
+        printf("Acknowledgment from server received\n");
+    } else {
+        printf("Error from server: %s\n", error);
     }
 }
 
-// Added By: Omi
-/**
- * Sends a registration message to the server with email and name
- *
- * param server_socket The socket descriptor for the server connection.
- * param email The user's email address.
- * param name The user's name.
- */
-void send_registration(int server_socket, char *email, char *name, char *password) {
-    c2s_send_message regis_msg;
-    regis_msg.type = REGISTRATION_TYPE;
-    // Prepare for use with strtok() in server
-    snprintf(regis_msg.message, BUFFER_SIZE, "%s %s %s", email, name, password);
-    regis_msg.length = strlen(regis_msg.message) + 1;
-    
-    if (send(server_socket, &regis_msg, sizeof(c2s_send_message), 0) == -1) {
-        perror("Error sending registration to server\n");
+void on_message(ChatClient *client, user_message *msg) {
+    if (msg->seq != 0) {
+        print_group_message(msg);
+    } else if (strcmp(msg->message, "END_OF_MESSAGES") == 0) {
+        printf("End of messages\n");
+    } else {
+        printf("Message from user (%s): %s\n", msg->name, msg->message);
     }
-
 }
 
-/**
- * Sends an exit signal to the server to terminate the client session.
- * The exit signal is encapsulated in a c2s_send_exit struct.
- *
- * param server_socket The socket descriptor for the server connection.
- */
-void send_exit_message(int server_socket) {
-    c2s_send_exit exit_message;
-    exit_message.type = EXIT_TYPE;
-    if (send(server_socket, &exit_message, sizeof(c2s_send_exit), 0) == -1) {
-        perror("Error sending exit message to server\n");
+// Without a cache, history is printed as it arrives.
+void on_history(ChatClient *client, user_message *msg) {
+    if (!cache_open) {
+        print_group_message(msg);
     }
 }
 
-// Added By: Omi
-/**
- * Requests all messages from the server
- *
- * param server_socket The socket descriptor for the server connection.
- */
-void request_all_messages(int server_socket) {
-    c2s_send_message req_msg;
-    req_msg.type = REQUEST_ALL_MESSAGES_TYPE;
-    snprintf(req_msg.message, BUFFER_SIZE, "REQUEST_ALL_MESSAGES");
-    req_msg.length = strlen(req_msg.message) + 1;
-    if (send(server_socket, &req_msg, sizeof(c2s_send_message), 0) == -1) {
-        perror("Error requesting messages from server\n");
+// Prints a synced group from the cache if the user asked for its history.
+void on_synced(ChatClient *client, const char *group) {
+    if (!cache_open) {
+        printf("End of messages\n");
+        send_read_receipt(client, group);
         return;
     }
+    pthread_mutex_lock(&cache.mutex);
+    CacheGroup *cached = getCacheGroup(&cache, group);
+    if (cached != NULL && cached->showSynced) {
+        user_message msg;
+        printf("History of %s:\n", cached->name);
+        for (unsigned int seq = cached->baseSeq; seq - cached->baseSeq < cached->capacity; seq++) {
+            if (getCachedMessage(&cache, cached, seq, &msg) == 0) {
+                print_group_message(&msg);
+            }
+        }
+        printf("End of messages\n");
+        cached->showSynced = 0;
+        send_read_receipt(client, group);
+    }
+    pthread_mutex_unlock(&cache.mutex);
 }
 
-/**
- * Sends a message to the server. The message is encapsulated in a c2s_send_message struct.
- *
- * param server_socket The socket descriptor for the server connection. 
- *                     Used to transmit the message to the server.
- * param message       A character pointer to the message that will be sent to the server.
- */
-void send_messege(int server_socket, char *message, char *group_name) {
-    c2s_send_message client_message;
-    client_message.type = MESSAGE_TYPE;
-    snprintf(client_message.message, BUFFER_SIZE, "%s %s", group_name, message);
-    client_message.length = strlen(client_message.message) + 1;
-
-    if (send(server_socket, &client_message, sizeof(c2s_send_message), 0) == -1) {
-        perror("Error sending message to server\n");
+void on_close(ChatClient *client) {
+    printf("Server disconnected. Exiting...\n");
+}
+
+void on_event(ChatClient *client, s2c_event *event) {
+    if (event->kind == EVENT_TYPING) {
+        printf("(%s is typing in %s)\n", event->name, event->group);
+    } else if (event->kind == EVENT_READ) {
+        printf("(%s read %s up to #%u)\n", event->name, event->group, event->seq);
     }
+    fflush(stdout);
 }
 
 /**
- * Receives an acknowledgment from the server and prints a confirmation message 
- * if the acknowledgment is valid. Otherwise, an error message is printed.
- * The acknowledgment is encapsulated in a s2c_send_ok_ack struct.
- *
- * param server_socket The socket descriptor for the server connection.
+ * Prints a page of the group list or of a roster, and asks for the next
+ * page until the last one arrived.
  */
-void receive_ack(int server_socket) {
-    s2c_send_ok_ack server_ack;
-    if (recv(server_socket, &server_ack, sizeof(s2c_send_ok_ack), 0) == -1) {
-        perror("Error receiving ack from server\n");
-    } else if (server_ack.type == ACK_TYPE) {
-        printf("Acknowledgement received from server\n");
+void on_page(ChatClient *client, s2c_page_header *header, const char *payload) {
+    size_t offset = 0;
+    int result;
+    if (header->type == GROUP_PAGE_TYPE) {
+        char name[GROUP_NAME_SIZE];
+        unsigned int members, last_seq;
+        while ((result = nextPageGroup(header, payload, &offset, name, &members, &last_seq)) == 1) {
+            printf("  %s (%u members, %u messages)\n", name, members, last_seq);
+        }
+        if (header->next != 0) {
+            chat_list_groups(client, header->next);
+        } else if (menu_state == MENU_JOIN) {
+            printf("Enter the group name to join: ");
+        }
     } else {
-        perror("Invalid acknowledgement received from server\n");
+        char name[BUFFER_SIZE];
+        char email[BUFFER_SIZE];
+        int online;
+        while ((result = nextPageMember(header, payload, &offset, name, email, &online)) == 1) {
+            printf("  %s <%s>%s\n", name, email, online ? " (online)" : "");
+        }
+        if (header->next != 0) {
+            chat_roster(client, roster_group, header->next);
+        }
     }
+    if (result == -1) {
+        printf("Invalid page received from server\n");
+    }
+    fflush(stdout);
 }
 
-int receive_login_response(int server_socket) {
-    user_message server_response;
-    if (recv(server_socket, &server_response, sizeof(user_message), 0) == -1) {
-        perror("Error receiving response from server\n");
-        return 0;
-    } else if (server_response.type == ACK_TYPE) {
-        printf("Login successful\n");
-        return 1;
-    } else if (server_response.type == ERROR_TYPE) {
-        printf("Error from server: %s\n", server_response.message);
-        return 0;
+void on_direct(ChatClient *client, s2c_direct_message *msg) {
+    if (msg->seq == 0) {
+        printf("End of direct messages with %s\n", msg->to);
+    } else if (msg->type == DIRECT_HISTORY_TYPE) {
+        printf("[%s -> %s #%u] %s\n", msg->from, msg->to, msg->seq, msg->message);
     } else {
-        printf("Invalid response received from server\n");
-        return 0;
+        printf("[Direct #%u] Message from user (%s <%s>) to %s: %s\n", msg->seq, msg->name, msg->from,
+               msg->to, msg->message);
     }
+    fflush(stdout);
 }
 
-int receive_registration_response(int server_socket) {
-    user_message server_response;
-    if (recv(server_socket, &server_response, sizeof(user_message), 0) == -1) {
-        perror("Error receiving response from server\n");
-        return 0;
-    } else if (server_response.type == ACK_TYPE) {
-        printf("Registration successful\n");
-        return 1;
-    } else if (server_response.type == ERROR_TYPE) {
-        printf("Error from server: %s\n", server_response.message);
-        return 0;
+// Attachments are posted as "blob:<hash> <size> <name>" and shown as such.
+void print_group_message(user_message *msg) {
+    char hash[BLOB_HASH_SIZE];
+    unsigned long long size;
+    int name_at = 0;
+    if (strncmp(msg->message, BLOB_REF_PREFIX, strlen(BLOB_REF_PREFIX)) == 0 &&
+        sscanf(msg->message + strlen(BLOB_REF_PREFIX), "%64s %llu %n", hash, &size, &name_at) == 2 && name_at > 0) {
+        printf("[%s #%u] File from user (%s): %s (%llu bytes, %s)\n", msg->group, msg->seq, msg->name,
+               msg->message + strlen(BLOB_REF_PREFIX) + name_at, size, hash);
     } else {
-        printf("Invalid response received from server\n");
-        return 0;
+        printf("[%s #%u] Message from user (%s): %s\n", msg->group, msg->seq, msg->name, msg->message);
     }
 }
 
-void *handle_receive(void *arg) {
-    int server_socket = *((int *) arg);
-    while (1) {
-        // Receive messages from the server
-        user_message server_message;
-        int bytes_received = recv(server_socket, &server_message, sizeof(user_message), 0);
-        if (bytes_received == -1) {
-            perror("Error receiving message from server\n");
-            break;
-        } else if (bytes_received == 0) {
-            printf("Server disconnected. Exiting...\n");
-            break;
-        }
-        switch (server_message.type)
-        {
-        case MESSAGE_TYPE:
-            printf("Message from server: %s\n", server_message.message);
-            break;
-        case PRINT_MESSAGE_TYPE:
-            if (strcmp(server_message.message, "END_OF_MESSAGES") == 0) {
-                printf("End of messages\n");
-            } else {
-                printf("Message from user (%s): %s\n", server_message.name, server_message.message);
-            }
-            break;
-        case ERROR_TYPE:
-            printf("Error from server: %s\n", server_message.message);
-            break;
-        case ACK_TYPE:
-            printf("Acknowledgment from server received\n");
-            break;
-        default:
-            break;
-        }
-        printf("Receive loop continues...\n");
+// The history of a group was shown: tell its members how far we read.
+void send_read_receipt(ChatClient *client, const char *group) {
+    SeqTracker *tracker = getSeqTracker(&client->trackers, group);
+    if (tracker != NULL && tracker->delivered > 0) {
+        chat_send_read(client, group, tracker->delivered);
     }
 }
 
-// Added By: Aedan
-void join_group(int server_socket, char *group_name) {
-    c2s_send_message join_msg;
-    join_msg.type = JOIN_GROUP_TYPE;
-    snprintf(join_msg.message, BUFFER_SIZE, "%s", group_name);
-    join_msg.length = strlen(join_msg.message) + 1;
+void print_menu(void) {
+    printf("\nMenu:\n");
+    printf("1. Send a message\n");
+    printf("2. Show message history\n");
+    printf("3. Join a group\n");
+    printf("4. Create a group\n");
+    printf("5. Leave a group\n");
+    printf("6. Show group members\n");
+    printf("7. Send a direct message\n");
+    printf("8. Show direct messages with a user\n");
+    printf("9. Send a file\n");
+    printf("10. Download a file\n");
+    printf("11. Exit\n");
+    printf("Enter your choice: ");
+    fflush(stdout);
+}
 
-    if (send(server_socket, &join_msg, sizeof(c2s_send_message), 0) == -1) {
-        perror("Error sending join group message to server\n");
+/**
+ * Shows the message history of every group: each group is brought up to
+ * date with an incremental sync, and printed from the cache when the sync
+ * completes. Only messages the cache doesn't have are downloaded.
+ */
+void request_history(ChatClient *client) {
+    for (SeqTracker *tracker = client->trackers.first; tracker != NULL; tracker = tracker->next) {
+        if (cache_open) {
+            pthread_mutex_lock(&cache.mutex);
+            CacheGroup *cached = getCacheGroup(&cache, tracker->group);
+            if (cached != NULL) {
+                cached->showSynced = 1;
+            }
+            pthread_mutex_unlock(&cache.mutex);
+        }
+        chat_sync(client, tracker->group);
     }
 }
 
-void *handle_send(void *arg) {
-    int server_socket = *((int *) arg);
-    int choice;
-
-    while(1) {
-        // Menu options
-        printf("\nMenu:\n");
-        printf("1. Send a message\n");
-        printf("2. Request all messages\n");
-        printf("3. Join a group\n");
-        printf("4. Exit\n");
-        printf("Enter your choice: ");
-        scanf("%d", &choice);
-        getchar();
+/**
+ * Advances the menu with one line typed by the user.
+ *
+ * return 0 to continue, 1 when the user chose to exit.
+ */
+int handle_input_line(ChatClient *client, char *line) {
+    switch (menu_state) {
+    case MENU_CHOICE: {
+        int choice = atoi(line);
+        if (choice == 1) {
+            printf("Enter the group name: ");
+            menu_state = MENU_GROUP;
+        } else if (choice == 2) {
+            // Show history (cached, topped up with an incremental sync)
+            request_history(client);
+            print_menu();
+        } else if (choice == 3) {
+            // The prompt follows the last page of the list (on_page()).
+            printf("Groups:\n");
+            chat_list_groups(client, 0);
+            menu_state = MENU_JOIN;
+        } else if (choice == 4) {
+            printf("Enter the new group's name: ");
+            menu_state = MENU_CREATE;
+        } else if (choice == 5) {
+            printf("Enter the group name to leave: ");
+            menu_state = MENU_LEAVE;
+        } else if (choice == 6) {
+            printf("Enter the group name: ");
+            menu_state = MENU_ROSTER;
+        } else if (choice == 7) {
+            printf("Enter the user's email: ");
+            menu_state = MENU_DIRECT_TO;
+        } else if (choice == 8) {
+            printf("Enter the user's email: ");
+            menu_state = MENU_DIRECT_HISTORY;
+        } else if (choice == 9) {
+            printf("Enter the group name: ");
+            menu_state = MENU_UPLOAD_GROUP;
+        } else if (choice == 10) {
+            printf("Enter the file's hash: ");
+            menu_state = MENU_DOWNLOAD_HASH;
+        } else if (choice == 11) {
+            return 1;
+        } else {
+            printf("Invalid choice. Try again.\n");
+            print_menu();
+        }
+        break;
+    }
+    case MENU_GROUP:
+        snprintf(pending_group, sizeof pending_group, "%s", line);
+        chat_send_typing(client, pending_group, 1);
+        printf("Enter your message: ");
+        menu_state = MENU_MESSAGE;
+        break;
+    case MENU_MESSAGE:
+        chat_send_message(client, pending_group, line);
+        menu_state = MENU_CHOICE;
+        print_menu();
+        break;
+    case MENU_JOIN:
+        chat_join_group(client, line);
+        menu_state = MENU_CHOICE;
+        print_menu();
+        break;
+    case MENU_CREATE:
+        chat_create_group(client, line);
+        menu_state = MENU_CHOICE;
+        print_menu();
+        break;
+    case MENU_LEAVE:
+        chat_leave_group(client, line);
+        menu_state = MENU_CHOICE;
+        print_menu();
+        break;
+    case MENU_DIRECT_TO:
+        snprintf(pending_email, sizeof pending_email, "%s", line);
+        printf("Enter your message: ");
+        menu_state = MENU_DIRECT_TEXT;
+        break;
+    case MENU_DIRECT_TEXT:
+        chat_send_direct(client, pending_email, line);
+        menu_state = MENU_CHOICE;
+        print_menu();
+        break;
+    case MENU_DIRECT_HISTORY:
+        chat_direct_history(client, line, 0);
+        menu_state = MENU_CHOICE;
+        print_menu();
+        break;
+    case MENU_UPLOAD_GROUP:
+        snprintf(pending_group, sizeof pending_group, "%s", line);
+        printf("Enter the path of the file: ");
+        menu_state = MENU_UPLOAD_PATH;
+        break;
+    case MENU_UPLOAD_PATH:
+        // The file goes out in the background; the ACK says it was posted.
+        if (client->upload != NULL) {
+            printf("A file is still being sent.\n");
+        } else if (chat_upload(client, pending_group, line) == 0) {
+            printf("Can't send %s (it must be a readable file of 1 byte to %d MB).\n", line, BLOB_MAX_SIZE >> 20);
+        }
+        menu_state = MENU_CHOICE;
+        print_menu();
+        break;
+    case MENU_DOWNLOAD_HASH:
+        snprintf(pending_hash, sizeof pending_hash, "%s", line);
+        printf("Save as: ");
+        menu_state = MENU_DOWNLOAD_PATH;
+        break;
+    case MENU_DOWNLOAD_PATH:
+        if (client->download != NULL) {
+            printf("A file is still being downloaded.\n");
+        } else if (chat_download(client, pending_hash, line) == 0) {
+            printf("Can't download to %s.\n", line);
+        }
+        menu_state = MENU_CHOICE;
+        print_menu();
+        break;
+    case MENU_ROSTER:
+        snprintf(roster_group, sizeof roster_group, "%s", line);
+        printf("Members of %s:\n", roster_group);
+        chat_roster(client, roster_group, 0);
+        menu_state = MENU_CHOICE;
+        print_menu();
+        break;
+    }
+    fflush(stdout);
+    return 0;
+}
 
-        switch (choice) {
-            case 1: {
-                // Send a message
-                char message[BUFFER_SIZE];
-                char group_name[BUFFER_SIZE];
-                printf("Enter the group name: ");
-                fgets(group_name, BUFFER_SIZE, stdin);
-                group_name[strcspn(group_name, "\n")] = '\0'; // Remove newline character
-
-                printf("Enter your message: ");
-                fgets(message, BUFFER_SIZE, stdin);
-                message[strcspn(message, "\n")] = '\0'; // Remove newline character
-
-                send_messege(server_socket, message, group_name);
-                break;
-            }
-            case 2:
-                // Request all messages
-                request_all_messages(server_socket);
-                break;
-            case 3:
-                // Join a group
-                printf("Select group to join\n");
-                printf("1. CMPS340\n");
-                printf("2. CMPS352\n");
-                int group_choice;
-                scanf("%d", &group_choice);
-                getchar();
-                if (group_choice == 1) {
-                    join_group(server_socket, "CMPS340");
-                } else if (group_choice == 2) {
-                    join_group(server_socket, "CMPS352");
-                } else {
-                    printf("Invalid group choice. Try again.\n");
-                }
-                break;
-            case 4:
-                // Exit the client
-                send_exit_message(server_socket);
-                printf("Exiting...\n");
-                close(server_socket);
-                return 0;
-            default:
-                printf("Invalid choice. Try again.\n");
+/**
+ * The logged-in session: one poll() over the keyboard and the connection.
+ * Incoming messages are printed as they arrive, even while the user is typing.
+ */
+void run_session(ChatClient *client) {
+    char input[BUFFER_SIZE * 2];
+    size_t input_len = 0;
+    int exiting = 0;
+
+    print_menu();
+    while (!client->closed) {
+        struct pollfd fds[2];
+        fds[0].fd = exiting ? -1 : STDIN_FILENO;
+        fds[0].events = POLLIN;
+        fds[1].fd = client->fd;
+        fds[1].events = chat_poll_events(client);
+        if (exiting && !(fds[1].events & POLLOUT)) {
+            break; // exit frame written
+        }
+        if (poll(fds, 2, -1) == -1) {
+            continue;
+        }
+        if (fds[1].revents != 0 && chat_process(client, fds[1].revents) == -1) {
+            break;
+        }
+        if (fds[0].revents == 0) {
+            continue;
+        }
+        ssize_t n = read(STDIN_FILENO, input + input_len, sizeof input - 1 - input_len);
+        if (n <= 0) {
+            exiting = 1; // end of input: leave like option 4
+        } else {
+            input_len += n;
+        }
+        // Handle each complete line
+        char *newline;
+        while (!exiting && (newline = memchr(input, '\n', input_len)) != NULL) {
+            *newline = '\0';
+            exiting = handle_input_line(client, input);
+            input_len -= newline + 1 - input;
+            memmove(input, newline + 1, input_len);
+        }
+        if (input_len == sizeof input - 1) {
+            input_len = 0; // overlong line
+        }
+        if (exiting) {
+            chat_exit(client);
+            printf("Exiting...\n");
         }
     }
 }
@@ -272,22 +433,80 @@ void *handle_send(void *arg) {
  * Main function to start the client and send messages to the server.
  *
  * param argc Number of command-line arguments.
- * param argv Array of command-line arguments. The first argument should be the hostname,
- *            and the second argument should be the port number.
+ * param argv Array of command-line arguments. Options: -t use TLS, -A <ca.pem> trusted CA,
+ *             -c <dir> message cache directory, -D <name> this device (default: the host name).
+ *            The remaining arguments should be the hostname and the port number.
  * return 0 on successful execution.
  */
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        printf("Usage: %s <hostname> <port>\n", argv[0]);
+    int use_tls = 0;
+    char *ca_file = NULL;
+    char *cache_dir = NULL;
+    char default_cache_dir[BUFFER_SIZE];
+    char *device = NULL;
+    char host_name[BUFFER_SIZE];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "tA:c:D:")) != -1) {
+        switch (opt) {
+        case 't':
+            use_tls = 1;
+            break;
+        case 'A':
+            ca_file = optarg;
+            use_tls = 1;
+            break;
+        case 'c':
+            cache_dir = optarg;
+            break;
+        case 'D':
+            device = optarg;
+            break;
+        default:
+            printf("Usage: %s [-t] [-A ca.pem] [-c cachedir] [-D device] <hostname> <port>\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind != 2) {
+        printf("Usage: %s [-t] [-A ca.pem] [-c cachedir] [-D device] <hostname> <port>\n", argv[0]);
         exit(1);
     }
+    if (cache_dir == NULL) {
+        const char *home = getenv("HOME");
+        snprintf(default_cache_dir, sizeof default_cache_dir, "%s/.chat-cache", home ? home : ".");
+        cache_dir = default_cache_dir;
+    }
+    // Each machine is a device of its own: logging in here leaves the
+    // user's other machines connected.
+    if (device == NULL && gethostname(host_name, sizeof host_name) == 0) {
+        host_name[sizeof host_name - 1] = '\0';
+        host_name[strcspn(host_name, ". ")] = '\0';
+        device = host_name;
+    }
+    char *hostname = argv[optind];
+    char *port = argv[optind + 1];
+
+    // The menu loop reads stdin directly; nothing may be left in a stdio buffer.
+    setvbuf(stdin, NULL, _IONBF, 0);
 
-    // Initialize the server socket
-    int server_socket = get_server_connection(argv[1], argv[2]);
-    if (server_socket == -1) {
+    if (use_tls && tls_client_init(ca_file) == -1) {
+        printf("Error setting up TLS\n");
+        exit(1);
+    }
+
+    ChatCallbacks callbacks = { on_response, on_message, on_history, on_synced, on_close, on_event, on_page, on_direct };
+    ChatClient *client = chat_connect(hostname, port, use_tls, &callbacks, NULL);
+    if (client == NULL) {
         printf("Error connecting to server\n");
         exit(1);
     }
+    if (use_tls) {
+        tls_print_connection(client->fd);
+    }
+    chat_set_device(client, device);
+    // Before logging in, so the backlog comes compressed. Answered with an
+    // ACK, or an error from a server that doesn't compress.
+    compress_request = chat_enable_compression(client);
 
     // Registration by email and name
     char email[BUFFER_SIZE];
@@ -295,16 +514,18 @@ int main(int argc, char *argv[]) {
     char password[BUFFER_SIZE];
     int regis_success = 0; // Initialize regis_success
 
-
     while (!regis_success) {
         printf("1. Login\n");
         printf("2. Register\n");
         printf("3. Exit\n");
         printf("Enter your choice: ");
         int choice;
-        scanf("%d", &choice);
+        if (scanf("%d", &choice) != 1) {
+            choice = 3;
+        }
         getchar();
 
+        unsigned int request_id = 0;
         switch (choice)
         {
         case 1:
@@ -316,11 +537,7 @@ int main(int argc, char *argv[]) {
             printf("Enter your password: ");
             getpasswd(password, BUFFER_SIZE);
 
-            // Send login data to the server
-            send_login(server_socket, email, password);
-
-            // Wait for acknowledgment or error from server
-            regis_success = receive_login_response(server_socket);
+            request_id = chat_login(client, email, password);
             break;
         case 2:
             // Ask for registration details
@@ -335,38 +552,60 @@ int main(int argc, char *argv[]) {
             printf("Enter your password: ");
             getpasswd(password, BUFFER_SIZE);
 
-            // Send registration data to the server
-            send_registration(server_socket, email, name, password);
-
-            // Wait for acknowledgment or error from server
-            regis_success = receive_registration_response(server_socket);
+            request_id = chat_register(client, email, name, password);
             break;
         case 3:
             // Exit the client
-            send_exit_message(server_socket);
+            chat_exit(client);
+            chat_process(client, 0);
             printf("Exiting...\n");
-            close(server_socket);
+            chat_close(client);
             return 0;
         default:
             break;
         }
-    }
-
-    pthread_t send_thread;
-    pthread_t receive_thread;
 
-    if (pthread_create(&send_thread, NULL, handle_send, &server_socket) != 0) {
-        perror("Error creating send thread\n");
-        exit(1);
+        // Wait for acknowledgment or error from server (errors are printed by on_response)
+        if (request_id != 0) {
+            // The cache is per user. Open it before the answer: the backlog
+            // frames right behind the ACK may be read together with it.
+            cache_open = openMessageCache(&cache, cache_dir, email) == 0;
+            chat_set_cache(client, cache_open ? &cache : NULL);
+            int result = chat_wait(client, request_id, RESPONSE_TIMEOUT_MS);
+            while (result == 0 && busy_retry > 0) {
+                // Refused while the server is overloaded: come back when it says.
+                printf("Retrying in %d seconds...\n", busy_retry);
+                fflush(stdout);
+                sleep(busy_retry);
+                request_id = (choice == 1) ? chat_login(client, email, password)
+                                           : chat_register(client, email, name, password);
+                result = chat_wait(client, request_id, RESPONSE_TIMEOUT_MS);
+            }
+            if (result == 1) {
+                printf("%s successful\n", (choice == 1) ? "Login" : "Registration");
+                regis_success = 1;
+            } else if (cache_open) {
+                chat_set_cache(client, NULL);
+                closeMessageCache(&cache);
+                cache_open = 0;
+            }
+            if (result == -1) {
+                printf("No response from server\n");
+                chat_close(client);
+                exit(1);
+            }
+        }
     }
 
-    if (pthread_create(&receive_thread, NULL, handle_receive, &server_socket) != 0) {
-        perror("Error creating receive thread\n");
-        exit(1);
+    if (!cache_open) {
+        printf("Running without a message cache\n");
     }
 
-    pthread_join(send_thread, NULL);
-    pthread_join(receive_thread, NULL);
+    run_session(client);
+
+    chat_close(client);
+    if (cache_open) {
+        closeMessageCache(&cache);
+    }
     return 0;
 }
-
@@ -1,58 +1,2077 @@
 #include "server-helper.h"
 #include "msg-list.h"
 #include "user-list.h"
+#include "group-list.h"
+#include "direct-list.h"
+#include "direct-log.h"
+#include "mutexes.h"
+#include "user-store.h"
+#include "msg-log.h"
+#include "msg-batch.h"
+#include "wire-compress.h"
+#include "fanout.h"
+#include "cpu-affinity.h"
+#include "uring-io.h"
+#include "traffic-capture.h"
+#include "hot-restart.h"
+#include "blob-store.h"
+#include "admission.h"
+#include "dedup-window.h"
+#include "msg-filter.h"
+#include "admin-socket.h"
 #include "authentication.h"
+#include "tls-transport.h"
 
-#define BACKLOG 10 // how many pending connections queue will hold
+#define BACKLOG 1024 // pending connections the kernel holds (capped by somaxconn); a short queue drops SYNs in a storm
+#define MAX_CATCHUP_MESSAGES 10000 // per group; an older backlog is skipped on login
+#define DIRECT_HISTORY_CHUNK 64 // messages copied per conversation lock while sending history
+#define HISTORY_CHUNK 256 // group index positions copied per group lock while sending history
 
 /**
  * Program name: my-server.c
  * Description:  This server program listens for client connections, processes incoming messages, 
  *               and maintains a list of messages sent by clients. It includes functionality to 
  *               send acknowledgments and handle client disconnections.
- * Compile:      gcc -o server my-server.c server-helper.c list.c
- * Run:          ./server <hostname> <port>
+ * Compile:      gcc -o server my-server.c server-helper.c user-list.c msg-list.c group-list.c \
+ *                   direct-list.c direct-log.c blob-store.c mutexes.c dedup-window.c user-store.c msg-log.c msg-batch.c wire-compress.c \
+ *                   fanout.c cpu-affinity.c \
+ *                   uring-io.c traffic-capture.c hot-restart.c admission.c msg-filter.c admin-socket.c \
+ *                   authentication.c tls-transport.c \
+ *                   -lcrypt -lssl -lcrypto -lz -pthread
+ * Run:          ./server [-C cert.pem -K key.pem] [-d datadir] [-w workers] [-a cpus] [-U] [-R capture]
+ *                        [-H handoff.sock] [-m max connections] [-F rules] [-A admin.sock]
+ *                        <hostname> <port>
+ *               ./server [-d datadir] -P capture [-x speed]
+ *               With -C/-K every client connection is wrapped in TLS.
+ *               Users, memberships, messages, direct conversations and attachments are kept in
+ *               datadir (default: chat-data).
+ *               Group messages are delivered by a pool of fan-out workers (default: one per CPU).
+ *               -a pins the workers, and each connection's thread, to the listed CPUs.
+ *               -U accepts connections and sends group messages with io_uring (Linux).
+ *               -R records every inbound frame; -P replays such a recording offline and reports
+ *               per-request latency.
+ *               SIGTERM/SIGINT drain the connections and save state before exiting.
+ *               -H hands the listener and open connections to a new server started with the same -H.
+ *               -m limits the connections served at once; under overload new connections and
+ *               logins are refused with a time to retry (admission.h).
+ *               -F refuses messages that match the blocklist in the rules file (msg-filter.h);
+ *               SIGHUP reloads it.
+ *               -A answers admin commands (stats, groups, queues, memory, top talkers, log level,
+ *               limits) on a Unix socket (admin-socket.h).
  */
 
 // Function prototypes
-void send_ack(int client_socket);
-void send_error(int client_socket, const char *error_message);
+void send_ack(int client_socket, unsigned int request_id);
+void send_error(int client_socket, unsigned int request_id, const char *error_message);
+void reply_ack(Session *session, unsigned int request_id);
+void reply_error(Session *session, unsigned int request_id, const char *error_message);
+int handle_request(Session *session, c2s_send_message *request);
+int handle_request_batch(Session *session, op_batch_header *header, const char *payload);
 void *start_subserver(void *session_data);
 void freeMessages(MessageList *msgList);
 void freeSession(Session *session);
+Group *find_membership(User *user, const char *group_name, GroupInfo **group);
+void fill_user_message(user_message *out, int type, MessageHeader *header, const char *name,
+                       const char *group, const char *text);
+long long now_ms(void);
+int send_group_backlog(Session *session, FrameWriter *writer, DeviceCursor *cursor, GroupInfo *group,
+                       int resume_sent, int locked, MessageBatch *batch);
+int send_backlog(Session *session);
+int join_fanout(Session *session, User *user, DeviceCursor *cursor, GroupInfo *group,
+                FrameWriter *writer, MessageBatch *batch);
+void bring_online(Session *session);
+void go_online(Session *session);
+void take_offline(Session *session);
+int send_history(Session *session, GroupInfo *group, const char *group_name, unsigned int after_seq);
+void fill_direct_message(s2c_direct_message *out, int type, Message *msg, User *to);
+int send_direct_history(int client_socket, Conversation *conversation, User *user, User *peer,
+                        unsigned int after_seq);
+int replay_capture(const char *path, double speed, Session *base);
+int handle_blob_chunk(Session *session, blob_chunk_header *header, const char *data);
+int send_download_chunk(Session *session);
+void end_transfers(Session *session);
 
 /**
  * Sends an acknowledgment to the client. The acknowledgment is encapsulated in a s2c_send_ok_ack struct.
  *
  * param client_socket The socket descriptor for the client connection. 
  *                     Used to send acknowledgment data back to the client.
+ * param request_id    The requestId of the client request being acknowledged.
  */
-void send_ack(int client_socket) {
+void send_ack(int client_socket, unsigned int request_id) {
     s2c_send_ok_ack server_ack;
     server_ack.type = ACK_TYPE;
-    if (send(client_socket, &server_ack, sizeof(s2c_send_ok_ack), 0) == -1) {
+    server_ack.requestId = request_id;
+    if (net_send(client_socket, &server_ack, sizeof(s2c_send_ok_ack)) == -1) {
         perror("Error sending acknowledgement to client\n");
     }
 }
 
 // OMI
-void send_error(int client_socket, const char *error_message) {
+void send_error(int client_socket, unsigned int request_id, const char *error_message) {
     user_message server_error;
+    memset(&server_error, 0, sizeof(server_error)); // don't leak stack memory to the client
     server_error.type = ERROR_TYPE;
+    server_error.requestId = request_id;
     server_error.name[0] = '\0'; // No user for error messages
     strncpy(server_error.message, error_message, BUFFER_SIZE - 1);
     server_error.message[BUFFER_SIZE - 1] = '\0';
 
-    if (send(client_socket, &server_error, sizeof(user_message), 0) == -1) {
+    if (net_send(client_socket, &server_error, sizeof(user_message)) == -1) {
         perror("Error sending error message to client\n");
     }
 }
 
+// Sends a GROUP_PAGE_TYPE or ROSTER_PAGE_TYPE answer.
+static int send_page(int client_socket, Page *page) {
+    return (net_send(client_socket, page, pageFrameSize(page)) == -1) ? -1 : 0;
+}
+
+// Sends the answers collected so far for a request batch.
+static void send_responses(Session *session) {
+    if (net_send(session->socketFd, session->response, opBatchFrameSize(session->response)) == -1) {
+        perror("Error sending responses to client\n");
+    }
+    initOpBatch(session->response, BATCH_RESPONSE_TYPE);
+}
+
+static void reply(Session *session, unsigned int request_id, int ok, const char *error_message) {
+    if (addBatchResponse(session->response, request_id, ok, error_message) == -1) {
+        send_responses(session); // full: this part goes out early
+        addBatchResponse(session->response, request_id, ok, error_message);
+    }
+}
+
+/**
+ * Answers a request with an ACK: right away, or in the combined response
+ * when the request is part of a batch.
+ */
+void reply_ack(Session *session, unsigned int request_id) {
+    if (session->response != NULL) {
+        reply(session, request_id, 1, NULL);
+    } else {
+        send_ack(session->socketFd, request_id);
+    }
+}
+
+/**
+ * Answers a request with an error, like reply_ack().
+ */
+void reply_error(Session *session, unsigned int request_id, const char *error_message) {
+    if (session->response != NULL) {
+        reply(session, request_id, 0, error_message);
+    } else {
+        send_error(session->socketFd, request_id, error_message);
+    }
+}
+
+// Refuses a login or registration while the server is overloaded.
+static void reply_busy(Session *session, unsigned int request_id, int retry_after) {
+    char error[64];
+    snprintf(error, sizeof error, BUSY_ERROR, retry_after);
+    reply_error(session, request_id, error);
+}
+
+// Refuses a connection the accept loop can't take on. A TLS client can't
+// read a frame before its handshake; it only sees the connection close.
+static void shed_connection(int client_socket, int retry_after) {
+    if (!tls_server_enabled()) {
+        char error[64];
+        snprintf(error, sizeof error, BUSY_ERROR, retry_after);
+        compress_set(client_socket, 0);
+        send_error(client_socket, 0, error);
+    }
+    net_close(client_socket);
+}
+
 void freeSession(Session *session) {
     // Free session data and user
     free(session);
 }
 
+// The user's membership node for a group, NULL if none. Call with the
+// user's lock held.
+static Group *membership_of(User *user, const char *group_name) {
+    Group *current_group = user->groups;
+    while (current_group != NULL && strcmp(current_group->name, group_name) != 0) {
+        current_group = current_group->next;
+    }
+    return current_group;
+}
+
+/**
+ * Finds the user's membership node for a group. The user's other devices
+ * may join and leave groups meanwhile; nodes are never freed, so the one
+ * returned stays valid.
+ *
+ * param group Set to the group the node is a member of, NULL if none (may be NULL).
+ * return the node (which holds the user's acknowledged cursor), or NULL if
+ *        the user is not in the group.
+ */
+Group *find_membership(User *user, const char *group_name, GroupInfo **group) {
+    pthread_mutex_lock(user_lock(user));
+    Group *current_group = membership_of(user, group_name);
+    if (group != NULL) {
+        *group = (current_group != NULL) ? current_group->info : NULL;
+    }
+    pthread_mutex_unlock(user_lock(user));
+    return current_group;
+}
+
+/**
+ * Builds the frame that carries a stored message to a client.
+ *
+ * param out    Frame to fill in.
+ * param type   PRINT_MESSAGE_TYPE for live delivery and retransmission,
+ *              HISTORY_MESSAGE_TYPE for a history replay.
+ * param header The stored message.
+ * param name, group, text The sender's name, the group's and the message's
+ *              text (readMessageBody()), which the header only refers to.
+ */
+void fill_user_message(user_message *out, int type, MessageHeader *header, const char *name,
+                       const char *group, const char *text) {
+    memset(out, 0, sizeof(user_message));
+    out->type = type;
+    snprintf(out->name, BUFFER_SIZE, "%s", name);
+    snprintf(out->message, BUFFER_SIZE, "%s", text);
+    snprintf(out->group, GROUP_NAME_SIZE, "%s", group);
+    out->seq = header->seq;
+    out->timestamp = header->timestamp;
+}
+
+long long now_ms(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/**
+ * Queues one device's backlog of a group in batch frames. As in
+ * send_history(), the group lock is only taken to read the group's head and
+ * to copy a chunk of the index (HISTORY_CHUNK positions); the texts are read
+ * and sent without it.
+ *
+ * param session     The requesting session (for the message list).
+ * param writer      Where the frames go; the caller flushes it.
+ * param cursor      The device's position in the group; sentSeq is advanced.
+ * param group       The group's messages, or NULL if nothing was ever posted.
+ * param resume_sent 0: start after the acknowledged cursor, and always send at
+ *                   least an empty batch so the client learns the cursor.
+ *                   1: start after what was already sent, and only if non-empty;
+ *                   this continues a live stream, so nothing is skipped.
+ * param locked      The caller holds group->lock (the hand-over to the fan-out).
+ * param batch       Scratch space for building frames.
+ * return 0 on success, -1 if sending failed.
+ */
+int send_group_backlog(Session *session, FrameWriter *writer, DeviceCursor *cursor, GroupInfo *group,
+                       int resume_sent, int locked, MessageBatch *batch) {
+    const char *name = cursor->membership->name;
+    unsigned int from = resume_sent ? cursor->sentSeq : cursor->ackedSeq;
+    unsigned int to = 0;
+    if (group != NULL) {
+        if (!locked) {
+            pthread_mutex_lock(&group->lock);
+        }
+        to = group->lastSeq;
+        if (!locked) {
+            pthread_mutex_unlock(&group->lock);
+        }
+    }
+    if (from > to) {
+        from = to;
+    }
+    if (resume_sent && from == to) {
+        return 0;
+    }
+    if (!resume_sent && to - from > MAX_CATCHUP_MESSAGES) {
+        printf("Skipping %u old messages of %s\n", to - from - MAX_CATCHUP_MESSAGES, name);
+        from = to - MAX_CATCHUP_MESSAGES;
+    }
+
+    BodyReader *reader = NULL;
+    if (from < to && (reader = (BodyReader *) malloc(sizeof(BodyReader))) == NULL) {
+        perror("Error allocating memory for message reader");
+        return -1;
+    }
+    if (reader != NULL) {
+        reader->length = 0;
+    }
+    unsigned int positions[HISTORY_CHUNK];
+    unsigned int seq = from;
+    int result = 0;
+    initBatch(batch, BATCH_MESSAGE_TYPE, name, from);
+    while (seq < to && result == 0) {
+        unsigned int count = 0;
+        if (!locked) {
+            pthread_mutex_lock(&group->lock);
+        }
+        while (count < HISTORY_CHUNK && seq + count < to) {
+            positions[count] = getGroupMessage(group, seq + count + 1);
+            count++;
+        }
+        if (!locked) {
+            pthread_mutex_unlock(&group->lock);
+        }
+        for (unsigned int i = 0; i < count && result == 0; i++) {
+            seq++;
+            MessageHeader *header = getMessageHeader(session->messageList, positions[i]);
+            if (header == NULL) {
+                continue; // lost with a damaged log
+            }
+            const char *sender = getSenderName(session->userList, header);
+            const char *text = readMessageBody(session->messageList, header, reader);
+            if (addBatchMessage(batch, sender, text, seq, header->timestamp) == -1) {
+                result = writeFrame(writer, batch, batchFrameSize(batch));
+                initBatch(batch, BATCH_MESSAGE_TYPE, name, seq - 1);
+                addBatchMessage(batch, sender, text, seq, header->timestamp);
+            }
+        }
+    }
+    free(reader);
+    if (result == -1 || writeFrame(writer, batch, batchFrameSize(batch)) == -1) {
+        return -1;
+    }
+    cursor->sentSeq = to;
+    return 0;
+}
+
+// send_backlog(), or with resume_sent set, what was posted after each
+// cursor's sentSeq (see send_group_backlog()).
+static int catch_up(Session *session, int resume_sent) {
+    User *user = session->user;
+    MessageBatch *batch = (MessageBatch *) malloc(sizeof(MessageBatch));
+    FrameWriter *writer = createFrameWriter(session->socketFd);
+    pthread_mutex_lock(user_lock(user));
+    int count = 0;
+    for (Group *member = user->groups; member != NULL; member = member->next) {
+        count++;
+    }
+    DeviceCursor **cursors = (DeviceCursor **) malloc((count + 1) * sizeof(DeviceCursor *));
+    GroupInfo **groups = (GroupInfo **) malloc((count + 1) * sizeof(GroupInfo *));
+    count = 0;
+    for (Group *member = user->groups; member != NULL && cursors != NULL && groups != NULL; member = member->next) {
+        if ((cursors[count] = getDeviceCursor(session->device, member)) != NULL) {
+            groups[count++] = member->info;
+        }
+    }
+    pthread_mutex_unlock(user_lock(user));
+    if (batch == NULL || writer == NULL || cursors == NULL || groups == NULL) {
+        perror("Error allocating memory for batch");
+        free(batch);
+        free(writer);
+        free(cursors);
+        free(groups);
+        return -1;
+    }
+
+    int result = 0;
+    for (int i = 0; i < count && result == 0; i++) {
+        GroupInfo *group = groups[i];
+        if (group == NULL) {
+            result = send_group_backlog(session, writer, cursors[i], NULL, resume_sent, 0, batch);
+            continue;
+        }
+        pthread_mutex_lock(&group->lock);
+        int member = cursors[i]->membership->info == group; // not left meanwhile
+        pthread_mutex_unlock(&group->lock);
+        if (member) {
+            result = send_group_backlog(session, writer, cursors[i], group, resume_sent, 0, batch);
+        }
+    }
+    if (result == 0) {
+        result = flushFrames(writer);
+    }
+    free(cursors);
+    free(groups);
+    free(writer);
+    free(batch);
+    return result;
+}
+
+/**
+ * Streams what the session's device missed while it was offline: every
+ * group's messages after its cursor. Work is bounded by the backlog (at
+ * most MAX_CATCHUP_MESSAGES per group), not by the size of the history.
+ * Batches of all groups are packed into as few sends (and compressed
+ * frames) as fit. The cursors are looked up under the user's lock and the
+ * frames sent without it, and without the group locks (send_group_backlog()),
+ * so a slow device doesn't hold up the others or the groups' posts.
+ *
+ * return 0 on success, -1 if sending failed.
+ */
+int send_backlog(Session *session) {
+    return catch_up(session, 0);
+}
+
+/**
+ * Makes a device a target of a group's live fan-out. Under the group lock
+ * it first hands the connection what was posted since the device's last
+ * delivery, so the fan-out takes over exactly where this catch-up ends.
+ * Those frames go through the connection's queue (net_queue()): nothing
+ * here waits on the socket, and a device that doesn't read is cut off
+ * rather than holding the locks. Called with the user's lock held; keep the
+ * tail short by catching up without the locks first (go_online()).
+ *
+ * param writer, batch Scratch space (writer is bound to the device's connection).
+ * return 0 on success, -1 if sending failed.
+ */
+int join_fanout(Session *session, User *user, DeviceCursor *cursor, GroupInfo *group,
+                FrameWriter *writer, MessageBatch *batch) {
+    writer->queue = 1;
+    writer->queued = 0;
+    pthread_mutex_lock(&group->lock);
+    int result = send_group_backlog(session, writer, cursor, group, 1, 1, batch);
+    if (result == 0) {
+        result = flushFrames(writer);
+    }
+    if (writer->queued) {
+        flushFanoutLater(session->fanout, writer->fd);
+    }
+    if (result == 0) {
+        result = addOnlineMember(session->fanout, group, user, cursor, writer->fd);
+    }
+    if (result == 0) {
+        cursor->group = group;
+    }
+    pthread_mutex_unlock(&group->lock);
+    writer->queue = 0;
+    return result;
+}
+
+/**
+ * Puts every online device of the session's user into a group's fan-out,
+ * after the user joined or created it on one of them.
+ *
+ * param member The user's new membership node of group.
+ */
+static void join_devices(Session *session, Group *member, GroupInfo *group) {
+    User *user = session->user;
+    MessageBatch *batch = (MessageBatch *) malloc(sizeof(MessageBatch));
+    if (batch == NULL) {
+        perror("Error allocating memory for batch");
+        return;
+    }
+    pthread_mutex_lock(user_lock(user));
+    for (Device *device = user->devices; device != NULL && member->info == group; device = device->next) {
+        if (!device->live) {
+            continue; // joins the group's fan-out when it goes online
+        }
+        DeviceCursor *cursor = getDeviceCursor(device, member);
+        if (cursor == NULL || cursor->group != NULL) {
+            continue;
+        }
+        FrameWriter *writer = createFrameWriter(device->fd);
+        if (writer == NULL || join_fanout(session, user, cursor, group, writer, batch) == -1) {
+            perror("Error sending message to client\n");
+        }
+        free(writer);
+    }
+    pthread_mutex_unlock(user_lock(user));
+    free(batch);
+}
+
+// ======= DEVICES =========== //
+
+// A client coming back rather than a new one: its TLS session was resumed,
+// or it names a device the user already has.
+static int resuming_login(Session *session, User *user, const char *name) {
+    if (tls_session_reused(session->socketFd)) {
+        return 1;
+    }
+    int known = 0;
+    pthread_mutex_lock(user_lock(user));
+    for (Device *device = user->devices; name != NULL && device != NULL && !known; device = device->next) {
+        known = device->name != NULL && strcmp(device->name, name) == 0;
+    }
+    pthread_mutex_unlock(user_lock(user));
+    return known;
+}
+
+/**
+ * Gives the session's connection one of its user's devices: the named one
+ * if the user has it (taken over from the connection that still has it,
+ * which is shut down), a new one otherwise. A remembered device that isn't
+ * connected makes room when the user already has MAX_DEVICES. Direct
+ * messages reach the connection from here on, group messages once it is
+ * online (go_online()).
+ *
+ * param name The device name the client sent, NULL for an unnamed device.
+ * return 0 on success, -1 if MAX_DEVICES are connected or memory ran out.
+ */
+static int attach_device(Session *session, const char *name) {
+    User *user = session->user;
+    pthread_mutex_lock(user_lock(user));
+    Device *device = NULL;
+    Device *replaced = NULL;
+    Device **idle = NULL; // link to the oldest device that isn't connected
+    int count = 0;
+    for (Device **link = &user->devices; *link != NULL; link = &(*link)->next) {
+        Device *ptr = *link;
+        count++;
+        if (name != NULL && ptr->name != NULL && strcmp(ptr->name, name) == 0) {
+            if (ptr->fd == -1) {
+                device = ptr;
+            } else {
+                replaced = ptr;
+            }
+        } else if (ptr->fd == -1) {
+            idle = link;
+        }
+    }
+    if (device == NULL && count >= MAX_DEVICES) {
+        if (idle == NULL) {
+            pthread_mutex_unlock(user_lock(user));
+            return -1;
+        }
+        Device *evicted = *idle;
+        *idle = evicted->next;
+        freeDevice(evicted);
+    }
+    if (device == NULL) {
+        device = (Device *) calloc(1, sizeof(Device));
+        if (device == NULL || (name != NULL && (device->name = strdup(name)) == NULL)) {
+            perror("Error allocating memory for device");
+            free(device);
+            pthread_mutex_unlock(user_lock(user));
+            return -1;
+        }
+        if (replaced != NULL) {
+            // The new connection resumes from what the old one acknowledged;
+            // the old one ends as an unnamed device.
+            for (DeviceCursor *old = replaced->cursors; old != NULL; old = old->next) {
+                DeviceCursor *cursor = (DeviceCursor *) calloc(1, sizeof(DeviceCursor));
+                if (cursor == NULL) {
+                    break; // the rest start from the user's cursor
+                }
+                cursor->membership = old->membership;
+                cursor->ackedSeq = old->ackedSeq;
+                cursor->sentSeq = old->ackedSeq;
+                cursor->joins = old->joins;
+                cursor->next = device->cursors;
+                device->cursors = cursor;
+            }
+            free(replaced->name);
+            replaced->name = NULL;
+            shutdown(replaced->fd, SHUT_RDWR);
+            printf("Device %s of %s moved to a new connection\n", name, user->email);
+        }
+        device->next = user->devices;
+        user->devices = device;
+    }
+    device->fd = session->socketFd;
+    __atomic_add_fetch(&user->isOnline, 1, __ATOMIC_RELAXED);
+    session->device = device;
+    pthread_mutex_unlock(user_lock(user));
+    return 0;
+}
+
+/**
+ * Pushes a direct message to every connected device of a user, in O(1)
+ * each, if the socket has room: a slow reader never holds up the sender,
+ * nor the locks held here. The frame is built once for all of them. A
+ * message that isn't pushed is still stored: the gap in the conversation's
+ * sequence tells the client to fetch it (DIRECT_HISTORY_TYPE). The part of
+ * a frame a socket didn't take is pushed out by the fan-out.
+ */
+static void deliver_direct(FanoutPool *fanout, User *user, s2c_direct_message *frame) {
+    pthread_mutex_lock(user_lock(user));
+    for (Device *device = user->devices; device != NULL; device = device->next) {
+        if (device->fd == -1) {
+            continue;
+        }
+        int result = net_send_if_room(device->fd, frame, sizeof(s2c_direct_message));
+        if (result == 1) {
+            flushFanoutLater(fanout, device->fd);
+        } else if (result == -1 && errno != EAGAIN) {
+            perror("Error sending direct message to client\n");
+        }
+    }
+    pthread_mutex_unlock(user_lock(user));
+}
+
+/**
+ * Catches the session's device up after login or registration and makes it
+ * a target of the live fan-out. The backlog goes out while the device is
+ * still offline, so it can't interleave with live messages; then each group
+ * hands over to the fan-out (go_online()), sending what was posted in between.
+ */
+void bring_online(Session *session) {
+    if (send_backlog(session) == -1) {
+        perror("Error sending backlog to client\n");
+    }
+    go_online(session);
+}
+
+/**
+ * Makes the session's device a target of the live fan-out of all the
+ * user's groups, sending first what was posted after its sentSeq. That is
+ * streamed without any lock (catch_up()); only what is posted meanwhile is
+ * left for the hand-over under the locks (join_fanout()).
+ */
+void go_online(Session *session) {
+    User *user = session->user;
+    if (catch_up(session, 1) == -1) {
+        perror("Error sending backlog to client\n");
+    }
+    MessageBatch *batch = (MessageBatch *) malloc(sizeof(MessageBatch));
+    FrameWriter *writer = createFrameWriter(session->socketFd);
+    if (batch == NULL || writer == NULL) {
+        perror("Error allocating memory for batch");
+        free(batch);
+        free(writer);
+        return;
+    }
+    pthread_mutex_lock(user_lock(user));
+    for (Group *member = user->groups; member != NULL; member = member->next) {
+        GroupInfo *group = member->info;
+        DeviceCursor *cursor = getDeviceCursor(session->device, member);
+        if (group != NULL && (cursor == NULL || join_fanout(session, user, cursor, group, writer, batch) == -1)) {
+            perror("Error sending backlog to client\n");
+        }
+    }
+    session->device->live = 1;
+    pthread_mutex_unlock(user_lock(user));
+    free(writer);
+    free(batch);
+}
+
+/**
+ * Takes the session's device out of the live fan-out of all its groups and
+ * out of direct delivery; an unnamed device is forgotten. Afterwards nothing
+ * is sent to the connection any more, so it can be closed.
+ */
+void take_offline(Session *session) {
+    User *user = session->user;
+    Device *device = session->device;
+    if (device == NULL) {
+        return;
+    }
+    pthread_mutex_lock(user_lock(user));
+    for (DeviceCursor *cursor = device->cursors; cursor != NULL; cursor = cursor->next) {
+        if (cursor->group != NULL) {
+            removeOnlineMember(session->fanout, cursor->group, user, device->fd);
+            cursor->group = NULL;
+        }
+    }
+    device->live = 0;
+    device->fd = -1;
+    __atomic_sub_fetch(&user->isOnline, 1, __ATOMIC_RELAXED);
+    int forget = device->name == NULL;
+    if (forget) {
+        Device **link = &user->devices;
+        while (*link != device) {
+            link = &(*link)->next;
+        }
+        *link = device->next;
+    }
+    pthread_mutex_unlock(user_lock(user));
+    if (forget) {
+        freeDevice(device);
+    }
+    session->device = NULL;
+}
+
+/**
+ * Answers a SYNC_TYPE request: the group's messages after after_seq in
+ * HISTORY_BATCH_TYPE frames (packed into as few sends as fit), then an
+ * empty one to mark the end. The group lock is only taken to copy a chunk
+ * of the index (HISTORY_CHUNK positions); the texts are read from the log
+ * without it, so a large sync doesn't stall the group's live fan-out
+ * (stored messages never change; only the index can move while it grows).
+ *
+ * param group The group's messages, or NULL if nothing was ever posted.
+ * return 0 on success, -1 if sending failed.
+ */
+int send_history(Session *session, GroupInfo *group, const char *group_name, unsigned int after_seq) {
+    MessageBatch *batch = (MessageBatch *) malloc(sizeof(MessageBatch));
+    FrameWriter *writer = createFrameWriter(session->socketFd);
+    BodyReader *reader = (BodyReader *) malloc(sizeof(BodyReader));
+    if (batch == NULL || writer == NULL || reader == NULL) {
+        perror("Error allocating memory for batch");
+        free(batch);
+        free(writer);
+        free(reader);
+        return -1;
+    }
+    reader->length = 0;
+    unsigned int positions[HISTORY_CHUNK];
+    unsigned int seq = after_seq;
+    int result = 0;
+    initBatch(batch, HISTORY_BATCH_TYPE, group_name, seq);
+    while (group != NULL && result == 0) {
+        unsigned int count = 0;
+        pthread_mutex_lock(&group->lock);
+        while (count < HISTORY_CHUNK && seq + count < group->lastSeq) {
+            positions[count] = getGroupMessage(group, seq + count + 1);
+            count++;
+        }
+        pthread_mutex_unlock(&group->lock);
+        if (count == 0) {
+            break;
+        }
+        for (unsigned int i = 0; i < count && result == 0; i++) {
+            seq++;
+            MessageHeader *header = getMessageHeader(session->messageList, positions[i]);
+            if (header == NULL) {
+                continue; // lost with a damaged log
+            }
+            const char *sender = getSenderName(session->userList, header);
+            const char *text = readMessageBody(session->messageList, header, reader);
+            if (addBatchMessage(batch, sender, text, seq, header->timestamp) == -1) {
+                result = writeFrame(writer, batch, batchFrameSize(batch));
+                initBatch(batch, HISTORY_BATCH_TYPE, group_name, seq - 1);
+                addBatchMessage(batch, sender, text, seq, header->timestamp);
+            }
+        }
+    }
+    if (result == 0 && batch->header.count > 0) {
+        result = writeFrame(writer, batch, batchFrameSize(batch));
+        initBatch(batch, HISTORY_BATCH_TYPE, group_name, seq);
+    }
+    if (result == 0) {
+        result = writeFrame(writer, batch, batchFrameSize(batch));
+    }
+    if (result == 0) {
+        result = flushFrames(writer);
+    }
+    free(writer);
+    free(batch);
+    free(reader);
+    return result;
+}
+
+/**
+ * Sends a group's messages after_seq+1..to_seq again, one PRINT_MESSAGE_TYPE
+ * frame each (a retransmission the client asked for). As in send_history(),
+ * the group lock is only held to copy a chunk of the index.
+ *
+ * return 0 on success, -1 if sending failed.
+ */
+static int resend_messages(Session *session, GroupInfo *group, unsigned int after_seq, unsigned int to_seq) {
+    FrameWriter *writer = createFrameWriter(session->socketFd);
+    BodyReader *reader = (BodyReader *) malloc(sizeof(BodyReader));
+    if (writer == NULL || reader == NULL) {
+        free(writer);
+        free(reader);
+        return -1;
+    }
+    reader->length = 0;
+    unsigned int positions[HISTORY_CHUNK];
+    unsigned int seq = after_seq;
+    int result = 0;
+    while (seq < to_seq && result == 0) {
+        unsigned int count = 0;
+        pthread_mutex_lock(&group->lock);
+        while (count < HISTORY_CHUNK && seq + count < to_seq) {
+            positions[count] = getGroupMessage(group, seq + count + 1);
+            count++;
+        }
+        pthread_mutex_unlock(&group->lock);
+        for (unsigned int i = 0; i < count && result == 0; i++) {
+            MessageHeader *header = getMessageHeader(session->messageList, positions[i]);
+            if (header == NULL) {
+                continue; // lost with a damaged log
+            }
+            user_message msg_to_send;
+            fill_user_message(&msg_to_send, PRINT_MESSAGE_TYPE, header, getSenderName(session->userList, header),
+                              group->name, readMessageBody(session->messageList, header, reader));
+            result = writeFrame(writer, &msg_to_send, sizeof(user_message));
+        }
+        seq += count;
+    }
+    if (result == 0) {
+        result = flushFrames(writer);
+    }
+    free(reader);
+    free(writer);
+    return result;
+}
+
+/**
+ * Fills a direct message frame from a stored message.
+ *
+ * param to The recipient (the other user of the conversation).
+ */
+void fill_direct_message(s2c_direct_message *out, int type, Message *msg, User *to) {
+    memset(out, 0, sizeof(s2c_direct_message));
+    out->type = type;
+    snprintf(out->from, BUFFER_SIZE, "%s", msg->sender->email);
+    snprintf(out->name, BUFFER_SIZE, "%s", msg->sender->name);
+    snprintf(out->to, BUFFER_SIZE, "%s", to->email);
+    snprintf(out->message, BUFFER_SIZE, "%s", msg->message);
+    out->seq = msg->seq;
+    out->timestamp = msg->timestamp;
+}
+
+/**
+ * Answers a DIRECT_HISTORY_TYPE request: the conversation's messages after
+ * after_seq, then a frame with seq 0 (from: user, to: peer) to mark the
+ * end. Only this conversation is read. The lock is held while a chunk of
+ * the index is copied, not while sending (stored messages never change).
+ *
+ * param conversation The conversation, or NULL if the two never wrote.
+ * return 0 on success, -1 if sending failed.
+ */
+int send_direct_history(int client_socket, Conversation *conversation, User *user, User *peer,
+                        unsigned int after_seq) {
+    FrameWriter *writer = createFrameWriter(client_socket);
+    if (writer == NULL) {
+        perror("Error allocating memory for history");
+        return -1;
+    }
+    s2c_direct_message frame;
+    Message *chunk[DIRECT_HISTORY_CHUNK];
+    unsigned int seq = after_seq;
+    int result = 0;
+    while (conversation != NULL && result == 0) {
+        unsigned int count = 0;
+        pthread_mutex_lock(&conversation->lock);
+        while (seq + count < conversation->lastSeq && count < DIRECT_HISTORY_CHUNK) {
+            chunk[count] = getDirectMessage(conversation, seq + count + 1);
+            count++;
+        }
+        pthread_mutex_unlock(&conversation->lock);
+        if (count == 0) {
+            break;
+        }
+        for (unsigned int i = 0; i < count && result == 0; i++) {
+            fill_direct_message(&frame, DIRECT_HISTORY_TYPE, chunk[i], conversationPeer(conversation, chunk[i]->sender));
+            result = writeFrame(writer, &frame, sizeof frame);
+        }
+        seq += count;
+    }
+    if (result == 0) {
+        memset(&frame, 0, sizeof frame);
+        frame.type = DIRECT_HISTORY_TYPE;
+        snprintf(frame.from, BUFFER_SIZE, "%s", user->email);
+        snprintf(frame.to, BUFFER_SIZE, "%s", peer->email);
+        result = writeFrame(writer, &frame, sizeof frame);
+    }
+    if (result == 0) {
+        result = flushFrames(writer);
+    }
+    free(writer);
+    return result;
+}
+
+// ======= ATTACHMENTS =========== //
+
+/**
+ * Stores a chunk of the connection's upload. The last one completes it: the
+ * blob is stored under its hash and the group gets a message referring to
+ * it, which answers the UPLOAD_TYPE request as if it had been that message.
+ * Chunks of no upload in progress (one that failed) are dropped.
+ *
+ * return 0 to keep the connection, -1 to close it.
+ */
+int handle_blob_chunk(Session *session, blob_chunk_header *header, const char *data) {
+    BlobUpload *upload = session->upload;
+    if (upload == NULL || header->requestId != upload->requestId) {
+        return 0;
+    }
+    if (header->length == 0 || header->offset != upload->received ||
+        header->length > upload->size - upload->received || writeBlobChunk(upload, data, header->length) == -1) {
+        session->upload = NULL;
+        abortBlobUpload(upload);
+        reply_error(session, header->requestId, (header->length == 0) ? "Upload cancelled."
+                                                : "Error storing file. Please try again.");
+        return 0;
+    }
+    if (upload->received < upload->size) {
+        return 0;
+    }
+
+    // The upload is freed with its temporary file; its message is made first.
+    c2s_send_message post;
+    char group[GROUP_NAME_SIZE];
+    char details[12 + BLOB_NAME_SIZE]; // " <size> <file name>"
+    char hash[BLOB_HASH_SIZE];
+    memset(&post, 0, sizeof post);
+    post.type = MESSAGE_TYPE;
+    post.requestId = upload->requestId;
+    snprintf(group, sizeof group, "%s", upload->group);
+    snprintf(details, sizeof details, " %u %s", (unsigned int) upload->size, upload->name);
+    session->upload = NULL;
+    if (finishBlobUpload(session->blobStore, upload, hash) == -1) {
+        reply_error(session, post.requestId, "Error storing file. Please try again.");
+        return 0;
+    }
+    snprintf(post.message, BUFFER_SIZE, "%s %s%s%s", group, BLOB_REF_PREFIX, hash, details);
+    post.length = strlen(post.message) + 1;
+    return handle_request(session, &post);
+}
+
+/**
+ * Sends the next chunk of the connection's download, straight from the
+ * file (net_send_file()). Other frames to the client go out between two
+ * chunks. After the last one comes the ACK.
+ *
+ * return 0 on success, -1 if the connection failed.
+ */
+int send_download_chunk(Session *session) {
+    BlobDownload *download = session->download;
+    unsigned long long left = download->size - download->offset;
+    size_t len = (left < BLOB_CHUNK_SIZE) ? (size_t) left : BLOB_CHUNK_SIZE;
+    if (len > 0) {
+        blob_chunk_header header;
+        memset(&header, 0, sizeof header);
+        header.type = BLOB_CHUNK_TYPE;
+        header.requestId = download->requestId;
+        header.length = len;
+        header.offset = download->offset;
+        header.size = download->size;
+        if (net_send_file(session->socketFd, &header, sizeof header, download->fd, download->offset, len) == -1) {
+            perror("Error sending file to client\n");
+            end_transfers(session);
+            return -1;
+        }
+        download->offset += len;
+    }
+    if (download->offset == download->size) {
+        session->download = NULL;
+        send_ack(session->socketFd, download->requestId);
+        close(download->fd);
+        free(download);
+    }
+    return 0;
+}
+
+/**
+ * Drops the connection's transfers in progress: it closes, or stops for a
+ * restart (the client starts them again; a download can resume at an offset).
+ */
+void end_transfers(Session *session) {
+    if (session->upload != NULL) {
+        abortBlobUpload(session->upload);
+        session->upload = NULL;
+    }
+    if (session->download != NULL) {
+        close(session->download->fd);
+        free(session->download);
+        session->download = NULL;
+    }
+}
+
+/**
+ * Runs one client request. Answers go through reply_ack()/reply_error(), so
+ * the same code serves single requests and request batches.
+ *
+ * return 0 to keep the connection, -1 to close it.
+ */
+int handle_request(Session *session, c2s_send_message *request) {
+    int client_socket = session->socketFd;
+    MessageList *messageList = session->messageList;
+    UserList *userList = session->userList;
+    GroupList *groupList = session->groupList;
+    UserStore *userStore = session->userStore;
+    MessageLog *messageLog = session->messageLog;
+    DirectList *directList = session->directList;
+
+    if ((request->type == REGISTRATION_TYPE || request->type == LOGIN_TYPE) && session->user != NULL) {
+        reply_error(session, request->requestId, "Already logged in.");
+    } else if (request->type == REGISTRATION_TYPE) {
+
+        // Create user and append to userList
+        char *email = strtok(request->message, " ");
+        char *name = strtok(NULL, " ");
+        char *raw_password = strtok(NULL, " ");
+        char *device = strtok(NULL, " ");
+        if (email == NULL || name == NULL || raw_password == NULL) {
+            reply_error(session, request->requestId, "Registration needs an email, a name and a password.");
+            return 0;
+        }
+        if (device != NULL && strlen(device) >= DEVICE_NAME_SIZE) {
+            reply_error(session, request->requestId, "Invalid device name.");
+            return 0;
+        }
+
+        // Encode password (crypt() is what a registration storm costs)
+        int retry_after = 0;
+        if (session->admission != NULL && beginAuth(session->admission, 0, &retry_after) == -1) {
+            reply_busy(session, request->requestId, retry_after);
+            return 0;
+        }
+        char* password = encode(raw_password);
+        if (session->admission != NULL) {
+            endAuth(session->admission);
+        }
+        // DEBUG
+        if (password == NULL) {
+           perror("Error encoding password\n");
+           return -1;
+        }
+
+        // The check, the log record and the append happen under one lock,
+        // so two clients can't register the same email and a snapshot
+        // never misses a registration.
+        // A new user starts at the head of the default group: older
+        // messages are history, not backlog.
+        GroupInfo *default_group = findGroup(groupList, DEFAULT_GROUP);
+        unsigned int head = 0;
+        if (default_group != NULL) {
+            pthread_mutex_lock(&default_group->lock);
+            head = default_group->lastSeq;
+            pthread_mutex_unlock(&default_group->lock);
+        }
+        pthread_mutex_lock(&userList_mutex);
+        int email_exists = findUser(userList, email) != NULL;
+        User *user = email_exists ? NULL : createUser(email, name, password);
+        if (user != NULL) {
+            user->groups->ackedSeq = head;
+        }
+        int logged = (user != NULL) && logRegistration(userStore, user) == 0;
+        if (logged) {
+            appendUser(userList, user);
+            if (default_group == NULL || addGroupMember(default_group, user->groups) == -1) {
+                printf("User %s not listed in group %s\n", user->email, DEFAULT_GROUP);
+            }
+        }
+        pthread_mutex_unlock(&userList_mutex);
+        free(password);
+
+        if (email_exists) {
+            printf("Email already exists: %s\n", email);
+            reply_error(session, request->requestId, "Email already exists. Please try again.");
+        } else if (logged) {
+            printf("Client registered with email: %s, name: %s\n", user->email, user->name);
+            session->user = user; // Set user for session
+            if (attach_device(session, device) == -1) {
+                // Registered all the same; the client can log in.
+                session->user = NULL;
+                reply_error(session, request->requestId, "Error connecting device. Please log in.");
+                return 0;
+            }
+            reply_ack(session, request->requestId);
+            bring_online(session);
+        } else {
+            printf("Error creating user\n");
+            if (user != NULL) {
+                free(user->groups->name);
+                free(user->groups);
+                free(user->email);
+                free(user->name);
+                free(user->password);
+                free(user);
+            }
+            reply_error(session, request->requestId, "Error creating user. Please try again.");
+        }
+
+    } else if (request->type == LOGIN_TYPE) {
+        // Handle login with mutex protection
+
+        // Create user and append to userList
+        char *email = strtok(request->message, " ");
+        char *password = strtok(NULL, " ");
+        char *device = strtok(NULL, " ");
+        if (email == NULL || password == NULL) {
+            reply_error(session, request->requestId, "Login needs an email and a password.");
+            return 0;
+        }
+        if (device != NULL && strlen(device) >= DEVICE_NAME_SIZE) {
+            reply_error(session, request->requestId, "Invalid device name.");
+            return 0;
+        }
+
+        // Cheks if email already exists in the userList
+        pthread_mutex_lock(&userList_mutex);
+        User *existing_user = findUser(userList, email);
+        pthread_mutex_unlock(&userList_mutex);
+
+        if (existing_user == NULL) {
+            printf("Email does not exist: %s\n", email);
+            reply_error(session, request->requestId, "Email does not exist. Please try again.");
+        } else {
+            // Check password. A client coming back goes ahead of new ones
+            // when logins queue up.
+            int retry_after = 0;
+            if (session->admission != NULL &&
+                beginAuth(session->admission, resuming_login(session, existing_user, device), &retry_after) == -1) {
+                reply_busy(session, request->requestId, retry_after);
+                return 0;
+            }
+            int authenticated = authenticate(password, existing_user->password);
+            if (session->admission != NULL) {
+                endAuth(session->admission);
+            }
+            if (authenticated) {
+                // One more device of the user: the others stay connected
+                session->user = existing_user; // Set user for session
+                if (attach_device(session, device) == -1) {
+                    session->user = NULL;
+                    printf("Too many devices for email: %s\n", existing_user->email);
+                    reply_error(session, request->requestId, "Too many devices are connected.");
+                    return 0;
+                }
+                printf("Client logged in with email: %s (%s)\n", existing_user->email,
+                       device != NULL ? device : "unnamed device");
+                reply_ack(session, request->requestId);
+                    // Deliver what arrived while offline, then go online
+                bring_online(session);
+            } else {
+                printf("Incorrect password for email: %s\n", existing_user->email);
+                reply_error(session, request->requestId, "Incorrect password. Please try again.");
+            }
+        }
+        // Unlock mutex
+    } else if (request->type == COMPRESS_TYPE) {
+        // Compression is negotiated before login so the backlog benefits.
+        if (strcmp(request->message, COMPRESS_ALGORITHM) == 0) {
+            reply_ack(session, request->requestId);
+            compress_set(client_socket, 1);
+        } else {
+            reply_error(session, request->requestId, "Unsupported compression.");
+        }
+    } else if (session->user == NULL) {
+        log_debug("Client is not registered. Ignoring message.\n");
+    }
+    else if (request->type == MESSAGE_TYPE || request->type == POST_TYPE) {
+        log_debug("Client sent: %s\n", request->message);
+
+        // Parse group name and message from the client message (Aedan)
+        char group_name[BUFFER_SIZE];
+        char msg_content[BUFFER_SIZE];
+        unsigned long long post_id = 0;
+        msg_content[0] = '\0';
+
+        if (request->type == MESSAGE_TYPE) {
+            sscanf(request->message, "%s %[^\n]", group_name, msg_content);
+        } else if (sscanf(request->message, "%s %llx %[^\n]", group_name, &post_id, msg_content) < 2) {
+            reply_error(session, request->requestId, "Invalid message id.");
+            return 0;
+        }
+
+        // Check if user is in the group (Aedan)
+        GroupInfo *group = NULL;
+        Group *member = find_membership(session->user, group_name, &group);
+        if (member == NULL || group == NULL) {
+            printf("User %s is not in group %s\n", session->user->name, group_name);
+            reply_error(session, request->requestId, "You are not in this group.");
+            return 0;
+        }
+        if (session->filter != NULL && filterMessage(session->filter, msg_content, strlen(msg_content))) {
+            printf("Blocked a message from user %s\n", session->user->name);
+            reply_error(session, request->requestId, BLOCKED_ERROR);
+            return 0;
+        }
+
+        // A retried post (its ACK was lost) is acknowledged again, but
+        // stored and fanned out once.
+        if (request->type == POST_TYPE) {
+            pthread_mutex_lock(user_lock(session->user));
+            int seen = rememberPostId(&session->user->recentPosts, post_id);
+            pthread_mutex_unlock(user_lock(session->user));
+            if (seen == 1) {
+                log_debug("Repeated post %016llx from user %s\n", post_id, session->user->name);
+                if (request->requestId != 0) {
+                    reply_ack(session, request->requestId);
+                }
+                return 0;
+            }
+        }
+
+        MessageHeader header;
+        header.groupId = group->id;
+        header.senderId = session->user->id;
+        header.timestamp = now_ms();
+
+        // Sequence assignment and publishing happen under the group lock, so
+        // the fan-out queues hold the group's messages in sequence order.
+        // The text goes to the log first: the stored header points into it.
+        pthread_mutex_lock(&group->lock);
+        header.seq = group->lastSeq + 1;
+        // A failed write is reported but doesn't hold up delivery (the
+        // text is kept in memory instead).
+        long long offset = logMessage(messageLog, &header, group_name, session->user->email, msg_content);
+        pthread_mutex_lock(&messageList_mutex);
+        unsigned int position = appendMessage(messageList, &header, msg_content, offset);
+        pthread_mutex_unlock(&messageList_mutex);
+        if (position == MESSAGE_NONE || appendGroupMessage(group, position) == 0) {
+            pthread_mutex_unlock(&group->lock);
+            if (request->type == POST_TYPE) {
+                // Not stored (memory ran out; the log may hold it): the retry must be.
+                pthread_mutex_lock(user_lock(session->user));
+                forgetPostId(session->user->recentPosts, post_id);
+                pthread_mutex_unlock(user_lock(session->user));
+            }
+            reply_error(session, request->requestId, "Error storing message. Please try again.");
+            return 0;
+        }
+        __atomic_fetch_add(&session->user->posts, 1, __ATOMIC_RELAXED);
+
+        // Send message to all online members of the group (Aedan). The
+        // fan-out workers do the sends; the sender only queues it.
+        user_message msg_to_send;
+        fill_user_message(&msg_to_send, PRINT_MESSAGE_TYPE, &header, session->user->name, group->name, msg_content);
+        if (publishMessage(session->fanout, group, session->user, &msg_to_send) == -1) {
+            perror("Error sending message to client\n");
+        }
+        pthread_mutex_unlock(&group->lock);
+
+        // The sender gets its own message back with its sequence number, and
+        // clients acknowledge in batches (CLIENT_ACK_TYPE). An explicit ACK
+        // only goes out when the client asked for one with a requestId.
+        if (request->requestId != 0) {
+            reply_ack(session, request->requestId);
+        }
+    } else if (request->type == CLIENT_ACK_TYPE) {
+        // Cumulative ack "<group> <ackedSeq>", optionally followed by the
+        // end of a gap the client wants retransmitted.
+        char group_name[BUFFER_SIZE];
+        unsigned int acked = 0;
+        unsigned int resend_to = 0;
+        if (sscanf(request->message, "%s %u %u", group_name, &acked, &resend_to) < 2) {
+            printf("Malformed ack from user %s\n", session->user->name);
+            return 0;
+        }
+        GroupInfo *group = NULL;
+        Group *member = find_membership(session->user, group_name, &group);
+        if (group == NULL) {
+            return 0;
+        }
+
+        pthread_mutex_lock(&group->lock);
+        if (member->info != group) {
+            pthread_mutex_unlock(&group->lock);
+            return 0; // left on another device meanwhile
+        }
+        if (acked > group->lastSeq) {
+            acked = group->lastSeq;
+        }
+        if (acked > member->ackedSeq) {
+            // Advance the user's cursor: a new device starts after it.
+            __atomic_store_n(&member->ackedSeq, acked, __ATOMIC_RELAXED);
+            logCursor(userStore, session->user, member);
+        }
+        if (resend_to > group->lastSeq) {
+            resend_to = group->lastSeq;
+        }
+        pthread_mutex_unlock(&group->lock);
+        if (resend_to > acked && resend_to - acked > MAX_CATCHUP_MESSAGES) {
+            resend_to = acked + MAX_CATCHUP_MESSAGES; // the range comes from the client
+        }
+        if (resend_to > acked) {
+            log_debug("Retransmitting %s %u-%u to user %s\n", group_name, acked + 1, resend_to,
+                      session->user->name);
+            if (resend_messages(session, group, acked, resend_to) == -1) {
+                perror("Error sending message to client\n");
+            }
+        }
+
+        // And this device's own: it resumes after it when it reconnects.
+        pthread_mutex_lock(user_lock(session->user));
+        DeviceCursor *cursor = getDeviceCursor(session->device, member);
+        if (cursor != NULL && acked > cursor->ackedSeq) {
+            cursor->ackedSeq = acked;
+        }
+        pthread_mutex_unlock(user_lock(session->user));
+    } else if (request->type == EVENT_TYPE) {
+        // "<group> <kind> [<seq>]": passed on to the group's online members,
+        // never stored and never answered.
+        char group_name[BUFFER_SIZE];
+        s2c_event event;
+        memset(&event, 0, sizeof event);
+        if (sscanf(request->message, "%s %d %u", group_name, &event.kind, &event.seq) < 2 ||
+            strlen(group_name) >= GROUP_NAME_SIZE ||
+            (event.kind != EVENT_TYPING && event.kind != EVENT_STOPPED_TYPING && event.kind != EVENT_READ)) {
+            printf("Malformed event from user %s\n", session->user->name);
+            return 0;
+        }
+        GroupInfo *group = NULL;
+        if (find_membership(session->user, group_name, &group) == NULL || group == NULL) {
+            return 0;
+        }
+        event.type = EVENT_TYPE;
+        if (event.kind != EVENT_READ) {
+            event.seq = 0;
+        }
+        snprintf(event.name, BUFFER_SIZE, "%s", session->user->name);
+        snprintf(event.group, GROUP_NAME_SIZE, "%s", group_name);
+        publishEvent(session->fanout, group, session->user, &event);
+    } else if (request->type == EXIT_TYPE) {
+        printf("Client requested to exit. Closing connection...\n");
+        return -1; // the user goes offline in start_subserver()
+    }
+    else if (request->type == REQUEST_ALL_MESSAGES_TYPE) {
+        log_debug("Client requested all messages\n");
+
+        // Loop through and send every message in the MessageList to the client,
+        // packed into as few (compressed) sends as fit.
+        // Only the first `count` headers are read: appends never touch them,
+        // so the list lock isn't held while sending.
+        pthread_mutex_lock(&messageList_mutex);
+        int count = messageList->count;
+        pthread_mutex_unlock(&messageList_mutex);
+        FrameWriter *writer = createFrameWriter(client_socket);
+        BodyReader *reader = (BodyReader *) malloc(sizeof(BodyReader));
+        if (writer == NULL || reader == NULL) {
+            free(writer);
+            free(reader);
+            reply_error(session, request->requestId, "Error sending messages. Please try again.");
+            return 0;
+        }
+        reader->length = 0;
+        for (int i = 0; i < count; i++) {
+            MessageHeader *header = getMessageHeader(messageList, (unsigned int) i);
+            GroupInfo *group = getGroupById(groupList, header->groupId);
+            // DEBUG
+            if (group == NULL) {
+                printf("Error: Unknown group in message list\n");
+                break;
+            }
+
+            user_message msg_to_send;
+            fill_user_message(&msg_to_send, HISTORY_MESSAGE_TYPE, header, getSenderName(userList, header),
+                              group->name, readMessageBody(messageList, header, reader));
+
+            // Debug
+            log_debug("sending message from user: %s\n", session->user->name);
+
+            if (writeFrame(writer, &msg_to_send, sizeof(user_message)) == -1) {
+                perror("Error sending message to client\n");
+                break;
+            }
+        }
+
+        // Send an end-of-messages indicator
+        user_message end_msg;
+        memset(&end_msg, 0, sizeof(end_msg));
+        end_msg.type = PRINT_MESSAGE_TYPE;
+        snprintf(end_msg.message, BUFFER_SIZE, "END_OF_MESSAGES");
+        end_msg.name[0] = '\0'; // No user for end of messages
+        if (writeFrame(writer, &end_msg, sizeof(user_message)) == -1 || flushFrames(writer) == -1) {
+            perror("Error sending end-of-messages indicator to client\n");
+        }
+        free(writer);
+        free(reader);
+
+        // Send acknowledgment to client
+        reply_ack(session, request->requestId);
+    } else if (request->type == SYNC_TYPE) {
+        // "<group> <afterSeq>": the client has the group's history up to
+        // afterSeq cached and wants the rest.
+        char group_name[BUFFER_SIZE];
+        unsigned int after_seq = 0;
+        if (sscanf(request->message, "%s %u", group_name, &after_seq) < 1 ||
+            strlen(group_name) >= GROUP_NAME_SIZE) {
+            reply_error(session, request->requestId, "Invalid sync request.");
+            return 0;
+        }
+        GroupInfo *group = NULL;
+        if (find_membership(session->user, group_name, &group) == NULL) {
+            reply_error(session, request->requestId, "You are not in this group.");
+            return 0;
+        }
+        log_debug("User %s syncing %s after #%u\n", session->user->name, group_name, after_seq);
+        if (send_history(session, group, group_name, after_seq) == -1) {
+            perror("Error sending history to client\n");
+        }
+    } else if (request->type == JOIN_GROUP_TYPE) {
+        log_debug("Client requested to join a group\n");
+
+        // Parse the group name from the message
+        char group_name[BUFFER_SIZE];
+        group_name[0] = '\0';
+        sscanf(request->message, "%s", group_name);
+        if (group_name[0] == '\0' || strlen(group_name) >= GROUP_NAME_SIZE) {
+            reply_error(session, request->requestId, "Invalid group name.");
+            return 0;
+        }
+
+        // Update the user's group information
+        if (session->user != NULL) {
+            // Check to see if the group is already joined by user
+            int already_in_group = find_membership(session->user, group_name, NULL) != NULL;
+
+            if(!already_in_group) {
+                // Only existing groups can be joined (CREATE_GROUP_TYPE
+                // makes new ones). Watermarks start at the group's
+                // current head: earlier messages were never owed to this member.
+                GroupInfo *group = findGroup(groupList, group_name);
+                if (group == NULL) {
+                    reply_error(session, request->requestId, "No such group.");
+                    return 0;
+                }
+                pthread_mutex_lock(&group->lock);
+                unsigned int head = group->lastSeq;
+                pthread_mutex_unlock(&group->lock);
+                pthread_mutex_lock(&userList_mutex);
+                pthread_mutex_lock(user_lock(session->user));
+                // Checked again under the lock: another device of the user
+                // may have joined since.
+                if (membership_of(session->user, group_name) != NULL) {
+                    pthread_mutex_unlock(user_lock(session->user));
+                    pthread_mutex_unlock(&userList_mutex);
+                    reply_error(session, request->requestId, "You are already in this group.");
+                    return 0;
+                }
+                Group *new_group = addUserGroup(session->user, group_name, head);
+                int logged = (new_group != NULL) && logJoin(userStore, session->user, group_name) == 0;
+                if (logged && addGroupMember(group, new_group) == -1) {
+                    printf("User %s not listed in group %s\n", session->user->email, group_name);
+                }
+                pthread_mutex_unlock(user_lock(session->user));
+                pthread_mutex_unlock(&userList_mutex);
+                if (!logged) {
+                    reply_error(session, request->requestId, "Error joining group. Please try again.");
+                    return -1;
+                }
+                printf("User %s joined group %s\n", session->user->name, group_name);
+                reply_ack(session, request->requestId);
+                // Live delivery to all the user's devices starts now, after
+                // whatever was posted between the lookup above and this point.
+                join_devices(session, new_group, group);
+            } else {
+                printf("User %s is already in group %s\n", session->user->name, group_name);
+                reply_error(session, request->requestId, "You are already in this group.");
+            }
+        } else {
+            printf("User is not registered. Cannot join group.\n");
+            reply_error(session, request->requestId, "User is not registered. Cannot join group.");
+        }
+            
+    } else if (request->type == DIRECT_MESSAGE_TYPE) {
+        // "<email> <text>": stored in the pair's conversation and pushed to
+        // both users (the sender learns the sequence number from its copy).
+        char email[BUFFER_SIZE];
+        char text[BUFFER_SIZE];
+        text[0] = '\0';
+        if (sscanf(request->message, "%s %[^\n]", email, text) < 2) {
+            reply_error(session, request->requestId, "A direct message needs an email and a text.");
+            return 0;
+        }
+        pthread_mutex_lock(&userList_mutex);
+        User *recipient = findUser(userList, email);
+        pthread_mutex_unlock(&userList_mutex);
+        if (recipient == NULL) {
+            reply_error(session, request->requestId, "No such user.");
+            return 0;
+        }
+        if (recipient == session->user) {
+            reply_error(session, request->requestId, "You can't message yourself.");
+            return 0;
+        }
+        if (session->filter != NULL && filterMessage(session->filter, text, strlen(text))) {
+            printf("Blocked a direct message from user %s\n", session->user->name);
+            reply_error(session, request->requestId, BLOCKED_ERROR);
+            return 0;
+        }
+        Conversation *conversation = getOrCreateConversation(directList, session->user, recipient, 0);
+        Message *msg = createMessage(strdup(text), session->user);
+        if (conversation == NULL || msg == NULL || msg->message == NULL) {
+            perror("Error creating message\n");
+            return -1;
+        }
+        msg->timestamp = now_ms();
+
+        // Under the conversation lock, so both users get the messages in
+        // sequence order and the log stays in order.
+        pthread_mutex_lock(&conversation->lock);
+        if (appendDirectMessage(conversation, msg) == 0) {
+            pthread_mutex_unlock(&conversation->lock);
+            free(msg->message);
+            free(msg);
+            reply_error(session, request->requestId, "Error storing message. Please try again.");
+            return 0;
+        }
+        logDirectMessage(session->directLog, conversation, msg);
+        __atomic_fetch_add(&session->user->posts, 1, __ATOMIC_RELAXED);
+        s2c_direct_message frame;
+        fill_direct_message(&frame, DIRECT_MESSAGE_TYPE, msg, recipient);
+        deliver_direct(session->fanout, recipient, &frame);
+        deliver_direct(session->fanout, session->user, &frame);
+        pthread_mutex_unlock(&conversation->lock);
+
+        if (request->requestId != 0) {
+            reply_ack(session, request->requestId);
+        }
+    } else if (request->type == DIRECT_HISTORY_TYPE) {
+        // "<email> <afterSeq>"
+        char email[BUFFER_SIZE];
+        unsigned int after_seq = 0;
+        if (sscanf(request->message, "%s %u", email, &after_seq) < 1) {
+            reply_error(session, request->requestId, "Invalid history request.");
+            return 0;
+        }
+        pthread_mutex_lock(&userList_mutex);
+        User *peer = findUser(userList, email);
+        pthread_mutex_unlock(&userList_mutex);
+        if (peer == NULL) {
+            reply_error(session, request->requestId, "No such user.");
+            return 0;
+        }
+        Conversation *conversation = findConversation(directList, session->user, peer);
+        if (send_direct_history(client_socket, conversation, session->user, peer, after_seq) == -1) {
+            perror("Error sending history to client\n");
+        }
+    } else if (request->type == UPLOAD_TYPE) {
+        // "<group> <size> <file name>": the chunks follow (handle_blob_chunk()),
+        // and the last one gets the answer.
+        char group_name[BUFFER_SIZE];
+        char file_name[BUFFER_SIZE];
+        unsigned long long size = 0;
+        if (sscanf(request->message, "%s %llu %[^\n]", group_name, &size, file_name) != 3 ||
+            size == 0 || size > BLOB_MAX_SIZE) {
+            reply_error(session, request->requestId, "Invalid upload request.");
+            return 0;
+        }
+        if (strlen(group_name) >= GROUP_NAME_SIZE || strlen(file_name) >= BLOB_NAME_SIZE) {
+            reply_error(session, request->requestId, "File name too long.");
+            return 0;
+        }
+        if (session->upload != NULL) {
+            reply_error(session, request->requestId, "An upload is already in progress.");
+            return 0;
+        }
+        if (find_membership(session->user, group_name, NULL) == NULL) {
+            reply_error(session, request->requestId, "You are not in this group.");
+            return 0;
+        }
+        if (session->filter != NULL && filterMessage(session->filter, file_name, strlen(file_name))) {
+            reply_error(session, request->requestId, BLOCKED_ERROR);
+            return 0;
+        }
+        BlobUpload *upload = beginBlobUpload(session->blobStore, size);
+        if (upload == NULL) {
+            reply_error(session, request->requestId, "Error storing file. Please try again.");
+            return 0;
+        }
+        upload->requestId = request->requestId;
+        snprintf(upload->group, sizeof upload->group, "%s", group_name);
+        snprintf(upload->name, sizeof upload->name, "%s", file_name);
+        session->upload = upload;
+    } else if (request->type == DOWNLOAD_TYPE) {
+        // "<hash> [<offset>]": the chunks go out between this connection's
+        // requests (wait_for_frame()), then an ACK.
+        char hash[BUFFER_SIZE];
+        unsigned long long offset = 0;
+        if (sscanf(request->message, "%s %llu", hash, &offset) < 1) {
+            reply_error(session, request->requestId, "Invalid download request.");
+            return 0;
+        }
+        if (session->download != NULL) {
+            reply_error(session, request->requestId, "A download is already in progress.");
+            return 0;
+        }
+        unsigned long long size = 0;
+        int fd = openBlob(session->blobStore, hash, &size);
+        if (fd == -1) {
+            reply_error(session, request->requestId, "No such file.");
+            return 0;
+        }
+        BlobDownload *download = (offset <= size) ? (BlobDownload *) malloc(sizeof(BlobDownload)) : NULL;
+        if (download == NULL) {
+            close(fd);
+            reply_error(session, request->requestId, (offset > size) ? "Invalid offset." : "Error sending file.");
+            return 0;
+        }
+        download->fd = fd;
+        download->size = size;
+        download->offset = offset;
+        download->requestId = request->requestId;
+        session->download = download;
+    } else if (request->type == CREATE_GROUP_TYPE) {
+        // "<group>": a new group, with the creator as its first member.
+        char group_name[BUFFER_SIZE];
+        group_name[0] = '\0';
+        sscanf(request->message, "%s", group_name);
+        if (group_name[0] == '\0' || strlen(group_name) >= GROUP_NAME_SIZE) {
+            reply_error(session, request->requestId, "Invalid group name.");
+            return 0;
+        }
+
+        // Groups are created under userList_mutex, like the memberships, so
+        // a snapshot has every group its memberships refer to.
+        pthread_mutex_lock(&userList_mutex);
+        int created = 0;
+        GroupInfo *group = getOrCreateGroup(groupList, group_name, &created);
+        Group *new_group = NULL;
+        int logged = 0;
+        if (group != NULL && created) {
+            pthread_mutex_lock(user_lock(session->user));
+            new_group = addUserGroup(session->user, group_name, 0);
+            logged = (new_group != NULL) && logCreate(userStore, group_name, session->user) == 0 &&
+                     logJoin(userStore, session->user, group_name) == 0;
+            if (logged && addGroupMember(group, new_group) == -1) {
+                printf("User %s not listed in group %s\n", session->user->email, group_name);
+            }
+            pthread_mutex_unlock(user_lock(session->user));
+        }
+        pthread_mutex_unlock(&userList_mutex);
+        if (group != NULL && !created) {
+            reply_error(session, request->requestId, "Group already exists.");
+            return 0;
+        }
+        if (!logged) {
+            reply_error(session, request->requestId, "Error creating group. Please try again.");
+            return -1;
+        }
+        printf("User %s created group %s\n", session->user->name, group_name);
+        reply_ack(session, request->requestId);
+        join_devices(session, new_group, group);
+    } else if (request->type == LEAVE_GROUP_TYPE) {
+        // "<group>"
+        char group_name[BUFFER_SIZE];
+        group_name[0] = '\0';
+        sscanf(request->message, "%s", group_name);
+        Group *member = find_membership(session->user, group_name, NULL);
+        if (member == NULL) {
+            reply_error(session, request->requestId, "You are not in this group.");
+            return 0;
+        }
+
+        // The record and the unlinking happen under one lock, so a snapshot
+        // never has a membership its log says was left. None of the user's
+        // devices gets the group's messages afterwards.
+        pthread_mutex_lock(&userList_mutex);
+        int logged = logLeave(userStore, session->user, group_name) == 0;
+        if (logged) {
+            pthread_mutex_lock(user_lock(session->user));
+            for (Device *device = session->user->devices; device != NULL; device = device->next) {
+                for (DeviceCursor *cursor = device->cursors; cursor != NULL; cursor = cursor->next) {
+                    if (cursor->membership == member && cursor->group != NULL) {
+                        removeOnlineMember(session->fanout, cursor->group, session->user, device->fd);
+                        cursor->group = NULL;
+                    }
+                }
+            }
+            removeGroupMember(member);
+            removeUserGroup(session->user, member);
+            pthread_mutex_unlock(user_lock(session->user));
+        }
+        pthread_mutex_unlock(&userList_mutex);
+        if (!logged) {
+            reply_error(session, request->requestId, "Error leaving group. Please try again.");
+            return 0;
+        }
+        printf("User %s left group %s\n", session->user->name, group_name);
+        reply_ack(session, request->requestId);
+    } else if (request->type == LIST_GROUPS_TYPE) {
+        // "<cursor> [<limit>]": one GROUP_PAGE_TYPE frame of the registry.
+        unsigned int cursor = 0;
+        unsigned int limit = PAGE_MAX_ENTRIES;
+        if (sscanf(request->message, "%u %u", &cursor, &limit) < 1) {
+            reply_error(session, request->requestId, "Invalid list request.");
+            return 0;
+        }
+        if (limit == 0 || limit > PAGE_MAX_ENTRIES) {
+            limit = PAGE_MAX_ENTRIES;
+        }
+        GroupInfo *range[PAGE_MAX_ENTRIES];
+        unsigned int total = 0;
+        unsigned int count = getGroupRange(groupList, cursor, limit, range, &total);
+        Page *page = (Page *) malloc(sizeof(Page));
+        if (page == NULL) {
+            reply_error(session, request->requestId, "Error listing groups. Please try again.");
+            return 0;
+        }
+        initPage(page, GROUP_PAGE_TYPE, request->requestId, total);
+        unsigned int packed = 0;
+        for (; packed < count; packed++) {
+            GroupInfo *group = range[packed];
+            pthread_mutex_lock(&group->lock);
+            unsigned int members = group->memberCount;
+            unsigned int last_seq = group->lastSeq;
+            pthread_mutex_unlock(&group->lock);
+            if (addPageGroup(page, group->name, members, last_seq) == -1) {
+                break;
+            }
+        }
+        page->header.next = (cursor + packed < total) ? cursor + packed : 0;
+        if (send_page(client_socket, page) == -1) {
+            perror("Error sending group list to client\n");
+        }
+        free(page);
+    } else if (request->type == ROSTER_TYPE) {
+        // "<group> <cursor> [<limit>]": one ROSTER_PAGE_TYPE frame of a
+        // group's members, for members of the group.
+        char group_name[BUFFER_SIZE];
+        unsigned int cursor = 0;
+        unsigned int limit = PAGE_MAX_ENTRIES;
+        if (sscanf(request->message, "%s %u %u", group_name, &cursor, &limit) < 2) {
+            reply_error(session, request->requestId, "Invalid roster request.");
+            return 0;
+        }
+        if (limit == 0 || limit > PAGE_MAX_ENTRIES) {
+            limit = PAGE_MAX_ENTRIES;
+        }
+        GroupInfo *group = NULL;
+        if (find_membership(session->user, group_name, &group) == NULL || group == NULL) {
+            reply_error(session, request->requestId, "You are not in this group.");
+            return 0;
+        }
+        Page *page = (Page *) malloc(sizeof(Page));
+        if (page == NULL) {
+            reply_error(session, request->requestId, "Error listing members. Please try again.");
+            return 0;
+        }
+        // Leaving moves the last member into the gap, so a roster paged
+        // while members leave can miss or repeat someone; each page itself
+        // is consistent.
+        pthread_mutex_lock(&group->lock);
+        unsigned int total = group->memberCount;
+        initPage(page, ROSTER_PAGE_TYPE, request->requestId, total);
+        unsigned int index = cursor;
+        for (; index < total && index - cursor < limit; index++) {
+            User *user = group->members[index]->user;
+            int online = __atomic_load_n(&user->isOnline, __ATOMIC_RELAXED) > 0;
+            if (addPageMember(page, user->name, user->email, online) == -1) {
+                break;
+            }
+        }
+        pthread_mutex_unlock(&group->lock);
+        page->header.next = (index < total) ? index : 0;
+        if (send_page(client_socket, page) == -1) {
+            perror("Error sending roster to client\n");
+        }
+        free(page);
+    } else {
+        printf("Client sent invalid message type: %d\n", request->type);
+    }
+    return 0;
+}
+
+/**
+ * Runs the requests of a batch in order, as if each had come in its own
+ * frame, and sends their answers as one BATCH_RESPONSE_TYPE frame: one
+ * read and one reply for the whole batch instead of one per request.
+ *
+ * return 0 to keep the connection, -1 to close it (an exit request, a
+ *        failure, or a malformed batch; what ran is still answered).
+ */
+int handle_request_batch(Session *session, op_batch_header *header, const char *payload) {
+    OpBatch *response = (OpBatch *) malloc(sizeof(OpBatch));
+    if (response == NULL) {
+        perror("Error allocating memory for responses");
+        return -1;
+    }
+    initOpBatch(response, BATCH_RESPONSE_TYPE);
+    session->response = response;
+
+    c2s_send_message request;
+    size_t offset = 0;
+    unsigned int handled = 0;
+    int result = 0;
+    int next = 0;
+    while (result == 0 && handled < header->count &&
+           (next = nextBatchRequest(header, payload, &offset, &request)) == 1) {
+        handled++;
+        if (request.type == BATCH_REQUEST_TYPE) {
+            reply_error(session, request.requestId, "Batches can't be nested.");
+            continue;
+        }
+        result = handle_request(session, &request);
+    }
+    if (next == -1) {
+        printf("Malformed request batch\n");
+        result = -1;
+    }
+
+    if (response->header.count > 0) {
+        send_responses(session);
+    }
+    session->response = NULL;
+    free(response);
+    return result;
+}
+
+// ======= CONNECTIONS AND STOPPING =========== //
+
+#define STOP_TIMEOUT_SEC 5 // how long a drain or handoff waits for requests in progress
+#define HANDOFF_DRAIN_MS 200 // how long a connection's queued frames get to go out before a handoff
+
+// Readable once the server is stopping (SIGTERM/SIGINT, or a successor
+// connected on the handoff socket). Never drained: the accept loop and
+// every connection thread poll it.
+static int stop_pipe[2] = { -1, -1 };
+static volatile sig_atomic_t stop_signal = 0;
+
+// Readable after a SIGHUP, when there are rules to reload (-F). Drained by
+// the accept loop.
+static int reload_pipe[2] = { -1, -1 };
+
+// The connections being served, so a drain or handoff can find them.
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sessions_changed = PTHREAD_COND_INITIALIZER;
+static Session **sessions = NULL;
+static int session_count = 0;
+static int session_capacity = 0;
+
+static void request_stop(void) {
+    char byte = 0;
+    ssize_t written = write(stop_pipe[1], &byte, 1); // async-signal-safe
+    (void) written; // the pipe only has to be non-empty
+}
+
+static void on_stop_signal(int signo) {
+    if (stop_signal != 0) {
+        _exit(1); // second signal: don't wait for the drain
+    }
+    stop_signal = signo;
+    request_stop();
+}
+
+/**
+ * Creates the stop pipe and makes SIGTERM and SIGINT drain the server.
+ *
+ * return 0 on success, -1 on failure.
+ */
+static int install_stop_handlers(void) {
+    if (pipe(stop_pipe) == -1) {
+        perror("Error creating stop pipe");
+        return -1;
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof action);
+    action.sa_handler = on_stop_signal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGTERM, &action, NULL) == -1 || sigaction(SIGINT, &action, NULL) == -1) {
+        perror("Error installing signal handlers");
+        return -1;
+    }
+    return 0;
+}
+
+static void on_reload_signal(int signo) {
+    (void) signo;
+    char byte = 0;
+    ssize_t written = write(reload_pipe[1], &byte, 1);
+    (void) written; // a reload is pending already
+}
+
+/**
+ * Creates the reload pipe and makes SIGHUP reload the filter rules.
+ *
+ * return 0 on success, -1 on failure.
+ */
+static int install_reload_handler(void) {
+    if (pipe(reload_pipe) == -1) {
+        perror("Error creating reload pipe");
+        return -1;
+    }
+    fcntl(reload_pipe[1], F_SETFL, O_NONBLOCK);
+    struct sigaction action;
+    memset(&action, 0, sizeof action);
+    action.sa_handler = on_reload_signal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGHUP, &action, NULL) == -1) {
+        perror("Error installing signal handlers");
+        return -1;
+    }
+    return 0;
+}
+
+static int register_session(Session *session) {
+    pthread_mutex_lock(&sessions_lock);
+    if (session_count == session_capacity) {
+        int capacity = session_capacity ? session_capacity * 2 : 64;
+        Session **grown = (Session **) realloc(sessions, capacity * sizeof(Session *));
+        if (grown == NULL) {
+            pthread_mutex_unlock(&sessions_lock);
+            perror("Error growing session table");
+            return -1;
+        }
+        sessions = grown;
+        session_capacity = capacity;
+    }
+    sessions[session_count++] = session;
+    pthread_mutex_unlock(&sessions_lock);
+    return 0;
+}
+
+static void unregister_session(Session *session) {
+    // Before the table: once it is empty, main may free the admission state.
+    if (session->admission != NULL) {
+        releaseConnection(session->admission);
+    }
+    pthread_mutex_lock(&sessions_lock);
+    for (int i = 0; i < session_count; i++) {
+        if (sessions[i] == session) {
+            sessions[i] = sessions[--session_count];
+            break;
+        }
+    }
+    pthread_cond_broadcast(&sessions_changed);
+    pthread_mutex_unlock(&sessions_lock);
+}
+
+static void park_session(Session *session) {
+    pthread_mutex_lock(&sessions_lock);
+    session->parked = 1;
+    pthread_cond_broadcast(&sessions_changed);
+    pthread_mutex_unlock(&sessions_lock);
+}
+
+/**
+ * Waits for the client's next frame, or for the server to stop. A download
+ * in progress moves on by a chunk whenever there is no frame to read, so
+ * the client's requests never wait behind it.
+ *
+ * return 1 when there is input (or the connection failed: the read will
+ *        say so), 0 when the server is stopping: the connection stops at
+ *        this frame boundary.
+ */
+static int wait_for_frame(Session *session) {
+    struct pollfd fds[2];
+    fds[0].fd = stop_pipe[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = session->socketFd;
+    fds[1].events = POLLIN;
+    while (1) {
+        // Input TLS already took off the socket doesn't make it readable.
+        int pending = net_pending(session->socketFd);
+        int ready = poll(fds, 2, (pending || session->download != NULL) ? 0 : -1);
+        if (ready == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ready == 0 && !pending) {
+            if (send_download_chunk(session) == -1) {
+                return 1;
+            }
+            continue;
+        }
+        return ready == -1 || !(fds[0].revents & POLLIN);
+    }
+}
+
+/**
+ * Brings every connection to a frame boundary once the stop pipe is
+ * readable. A connection still inside a request (or a frame) after
+ * STOP_TIMEOUT_SEC is shut down, and given STOP_TIMEOUT_SEC more to end.
+ * A thread that is waiting on a lock rather than the socket may not end
+ * then; the stop goes on without it.
+ *
+ * return the number of connection threads still running: 0 if every one
+ *        has exited or parked (the parked sessions stay in sessions for
+ *        the caller to close or hand off).
+ */
+static int quiesce_sessions(void) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += STOP_TIMEOUT_SEC;
+    int forced = 0;
+    int busy = 0;
+    pthread_mutex_lock(&sessions_lock);
+    while (1) {
+        busy = 0;
+        for (int i = 0; i < session_count; i++) {
+            busy += !sessions[i]->parked;
+        }
+        if (busy == 0) {
+            break;
+        }
+        if (pthread_cond_timedwait(&sessions_changed, &sessions_lock, &deadline) != ETIMEDOUT) {
+            continue;
+        }
+        if (forced) {
+            printf("%d connections still busy %d s after closing them, stopping without them\n", busy,
+                   STOP_TIMEOUT_SEC);
+            break;
+        }
+        printf("%d connections still busy after %d s, closing them\n", busy, STOP_TIMEOUT_SEC);
+        for (int i = 0; i < session_count; i++) {
+            if (!sessions[i]->parked) {
+                shutdown(sessions[i]->socketFd, SHUT_RDWR);
+            }
+        }
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += STOP_TIMEOUT_SEC;
+        forced = 1;
+    }
+    pthread_mutex_unlock(&sessions_lock);
+    return busy;
+}
+
+/**
+ * Closes the connections quiesce_sessions() left parked (after a handoff,
+ * only this process's copies).
+ */
+static void close_sessions(void) {
+    pthread_mutex_lock(&sessions_lock);
+    for (int i = 0; i < session_count; i++) {
+        net_close(sessions[i]->socketFd);
+        free(sessions[i]);
+    }
+    free(sessions);
+    sessions = NULL;
+    session_count = 0;
+    session_capacity = 0;
+    pthread_mutex_unlock(&sessions_lock);
+}
+
+/**
+ * Waits in the accept loop for a new connection, for the next server on the
+ * handoff socket, for a stop request or for a reload.
+ *
+ * param ring           The io_uring accept ring, NULL to accept() directly.
+ * param control_socket The handoff socket (-H), -1 if none.
+ * return the descriptor that is ready: server_socket (accept now),
+ *        control_socket, stop_pipe[0] or reload_pipe[0].
+ */
+static int wait_for_event(int server_socket, Uring *ring, int control_socket) {
+    // With io_uring the connection arrives through the ring's multishot
+    // accept, so the ring is what becomes readable.
+    if (ring != NULL && uringArmAccept(ring, server_socket) == -1) {
+        return server_socket; // accept_client_uring() finds the ring broken
+    }
+    struct pollfd fds[4];
+    fds[0].fd = stop_pipe[0];
+    fds[1].fd = control_socket;
+    fds[2].fd = (ring != NULL) ? ring->fd : server_socket;
+    fds[3].fd = reload_pipe[0];
+    for (int i = 0; i < 4; i++) {
+        fds[i].events = POLLIN;
+        fds[i].revents = 0;
+    }
+    while (poll(fds, 4, -1) == -1) {
+        if (errno != EINTR) {
+            perror("Error waiting for connections");
+            return server_socket;
+        }
+    }
+    if (fds[0].revents & POLLIN) {
+        return stop_pipe[0];
+    }
+    if (fds[1].revents & POLLIN) {
+        return control_socket;
+    }
+    if (fds[3].revents & POLLIN) {
+        return reload_pipe[0];
+    }
+    return server_socket;
+}
+
+/**
+ * Starts the thread serving a connection.
+ *
+ * return 0 on success, -1 on failure (the connection is closed).
+ */
+static int start_session(Session *session) {
+    if (register_session(session) == -1) {
+        if (session->admission != NULL) {
+            releaseConnection(session->admission);
+        }
+        net_close(session->socketFd);
+        free(session);
+        return -1;
+    }
+    // Added By: Aedan
+    // Creating a new thread for each client connection
+    pthread_t thread_id;
+    if (pthread_create(&thread_id, NULL, start_subserver, (void *) session) != 0) {
+        perror("Error creating thread\n");
+        unregister_session(session);
+        net_close(session->socketFd);
+        free(session);
+        return -1;
+    }
+
+    // Detaching the thread allows thread resources to be auto released on termination
+    pthread_detach(thread_id);
+    return 0;
+}
+
 // Added By: Daniel & Aedan
 /**
  * Manages the client connection in a loop, processing incoming messages and appending them 
@@ -67,330 +2086,955 @@ void *start_subserver (void *session_data) {
 
     Session *session = (Session *) session_data;
     int client_socket = session->socketFd;
-    MessageList *messageList = session->messageList;
-    UserList *userList = session->userList;
+    char *batch_payload = NULL; // allocated with the first request batch
+    char *chunk_payload = NULL; // allocated with the first upload chunk
 
-    // Registration handling: Ensure user is registered before processing messages
-    int isRegistered = 0;
+    // Run next to the fan-out worker that sends to this client; buffers
+    // allocated from here on come from that CPU's node.
+    int cpu = fanoutCpu(session->fanout, client_socket);
+    if (cpu >= 0) {
+        pinThreadToCpu(pthread_self(), cpu);
+    }
+
+    // An inherited connection (-H) keeps what it negotiated.
+    if (!session->resumed) {
+        // Descriptors are reused: a new connection starts uncompressed.
+        compress_set(client_socket, 0);
+
+        // Handshake here rather than in the accept loop so one slow client
+        // can't stall new connections.
+        if (tls_server_enabled()) {
+            if (tls_accept_client(client_socket) == -1) {
+                unregister_session(session);
+                net_close(client_socket);
+                free(session);
+                pthread_exit(NULL);
+            }
+            tls_print_connection(client_socket);
+        }
+    }
+    if (session->capture != NULL) {
+        session->connectionId = captureOpen(session->capture);
+    }
+    if (session->resumed && session->user != NULL) {
+        // Back into the live fan-out, after what the previous server
+        // hadn't sent yet.
+        go_online(session);
+    }
 
+    int parked = 0;
     while (1) {
+        // A drain or handoff stops the connection between two frames.
+        if (!wait_for_frame(session)) {
+            parked = 1;
+            break;
+        }
 
         // Initialize client message
         c2s_send_message client_message;
+        op_batch_header batch_header;
+        blob_chunk_header chunk_header;
 
-        // Receive message from client
-        int bytes_received = recv(client_socket, &client_message, sizeof(client_message), 0);
+        // Receive message from client. The type comes first and decides the
+        // frame size (an exit frame is only the type, a batch is a header
+        // and its payload).
+        int bytes_received = net_recv_all(client_socket, &client_message.type, sizeof(int));
+        if (bytes_received > 0 && client_message.type == BATCH_REQUEST_TYPE) {
+            batch_header.type = BATCH_REQUEST_TYPE;
+            bytes_received = net_recv_all(client_socket, (char *) &batch_header + sizeof(int),
+                                          sizeof(batch_header) - sizeof(int));
+            if (bytes_received > 0 && batch_header.length > BATCH_MAX_BYTES) {
+                printf("Request batch too large\n");
+                break;
+            }
+            if (batch_payload == NULL && (batch_payload = (char *) malloc(BATCH_MAX_BYTES)) == NULL) {
+                perror("Error allocating memory for batch");
+                break;
+            }
+            if (bytes_received > 0 && batch_header.length > 0) {
+                bytes_received = net_recv_all(client_socket, batch_payload, batch_header.length);
+            }
+        } else if (bytes_received > 0 && client_message.type == BLOB_CHUNK_TYPE) {
+            chunk_header.type = BLOB_CHUNK_TYPE;
+            bytes_received = net_recv_all(client_socket, (char *) &chunk_header + sizeof(int),
+                                          sizeof(chunk_header) - sizeof(int));
+            if (bytes_received > 0 && chunk_header.length > BLOB_CHUNK_SIZE) {
+                printf("Upload chunk too large\n");
+                break;
+            }
+            if (chunk_payload == NULL && (chunk_payload = (char *) malloc(BLOB_CHUNK_SIZE)) == NULL) {
+                perror("Error allocating memory for upload");
+                break;
+            }
+            if (bytes_received > 0 && chunk_header.length > 0) {
+                bytes_received = net_recv_all(client_socket, chunk_payload, chunk_header.length);
+            }
+        } else if (bytes_received > 0 && client_message.type != EXIT_TYPE) {
+            bytes_received = net_recv_all(client_socket, (char *) &client_message + sizeof(int),
+                                          sizeof(client_message) - sizeof(int));
+            client_message.message[BUFFER_SIZE - 1] = '\0';
+        }
         if (bytes_received == -1) {
             perror("Error receiving message from client\n");
             break;
         } else if (bytes_received == 0) {
-            printf("Client disconnected. Waiting for a new connection...\n");
-            if (session->user != NULL) {
-                session->user->isOnline = 0; // Set user as offline
-            }
+            log_debug("Client disconnected. Waiting for a new connection...\n");
             break;
         }
+        if (session->capture != NULL) {
+            // The frame exactly as it was read
+            if (client_message.type == BATCH_REQUEST_TYPE) {
+                captureFrame(session->capture, session->connectionId, &batch_header, sizeof(batch_header),
+                             batch_payload, batch_header.length);
+            } else if (client_message.type == BLOB_CHUNK_TYPE) {
+                captureFrame(session->capture, session->connectionId, &chunk_header, sizeof(chunk_header),
+                             chunk_payload, chunk_header.length);
+            } else {
+                captureFrame(session->capture, session->connectionId, &client_message,
+                             (client_message.type == EXIT_TYPE) ? sizeof(int) : sizeof(client_message), NULL, 0);
+            }
+        }
         
-        // Process client message
-        if (client_message.type == REGISTRATION_TYPE) {
+        if (client_message.type == BATCH_REQUEST_TYPE) {
+            if (handle_request_batch(session, &batch_header, batch_payload) == -1) {
+                break;
+            }
+        } else if (client_message.type == BLOB_CHUNK_TYPE) {
+            if (handle_blob_chunk(session, &chunk_header, chunk_payload) == -1) {
+                break;
+            }
+        } else if (handle_request(session, &client_message) == -1) {
+            break;
+        }
+    }
+    free(batch_payload);
+    free(chunk_payload);
+    end_transfers(session);
+    if (session->capture != NULL) {
+        captureClose(session->capture, session->connectionId);
+    }
+    if (parked) {
+        // The main thread closes the connection or hands it off, after the
+        // fan-out delivered what is queued for it.
+        park_session(session);
+        pthread_exit(NULL);
+    }
+    // Set user as offline; no fan-out worker sends to the socket after this
+    if (session->user != NULL) {
+        take_offline(session);
+    }
+    net_close(client_socket);
+    unregister_session(session);
+    log_debug("Client disconnected. Waiting for a new connection...\n");
+    // Daniel: Freeing session causes userList and messageList to be freed prematurely
+    // freeSession needs rework 
+    // freeSession(session);
+    pthread_exit(NULL);
+    return 0;
+}
 
-            // Create user and append to userList
-            char *email = strtok(client_message.message, " ");
-            char *name = strtok(NULL, " ");
-            char *raw_password = strtok(NULL, " ");
+// ======= REPLAY (-P) =========== //
 
-            // Encode password
-            char* password = encode(raw_password);
-            // DEBUG
-            if (password == NULL) {
-               perror("Error encoding password\n");
-               break;
-            }
-            // Cheks if email already exists in the userList
-            User *existing_user = userList->first;
-            int email_exists = 0;
-            while (existing_user != NULL) {
-                if (strcmp(existing_user->email, email) == 0) {
-                    email_exists = 1;
-                    break;
-                }
-                existing_user = existing_user->next;
-            }
-
-            User *user = createUser(email, name, password, client_socket);
-            if (email_exists) {
-                printf("Email already exists: %s\n", email);
-                send_error(client_socket, "Email already exists. Please try again.");
-            } else if (user != NULL) {
-                appendUser(userList, user);
-                printf("Client registered with email: %s, name: %s\n", user->email, user->name);
-                session->user = user; // Set user for session
-                send_ack(client_socket);
-                isRegistered = 1;
-            } else {
-                printf("Error creating user\n");
-                send_error(client_socket, "Error creating user. Please try again.");
-            }
-            // free(password);
-            // free(raw_password);
-
-        } else if (client_message.type == LOGIN_TYPE) {
-            // Handle login with mutex protection
-
-            // Create user and append to userList
-            char *email = strtok(client_message.message, " ");
-            char *password = strtok(NULL, " ");
-
-            // Cheks if email already exists in the userList
-            User *existing_user = userList->first;
-            int email_exists = 0;
-            while (existing_user != NULL) {
-                if (strcmp(existing_user->email, email) == 0) {
-                    email_exists = 1;
-                    break;
-                }
-                existing_user = existing_user->next;
-            }
+#define REPLAY_OTHER (EXIT_TYPE + 1) // stats slot of unknown request types
 
-            if (!email_exists) {
-                printf("Email does not exist: %s\n", email);
-                send_error(client_socket, "Email does not exist. Please try again.");
-            } else {
-                // Check password
-                if (authenticate(password, existing_user->password)) {
-                    // Restore user's socket file descriptor
-                    existing_user->socketFd = client_socket;
-                    printf("Client logged in with email: %s\n", existing_user->email);
-                    existing_user->isOnline = 1; // Set user as online
-                    session->user = existing_user; // Set user for session
-                    send_ack(client_socket);
-                    isRegistered = 1;
-                } else {
-                    printf("Incorrect password for email: %s\n", existing_user->email);
-                    send_error(client_socket, "Incorrect password. Please try again.");
-                }
-            }
-            // Unlock mutex
-        } else if (!isRegistered) {
-            printf("Client is not registered. Ignoring message.\n");
+/**
+ * Struct name: OpcodeStats
+ * Description: Dispatch times of one request type during a replay.
+ */
+typedef struct {
+    double *samples; // seconds
+    long count;
+    long capacity;
+    double total;
+} OpcodeStats;
+
+static const char *opcode_name(int type) {
+    switch (type) {
+    case LOGIN_TYPE: return "login";
+    case REGISTRATION_TYPE: return "register";
+    case MESSAGE_TYPE: return "message";
+    case REQUEST_ALL_MESSAGES_TYPE: return "all";
+    case JOIN_GROUP_TYPE: return "join";
+    case CLIENT_ACK_TYPE: return "ack";
+    case SYNC_TYPE: return "sync";
+    case COMPRESS_TYPE: return "compress";
+    case BATCH_REQUEST_TYPE: return "batch";
+    case EVENT_TYPE: return "event";
+    case CREATE_GROUP_TYPE: return "create";
+    case LEAVE_GROUP_TYPE: return "leave";
+    case LIST_GROUPS_TYPE: return "groups";
+    case ROSTER_TYPE: return "roster";
+    case DIRECT_MESSAGE_TYPE: return "direct";
+    case DIRECT_HISTORY_TYPE: return "dhistory";
+    case UPLOAD_TYPE: return "upload";
+    case BLOB_CHUNK_TYPE: return "chunk";
+    case DOWNLOAD_TYPE: return "download";
+    case POST_TYPE: return "post";
+    case EXIT_TYPE: return "exit";
+    default: return "other";
+    }
+}
+
+static double monotonic_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_samples(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static void add_sample(OpcodeStats *stats, double seconds) {
+    if (stats->count == stats->capacity) {
+        long capacity = stats->capacity ? stats->capacity * 2 : 1024;
+        double *samples = (double *) realloc(stats->samples, capacity * sizeof(double));
+        if (samples == NULL) {
+            return;
         }
-        else if (client_message.type == MESSAGE_TYPE) {
-            printf("Client sent: %s\n", client_message.message);
+        stats->samples = samples;
+        stats->capacity = capacity;
+    }
+    stats->samples[stats->count++] = seconds;
+    stats->total += seconds;
+}
 
-            // Parse group name and message from the client message (Aedan)
-            char group_name[BUFFER_SIZE];
-            char msg_content[BUFFER_SIZE];
+// Plays the client's side of a replayed connection: reads and discards
+// whatever the server sends, so its sends never block for long.
+static void *drain_replay_socket(void *arg) {
+    int fd = (int) (long) arg;
+    char buffer[16384];
+    while (recv(fd, buffer, sizeof buffer, 0) > 0) {
+    }
+    close(fd);
+    return NULL;
+}
 
-            sscanf(client_message.message, "%s %[^\n]", group_name, msg_content);
+static Session *open_replay_connection(Session *base) {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1) {
+        perror("Error creating replay socket");
+        return NULL;
+    }
+    pthread_t thread_id;
+    if (pthread_create(&thread_id, NULL, drain_replay_socket, (void *) (long) pair[1]) != 0) {
+        perror("Error creating thread\n");
+        close(pair[0]);
+        close(pair[1]);
+        return NULL;
+    }
+    pthread_detach(thread_id);
+    Session *session = (Session *) malloc(sizeof(Session));
+    if (session == NULL) {
+        close(pair[0]); // the drain thread closes the other end
+        return NULL;
+    }
+    *session = *base;
+    session->socketFd = pair[0];
+    compress_set(pair[0], 0);
+    return session;
+}
 
-            // Check if user is in the group (Aedan)
-            Group *current_group = session->user->groups;
-            int in_group = 0;
-            while (current_group != NULL) {
-                if (strcmp(current_group->name, group_name) == 0) {
-                    in_group = 1;
-                    break;
-                }
-                current_group = current_group->next;
-            }
+static void close_replay_connection(Session *session) {
+    end_transfers(session);
+    if (session->user != NULL) {
+        take_offline(session);
+    }
+    net_close(session->socketFd);
+    free(session);
+}
 
-            if (!in_group) {
-                printf("User %s is not in group %s\n", session->user->name, group_name);
-                send_error(client_socket, "You are not in this group.");
-                continue;
-            }
+/**
+ * Replays a capture (-R) through the request dispatcher, with socket pairs
+ * in place of client connections, and prints how long each request type
+ * took to handle. Run it on a copy of the data directory as it was when the
+ * capture started: the replay writes to it like live traffic would.
+ *
+ * param speed 1 keeps the captured timing, 10 plays ten times faster, 0
+ *             sends every frame as soon as the previous one is handled.
+ * return 0 on success, -1 if the capture can't be read.
+ */
+int replay_capture(const char *path, double speed, Session *base) {
+    FILE *file = openCaptureReader(path);
+    char *frame = (char *) malloc(CAPTURE_MAX_FRAME);
+    Session **connections = NULL;
+    unsigned int capacity = 0;
+    OpcodeStats stats[REPLAY_OTHER + 1];
+    long frames = 0;
+    int result = 0;
+    if (file == NULL || frame == NULL) {
+        if (file != NULL) {
+            fclose(file);
+        }
+        free(frame);
+        return -1;
+    }
+    memset(stats, 0, sizeof stats);
 
-            // Create message and append to msgList
-            char *msgString = strdup(client_message.message);
-            Message *msg = createMessage(msgString, session->user);
-            // DEBUG
-            if (msg == NULL) {
-                perror("Error creating message\n");
+    CaptureRecord record;
+    int status;
+    double start = monotonic_sec();
+    while ((status = readCaptureRecord(file, &record, frame)) == 1) {
+        if (speed > 0) {
+            double wait = start + record.timestamp / 1e9 / speed - monotonic_sec();
+            if (wait > 0) {
+                struct timespec ts;
+                ts.tv_sec = (time_t) wait;
+                ts.tv_nsec = (long) ((wait - ts.tv_sec) * 1e9);
+                nanosleep(&ts, NULL);
+            }
+        }
+        if (record.connection >= capacity) {
+            unsigned int grown = (record.connection + 1 > 2 * capacity) ? record.connection + 1 : 2 * capacity;
+            Session **table = (Session **) realloc(connections, grown * sizeof(Session *));
+            if (table == NULL) {
+                perror("Error allocating replay connections");
+                result = -1;
                 break;
             }
-            appendMessage(messageList, msg);
-
-            // Send message to all users in the selected group (Aedan)
-            User *user_ptr = userList->first;
-            while (user_ptr != NULL) {
-                if (user_ptr->isOnline) {
-                    Group *user_group = user_ptr->groups;
-                    while (user_group != NULL) {
-                        if (strcmp(user_group->name, group_name) == 0) {
-                            user_message msg_to_send;
-                            msg_to_send.type = PRINT_MESSAGE_TYPE;
-                            strncpy(msg_to_send.name, session->user->name, BUFFER_SIZE - 1);
-                            msg_to_send.name[BUFFER_SIZE - 1] = '\0'; // Ensure null-termination
-                            strncpy(msg_to_send.message, msg_content, BUFFER_SIZE - 1);
-                            msg_to_send.message[BUFFER_SIZE - 1] = '\0'; // Ensure null-termination
-                            
-                            // Send the message to the user
-                            if (send(user_ptr->socketFd, &msg_to_send, sizeof(user_message), 0) == -1) {
-                                perror("Error sending message to client\n");
-                            }
-                            break;
-                        }
-                        user_group = user_group->next;
-                    }
+            memset(table + capacity, 0, (grown - capacity) * sizeof(Session *));
+            connections = table;
+            capacity = grown;
+        }
+        Session **slot = &connections[record.connection];
+
+        if (record.kind == CAPTURE_OPEN) {
+            if (*slot == NULL) {
+                *slot = open_replay_connection(base);
+            }
+        } else if (record.kind == CAPTURE_CLOSE) {
+            if (*slot != NULL) {
+                close_replay_connection(*slot);
+                *slot = NULL;
+            }
+        } else if (*slot != NULL && record.length >= sizeof(int)) {
+            int type;
+            int keep;
+            memcpy(&type, frame, sizeof(int));
+            double begin = monotonic_sec();
+            if (type == BATCH_REQUEST_TYPE) {
+                op_batch_header header;
+                if (record.length < sizeof(header)) {
+                    continue;
+                }
+                memcpy(&header, frame, sizeof(header));
+                if (header.length != record.length - sizeof(header)) {
+                    continue;
+                }
+                keep = handle_request_batch(*slot, &header, frame + sizeof(header));
+            } else if (type == BLOB_CHUNK_TYPE) {
+                blob_chunk_header header;
+                if (record.length < sizeof(header)) {
+                    continue;
+                }
+                memcpy(&header, frame, sizeof(header));
+                if (header.length != record.length - sizeof(header)) {
+                    continue;
+                }
+                keep = handle_blob_chunk(*slot, &header, frame + sizeof(header));
+            } else {
+                c2s_send_message request;
+                memset(&request, 0, sizeof request);
+                memcpy(&request, frame, (record.length < sizeof request) ? record.length : sizeof request);
+                request.message[BUFFER_SIZE - 1] = '\0';
+                keep = handle_request(*slot, &request);
+                // There is no connection loop to interleave a download with.
+                while (keep == 0 && (*slot)->download != NULL) {
+                    keep = send_download_chunk(*slot);
                 }
-                user_ptr = user_ptr->next;
             }
-
-            send_ack(client_socket);
-        } else if (client_message.type == EXIT_TYPE) {
-            printf("Client requested to exit. Closing connection...\n");
-            if (session->user != NULL) {
-                session->user->isOnline = 0; // Set user as offline
+            add_sample(&stats[(type >= 0 && type <= EXIT_TYPE) ? type : REPLAY_OTHER], monotonic_sec() - begin);
+            frames++;
+            if (keep == -1) {
+                close_replay_connection(*slot);
+                *slot = NULL;
             }
-            break;
         }
-        else if (client_message.type == REQUEST_ALL_MESSAGES_TYPE) {
-            printf("Client requested all messages\n");
+    }
+    if (status == -1) {
+        printf("Capture file %s is corrupt; replay stopped there\n", path);
+        result = -1;
+    }
+    double elapsed = monotonic_sec() - start;
+    for (unsigned int i = 0; i < capacity; i++) {
+        if (connections[i] != NULL) {
+            close_replay_connection(connections[i]);
+        }
+    }
 
-            // Loop through and send every message in the MessageList to the client
-            Message *ptr = messageList->first;
-            while (ptr != NULL) {
-                // DEBUG
-                if (ptr->sender == NULL || ptr->message == NULL) {
-                    printf("Error: Null sender or message in message list\n");
-                    break;
-                }
+    printf("Replayed %ld frames in %.2f s (%.0f frames/s)\n", frames, elapsed, frames / elapsed);
+    printf("%-10s %9s %10s %10s %10s %10s\n", "request", "count", "mean ms", "p50 ms", "p99 ms", "max ms");
+    for (int type = 0; type <= REPLAY_OTHER; type++) {
+        OpcodeStats *entry = &stats[type];
+        if (entry->count == 0) {
+            continue;
+        }
+        qsort(entry->samples, entry->count, sizeof(double), compare_samples);
+        printf("%-10s %9ld %10.3f %10.3f %10.3f %10.3f\n", opcode_name(type),
+               entry->count, entry->total / entry->count * 1e3, entry->samples[entry->count / 2] * 1e3,
+               entry->samples[entry->count * 99 / 100] * 1e3, entry->samples[entry->count - 1] * 1e3);
+        free(entry->samples);
+    }
+    free(connections);
+    free(frame);
+    fclose(file);
+    return result;
+}
 
-                user_message msg_to_send;
-                msg_to_send.type = PRINT_MESSAGE_TYPE;
-                strncpy(msg_to_send.name, ptr->sender->name, BUFFER_SIZE - 1);
-                msg_to_send.name[BUFFER_SIZE - 1] = '\0'; // Ensure null-termination
-                strncpy(msg_to_send.message, ptr->message, BUFFER_SIZE - 1);
-                msg_to_send.message[BUFFER_SIZE - 1] = '\0'; // Ensure null-termination
+// ======= HOT RESTART (-H) =========== //
 
-                // Debug
-                printf("sending message from user: %s\n", session->user->name);
+/**
+ * Struct name: InheritedConnection
+ * Description: A client connection received from the previous server, with
+ *              the state it had there.
+ */
+typedef struct {
+    int fd;
+    HandoffConnection *state;
+} InheritedConnection;
 
-                if (send(client_socket, &msg_to_send, sizeof(user_message), 0) == -1) {
-                    perror("Error sending message to client\n");
-                    break;
-                }
-                ptr = ptr->next;
-            }
-
-            // Send an end-of-messages indicator
-            user_message end_msg;
-            end_msg.type = PRINT_MESSAGE_TYPE;
-            snprintf(end_msg.message, BUFFER_SIZE, "END_OF_MESSAGES");
-            end_msg.name[0] = '\0'; // No user for end of messages
-            if (send(client_socket, &end_msg, sizeof(user_message), 0) == -1) {
-                perror("Error sending end-of-messages indicator to client\n");
-            }
-
-            // Send acknowledgment to client
-            send_ack(client_socket);
-        } else if (client_message.type == JOIN_GROUP_TYPE) {
-            printf("Client requested to join a group\n");
-
-            // Parse the group name from the message
-            char group_name[BUFFER_SIZE];
-            sscanf(client_message.message, "%s", group_name);
-
-            // Update the user's group information
-            if (session->user != NULL) {
-                // Check to see if the group is already joined by user
-                Group *current_group = session->user->groups;
-                int already_in_group = 0;
-                while (current_group != NULL) {
-                    if (strcmp(current_group->name, group_name) == 0) {
-                        already_in_group = 1;
-                        break;
-                    }
-                    current_group = current_group->next;
+/**
+ * Hands the listening socket and every parked connection to the server at
+ * the other end of channel (see hot-restart.h). Call after the fan-out
+ * delivered its queues and the state is on disk. Connections with TLS can't
+ * move, and neither can one whose client doesn't take the frames still
+ * queued for it (its sentSeq counts them): both are left out (closed by
+ * close_sessions()).
+ *
+ * return 0 once the new server confirmed it has everything, -1 on failure.
+ */
+static int hand_off(int channel, int server_socket) {
+    HandoffConnection *record = (HandoffConnection *) malloc(sizeof(HandoffConnection));
+    char *movable = (char *) calloc(session_count + 1, 1);
+    if (record == NULL || movable == NULL) {
+        perror("Error allocating handoff record");
+        free(record);
+        free(movable);
+        return -1;
+    }
+    HandoffHeader header;
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, HANDOFF_MAGIC, sizeof header.magic);
+    for (int i = 0; i < session_count; i++) {
+        int fd = sessions[i]->socketFd;
+        movable[i] = !tls_is_active(fd) && net_drain(fd, HANDOFF_DRAIN_MS) == 0;
+        header.connections += movable[i];
+    }
+    int result = sendHandoffRecord(channel, server_socket, &header, sizeof header);
+    for (int i = 0; i < session_count && result == 0; i++) {
+        Session *session = sessions[i];
+        if (!movable[i]) {
+            continue;
+        }
+        memset(record, 0, sizeof(HandoffConnection));
+        record->compressed = compress_enabled(session->socketFd);
+        if (session->user != NULL && session->device != NULL) {
+            User *user = session->user;
+            strncpy(record->email, user->email, BUFFER_SIZE - 1);
+            if (session->device->name != NULL) {
+                strncpy(record->device, session->device->name, DEVICE_NAME_SIZE - 1);
+            }
+            pthread_mutex_lock(user_lock(user));
+            for (Group *member = user->groups;
+                 member != NULL && record->groupCount < HANDOFF_MAX_GROUPS; member = member->next) {
+                DeviceCursor *cursor = getDeviceCursor(session->device, member);
+                if (cursor != NULL) {
+                    HandoffGroup *group = &record->groups[record->groupCount++];
+                    strncpy(group->name, member->name, GROUP_NAME_SIZE - 1);
+                    group->sentSeq = cursor->sentSeq;
                 }
+            }
+            pthread_mutex_unlock(user_lock(user));
+        }
+        result = sendHandoffRecord(channel, session->socketFd, record,
+                                   handoffConnectionSize(record->groupCount));
+    }
+    free(record);
+    free(movable);
 
-                if(!already_in_group) {
-                    // Add user to group
-                    Group *new_group = (Group *) malloc(sizeof(Group));
-                    if (new_group == NULL) {
-                        perror("Error allocating memory for group\n");
-                        send_error(client_socket, "Error joining group. Please try again.");
-                        break;
-                    }
-                    new_group->name = strdup(group_name);
-                    new_group->next = session->user->groups;
-                    session->user->groups = new_group;
-                    printf("User %s joined group %s\n", session->user->name, group_name);
-                    send_ack(client_socket);
-                } else {
-                    printf("User %s is already in group %s\n", session->user->name, group_name);
-                    send_error(client_socket, "You are already in this group.");
-                }
-            } else {
-                printf("User is not registered. Cannot join group.\n");
-                send_error(client_socket, "User is not registered. Cannot join group.");
+    char confirmation;
+    int fd;
+    if (result == 0 && receiveHandoffRecord(channel, &fd, &confirmation, 1) != 1) {
+        printf("The new server didn't confirm the handoff\n");
+        result = -1;
+    }
+    if (result == 0) {
+        printf("Handed off %u connections\n", header.connections);
+    }
+    return result;
+}
+
+/**
+ * Takes over from the server at the other end of channel: receives its
+ * listening socket and connections, then confirms, after which the old
+ * server exits. The old server wrote its state before sending, so this
+ * comes before the data directory is opened.
+ *
+ * param connections Set to the inherited connections (free() each state and the array).
+ * return the listening socket, or -1 if the handoff failed.
+ */
+static int inherit_server(int channel, InheritedConnection **connections, int *count) {
+    HandoffHeader header;
+    int server_socket;
+    *connections = NULL;
+    *count = 0;
+    if (receiveHandoffRecord(channel, &server_socket, &header, sizeof header) != sizeof header ||
+        server_socket == -1 || memcmp(header.magic, HANDOFF_MAGIC, sizeof header.magic) != 0) {
+        printf("Invalid handoff from the running server\n");
+        if (server_socket != -1) {
+            close(server_socket);
+        }
+        return -1;
+    }
+    InheritedConnection *received = (InheritedConnection *) calloc(header.connections + 1, sizeof(InheritedConnection));
+    HandoffConnection *record = (HandoffConnection *) malloc(sizeof(HandoffConnection));
+    int result = (received != NULL && record != NULL) ? 0 : -1;
+    unsigned int n = 0;
+    while (result == 0 && n < header.connections) {
+        int fd;
+        ssize_t length = receiveHandoffRecord(channel, &fd, record, sizeof(HandoffConnection));
+        if (length < (ssize_t) handoffConnectionSize(0) || fd == -1 || record->groupCount > HANDOFF_MAX_GROUPS ||
+            length != (ssize_t) handoffConnectionSize(record->groupCount) ||
+            (received[n].state = (HandoffConnection *) malloc(length)) == NULL) {
+            printf("Invalid handoff record\n");
+            if (fd != -1) {
+                close(fd);
             }
-                
-        } else {
-            printf("Client sent invalid message type: %d\n", client_message.type);
+            result = -1;
+            break;
         }
+        record->email[BUFFER_SIZE - 1] = '\0';
+        record->device[DEVICE_NAME_SIZE - 1] = '\0';
+        for (unsigned int i = 0; i < record->groupCount; i++) {
+            record->groups[i].name[GROUP_NAME_SIZE - 1] = '\0';
+        }
+        memcpy(received[n].state, record, length);
+        received[n].fd = fd;
+        n++;
     }
-    close(client_socket);
-    printf("Client disconnected. Waiting for a new connection...\n");
-    // Daniel: Freeing session causes userList and messageList to be freed prematurely
-    // freeSession needs rework 
-    // freeSession(session);
-    pthread_exit(NULL);
-    return 0;
+    free(record);
+    char confirmation = 1;
+    if (result == 0) {
+        result = sendHandoffRecord(channel, -1, &confirmation, 1);
+    }
+    if (result == -1) {
+        for (unsigned int i = 0; i < n; i++) {
+            close(received[i].fd);
+            free(received[i].state);
+        }
+        free(received);
+        close(server_socket);
+        return -1;
+    }
+    *connections = received;
+    *count = n;
+    return server_socket;
+}
+
+/**
+ * Serves a connection inherited from the previous server: restores its
+ * compression, its device and the device's delivery positions and starts
+ * the connection's thread.
+ */
+static void resume_connection(InheritedConnection *connection, Session *base) {
+    HandoffConnection *state = connection->state;
+    Session *session = (Session *) malloc(sizeof(Session));
+    if (session == NULL) {
+        perror("Error allocating session");
+        close(connection->fd);
+        return;
+    }
+    *session = *base;
+    session->socketFd = connection->fd;
+    session->resumed = 1;
+    compress_set(connection->fd, state->compressed);
+    if (state->email[0] != '\0') {
+        pthread_mutex_lock(&userList_mutex);
+        User *user = findUser(base->userList, state->email);
+        pthread_mutex_unlock(&userList_mutex);
+        if (user == NULL) {
+            printf("Inherited connection of unknown user %s, closing it\n", state->email);
+            close(connection->fd);
+            free(session);
+            return;
+        }
+        session->user = user; // start_subserver() puts the device back online
+        if (attach_device(session, state->device[0] != '\0' ? state->device : NULL) == -1) {
+            printf("Inherited connection of %s has no room for its device, closing it\n", state->email);
+            close(connection->fd);
+            free(session);
+            return;
+        }
+        for (unsigned int i = 0; i < state->groupCount; i++) {
+            Group *member = find_membership(user, state->groups[i].name, NULL);
+            if (member == NULL) {
+                continue;
+            }
+            pthread_mutex_lock(user_lock(user));
+            DeviceCursor *cursor = getDeviceCursor(session->device, member);
+            if (cursor != NULL && state->groups[i].sentSeq > cursor->sentSeq) {
+                cursor->sentSeq = state->groups[i].sentSeq;
+            }
+            pthread_mutex_unlock(user_lock(user));
+        }
+    }
+    if (session->admission != NULL) {
+        admitConnection(session->admission, 1, NULL); // already served: never refused
+    }
+    start_session(session);
+}
+
+static void print_usage(const char *program) {
+    printf("Usage: %s [-C cert.pem -K key.pem] [-d datadir] [-w workers] [-a cpus] [-U] [-R capture] "
+           "[-H handoff.sock] [-m max connections] [-F rules] [-A admin.sock] <hostname> <port>\n", program);
+    printf("       %s [-d datadir] [-w workers] [-F rules] -P capture [-x speed]\n", program);
 }
 
 /**
  * Main function to start the server and handle client connections.
  *
  * param argc Number of command-line arguments.
- * param argv Array of command-line arguments. The first argument should be the hostname,
- *            and the second argument should be the port number.
+ * param argv Array of command-line arguments. Options: -C <cert.pem> -K <key.pem> enable TLS.
+ *            -w <workers> sets the number of fan-out threads, -a <cpus> (e.g. 0-7,16-23)
+ *            pins them and the connection threads, -U uses io_uring where available,
+ *            -R <file> records inbound traffic. -P <file> replays a recording instead
+ *            of serving (-x <speed>: 1 = as captured, 0 = flat out). -H <path> takes
+ *            over from the server listening there, if any, and listens there for
+ *            the next one (hot restart). -m <n> serves at most n connections at once.
+ *            -F <file> blocks messages matching the patterns in file (reloaded on SIGHUP).
+ *            -A <path> listens there for admin commands.
+ *            The remaining arguments should be the hostname and the port number.
  * return 0 on successful execution.
  */
 int main(int argc, char *argv[]) {
-    int server_socket;  // http server socket
+    int server_socket = -1;  // http server socket
     int client_socket;  // client connection
     UserList userList;
     MessageList messageList;
+    GroupList groupList;
+    DirectList directList;
+    UserStore userStore;
+    MessageLog messageLog;
+    DirectLog directLog;
+    BlobStore blobStore;
+    Admission admission;
+    int max_sessions = 0; // default: ADMISSION_MAX_SESSIONS, within the descriptor limit
+    MessageFilter filter;
+    char *filter_file = NULL;
+    AdminSocket admin;
+    char *admin_path = NULL;
+    char *data_dir = "chat-data";
+    char *cert_file = NULL;
+    char *key_file = NULL;
+    int workers = 0; // default: one per CPU in the -a list, or per online CPU
+    CpuList cpus;
+    char *cpu_spec = NULL;
+    int use_uring = 0;
+    Uring accept_ring;
+    char *capture_file = NULL;
+    char *replay_file = NULL;
+    double speed = 1;
+    TrafficCapture capture;
+    FanoutPool fanout;
+    char *handoff_path = NULL;
+    int control_socket = -1;            // where the next server connects (-H)
+    int successor = -1;                 // the next server, once it connected
+    InheritedConnection *inherited = NULL;
+    int inherited_count = 0;
+    int exit_code = 0;
+    int stuck = 0; // connection threads that didn't stop (quiesce_sessions())
+    int opt;
+
+    while ((opt = getopt(argc, argv, "C:K:d:w:a:UR:P:x:H:m:F:A:")) != -1) {
+        switch (opt) {
+        case 'C':
+            cert_file = optarg;
+            break;
+        case 'K':
+            key_file = optarg;
+            break;
+        case 'd':
+            data_dir = optarg;
+            break;
+        case 'w':
+            workers = atoi(optarg);
+            break;
+        case 'a':
+            cpu_spec = optarg;
+            break;
+        case 'U':
+            use_uring = 1;
+            break;
+        case 'R':
+            capture_file = optarg;
+            break;
+        case 'P':
+            replay_file = optarg;
+            break;
+        case 'x':
+            speed = atof(optarg);
+            break;
+        case 'H':
+            handoff_path = optarg;
+            break;
+        case 'm':
+            max_sessions = atoi(optarg);
+            break;
+        case 'F':
+            filter_file = optarg;
+            break;
+        case 'A':
+            admin_path = optarg;
+            break;
+        default:
+            print_usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind != ((replay_file != NULL) ? 0 : 2) || (cert_file == NULL) != (key_file == NULL)) {
+        print_usage(argv[0]);
+        exit(1);
+    }
+    // sendfile() has no MSG_NOSIGNAL: a client that hangs up during a
+    // download must cost an EPIPE, not the server.
+    signal(SIGPIPE, SIG_IGN);
+    if (cpu_spec != NULL && parseCpuList(cpu_spec, &cpus) == -1) {
+        printf("Invalid CPU list: %s (expected e.g. 0-7,16-23)\n", cpu_spec);
+        exit(1);
+    }
+    if (capture_file != NULL && openCapture(&capture, capture_file) == -1) {
+        exit(1);
+    }
+    if (filter_file != NULL && openMessageFilter(&filter, filter_file) == -1) {
+        printf("Error loading filter rules from %s\n", filter_file);
+        exit(1);
+    }
+    if (cert_file != NULL && tls_server_init(cert_file, key_file) == -1) {
+        printf("Error setting up TLS\n");
+        exit(1);
+    }
+
+    // A running server hands over its sockets only after writing its state,
+    // so this comes before the data directory is read.
+    if (handoff_path != NULL && replay_file == NULL) {
+        int channel = connectHandoff(handoff_path);
+        if (channel != -1) {
+            printf("Taking over from the server at %s\n", handoff_path);
+            server_socket = inherit_server(channel, &inherited, &inherited_count);
+            close(channel);
+            if (server_socket == -1) {
+                printf("Error taking over from the running server\n");
+                exit(1);
+            }
+        }
+    }
 
     initUserList(&userList);
     initMessageList(&messageList);
+    initGroupList(&groupList);
+    initDirectList(&directList);
 
-    server_socket = start_server(argv[1], argv[2], BACKLOG);
-    if (server_socket == -1) {
-        printf("Error starting server\n");
+    // Load registered users before accepting anyone
+    if (openUserStore(&userStore, data_dir, &userList, &groupList) == -1 ||
+        getOrCreateGroup(&groupList, DEFAULT_GROUP, NULL) == NULL) {
+        printf("Error loading users from %s\n", data_dir);
+        exit(1);
+    }
+    startSnapshotThread(&userStore);
+    if (openMessageLog(&messageLog, data_dir, &userList, &messageList, &groupList) == -1 ||
+        openDirectLog(&directLog, data_dir, &userList, &directList) == -1 ||
+        openBlobStore(&blobStore, data_dir) == -1) {
+        printf("Error loading messages from %s\n", data_dir);
         exit(1);
     }
 
-    while (1) {
-        // Accept connection from client
-        if ((client_socket = accept_client(server_socket)) == -1) {
-            continue;
+    if (use_uring && initUring(&accept_ring, 8) == -1) {
+        perror("io_uring not available, using accept()/send()");
+        use_uring = 0;
+    }
+    if (workers <= 0) {
+        workers = (cpu_spec != NULL) ? cpus.count : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (startFanoutPool(&fanout, workers, (cpu_spec != NULL) ? &cpus : NULL, use_uring) == -1) {
+        printf("Error starting fan-out workers\n");
+        exit(1);
+    }
+    for (int i = 0; cpu_spec != NULL && i < fanout.count; i++) {
+        int cpu = fanout.workers[i].cpu;
+        printf("Fan-out worker %d on CPU %d (node %d)\n", i, cpu, cpuNode(cpu));
+    }
+
+    // Added By: Daniel
+    // What every connection's session starts from
+    Session base;
+    memset(&base, 0, sizeof base);
+    base.messageList = &messageList;
+    base.userList = &userList;
+    base.groupList = &groupList;
+    base.userStore = &userStore;
+    base.messageLog = &messageLog;
+    base.directList = &directList;
+    base.directLog = &directLog;
+    base.blobStore = &blobStore;
+    base.fanout = &fanout;
+    base.filter = (filter_file != NULL) ? &filter : NULL;
+
+    if (replay_file != NULL) {
+        exit_code = (replay_capture(replay_file, speed, &base) == 0) ? 0 : 1;
+    } else {
+        base.capture = (capture_file != NULL) ? &capture : NULL;
+        initAdmission(&admission, max_sessions);
+        base.admission = &admission;
+        if (install_stop_handlers() == -1 || (filter_file != NULL && install_reload_handler() == -1)) {
+            exit(1);
+        }
+        if (server_socket == -1) {
+            server_socket = start_server(argv[optind], argv[optind + 1], BACKLOG);
+            if (server_socket == -1) {
+                printf("Error starting server\n");
+                exit(1);
+            }
+        }
+        for (int i = 0; i < inherited_count; i++) {
+            resume_connection(&inherited[i], &base);
+            free(inherited[i].state);
+        }
+        if (inherited != NULL) {
+            printf("Serving %d inherited connections\n", inherited_count);
+            free(inherited);
+        }
+        if (handoff_path != NULL && (control_socket = listenHandoff(handoff_path)) == -1) {
+            printf("Hot restart not available\n");
         }
+        if (admin_path != NULL && startAdminSocket(&admin, admin_path, &base) == -1) {
+            printf("Admin socket not available\n");
+            admin_path = NULL;
+        }
+
+        while (1) {
+            int ready = wait_for_event(server_socket, use_uring ? &accept_ring : NULL, control_socket);
+            if (ready == stop_pipe[0]) {
+                printf("Signal %d: draining connections\n", (int) stop_signal);
+                break;
+            }
+            if (ready == reload_pipe[0]) {
+                char bytes[16];
+                ssize_t drained = read(reload_pipe[0], bytes, sizeof bytes);
+                (void) drained;
+                reloadMessageFilter(&filter);
+                continue;
+            }
+            if (ready == control_socket) {
+                successor = accept(control_socket, NULL, NULL);
+                if (successor == -1) {
+                    perror("Error accepting the new server");
+                    continue;
+                }
+                printf("A new server is taking over\n");
+                request_stop();
+                break;
+            }
 
-        // Added By: Daniel
-        Session *session = (Session *) malloc(sizeof(Session));
-        session->socketFd = client_socket;
-        session->messageList = &messageList;
-        session->userList = &userList;
-        session->user = NULL; // Initialize user to NULL, later set by registration
+            // Accept connection from client
+            if (use_uring) {
+                client_socket = accept_client_uring(&accept_ring, server_socket);
+                if (accept_ring.broken) {
+                    printf("io_uring accept failed, using accept()\n");
+                    freeUring(&accept_ring);
+                    use_uring = 0;
+                }
+            } else {
+                client_socket = accept_client(server_socket);
+            }
+            if (client_socket == -1) {
+                continue;
+            }
+            int retry_after = 0;
+            if (admitConnection(&admission, 0, &retry_after) == -1) {
+                shed_connection(client_socket, retry_after);
+                continue;
+            }
 
-        // Added By: Aedan
-        // Creating a new thread for each client connection
-        pthread_t thread_id;
-        if (pthread_create(&thread_id, NULL, start_subserver, (void *) session) != 0) {
-            perror("Error creating thread\n");
-            close(client_socket);
-            free(session);
-            continue;
+            Session *session = (Session *) malloc(sizeof(Session));
+            if (session == NULL) {
+                perror("Error allocating session");
+                releaseConnection(&admission);
+                net_close(client_socket);
+                continue;
+            }
+            *session = base; // user is set later by registration or login
+            session->socketFd = client_socket;
+            start_session(session);
         }
 
-        // Detaching the thread allows thread resources to be auto released on termination
-        pthread_detach(thread_id);
+        // Stopping: no new connections, and each connection stops at its
+        // next frame boundary.
+        if (admin_path != NULL) {
+            stopAdminSocket(&admin);
+        }
+        if (control_socket != -1) {
+            close(control_socket);
+            if (successor == -1) {
+                unlink(handoff_path);
+            }
+        }
+        stuck = quiesce_sessions();
     }
 
-    close(server_socket);
+    // Deliver what the fan-out still has queued (a successor sends it from
+    // each member's sentSeq instead), then put the state on disk (a snapshot
+    // makes the next start, or the successor's, quick).
+    if (successor != -1) {
+        abandonFanoutQueues(&fanout);
+    }
+    stopFanoutPool(&fanout, &groupList);
+    stopSnapshotThread(&userStore);
+    if (replay_file == NULL) {
+        writeUserSnapshot(&userStore);
+    }
+    closeMessageLog(&messageLog);
+    closeDirectLog(&directLog);
+    closeBlobStore(&blobStore);
+    if (successor != -1) {
+        if (hand_off(successor, server_socket) == -1) {
+            printf("Handoff failed, closing connections\n");
+            exit_code = 1;
+        }
+        close(successor);
+    }
+    if (stuck > 0) {
+        // Their threads may still be using the sessions and the lists, so
+        // nothing is freed: the exit takes it all. Only the user log is synced.
+        if (userStore.walFd != -1) {
+            fdatasync(userStore.walFd);
+        }
+        return exit_code;
+    }
+    close_sessions();
+    if (replay_file == NULL) {
+        freeAdmission(&admission);
+    }
+    if (filter_file != NULL) {
+        closeMessageFilter(&filter);
+    }
+    if (server_socket != -1) {
+        close(server_socket);
+    }
+    if (use_uring) {
+        freeUring(&accept_ring);
+    }
+    if (cpu_spec != NULL) {
+        freeCpuList(&cpus);
+    }
+    freeGroupList(&groupList);
+    freeDirectList(&directList);
     freeMessageList(&messageList);
     freeUserList(&userList);
-    return 0;
+    closeUserStore(&userStore);
+    if (capture_file != NULL) {
+        closeCapture(&capture);
+    }
+    return exit_code;
 }
@@ -1,6 +1,8 @@
 #ifndef PROTOCOL_H
 #define PROTOCOL_H
 
+#include <pthread.h>
+
 #define BUFFER_SIZE 256
 #define MESSAGE_TYPE 2
 #define EXIT_TYPE 99
@@ -16,17 +18,94 @@
 //Added By: Aedan
 #define JOIN_GROUP_TYPE 4
 
+// Per-group ordered delivery
+#define CLIENT_ACK_TYPE 6         // client -> server: "<group> <ackedSeq> [<resendUpTo>]"
+#define HISTORY_MESSAGE_TYPE 7    // server -> client: stored message replayed on request
+#define GROUP_NAME_SIZE 64        // max group name length, including the terminator
+
+// Store-and-forward
+#define BATCH_MESSAGE_TYPE 8      // server -> client: s2c_batch_header + packed messages
+#define BATCH_MAX_BYTES 16384     // max packed bytes after one batch header
+
+// Incremental history sync
+#define SYNC_TYPE 9               // client -> server: "<group> <afterSeq>"
+#define HISTORY_BATCH_TYPE 10     // server -> client: batch answering a sync; an empty one ends it
+
+// Wire compression (wire-compress.c)
+#define COMPRESS_TYPE 11          // client -> server: "<algorithm>"; the ACK turns compression on
+#define COMPRESSED_TYPE 12        // server -> client: s2c_compressed_header + deflate data
+#define COMPRESS_MAX_RAW 65536    // max uncompressed bytes carried by one compressed frame
+
+// Request pipelining
+#define BATCH_REQUEST_TYPE 13     // client -> server: op_batch_header + packed requests
+#define BATCH_RESPONSE_TYPE 14    // server -> client: op_batch_header + packed answers
+
+// Ephemeral events: never stored, coalesced and dropped under load (fanout.h)
+#define EVENT_TYPE 15             // client -> server: "<group> <kind> [<seq>]"; server -> client: s2c_event
+#define EVENT_TYPING 1            // the user is typing in the group
+#define EVENT_STOPPED_TYPING 2    // ... and stopped without posting
+#define EVENT_READ 3              // the user read the group up to seq
+
+// Group registry (group-list.c)
+#define CREATE_GROUP_TYPE 16      // client -> server: "<group>"; the creator joins it
+#define LEAVE_GROUP_TYPE 17       // client -> server: "<group>"
+#define LIST_GROUPS_TYPE 18       // client -> server: "<cursor> [<limit>]"; answered with a GROUP_PAGE_TYPE
+#define ROSTER_TYPE 19            // client -> server: "<group> <cursor> [<limit>]"; answered with a ROSTER_PAGE_TYPE
+#define GROUP_PAGE_TYPE 20        // server -> client: s2c_page_header + packed groups
+#define ROSTER_PAGE_TYPE 21       // server -> client: s2c_page_header + packed members
+#define PAGE_MAX_ENTRIES 100      // entries per page (and the default limit)
+#define DEFAULT_GROUP "CMPS"      // every new user starts in it
+
+// Direct messages between two users (direct-list.c)
+#define DIRECT_MESSAGE_TYPE 22    // client -> server: "<email> <text>"; server -> client: s2c_direct_message
+#define DIRECT_HISTORY_TYPE 23    // client -> server: "<email> <afterSeq>"; answered with s2c_direct_message
+                                  // frames of this type, then one with seq 0
+
+// Several connections per user (my-server.c): LOGIN_TYPE and REGISTRATION_TYPE
+// take an optional device name as their last word
+#define DEVICE_NAME_SIZE 32       // max device name length, including the terminator
+#define MAX_DEVICES 8             // devices a user can have, connected or remembered
+
+// Attachments (blob-store.c): streamed in chunks, stored by content hash,
+// and posted to the group as a message "blob:<hash> <size> <file name>"
+#define UPLOAD_TYPE 24            // client -> server: "<group> <size> <file name>", then the chunks;
+                                  // answered (like a MESSAGE_TYPE) once the last chunk is stored
+#define BLOB_CHUNK_TYPE 25        // both ways: blob_chunk_header + data
+#define DOWNLOAD_TYPE 26          // client -> server: "<hash> [<offset>]"; answered with the chunks, then an ACK
+#define BLOB_CHUNK_SIZE 32768     // max data bytes after one chunk header
+#define BLOB_MAX_SIZE (64 << 20)  // largest attachment
+#define BLOB_HASH_SIZE 65         // hex SHA-256, including the terminator
+#define BLOB_NAME_SIZE 100        // max file name length, including the terminator
+#define BLOB_REF_PREFIX "blob:"   // starts the text of a message that refers to an attachment
+
+// Idempotent posts (dedup-window.c): the client picks a 64-bit id per message
+// and sends the same id again when it retries
+#define POST_TYPE 27              // client -> server: "<group> <message id in hex> <text>"; like MESSAGE_TYPE,
+                                  // but a message id the user posted recently is acknowledged, not stored again
+
+// Overload (admission.c): a refused connection gets this ERROR_TYPE (requestId 0)
+// before it is closed, a refused login or registration gets it as its answer
+#define BUSY_ERROR "Server busy. Retry after %d seconds."
+
+// The answer to a message, direct message or upload refused by the server's
+// blocklist (msg-filter.c)
+#define BLOCKED_ERROR "Your message contains blocked words or links."
+
 /**
  * Struct name: c2s_send_message
  * Description: Represents a message sent from the client to the server.
  *
- * param type    The type identifier for a message. Should be MESSAGE_TYPE.
- * param length  The length of the message.
- * param message A character buffer holding the actual message content.
+ * param type      The type identifier for a message. Should be MESSAGE_TYPE.
+ * param length    The length of the message.
+ * param requestId Chosen by the client; echoed in the ACK or error answering
+ *                 this request. 0 means the client doesn't need an answer to
+ *                 a successful MESSAGE_TYPE.
+ * param message   A character buffer holding the actual message content.
  */
 typedef struct {
     int type;    // type = 2
     int length;  // Length of the message
+    unsigned int requestId;
     char message[BUFFER_SIZE]; // The actual message
 } c2s_send_message;
 
@@ -38,12 +117,165 @@ typedef struct {
 
 // Added By: Aedan
 // Struct used to handle passing user and messages to the client
+// group/seq/timestamp identify a stored message; seq is 0 for errors and
+// other frames that are not part of a group's history. An error carries the
+// requestId of the request that failed.
 typedef struct {
     int type;
     char name[BUFFER_SIZE];
     char message[BUFFER_SIZE];
+    char group[GROUP_NAME_SIZE]; // group the message was posted to
+    unsigned int seq;            // per-group sequence number, starts at 1
+    unsigned int requestId;      // errors: the failed request (0 if none)
+    long long timestamp;         // when the server stored it (ms since epoch)
 } user_message;
 
+/**
+ * Struct name: s2c_event
+ * Description: An ephemeral event of another member of a group. Events are
+ *              best effort: the server keeps only the latest of each kind per
+ *              user and group for a short window, and drops them before it
+ *              would delay a message. A message from the user ends its typing.
+ *
+ * param kind EVENT_TYPING, EVENT_STOPPED_TYPING or EVENT_READ.
+ * param seq  EVENT_READ: the newest message the user has read; 0 otherwise.
+ */
+typedef struct {
+    int type;                    // type = 15
+    int kind;
+    char name[BUFFER_SIZE];      // the user the event is about
+    char group[GROUP_NAME_SIZE];
+    unsigned int seq;
+} s2c_event;
+
+/**
+ * Struct name: s2c_direct_message
+ * Description: A direct message, sent live to both users of the conversation
+ *              (DIRECT_MESSAGE_TYPE) or as part of a history fetch
+ *              (DIRECT_HISTORY_TYPE). seq counts the messages of the pair's
+ *              conversation, from 1.
+ *
+ * param from, name The sender's email and name.
+ * param to         The recipient's email.
+ */
+typedef struct {
+    int type;                    // type = 22 or 23
+    char from[BUFFER_SIZE];
+    char name[BUFFER_SIZE];
+    char to[BUFFER_SIZE];
+    char message[BUFFER_SIZE];
+    unsigned int seq;
+    unsigned int requestId;      // unused, 0
+    long long timestamp;         // when the server stored it (ms since epoch)
+} s2c_direct_message;
+
+/**
+ * Struct name: s2c_batch_header
+ * Description: Header of a batch of stored messages of one group, sent on
+ *              login/registration (the user's backlog) and on join. It is
+ *              followed by `length` bytes holding `count` packed entries:
+ *
+ *                uint32 seq, int64 timestamp, uint16 name length, uint16 text length,
+ *                name bytes, text bytes (no terminators)
+ *
+ *              in increasing seq order. A batch also tells the client where its
+ *              cursor for the group is, so an empty batch is still meaningful.
+ *              The same layout with type HISTORY_BATCH_TYPE answers a SYNC_TYPE
+ *              request; those end with an empty batch.
+ *
+ * param afterSeq The receiver's cursor (or the sync's starting point): the
+ *                entries follow this sequence number.
+ */
+typedef struct {
+    int type;                    // type = 8 or 10
+    char group[GROUP_NAME_SIZE];
+    unsigned int afterSeq;
+    unsigned int count;
+    unsigned int length;
+} s2c_batch_header;
+
+/**
+ * Struct name: s2c_compressed_header
+ * Description: Header of a compressed frame, followed by `length` bytes of
+ *              raw deflate data (preset dictionary, see wire-compress.c). The
+ *              data inflates to `rawLength` bytes holding one or more complete
+ *              frames of the other types, back to back.
+ */
+typedef struct {
+    int type;                    // type = 12
+    unsigned int rawLength;
+    unsigned int length;
+} s2c_compressed_header;
+
+/**
+ * Struct name: s2c_page_header
+ * Description: One page of the group registry (GROUP_PAGE_TYPE) or of a
+ *              group's members (ROSTER_PAGE_TYPE), answering the request with
+ *              requestId. It is followed by `length` bytes (at most
+ *              BATCH_MAX_BYTES) holding `count` packed entries:
+ *
+ *                groups:  uint32 members, uint32 lastSeq, uint16 name length, name
+ *                members: uint16 online, uint16 name length, uint16 email length, name, email
+ *
+ *              Groups are listed in creation order. A member who leaves while a
+ *              roster is paged may be skipped, and the last member may move
+ *              into their place and be listed twice.
+ *
+ * param total The number of groups (or members) when the page was made.
+ * param next  The cursor of the next page, 0 if this is the last one.
+ */
+typedef struct {
+    int type;                    // type = 20 or 21
+    unsigned int requestId;
+    unsigned int total;
+    unsigned int next;
+    unsigned int count;
+    unsigned int length;
+} s2c_page_header;
+
+/**
+ * Struct name: op_batch_header
+ * Description: Header of a batch of requests (BATCH_REQUEST_TYPE) or of the
+ *              combined answer to one (BATCH_RESPONSE_TYPE). It is followed
+ *              by `length` bytes (at most BATCH_MAX_BYTES) holding `count`
+ *              packed entries, in order:
+ *
+ *                requests: int32 type, uint32 requestId, uint16 text length, text
+ *                answers:  uint32 requestId, int32 ACK_TYPE or ERROR_TYPE,
+ *                          uint16 error length, error text
+ *
+ *              The server runs the requests one after the other, as if they had
+ *              come as separate frames, and answers every request that would have
+ *              got an ACK or error in one response at the end. Frames a request
+ *              causes (messages, backlog, history) go out as usual, before it.
+ */
+typedef struct {
+    int type;                    // type = 13 or 14
+    unsigned int count;
+    unsigned int length;
+} op_batch_header;
+
+/**
+ * Struct name: blob_chunk_header
+ * Description: Header of a piece of an attachment, followed by `length`
+ *              bytes (at most BLOB_CHUNK_SIZE) of its data. An upload sends
+ *              its chunks in order after the UPLOAD_TYPE request; a chunk
+ *              without data cancels it. A download gets its chunks in
+ *              order, between the connection's other frames.
+ *
+ * param requestId The UPLOAD_TYPE or DOWNLOAD_TYPE request the chunk belongs to.
+ * param offset    Position of the data in the attachment.
+ * param size      Size of the whole attachment.
+ */
+typedef struct {
+    int type;                    // type = 25
+    unsigned int requestId;
+    unsigned int length;
+    unsigned int reserved;
+    unsigned long long offset;
+    unsigned long long size;
+} blob_chunk_header;
+
 /**
  * Struct name: c2s_send_exit
  * Description: Represents an exit signal sent from the client to the server.
@@ -58,26 +290,67 @@ typedef struct {
  * Struct name: s2c_send_ok_ack
  * Description: Represents an acknowledgment sent from the server to the client.
  *
- * param type The type identifier for an acknowledgment. Should be ACK_TYPE.
+ * param type      The type identifier for an acknowledgment. Should be ACK_TYPE.
+ * param requestId The request this acknowledges.
  */
 typedef struct {
     int type; // type = 200
+    unsigned int requestId;
 } s2c_send_ok_ack;
 
 // Added By: Aedan
+// One node per group the user joined. The node is the membership itself:
+// it is in the user's list (next) and in the group's members array
+// (info->members[memberIndex]). Each device has its own delivery position
+// in the group (DeviceCursor); the node keeps the durable one. A node the
+// user left moves to their retired list and is reused if they rejoin, so
+// other connections of the user never see it freed.
 typedef struct GROUP {
     char *name;
+    unsigned int ackedSeq; // the newest message any of the user's devices acknowledged
+    unsigned int joins;    // times the user joined: device cursors of an earlier membership are stale
+    int inSnapshot;        // node lives in the loaded snapshot (user-store.c)
+    struct USER *user;     // the member
+    struct GROUP_INFO *info; // the group, NULL until addGroupMember()
+    unsigned int memberIndex; // position in info->members
     struct GROUP *next;
 } Group;
 
+// Delivery position of one device in one of the user's groups.
+typedef struct DEVICE_CURSOR {
+    Group *membership;
+    struct GROUP_INFO *group; // the group whose fan-out the device is in, NULL if none
+    unsigned int ackedSeq;    // everything up to here was acknowledged by the device
+    unsigned int sentSeq;     // newest message sent to the device
+    unsigned int joins;       // membership->joins when the cursor was made
+    struct DEVICE_CURSOR *next;
+} DeviceCursor;
+
+// One of a user's clients. A named device keeps its cursors while it is
+// disconnected and picks up where it left off; an unnamed one lasts as
+// long as its connection.
+typedef struct DEVICE {
+    char *name;               // chosen by the client, NULL if none
+    int fd;                   // its connection, -1 while disconnected
+    int live;                 // in the live fan-out of the user's groups (go_online())
+    DeviceCursor *cursors;    // one per group it has been in
+    struct DEVICE *next;
+} Device;
+
 // Added By: Omi
+// devices, groups and retired are guarded by the user's lock (user_lock()).
 typedef struct USER {
 char *email;
 char *name;
 char *password; // Encoded password
 Group *groups; // List of user's joined groups (Aedan)
-int socketFd; // Socket file descriptor for the user (Aedan)
-int isOnline; // Check if user is online (Aedan)
+Group *retired; // groups the user left
+Device *devices; // connected and remembered devices
+struct DEDUP_WINDOW *recentPosts; // ids of the latest posts (dedup-window.h), NULL before the first
+int isOnline; // number of connected devices
+unsigned int posts; // messages sent since the server started (admin "top")
+int inSnapshot; // struct and strings live in the loaded snapshot (user-store.c)
+unsigned int id; // position in the user list (registration order), for getUserById()
 struct USER *next;
 } User;
 
@@ -85,25 +358,120 @@ typedef struct USER_LIST {
 User *first; // points to first user
 User *last; // points to last user
 int count; // # of the users
+User **index; // open-addressing hash table by email, for findUser()
+unsigned int indexCapacity; // slots in index (power of two)
+User ***byId; // blocks of USER_ID_BLOCK users by id (user-list.h); blocks never move
 } UserList;
 
+// A direct message (direct-list.c).
 typedef struct MESSAGE {
 char *message;
 User *sender; // sender of the message
+char *group; // group the message was posted to
+unsigned int seq; // position in the group's history, starts at 1
+long long timestamp; // ms since epoch
 struct MESSAGE *next;
 } Message;
 
+// A stored group message: a fixed-size record, with the sender and group
+// by id, so millions stay resident. The text is read only when a client
+// fetches it (readMessageBody() in msg-list.c).
+typedef struct MESSAGE_HEADER {
+unsigned long long body; // offset of the text in the message log, or in the arena (MESSAGE_IN_ARENA)
+long long timestamp; // ms since epoch
+unsigned int seq; // position in the group's history, starts at 1
+unsigned int groupId; // GroupInfo id
+unsigned int senderId; // User id
+unsigned int length; // text bytes
+} MessageHeader;
+
+#define MESSAGE_NONE 0xFFFFFFFFu // no message at this position (getGroupMessage())
+
+// Every group message, in arrival order: headers in blocks of
+// MESSAGE_BLOCK (msg-list.h) that never move, so a header can be read
+// while messages are appended.
 typedef struct MESSAGE_LIST {
-Message *first; // points to first message
-Message *last; // points to last message
+MessageHeader **blocks; // MESSAGE_BLOCKS slots, allocated as needed
 int count; // # of the messages
+size_t bytes; // their text, in bytes
+int bodyFd; // the message log, opened for reading texts; -1 if none
+char **arena; // chunks holding texts that aren't in the log (no log, failed write)
+unsigned int arenaChunks; // chunks allocated
+size_t arenaUsed; // bytes used in the last chunk
 } MessageList;
 
+// Server-side state of one group: its sequence counter, an index of its
+// messages by sequence number, used to retransmit gaps, and its members.
+typedef struct GROUP_INFO {
+char *name;
+unsigned int id; // position in the registry (creation order)
+unsigned int lastSeq; // seq of the newest message, 0 if none
+unsigned int *messages; // messages[seq - 1]: position in the MessageList
+unsigned int capacity; // allocated slots in messages
+Group **members; // every member's membership node, in no particular order
+unsigned int memberCount;
+unsigned int memberCapacity;
+pthread_mutex_t lock; // orders seq assignment and fan-out; guards members
+struct FANOUT_PARTITION *partitions; // online members, one list per fan-out worker (fanout.c)
+} GroupInfo;
+
+// Registry of every group: by creation order and by name. Groups are never
+// removed, so a GroupInfo pointer stays valid for the server's lifetime.
+typedef struct GROUP_LIST {
+GroupInfo **groups; // groups[id]
+int count; // # of the groups
+unsigned int capacity; // allocated slots in groups
+GroupInfo **index; // open-addressing hash table by name
+unsigned int indexCapacity; // slots in index (power of two)
+pthread_mutex_t lock; // guards the registry itself
+} GroupList;
+
+// Direct conversation of two users: its own sequence numbers and message
+// index, like a group's, and its own log file (direct-log.c).
+typedef struct CONVERSATION {
+User *first; // the two users, in email order
+User *second;
+unsigned int id; // names the log file; never reused
+unsigned int lastSeq; // seq of the newest message, 0 if none
+Message **messages; // messages[seq - 1]
+unsigned int capacity; // allocated slots in messages
+int dirty; // written since the log was last synced (direct-log.c)
+int fd; // its log file, kept open after the first write; -1 if not (direct-log.c)
+long long logSize; // bytes of whole records in the log file, once it is open
+pthread_mutex_t lock; // orders seq assignment, logging and delivery
+} Conversation;
+
+// Every conversation, by the pair of users. Conversations are never removed.
+typedef struct DIRECT_LIST {
+Conversation **index; // open-addressing hash table by the two users
+unsigned int indexCapacity; // slots in index (power of two)
+int count; // # of the conversations
+unsigned int nextId; // id of the next new conversation
+pthread_mutex_t lock; // guards the registry itself
+} DirectList;
+
 typedef struct SESSION_DATA {
 UserList *userList; // points to UserList
 MessageList *messageList; // points to MessageList
+GroupList *groupList; // points to GroupList
+struct USER_STORE *userStore; // durable user directory (user-store.h)
+struct MESSAGE_LOG *messageLog; // durable message history (msg-log.h)
+DirectList *directList; // direct conversations (direct-list.h)
+struct DIRECT_LOG *directLog; // their durable logs (direct-log.h)
+struct OP_BATCH *response; // answers collected while running a request batch, NULL otherwise (msg-batch.h)
+struct FANOUT_POOL *fanout; // delivers group messages to online members (fanout.h)
+struct TRAFFIC_CAPTURE *capture; // records inbound frames (-R), NULL otherwise (traffic-capture.h)
+struct BLOB_STORE *blobStore; // attachments (blob-store.h)
+struct BLOB_UPLOAD *upload; // the connection's upload in progress, NULL if none
+struct BLOB_DOWNLOAD *download; // the connection's download in progress, NULL if none
+struct ADMISSION *admission; // connection and login limits (admission.h), NULL when replaying
+struct MESSAGE_FILTER *filter; // blocklist (msg-filter.h), NULL without -F
+unsigned int connectionId; // the connection's number in the capture
 User *user; // user of the session
+Device *device; // the user's device on this connection
 int socketFd; // socket fd of the client
+int resumed; // inherited from the previous server (-H): already set up, don't handshake
+int parked; // the thread stopped at a frame boundary (drain, handoff); main owns the connection now
 } Session;
 
 #endif // PROTOCOL_H
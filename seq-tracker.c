@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include "protocol.h"
+#include "seq-tracker.h"
+
+void initSeqTrackerList(SeqTrackerList *list) {
+    list->first = NULL;
+}
+
+/**
+ * Finds the tracker of a group, creating an empty one if needed.
+ *
+ * return the tracker, or NULL if memory ran out.
+ */
+SeqTracker *getSeqTracker(SeqTrackerList *list, const char *group) {
+    SeqTracker *ptr = list->first;
+    while (ptr != NULL) {
+        if (strcmp(ptr->group, group) == 0) {
+            return ptr;
+        }
+        ptr = ptr->next;
+    }
+    ptr = (SeqTracker *) calloc(1, sizeof(SeqTracker));
+    if (ptr == NULL) {
+        perror("Error allocating memory for sequence tracker");
+        return NULL;
+    }
+    ptr->group = strdup(group);
+    ptr->next = list->first;
+    list->first = ptr;
+    return ptr;
+}
+
+// Delivers buffered messages that became contiguous with the watermark.
+static void flushPending(SeqTracker *tracker, void (*deliver)(user_message *msg, void *arg), void *arg) {
+    int used = 0;
+    while (used < tracker->pendingCount && tracker->pending[used]->seq <= tracker->delivered + 1) {
+        user_message *msg = tracker->pending[used++];
+        if (msg->seq == tracker->delivered + 1) {
+            deliver(msg, arg);
+            tracker->delivered++;
+            tracker->unacked++;
+        }
+        free(msg);
+    }
+    memmove(tracker->pending, tracker->pending + used, (tracker->pendingCount - used) * sizeof(user_message *));
+    tracker->pendingCount -= used;
+}
+
+// Keeps an early message until the gap before it is filled.
+static void holdMessage(SeqTracker *tracker, user_message *msg) {
+    int pos = 0;
+    while (pos < tracker->pendingCount && tracker->pending[pos]->seq < msg->seq) {
+        pos++;
+    }
+    if (pos < tracker->pendingCount && tracker->pending[pos]->seq == msg->seq) {
+        return; // already held
+    }
+    user_message *copy = (user_message *) malloc(sizeof(user_message));
+    if (copy == NULL) {
+        perror("Error allocating memory for pending message");
+        return;
+    }
+    memcpy(copy, msg, sizeof(user_message));
+    memmove(tracker->pending + pos + 1, tracker->pending + pos, (tracker->pendingCount - pos) * sizeof(user_message *));
+    tracker->pending[pos] = copy;
+    tracker->pendingCount++;
+}
+
+/**
+ * Tells a group's tracker where the server's cursor for this client is
+ * (from a batch header). Everything up to afterSeq was already delivered in
+ * an earlier session; held messages it covers are dropped and the rest are
+ * delivered if now in order. A watermark already past afterSeq is kept.
+ */
+void seedSeqTracker(SeqTrackerList *list, const char *group, unsigned int afterSeq,
+                    void (*deliver)(user_message *msg, void *arg), void *arg) {
+    SeqTracker *tracker = getSeqTracker(list, group);
+    if (tracker == NULL) {
+        return;
+    }
+    if (!tracker->started || afterSeq > tracker->delivered) {
+        tracker->delivered = afterSeq;
+    }
+    tracker->started = 1;
+    flushPending(tracker, deliver, arg);
+}
+
+/**
+ * Feeds a received group message through its group's tracker. Messages are
+ * passed to deliver() in sequence order, exactly once.
+ *
+ * Unless the tracker was seeded, the first message seen for a group sets
+ * the starting point, since the client has no history before it.
+ *
+ * param list    The client's trackers.
+ * param msg     A PRINT_MESSAGE_TYPE frame with a non-zero seq.
+ * param deliver Called for each message that is now in order.
+ * return SEQ_DELIVERED, SEQ_DUPLICATE, or SEQ_GAP when msg was held back and
+ *        messages delivered+1 .. msg->seq-1 should be requested again.
+ */
+int trackMessage(SeqTrackerList *list, user_message *msg, void (*deliver)(user_message *msg, void *arg), void *arg) {
+    SeqTracker *tracker = getSeqTracker(list, msg->group);
+    if (tracker == NULL) {
+        deliver(msg, arg);
+        return SEQ_DELIVERED;
+    }
+    if (!tracker->started) {
+        tracker->delivered = msg->seq - 1;
+        tracker->started = 1;
+    }
+    if (msg->seq <= tracker->delivered) {
+        return SEQ_DUPLICATE;
+    }
+    if (msg->seq > tracker->delivered + 1) {
+        if (tracker->pendingCount < MAX_PENDING) {
+            holdMessage(tracker, msg);
+            return SEQ_GAP;
+        }
+        // Buffer full: give up on the oldest gap and deliver what is held.
+        printf("Messages %u-%u in %s were lost\n", tracker->delivered + 1,
+               tracker->pending[0]->seq - 1, tracker->group);
+        tracker->delivered = tracker->pending[0]->seq - 1;
+        flushPending(tracker, deliver, arg);
+        return trackMessage(list, msg, deliver, arg);
+    }
+    deliver(msg, arg);
+    tracker->delivered++;
+    tracker->unacked++;
+    flushPending(tracker, deliver, arg);
+    return SEQ_DELIVERED;
+}
+
+void freeSeqTrackerList(SeqTrackerList *list) {
+    SeqTracker *ptr = list->first;
+    while (ptr != NULL) {
+        SeqTracker *temp = ptr;
+        ptr = ptr->next;
+        for (int i = 0; i < temp->pendingCount; i++) {
+            free(temp->pending[i]);
+        }
+        free(temp->group);
+        free(temp);
+    }
+    list->first = NULL;
+}
@@ -0,0 +1,47 @@
+#ifndef SEQ_TRACKER_H
+#define SEQ_TRACKER_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "protocol.h"
+
+#define ACK_BATCH_SIZE 16   // messages per group between cumulative acks
+#define MAX_PENDING 64      // out-of-order messages held while a gap is retransmitted
+
+// Result of trackMessage()
+#define SEQ_DELIVERED 0     // message (and any buffered successors) delivered
+#define SEQ_DUPLICATE 1     // already delivered, dropped
+#define SEQ_GAP 2           // held back; request a retransmit of the gap
+
+/**
+ * Struct name: SeqTracker
+ * Description: Client-side receive state of one group.
+ *
+ * param delivered Highest sequence number delivered in order (the watermark).
+ * param started   Set once the watermark is known (seeded or first message).
+ * param unacked   Messages delivered since the last ack was sent.
+ * param pending   Messages that arrived ahead of a gap, sorted by seq.
+ */
+typedef struct SEQ_TRACKER {
+    char *group;
+    unsigned int delivered;
+    unsigned int unacked;
+    int started;
+    user_message *pending[MAX_PENDING];
+    int pendingCount;
+    struct SEQ_TRACKER *next;
+} SeqTracker;
+
+typedef struct SEQ_TRACKER_LIST {
+    SeqTracker *first;
+} SeqTrackerList;
+
+// Function prototypes
+void initSeqTrackerList(SeqTrackerList *list);
+SeqTracker *getSeqTracker(SeqTrackerList *list, const char *group);
+void seedSeqTracker(SeqTrackerList *list, const char *group, unsigned int afterSeq,
+                    void (*deliver)(user_message *msg, void *arg), void *arg);
+int trackMessage(SeqTrackerList *list, user_message *msg, void (*deliver)(user_message *msg, void *arg), void *arg);
+void freeSeqTrackerList(SeqTrackerList *list);
+
+#endif // SEQ_TRACKER_H
@@ -13,6 +13,8 @@
 #include <pthread.h>
 #include "server-helper.h"
 
+int log_level = LOG_DEBUG;
+
 // Analogy: You bought a phone(socket) and bound to a # (port#)
 int get_server_socket(char *hostname, char *port) {
    struct addrinfo hints, *servinfo, *p;
@@ -84,8 +86,37 @@ int accept_client(int serv_sock) {
       // here is for info only, not really needed.
        inet_ntop(client_addr.ss_family, get_in_addr((struct sockaddr *)&client_addr), 
                    client_printable_addr, sizeof client_printable_addr);
-       printf("server: connection from %s at port %d\n", client_printable_addr,
+       log_debug("server: connection from %s at port %d\n", client_printable_addr,
                   ((struct sockaddr_in*)&client_addr)->sin_port);
+       // frames are already packed before they are sent (FrameWriter);
+       // Nagle would only hold back the short last one of a burst.
+       int one = 1;
+       setsockopt(reply_sock_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+   }
+   return reply_sock_fd;
+}
+
+// Same as accept_client(), but the connection comes from the multishot
+// accept kept armed on ring (one submission for many connections).
+int accept_client_uring(Uring *ring, int serv_sock) {
+   int reply_sock_fd = uringAccept(ring, serv_sock);
+   socklen_t sin_size = sizeof(struct sockaddr_storage);
+   struct sockaddr_storage client_addr;
+   char client_printable_addr[INET6_ADDRSTRLEN];
+
+   if (reply_sock_fd == -1) {
+      printf("socket accept error\n");
+   }
+   else {
+      // the multishot accept doesn't report the address; ask for it
+      if (getpeername(reply_sock_fd, (struct sockaddr *)&client_addr, &sin_size) == 0) {
+         inet_ntop(client_addr.ss_family, get_in_addr((struct sockaddr *)&client_addr),
+                   client_printable_addr, sizeof client_printable_addr);
+         log_debug("server: connection from %s at port %d\n", client_printable_addr,
+                ((struct sockaddr_in*)&client_addr)->sin_port);
+      }
+      int one = 1;
+      setsockopt(reply_sock_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
    }
    return reply_sock_fd;
 }
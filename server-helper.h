@@ -6,14 +6,34 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdint.h>
 #include <pthread.h>
+#include "uring-io.h"
+
+// How much the server prints (changed live with the admin socket's "log"):
+// LOG_DEBUG traces every connection and request, LOG_INFO only logins,
+// changes to users and groups, and problems.
+#define LOG_INFO 0
+#define LOG_DEBUG 1
+extern int log_level;
+#define log_debug(...) \
+    do { \
+        if (__atomic_load_n(&log_level, __ATOMIC_RELAXED) >= LOG_DEBUG) { \
+            printf(__VA_ARGS__); \
+        } \
+    } while (0)
 
 int start_server(char *hostname, char *port, int backlog);  // start the server
 int accept_client(int serv_sock);                    // accept a connection from client
+int accept_client_uring(Uring *ring, int serv_sock); // same, with a multishot accept on ring
 // helper functions
 void *get_in_addr(struct sockaddr * sa);             // get internet address
 int get_server_socket(char *hostname, char *port);   // get a server socket
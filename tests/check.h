@@ -0,0 +1,30 @@
+#ifndef CHECK_H
+#define CHECK_H
+#include <stdio.h>
+
+/**
+ * Minimal assertions for the unit tests: a failed CHECK() prints where and
+ * what, and the test keeps going; main() returns check_result() so ctest
+ * sees the failure.
+ */
+
+static int check_failures = 0;
+
+#define CHECK(cond)                                                              \
+    do {                                                                         \
+        if (!(cond)) {                                                           \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond);      \
+            check_failures++;                                                    \
+        }                                                                        \
+    } while (0)
+
+static inline int check_result(const char *name) {
+    if (check_failures > 0) {
+        printf("%s: %d check(s) failed\n", name, check_failures);
+        return 1;
+    }
+    printf("%s: ok\n", name);
+    return 0;
+}
+
+#endif // CHECK_H
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../dedup-window.h"
+#include "check.h"
+
+/**
+ * Program name: test-dedup-window.c
+ * Description:  The post-id window (dedup-window.c): a repeated id is
+ *               reported, the oldest id goes once DEDUP_WINDOW_SIZE newer
+ *               ones arrived, a forgotten id is new again, and after a long
+ *               random run of remembers and forgets the window agrees with a
+ *               plain list of the ids it should hold (the index stays
+ *               consistent across evictions and deletions).
+ */
+
+// Reference model: the ring of remembered ids, 0 for a forgotten one.
+typedef struct {
+    unsigned long long ids[DEDUP_WINDOW_SIZE];
+    unsigned int next;
+    unsigned int count;
+} Model;
+
+static int model_has(Model *model, unsigned long long id) {
+    for (unsigned int i = 0; i < model->count; i++) {
+        if (model->ids[i] == id) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int model_remember(Model *model, unsigned long long id) {
+    if (model_has(model, id)) {
+        return 1;
+    }
+    model->ids[model->next] = id;
+    model->next = (model->next + 1) % DEDUP_WINDOW_SIZE;
+    if (model->count < DEDUP_WINDOW_SIZE) {
+        model->count++;
+    }
+    return 0;
+}
+
+static void model_forget(Model *model, unsigned long long id) {
+    for (unsigned int i = 0; i < model->count; i++) {
+        if (model->ids[i] == id) {
+            model->ids[i] = 0; // the slot stays taken until the ring comes round
+        }
+    }
+}
+
+static void test_basics(void) {
+    DedupWindow *window = NULL;
+    forgetPostId(window, 1); // no window yet: nothing to do
+    CHECK(rememberPostId(&window, 1) == 0);
+    CHECK(window != NULL);
+    CHECK(rememberPostId(&window, 1) == 1);
+    CHECK(rememberPostId(&window, 2) == 0);
+
+    forgetPostId(window, 1);
+    CHECK(rememberPostId(&window, 2) == 1);
+    CHECK(rememberPostId(&window, 1) == 0); // the retry of a failed post goes through
+    forgetPostId(window, 99);                // never remembered
+    CHECK(rememberPostId(&window, 2) == 1);
+    freeDedupWindow(window);
+}
+
+static void test_eviction(void) {
+    DedupWindow *window = NULL;
+    for (unsigned long long id = 1; id <= DEDUP_WINDOW_SIZE; id++) {
+        CHECK(rememberPostId(&window, id) == 0);
+    }
+    CHECK(rememberPostId(&window, 1) == 1);
+    CHECK(rememberPostId(&window, DEDUP_WINDOW_SIZE) == 1);
+
+    // One more id pushes out the oldest, and only it.
+    CHECK(rememberPostId(&window, DEDUP_WINDOW_SIZE + 1) == 0);
+    CHECK(rememberPostId(&window, 2) == 1);
+    CHECK(rememberPostId(&window, DEDUP_WINDOW_SIZE + 1) == 1);
+    CHECK(rememberPostId(&window, 1) == 0); // forgotten: new again (and 2 goes)
+    CHECK(rememberPostId(&window, 3) == 1);
+    CHECK(rememberPostId(&window, 2) == 0);
+    freeDedupWindow(window);
+}
+
+static void test_against_model(void) {
+    DedupWindow *window = NULL;
+    Model model;
+    memset(&model, 0, sizeof model);
+    unsigned int seed = 12345;
+    int mismatches = 0;
+    for (int i = 0; i < 200000 && mismatches < 10; i++) {
+        seed = seed * 1103515245u + 12345u;
+        // Few distinct ids, so they repeat, collide in the index and get evicted.
+        unsigned long long id = 1 + (seed >> 8) % (3 * DEDUP_WINDOW_SIZE);
+        if ((seed >> 4) % 8 == 0) {
+            forgetPostId(window, id);
+            model_forget(&model, id);
+        } else if (rememberPostId(&window, id) != model_remember(&model, id)) {
+            printf("step %d: id %llu disagrees with the model\n", i, id);
+            mismatches++;
+        }
+    }
+    CHECK(mismatches == 0);
+    freeDedupWindow(window);
+}
+
+int main(void) {
+    test_basics();
+    test_eviction();
+    test_against_model();
+    return check_result("test-dedup-window");
+}
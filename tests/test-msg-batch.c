@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../protocol.h"
+#include "../msg-batch.h"
+#include "check.h"
+
+/**
+ * Program name: test-msg-batch.c
+ * Description:  Round trips of the batch, request batch and page codecs
+ *               (msg-batch.c): what is packed comes back unchanged, a full
+ *               frame refuses the next entry, and a payload cut short or
+ *               with a length running past its end is reported as malformed.
+ */
+
+typedef struct {
+    user_message messages[64];
+    int count;
+} Decoded;
+
+static void collect(user_message *msg, void *arg) {
+    Decoded *decoded = (Decoded *) arg;
+    if (decoded->count < 64) {
+        decoded->messages[decoded->count] = *msg;
+    }
+    decoded->count++;
+}
+
+static void test_message_batch(void) {
+    MessageBatch *batch = (MessageBatch *) malloc(sizeof(MessageBatch));
+    Decoded *decoded = (Decoded *) calloc(1, sizeof(Decoded));
+    initBatch(batch, BATCH_MESSAGE_TYPE, "CMPS", 41);
+    CHECK(addBatchMessage(batch, "alice", "hello", 42, 1700000000123LL) == 0);
+    CHECK(addBatchMessage(batch, "bob", "", 43, 1700000000456LL) == 0);
+    CHECK(batch->header.count == 2);
+    CHECK(batch->header.afterSeq == 41);
+    CHECK(batchFrameSize(batch) == sizeof(s2c_batch_header) + batch->header.length);
+
+    CHECK(decodeBatch(&batch->header, batch->payload, collect, decoded) == 2);
+    CHECK(decoded->count == 2);
+    CHECK(strcmp(decoded->messages[0].group, "CMPS") == 0);
+    CHECK(strcmp(decoded->messages[0].name, "alice") == 0);
+    CHECK(strcmp(decoded->messages[0].message, "hello") == 0);
+    CHECK(decoded->messages[0].seq == 42);
+    CHECK(decoded->messages[0].timestamp == 1700000000123LL);
+    CHECK(decoded->messages[0].type == PRINT_MESSAGE_TYPE);
+    CHECK(strcmp(decoded->messages[1].name, "bob") == 0);
+    CHECK(decoded->messages[1].message[0] == '\0');
+    CHECK(decoded->messages[1].seq == 43);
+
+    // Cut one byte off the last entry: the decoder stops instead of reading past it.
+    s2c_batch_header cut = batch->header;
+    cut.length--;
+    decoded->count = 0;
+    CHECK(decodeBatch(&cut, batch->payload, collect, decoded) == -1);
+    CHECK(decoded->count == 1);
+
+    // A text longer than a user_message holds is cut to fit.
+    char text[BUFFER_SIZE + 100];
+    memset(text, 'x', sizeof text - 1);
+    text[sizeof text - 1] = '\0';
+    initBatch(batch, BATCH_MESSAGE_TYPE, "CMPS", 0);
+    CHECK(addBatchMessage(batch, "carol", text, 1, 0) == 0);
+    decoded->count = 0;
+    CHECK(decodeBatch(&batch->header, batch->payload, collect, decoded) == 1);
+    CHECK(strlen(decoded->messages[0].message) == BUFFER_SIZE - 1);
+
+    // Fill the frame: the entry that doesn't fit is refused, nothing is lost.
+    initBatch(batch, BATCH_MESSAGE_TYPE, "CMPS", 0);
+    unsigned int added = 0;
+    while (addBatchMessage(batch, "carol", text, added + 1, 0) == 0) {
+        added++;
+    }
+    CHECK(added > 0);
+    CHECK(batch->header.count == added);
+    CHECK(batch->header.length <= BATCH_MAX_BYTES);
+    decoded->count = 0;
+    CHECK(decodeBatch(&batch->header, batch->payload, collect, decoded) == (int) added);
+    free(decoded);
+    free(batch);
+}
+
+static void test_op_batch(void) {
+    OpBatch *batch = (OpBatch *) malloc(sizeof(OpBatch));
+    initOpBatch(batch, BATCH_REQUEST_TYPE);
+    CHECK(addBatchRequest(batch, JOIN_GROUP_TYPE, 7, "CMPS") == 0);
+    CHECK(addBatchRequest(batch, MESSAGE_TYPE, 8, "CMPS hi there") == 0);
+    CHECK(batch->header.count == 2);
+
+    c2s_send_message request;
+    size_t offset = 0;
+    CHECK(nextBatchRequest(&batch->header, batch->payload, &offset, &request) == 1);
+    CHECK(request.type == JOIN_GROUP_TYPE && request.requestId == 7);
+    CHECK(strcmp(request.message, "CMPS") == 0 && request.length == 5);
+    CHECK(nextBatchRequest(&batch->header, batch->payload, &offset, &request) == 1);
+    CHECK(request.type == MESSAGE_TYPE && request.requestId == 8);
+    CHECK(strcmp(request.message, "CMPS hi there") == 0);
+    CHECK(nextBatchRequest(&batch->header, batch->payload, &offset, &request) == 0);
+
+    op_batch_header cut = batch->header;
+    cut.length -= 3;
+    offset = 0;
+    CHECK(nextBatchRequest(&cut, batch->payload, &offset, &request) == 1);
+    CHECK(nextBatchRequest(&cut, batch->payload, &offset, &request) == -1);
+
+    initOpBatch(batch, BATCH_RESPONSE_TYPE);
+    CHECK(addBatchResponse(batch, 7, 1, "ignored") == 0);
+    CHECK(addBatchResponse(batch, 8, 0, "Not in group") == 0);
+    unsigned int requestId;
+    int ok;
+    char error[BUFFER_SIZE];
+    offset = 0;
+    CHECK(nextBatchResponse(&batch->header, batch->payload, &offset, &requestId, &ok, error) == 1);
+    CHECK(requestId == 7 && ok == 1 && error[0] == '\0');
+    CHECK(nextBatchResponse(&batch->header, batch->payload, &offset, &requestId, &ok, error) == 1);
+    CHECK(requestId == 8 && ok == 0 && strcmp(error, "Not in group") == 0);
+    CHECK(nextBatchResponse(&batch->header, batch->payload, &offset, &requestId, &ok, error) == 0);
+    free(batch);
+}
+
+static void test_pages(void) {
+    Page *page = (Page *) malloc(sizeof(Page));
+    initPage(page, GROUP_PAGE_TYPE, 5, 2);
+    CHECK(addPageGroup(page, "CMPS", 12, 340) == 0);
+    CHECK(addPageGroup(page, "MATH", 0, 0) == 0);
+    CHECK(page->header.count == 2 && page->header.requestId == 5 && page->header.total == 2);
+
+    char name[BUFFER_SIZE];
+    char email[BUFFER_SIZE];
+    unsigned int members, lastSeq;
+    size_t offset = 0;
+    CHECK(nextPageGroup(&page->header, page->payload, &offset, name, &members, &lastSeq) == 1);
+    CHECK(strcmp(name, "CMPS") == 0 && members == 12 && lastSeq == 340);
+    CHECK(nextPageGroup(&page->header, page->payload, &offset, name, &members, &lastSeq) == 1);
+    CHECK(strcmp(name, "MATH") == 0 && members == 0 && lastSeq == 0);
+    CHECK(nextPageGroup(&page->header, page->payload, &offset, name, &members, &lastSeq) == 0);
+
+    initPage(page, ROSTER_PAGE_TYPE, 6, 1);
+    CHECK(addPageMember(page, "Alice", "alice@scranton.edu", 1) == 0);
+    int online;
+    offset = 0;
+    CHECK(nextPageMember(&page->header, page->payload, &offset, name, email, &online) == 1);
+    CHECK(strcmp(name, "Alice") == 0 && strcmp(email, "alice@scranton.edu") == 0 && online == 1);
+    CHECK(nextPageMember(&page->header, page->payload, &offset, name, email, &online) == 0);
+
+    s2c_page_header cut = page->header;
+    cut.length--;
+    offset = 0;
+    CHECK(nextPageMember(&cut, page->payload, &offset, name, email, &online) == -1);
+    free(page);
+}
+
+int main(void) {
+    test_message_batch();
+    test_op_batch();
+    test_pages();
+    return check_result("test-msg-batch");
+}
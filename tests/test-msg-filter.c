@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../msg-filter.h"
+#include "check.h"
+
+/**
+ * Program name: test-msg-filter.c
+ * Description:  The moderation rules (msg-filter.c): a plain pattern only
+ *               matches a whole word, a '*' edge lets the match run into a
+ *               word on that side, case is ignored, non-ASCII bytes count as
+ *               word characters, and a rule file (comments, blank lines)
+ *               loads and reloads.
+ */
+
+static int scan(FilterAutomaton *automaton, const char *text) {
+    return scanFilter(automaton, text, strlen(text));
+}
+
+static void test_word_edges(void) {
+    char *patterns[] = { "spam", "http*", "*ware", "*bad*", "*" };
+    FilterAutomaton *automaton = compileFilter(patterns, 5);
+    CHECK(automaton != NULL);
+
+    // "spam": a whole word, whatever the case and the punctuation around it.
+    CHECK(scan(automaton, "spam") == 1);
+    CHECK(scan(automaton, "Spam!") == 1);
+    CHECK(scan(automaton, "buy SPAM now") == 1);
+    CHECK(scan(automaton, "(spam)") == 1);
+    CHECK(scan(automaton, "spamalot") == 0);
+    CHECK(scan(automaton, "myspam") == 0);
+    CHECK(scan(automaton, "spam_filter") == 0); // '_' is a word character
+    CHECK(scan(automaton, "spam2") == 0);
+    CHECK(scan(automaton, "spam\xc3\xa9") == 0); // so are the bytes of "é"
+    CHECK(scan(automaton, "spamalot spam") == 1); // a later whole word still counts
+
+    // "http*": starts a word, may run on.
+    CHECK(scan(automaton, "see https://example.com") == 1);
+    CHECK(scan(automaton, "http") == 1);
+    CHECK(scan(automaton, "xhttp") == 0);
+
+    // "*ware": ends a word.
+    CHECK(scan(automaton, "malware.") == 1);
+    CHECK(scan(automaton, "ware") == 1);
+    CHECK(scan(automaton, "wares") == 0);
+
+    // "*bad*": anywhere. The lone "*" is empty and skipped, not a match-all.
+    CHECK(scan(automaton, "abadabc") == 1);
+    CHECK(scan(automaton, "nothing to see") == 0);
+    CHECK(scan(automaton, "") == 0);
+    freeFilterAutomaton(automaton);
+}
+
+static void test_shared_patterns(void) {
+    // The same text under two rules counts where either allows it, and a
+    // pattern inside a longer one is still found.
+    char *patterns[] = { "scam", "*scam", "scammer" };
+    FilterAutomaton *automaton = compileFilter(patterns, 3);
+    CHECK(automaton != NULL);
+    CHECK(scan(automaton, "scam") == 1);
+    CHECK(scan(automaton, "antiscam") == 1);
+    CHECK(scan(automaton, "scams") == 0);
+    CHECK(scan(automaton, "a scammer") == 1);
+    CHECK(scan(automaton, "scammers") == 0);
+    freeFilterAutomaton(automaton);
+
+    automaton = compileFilter(NULL, 0);
+    CHECK(automaton != NULL);
+    CHECK(scan(automaton, "anything at all") == 0);
+    freeFilterAutomaton(automaton);
+}
+
+static void test_rule_file(void) {
+    char path[] = "/tmp/test-msg-filter-XXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd != -1);
+    FILE *file = fdopen(fd, "w");
+    fputs("# blocked words\n\nspam\n  # indented comment\n*coin\n", file);
+    fclose(file);
+
+    MessageFilter filter;
+    CHECK(openMessageFilter(&filter, path) == 0);
+    CHECK(filterMessage(&filter, "free bitcoin", 12) == 1);
+    CHECK(filterMessage(&filter, "Spam?", 5) == 1);
+    CHECK(filterMessage(&filter, "blocked words", 13) == 0); // comments aren't rules
+    CHECK(filterMessage(&filter, "eggs", 4) == 0);
+    CHECK(filter.stats.scanned == 4 && filter.stats.blocked == 2);
+
+    file = fopen(path, "w");
+    fputs("eggs\n", file);
+    fclose(file);
+    CHECK(reloadMessageFilter(&filter) == 0);
+    CHECK(filterMessage(&filter, "eggs", 4) == 1);
+    CHECK(filterMessage(&filter, "spam", 4) == 0);
+
+    unlink(path);
+    CHECK(reloadMessageFilter(&filter) == -1); // the rules in force stay
+    CHECK(filterMessage(&filter, "eggs", 4) == 1);
+    closeMessageFilter(&filter);
+}
+
+int main(void) {
+    test_word_edges();
+    test_shared_patterns();
+    test_rule_file();
+    return check_result("test-msg-filter");
+}
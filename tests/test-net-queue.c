@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "../tls-transport.h"
+#include "check.h"
+
+/**
+ * Program name: test-net-queue.c
+ * Description:  The per-connection outbound queue (tls-transport.c), on a
+ *               socket pair with small buffers: what the socket doesn't take
+ *               is queued and goes out in order, a queue past NET_QUEUE_LIMIT
+ *               shuts the connection down, and while a thread waits in
+ *               net_send() on a full socket, net_queue() still returns at
+ *               once (it appends behind that frame instead of taking the
+ *               socket) and the bytes come out whole and in order.
+ */
+
+#define FRAME 600
+#define BIG_SEND (1024 * 1024)
+
+static void make_pair(int fds[2]) {
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    int size = 4096;
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof size);
+    setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof size);
+}
+
+static void fill_frame(char *frame, unsigned int n) {
+    memset(frame, 'a' + n % 26, FRAME);
+    memcpy(frame, &n, sizeof n);
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// Reads exactly len bytes from the other end.
+static int read_exactly(int fd, char *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = read(fd, buf + got, len - got);
+        if (n <= 0) {
+            return -1;
+        }
+        got += n;
+    }
+    return 0;
+}
+
+// Reads frames first..first+count-1 and checks each one.
+static int read_frames(int fd, unsigned int first, unsigned int count) {
+    char frame[FRAME], expected[FRAME];
+    for (unsigned int n = first; n < first + count; n++) {
+        fill_frame(expected, n);
+        if (read_exactly(fd, frame, FRAME) == -1 || memcmp(frame, expected, FRAME) != 0) {
+            printf("frame %u is wrong\n", n);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// net_drain() while a child process reads frames first..first+count-1.
+static int drain_to_reader(int fds[2], unsigned int first, unsigned int count) {
+    pid_t child = fork();
+    if (child == 0) {
+        _exit(read_frames(fds[1], first, count) ? 0 : 1);
+    }
+    int drained = net_drain(fds[0], 5000);
+    int status = 1;
+    waitpid(child, &status, 0);
+    return drained == 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static void test_queue_in_order(void) {
+    int fds[2];
+    make_pair(fds);
+    char frame[FRAME];
+    int results[3] = { 0, 0, 0 };
+    for (unsigned int n = 0; n < 100; n++) {
+        fill_frame(frame, n);
+        int result = net_queue(fds[0], frame, FRAME);
+        CHECK(result >= 0 && result <= 2);
+        if (result >= 0 && result <= 2) {
+            results[result]++;
+        }
+    }
+    // The socket took the first frames, the first frame it refused started
+    // the queue (1) and the rest found it started (2).
+    CHECK(results[0] > 0 && results[1] == 1 && results[2] > 0);
+    CHECK(net_flush(fds[0]) == 1);
+    CHECK(net_drain(fds[0], 0) == -1); // nobody reads
+
+    // Drain while the other end reads: every frame, once, in order.
+    CHECK(drain_to_reader(fds, 0, 100));
+    net_close(fds[0]);
+    close(fds[1]);
+}
+
+static void test_overflow(void) {
+    int fds[2];
+    make_pair(fds);
+    char frame[FRAME];
+    fill_frame(frame, 0);
+    int result = 0;
+    unsigned int n;
+    for (n = 0; n < 2 * NET_QUEUE_LIMIT / FRAME && result != -1; n++) {
+        result = net_queue(fds[0], frame, FRAME);
+    }
+    CHECK(result == -1 && errno == ENOBUFS);
+    CHECK(n * FRAME > NET_QUEUE_LIMIT);
+    CHECK(net_queue(fds[0], frame, FRAME) == -1 && errno == EPIPE);
+    CHECK(net_send(fds[0], frame, FRAME) == -1);
+    net_close(fds[0]);
+    close(fds[1]);
+}
+
+typedef struct {
+    int fd;
+    char *buf;
+    ssize_t result;
+} BigSend;
+
+static void *big_send(void *arg) {
+    BigSend *send = (BigSend *) arg;
+    send->result = net_send(send->fd, send->buf, BIG_SEND);
+    return NULL;
+}
+
+static void test_send_does_not_block_queue(void) {
+    int fds[2];
+    make_pair(fds);
+    BigSend send = { fds[0], (char *) malloc(BIG_SEND), 0 };
+    for (int i = 0; i < BIG_SEND; i++) {
+        send.buf[i] = (char) (i * 7);
+    }
+    pthread_t thread;
+    pthread_create(&thread, NULL, big_send, &send);
+    usleep(100 * 1000); // the socket is full, net_send() waits for the reader
+
+    // A fan-out write doesn't wait for it: it is queued behind the frame.
+    char frame[FRAME];
+    fill_frame(frame, 1);
+    double start = now_ms();
+    CHECK(net_queue(fds[0], frame, FRAME) == 1);
+    fill_frame(frame, 2);
+    CHECK(net_queue(fds[0], frame, FRAME) == 2);
+    CHECK(net_flush(fds[0]) == 1);
+    CHECK(net_send_if_room(fds[0], frame, FRAME) == -1 && errno == EAGAIN);
+    CHECK(net_claim_plain(fds[0]) == -1);
+    CHECK(now_ms() - start < 50);
+
+    // The reader gets the big frame whole, then the queued frames.
+    char *got = (char *) malloc(BIG_SEND);
+    CHECK(read_exactly(fds[1], got, BIG_SEND) == 0);
+    CHECK(memcmp(got, send.buf, BIG_SEND) == 0);
+    pthread_join(thread, NULL);
+    CHECK(send.result == BIG_SEND);
+    CHECK(drain_to_reader(fds, 1, 2));
+    int flags = fcntl(fds[1], F_GETFL, 0);
+    fcntl(fds[1], F_SETFL, flags | O_NONBLOCK);
+    char extra;
+    CHECK(read(fds[1], &extra, 1) == -1 && errno == EAGAIN); // nothing else came
+    free(got);
+    free(send.buf);
+    net_close(fds[0]);
+    close(fds[1]);
+}
+
+int main(void) {
+    test_queue_in_order();
+    test_overflow();
+    test_send_does_not_block_queue();
+    return check_result("test-net-queue");
+}
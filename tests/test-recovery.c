@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "../protocol.h"
+#include "../user-list.h"
+#include "../group-list.h"
+#include "../msg-list.h"
+#include "../user-store.h"
+#include "../msg-log.h"
+#include "check.h"
+
+/**
+ * Program name: test-recovery.c
+ * Description:  Restart after a crash mid-write: the user log (user-store.c)
+ *               and the message log (msg-log.c) are cut short inside their
+ *               last record, or end in garbage. On reopening, every whole
+ *               record before the damage is replayed, the file is cut back
+ *               to the last good record, and records written afterwards are
+ *               replayed on the next start (they aren't stranded behind the
+ *               damaged bytes).
+ * Run:          ./test-recovery [scratch dir] (default: a new one in /tmp)
+ */
+
+static char password[] = "$5$abcdefgh$0123456789abcdefghijABCDEFGHIJ0123456789abc";
+
+static off_t file_size(const char *path) {
+    struct stat st;
+    return (stat(path, &st) == 0) ? st.st_size : -1;
+}
+
+static void append_bytes(const char *path, const char *bytes, size_t len) {
+    FILE *file = fopen(path, "a");
+    CHECK(file != NULL);
+    if (file != NULL) {
+        CHECK(fwrite(bytes, 1, len, file) == len);
+        fclose(file);
+    }
+}
+
+// The newest user log generation in dir.
+static int newest_wal(const char *dir, char *path, size_t size) {
+    DIR *d = opendir(dir);
+    unsigned int newest = 0;
+    int found = 0;
+    struct dirent *entry;
+    while (d != NULL && (entry = readdir(d)) != NULL) {
+        unsigned int gen;
+        if (sscanf(entry->d_name, "users.wal.%u", &gen) == 1 && (!found || gen > newest)) {
+            newest = gen;
+            found = 1;
+        }
+    }
+    if (d != NULL) {
+        closedir(d);
+    }
+    snprintf(path, size, "%s/users.wal.%u", dir, newest);
+    return found ? 0 : -1;
+}
+
+static User *register_user(UserStore *store, UserList *userList, char *email, char *name) {
+    User *user = createUser(email, name, password);
+    appendUser(userList, user);
+    CHECK(logRegistration(store, user) == 0);
+    return user;
+}
+
+static void test_user_log(const char *dir) {
+    UserList userList;
+    GroupList groupList;
+    UserStore store;
+    char wal[512];
+
+    initUserList(&userList);
+    initGroupList(&groupList);
+    CHECK(openUserStore(&store, dir, &userList, &groupList) == 0);
+    User *alice = register_user(&store, &userList, "alice@scranton.edu", "Alice");
+    CHECK(logCreate(&store, "CMPS", alice) == 0);
+    addUserGroup(alice, "CMPS", 0);
+    CHECK(logJoin(&store, alice, "CMPS") == 0);
+    CHECK(newest_wal(dir, wal, sizeof wal) == 0);
+    off_t good = file_size(wal);
+    register_user(&store, &userList, "bob@scranton.edu", "Bob");
+    freeUserList(&userList);
+    freeGroupList(&groupList);
+    closeUserStore(&store);
+
+    // Crash in the middle of Bob's registration.
+    CHECK(truncate(wal, file_size(wal) - 5) == 0);
+    initUserList(&userList);
+    initGroupList(&groupList);
+    CHECK(openUserStore(&store, dir, &userList, &groupList) == 0);
+    alice = findUser(&userList, "alice@scranton.edu");
+    CHECK(alice != NULL);
+    CHECK(findUser(&userList, "bob@scranton.edu") == NULL);
+    CHECK(findGroup(&groupList, "CMPS") != NULL);
+    CHECK(alice != NULL && alice->groups != NULL);
+    CHECK(file_size(wal) == good);
+
+    // Written after the cut: replayed next time.
+    register_user(&store, &userList, "carol@scranton.edu", "Carol");
+    freeUserList(&userList);
+    freeGroupList(&groupList);
+    closeUserStore(&store);
+
+    // Garbage after the last record (a header whose payload never came).
+    char newest[512];
+    CHECK(newest_wal(dir, newest, sizeof newest) == 0);
+    off_t before = file_size(newest);
+    char garbage[24];
+    memset(garbage, 0x5a, sizeof garbage);
+    append_bytes(newest, garbage, sizeof garbage);
+    initUserList(&userList);
+    initGroupList(&groupList);
+    CHECK(openUserStore(&store, dir, &userList, &groupList) == 0);
+    CHECK(findUser(&userList, "alice@scranton.edu") != NULL);
+    CHECK(findUser(&userList, "carol@scranton.edu") != NULL);
+    CHECK(findUser(&userList, "bob@scranton.edu") == NULL);
+    CHECK(file_size(newest) == before);
+    freeUserList(&userList);
+    freeGroupList(&groupList);
+    closeUserStore(&store);
+}
+
+// Opens the log into fresh lists; alice is the only sender.
+static void open_log(MessageLog *log, const char *dir, UserList *userList, MessageList *msgList,
+                     GroupList *groupList) {
+    initUserList(userList);
+    initMessageList(msgList);
+    initGroupList(groupList);
+    appendUser(userList, createUser("alice@scranton.edu", "Alice", password));
+    CHECK(openMessageLog(log, dir, userList, msgList, groupList) == 0);
+}
+
+static void close_log(MessageLog *log, UserList *userList, MessageList *msgList, GroupList *groupList) {
+    closeMessageLog(log);
+    freeMessageList(msgList);
+    freeGroupList(groupList);
+    freeUserList(userList);
+}
+
+static long long post(MessageLog *log, unsigned int seq, const char *text) {
+    MessageHeader header;
+    memset(&header, 0, sizeof header);
+    header.seq = seq;
+    header.timestamp = 1700000000000LL + seq;
+    long long offset = logMessage(log, &header, "CMPS", "alice@scranton.edu", text);
+    CHECK(offset != -1);
+    return offset + strlen(text) + 1; // the text ends the record
+}
+
+// The text of a replayed message of CMPS, "" if it isn't there.
+static const char *text_of(GroupInfo *group, MessageList *msgList, unsigned int seq, BodyReader *reader) {
+    if (group == NULL || seq > group->lastSeq) {
+        return "";
+    }
+    MessageHeader *header = getMessageHeader(msgList, getGroupMessage(group, seq));
+    const char *text = (header != NULL) ? readMessageBody(msgList, header, reader) : NULL;
+    return (text != NULL) ? text : "";
+}
+
+static void test_message_log(const char *dir) {
+    UserList userList;
+    MessageList msgList;
+    GroupList groupList;
+    MessageLog log;
+    char path[1024];
+    BodyReader *reader = (BodyReader *) malloc(sizeof(BodyReader));
+    snprintf(path, sizeof path, "%s/%s", dir, MESSAGE_LOG_FILE);
+
+    open_log(&log, dir, &userList, &msgList, &groupList);
+    CHECK(log.records == 0);
+    post(&log, 1, "first");
+    off_t good = post(&log, 2, "second");
+    post(&log, 3, "third");
+    close_log(&log, &userList, &msgList, &groupList);
+
+    // Crash in the middle of the third record.
+    CHECK(truncate(path, file_size(path) - 3) == 0);
+    open_log(&log, dir, &userList, &msgList, &groupList);
+    GroupInfo *group = findGroup(&groupList, "CMPS");
+    CHECK(log.records == 2);
+    CHECK(group != NULL && group->lastSeq == 2);
+    CHECK(file_size(path) == good);
+    reader->length = 0;
+    CHECK(strcmp(text_of(group, &msgList, 1, reader), "first") == 0);
+    CHECK(strcmp(text_of(group, &msgList, 2, reader), "second") == 0);
+
+    // The third message again, after the cut: replayed next time.
+    good = post(&log, 3, "third, again");
+    close_log(&log, &userList, &msgList, &groupList);
+
+    // Garbage after the last record (a header with a bad checksum).
+    char garbage[40];
+    memset(garbage, 0, sizeof garbage);
+    garbage[0] = 8; // payload length
+    append_bytes(path, garbage, sizeof garbage);
+    open_log(&log, dir, &userList, &msgList, &groupList);
+    group = findGroup(&groupList, "CMPS");
+    CHECK(log.records == 3);
+    CHECK(group != NULL && group->lastSeq == 3);
+    CHECK(file_size(path) == good);
+    reader->length = 0;
+    CHECK(strcmp(text_of(group, &msgList, 3, reader), "third, again") == 0);
+    close_log(&log, &userList, &msgList, &groupList);
+    free(reader);
+}
+
+int main(int argc, char *argv[]) {
+    char scratch[] = "/tmp/test-recovery-XXXXXX";
+    const char *dir = (argc > 1) ? argv[1] : mkdtemp(scratch);
+    if (dir == NULL) {
+        perror("Error creating scratch directory");
+        return 1;
+    }
+    char users[512], messages[512];
+    snprintf(users, sizeof users, "%s/users", dir);
+    snprintf(messages, sizeof messages, "%s/messages", dir);
+    mkdir(dir, 0700);
+    mkdir(users, 0700);
+    mkdir(messages, 0700);
+
+    test_user_log(users);
+    test_message_log(messages);
+
+    char command[600];
+    snprintf(command, sizeof command, "rm -rf '%s'", dir);
+    if (system(command) != 0) {
+        printf("Couldn't remove %s\n", dir);
+    }
+    return check_result("test-recovery");
+}
@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../protocol.h"
+#include "../seq-tracker.h"
+#include "check.h"
+
+/**
+ * Program name: test-seq-tracker.c
+ * Description:  Client-side ordering (seq-tracker.c): messages come out in
+ *               sequence order exactly once, a gap holds later messages
+ *               until it is filled, a seed from a batch header moves the
+ *               watermark forward (never back) and drops held messages it
+ *               covers, and a full hold buffer gives up on the oldest gap.
+ */
+
+typedef struct {
+    unsigned int seqs[4 * MAX_PENDING];
+    int count;
+} Delivered;
+
+static void record(user_message *msg, void *arg) {
+    Delivered *delivered = (Delivered *) arg;
+    if (delivered->count < 4 * MAX_PENDING) {
+        delivered->seqs[delivered->count] = msg->seq;
+    }
+    delivered->count++;
+}
+
+static int feed(SeqTrackerList *list, const char *group, unsigned int seq, Delivered *delivered) {
+    user_message msg;
+    memset(&msg, 0, sizeof msg);
+    msg.type = PRINT_MESSAGE_TYPE;
+    strcpy(msg.group, group);
+    snprintf(msg.message, sizeof msg.message, "message %u", seq);
+    msg.seq = seq;
+    return trackMessage(list, &msg, record, delivered);
+}
+
+// delivered holds exactly from..to, in order.
+static int delivered_run(Delivered *delivered, unsigned int from, unsigned int to) {
+    if (delivered->count != (int) (to - from + 1)) {
+        return 0;
+    }
+    for (int i = 0; i < delivered->count; i++) {
+        if (delivered->seqs[i] != from + i) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void test_gaps(void) {
+    SeqTrackerList list;
+    Delivered delivered = { .count = 0 };
+    initSeqTrackerList(&list);
+
+    // Unseeded, the first message sets the starting point.
+    CHECK(feed(&list, "CMPS", 10, &delivered) == SEQ_DELIVERED);
+    CHECK(feed(&list, "CMPS", 11, &delivered) == SEQ_DELIVERED);
+    CHECK(feed(&list, "CMPS", 11, &delivered) == SEQ_DUPLICATE);
+    CHECK(feed(&list, "CMPS", 5, &delivered) == SEQ_DUPLICATE);
+
+    // 12 and 13 lost: 14 and 15 wait, and a repeat of 15 is held once.
+    CHECK(feed(&list, "CMPS", 15, &delivered) == SEQ_GAP);
+    CHECK(feed(&list, "CMPS", 14, &delivered) == SEQ_GAP);
+    CHECK(feed(&list, "CMPS", 15, &delivered) == SEQ_GAP);
+    CHECK(getSeqTracker(&list, "CMPS")->pendingCount == 2);
+    CHECK(delivered_run(&delivered, 10, 11));
+
+    CHECK(feed(&list, "CMPS", 13, &delivered) == SEQ_GAP);
+    CHECK(feed(&list, "CMPS", 12, &delivered) == SEQ_DELIVERED); // releases 13..15
+    CHECK(delivered_run(&delivered, 10, 15));
+    CHECK(getSeqTracker(&list, "CMPS")->pendingCount == 0);
+    CHECK(getSeqTracker(&list, "CMPS")->delivered == 15);
+    CHECK(getSeqTracker(&list, "CMPS")->unacked == 6);
+
+    // Groups are independent.
+    CHECK(feed(&list, "MATH", 1, &delivered) == SEQ_DELIVERED);
+    CHECK(getSeqTracker(&list, "CMPS")->delivered == 15);
+    freeSeqTrackerList(&list);
+}
+
+static void test_seed(void) {
+    SeqTrackerList list;
+    Delivered delivered = { .count = 0 };
+    initSeqTrackerList(&list);
+
+    // Seeded at 20: 21 is next, 20 and older are duplicates.
+    seedSeqTracker(&list, "CMPS", 20, record, &delivered);
+    CHECK(feed(&list, "CMPS", 20, &delivered) == SEQ_DUPLICATE);
+    CHECK(feed(&list, "CMPS", 22, &delivered) == SEQ_GAP);
+    CHECK(feed(&list, "CMPS", 25, &delivered) == SEQ_GAP);
+    CHECK(delivered.count == 0);
+
+    // A batch says everything up to 23 came in an earlier session: 22 is
+    // dropped, 24 is still missing, so 25 keeps waiting.
+    seedSeqTracker(&list, "CMPS", 23, record, &delivered);
+    CHECK(delivered.count == 0);
+    CHECK(getSeqTracker(&list, "CMPS")->pendingCount == 1);
+    CHECK(feed(&list, "CMPS", 24, &delivered) == SEQ_DELIVERED);
+    CHECK(delivered_run(&delivered, 24, 25));
+
+    // An older seed doesn't move the watermark back.
+    seedSeqTracker(&list, "CMPS", 3, record, &delivered);
+    CHECK(getSeqTracker(&list, "CMPS")->delivered == 25);
+    CHECK(feed(&list, "CMPS", 4, &delivered) == SEQ_DUPLICATE);
+
+    // A seed that closes the gap before a held message delivers it (26
+    // itself came in the earlier session).
+    CHECK(feed(&list, "CMPS", 27, &delivered) == SEQ_GAP);
+    seedSeqTracker(&list, "CMPS", 26, record, &delivered);
+    CHECK(delivered.count == 3 && delivered.seqs[2] == 27);
+    CHECK(getSeqTracker(&list, "CMPS")->delivered == 27);
+    freeSeqTrackerList(&list);
+}
+
+static void test_full_buffer(void) {
+    SeqTrackerList list;
+    Delivered delivered = { .count = 0 };
+    initSeqTrackerList(&list);
+    seedSeqTracker(&list, "CMPS", 0, record, &delivered);
+
+    // 1 never comes; 2..MAX_PENDING+1 fill the buffer.
+    for (unsigned int seq = 2; seq <= MAX_PENDING + 1; seq++) {
+        CHECK(feed(&list, "CMPS", seq, &delivered) == SEQ_GAP);
+    }
+    CHECK(delivered.count == 0);
+    // One more: the gap at 1 is given up and everything held goes out.
+    CHECK(feed(&list, "CMPS", MAX_PENDING + 2, &delivered) == SEQ_DELIVERED);
+    CHECK(delivered_run(&delivered, 2, MAX_PENDING + 2));
+    CHECK(getSeqTracker(&list, "CMPS")->pendingCount == 0);
+    freeSeqTrackerList(&list);
+}
+
+int main(void) {
+    test_gaps();
+    test_seed();
+    test_full_buffer();
+    return check_result("test-seq-tracker");
+}
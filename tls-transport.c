@@ -0,0 +1,1076 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#elif defined(__FreeBSD__)
+#include <sys/uio.h>
+#endif
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+#include "tls-transport.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // macOS: SIGPIPE is ignored per socket instead
+#endif
+
+#define HANDSHAKE_TIMEOUT_SEC 10  // a peer that stalls the handshake loses its slot
+#define SESSION_CACHE_SIZE 65536  // server-side sessions kept for resumption
+#define SESSION_TIMEOUT_SEC 7200  // lifetime of a session / ticket
+
+// TLS 1.3 AES-GCM suites first: those are the ones the kernel can offload.
+#define TLS13_CIPHERSUITES "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256"
+#define TLS12_CIPHERS "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:" \
+                      "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384"
+
+/**
+ * Struct name: TransportSlot
+ * Description: Per-descriptor transport state, indexed by socket fd.
+ *
+ * param ssl  The TLS session on this socket, NULL for a plaintext socket.
+ * param lock Guards the slot. It is only held for calls that don't wait, so
+ *            the fan-out can always get it. For TLS sockets it also guards
+ *            the SSL object, which is not safe to use from two threads at once.
+ * param writing A thread is writing a frame that may wait for the socket
+ *            (net_send(), net_send_file()): it owns the byte stream, and
+ *            other writers queue behind it (net_queue()) or wait for idle.
+ * param out  Bytes queued by net_queue() that the socket hasn't taken yet:
+ *            out[outStart..outEnd). Every writer sends them first.
+ * param outClosed The queue overflowed and the connection was shut down.
+ */
+typedef struct TRANSPORT_SLOT {
+    SSL *ssl;
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    int writing;
+    char *out;
+    size_t outStart;
+    size_t outEnd;
+    size_t outCapacity;
+    int outClosed;
+} TransportSlot;
+
+static TransportSlot *slots;
+static pthread_once_t slots_once = PTHREAD_ONCE_INIT;
+
+static SSL_CTX *server_ctx;
+static SSL_CTX *client_ctx;
+
+// Client-side session cache: the last session ticket the server gave us.
+static SSL_SESSION *cached_session;
+static pthread_mutex_t cached_session_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void init_slots(void) {
+    slots = (TransportSlot *) calloc(MAX_CONNECTIONS, sizeof(TransportSlot));
+    if (slots == NULL) {
+        perror("Error allocating transport table");
+        exit(1);
+    }
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        pthread_mutex_init(&slots[i].lock, NULL);
+        pthread_cond_init(&slots[i].idle, NULL);
+    }
+}
+
+static TransportSlot *get_slot(int fd) {
+    pthread_once(&slots_once, init_slots);
+    if (fd < 0 || fd >= MAX_CONNECTIONS) {
+        return NULL;
+    }
+    return &slots[fd];
+}
+
+static void print_ssl_errors(const char *what) {
+    unsigned long err;
+    printf("%s\n", what);
+    while ((err = ERR_get_error()) != 0) {
+        char buf[256];
+        ERR_error_string_n(err, buf, sizeof buf);
+        printf("  %s\n", buf);
+    }
+}
+
+// Wait until the socket can make progress on the SSL operation that
+// returned err (SSL_ERROR_WANT_READ or SSL_ERROR_WANT_WRITE).
+static void wait_for_socket(int fd, int err) {
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = (err == SSL_ERROR_WANT_WRITE) ? POLLOUT : POLLIN;
+    pfd.revents = 0;
+    while (poll(&pfd, 1, -1) == -1 && errno == EINTR) {
+    }
+}
+
+static void set_handshake_timeout(int fd, int seconds) {
+    struct timeval tv;
+    tv.tv_sec = seconds;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+}
+
+// Settings shared by both ends: modern protocol versions, offloadable
+// ciphers first, kTLS on, and idle read/write buffers released so tens of
+// thousands of mostly idle connections don't each pin ~34KB of buffers.
+// Partial writes let net_send_some() and net_queue() report progress record
+// by record; a retried write may come from a different address (a compacted
+// queue).
+static void configure_ctx(SSL_CTX *ctx) {
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+    SSL_CTX_set_ciphersuites(ctx, TLS13_CIPHERSUITES);
+    SSL_CTX_set_cipher_list(ctx, TLS12_CIPHERS);
+    SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS | SSL_MODE_ENABLE_PARTIAL_WRITE |
+                          SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+}
+
+// Attach ssl to fd once the handshake is done. The socket becomes
+// non-blocking so a reader waiting in poll() never holds the slot lock
+// and writers on other threads can still get through.
+static void attach_session(int fd, SSL *ssl) {
+    TransportSlot *slot = get_slot(fd);
+    set_handshake_timeout(fd, 0);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    pthread_mutex_lock(&slot->lock);
+    slot->ssl = ssl;
+    pthread_mutex_unlock(&slot->lock);
+}
+
+/**
+ * Creates the server TLS context from a PEM certificate chain and key.
+ *
+ * param cert_file Path of the PEM certificate chain.
+ * param key_file  Path of the PEM private key.
+ * return 0 on success, -1 on error.
+ */
+int tls_server_init(const char *cert_file, const char *key_file) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == NULL) {
+        print_ssl_errors("Error creating TLS server context");
+        return -1;
+    }
+    configure_ctx(ctx);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        print_ssl_errors("Error loading TLS certificate or key");
+        SSL_CTX_free(ctx);
+        return -1;
+    }
+
+    // Resumption: stateless tickets (one per handshake is enough, clients
+    // only keep the latest) plus a server-side cache for TLS 1.2 peers.
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char *) "group-chat", 10);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(ctx, SESSION_TIMEOUT_SEC);
+    SSL_CTX_set_num_tickets(ctx, 1);
+
+    server_ctx = ctx;
+    return 0;
+}
+
+int tls_server_enabled(void) {
+    return server_ctx != NULL;
+}
+
+/**
+ * Runs the server side of the TLS handshake on an accepted socket.
+ * Called from the connection's own thread so a slow handshake never
+ * holds up the accept loop.
+ *
+ * param client_socket The socket returned by accept_client().
+ * return 0 on success, -1 if the handshake failed.
+ */
+int tls_accept_client(int client_socket) {
+    if (get_slot(client_socket) == NULL) {
+        printf("TLS: socket %d out of range\n", client_socket);
+        return -1;
+    }
+    SSL *ssl = SSL_new(server_ctx);
+    if (ssl == NULL) {
+        print_ssl_errors("Error creating TLS session");
+        return -1;
+    }
+    SSL_set_fd(ssl, client_socket);
+    set_handshake_timeout(client_socket, HANDSHAKE_TIMEOUT_SEC);
+    if (SSL_accept(ssl) != 1) {
+        print_ssl_errors("TLS handshake with client failed");
+        SSL_free(ssl);
+        return -1;
+    }
+    attach_session(client_socket, ssl);
+    return 0;
+}
+
+// New-session callback: keep only the newest ticket. Returning 1 tells
+// OpenSSL we took ownership of the reference.
+static int remember_session(SSL *ssl, SSL_SESSION *session) {
+    (void) ssl;
+    pthread_mutex_lock(&cached_session_mutex);
+    if (cached_session != NULL) {
+        SSL_SESSION_free(cached_session);
+    }
+    cached_session = session;
+    pthread_mutex_unlock(&cached_session_mutex);
+    return 1;
+}
+
+/**
+ * Creates the client TLS context. The server certificate is always verified.
+ *
+ * param ca_file PEM file of trusted CAs (or the server's self-signed
+ *               certificate). NULL uses the system trust store.
+ * return 0 on success, -1 on error.
+ */
+int tls_client_init(const char *ca_file) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    if (ctx == NULL) {
+        print_ssl_errors("Error creating TLS client context");
+        return -1;
+    }
+    configure_ctx(ctx);
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+
+    int loaded = (ca_file != NULL) ? SSL_CTX_load_verify_locations(ctx, ca_file, NULL)
+                                   : SSL_CTX_set_default_verify_paths(ctx);
+    if (loaded != 1) {
+        print_ssl_errors("Error loading trusted certificates");
+        SSL_CTX_free(ctx);
+        return -1;
+    }
+
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, remember_session);
+
+    client_ctx = ctx;
+    return 0;
+}
+
+int tls_client_enabled(void) {
+    return client_ctx != NULL;
+}
+
+/**
+ * Runs the client side of the TLS handshake on a connected socket,
+ * offering the cached session (if any) for an abbreviated handshake.
+ *
+ * param server_socket The socket returned by get_server_connection().
+ * param hostname      Name or address the certificate must match.
+ * return 0 on success, -1 if the handshake or verification failed.
+ */
+int tls_connect_server(int server_socket, const char *hostname) {
+    if (get_slot(server_socket) == NULL) {
+        printf("TLS: socket %d out of range\n", server_socket);
+        return -1;
+    }
+    SSL *ssl = SSL_new(client_ctx);
+    if (ssl == NULL) {
+        print_ssl_errors("Error creating TLS session");
+        return -1;
+    }
+    SSL_set_fd(ssl, server_socket);
+
+    // Verify against an IP SAN for literal addresses, otherwise the DNS
+    // name (which is also sent as SNI).
+    unsigned char addr[sizeof(struct in6_addr)];
+    if (inet_pton(AF_INET, hostname, addr) == 1 || inet_pton(AF_INET6, hostname, addr) == 1) {
+        X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), hostname);
+    } else {
+        SSL_set_tlsext_host_name(ssl, hostname);
+        SSL_set1_host(ssl, hostname);
+    }
+
+    pthread_mutex_lock(&cached_session_mutex);
+    if (cached_session != NULL) {
+        SSL_set_session(ssl, cached_session);
+    }
+    pthread_mutex_unlock(&cached_session_mutex);
+
+    set_handshake_timeout(server_socket, HANDSHAKE_TIMEOUT_SEC);
+    if (SSL_connect(ssl) != 1) {
+        print_ssl_errors("TLS handshake with server failed");
+        SSL_free(ssl);
+        return -1;
+    }
+    attach_session(server_socket, ssl);
+    return 0;
+}
+
+/**
+ * Drops the cached client session so the next connect does a full handshake.
+ */
+void tls_client_forget_session(void) {
+    pthread_mutex_lock(&cached_session_mutex);
+    if (cached_session != NULL) {
+        SSL_SESSION_free(cached_session);
+        cached_session = NULL;
+    }
+    pthread_mutex_unlock(&cached_session_mutex);
+}
+
+static ssize_t plain_send(int fd, const char *buf, size_t len) {
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t n = send(fd, buf + sent, len - sent, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        sent += n;
+    }
+    return sent;
+}
+
+// Waits for the socket with slot->lock released; the caller holds it.
+static void wait_unlocked(int fd, TransportSlot *slot, int err) {
+    pthread_mutex_unlock(&slot->lock);
+    wait_for_socket(fd, err);
+    pthread_mutex_lock(&slot->lock);
+}
+
+// The caller holds slot->lock and owns the stream (slot->writing).
+static ssize_t tls_send(int fd, TransportSlot *slot, const char *buf, size_t len) {
+    size_t sent = 0;
+    while (sent < len) {
+        size_t written = 0;
+        int ret = SSL_write_ex(slot->ssl, buf + sent, len - sent, &written);
+        if (ret == 1) {
+            sent += written;
+            continue;
+        }
+        int err = SSL_get_error(slot->ssl, ret);
+        if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) {
+            // The retry repeats the same arguments: no other writer gets in
+            // while the lock is down, they see slot->writing.
+            wait_unlocked(fd, slot, err);
+            continue;
+        }
+        ERR_clear_error();
+        errno = EPIPE;
+        return -1;
+    }
+    return sent;
+}
+
+// Writes what the socket takes now; the caller holds slot->lock.
+// return bytes written, or -1 (errno EAGAIN if none could be).
+static ssize_t write_some(int fd, TransportSlot *slot, const char *buf, size_t len) {
+    ssize_t result;
+    if (slot->ssl == NULL) {
+        while ((result = send(fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT)) == -1 && errno == EINTR) {
+        }
+        return result;
+    }
+    size_t written = 0;
+    int ret = SSL_write_ex(slot->ssl, buf, len, &written);
+    int err = (ret == 1) ? SSL_ERROR_NONE : SSL_get_error(slot->ssl, ret);
+    if (err == SSL_ERROR_NONE) {
+        return written;
+    }
+    ERR_clear_error();
+    errno = (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) ? EAGAIN : EPIPE;
+    return -1;
+}
+
+// Writes what the socket takes now of the queued bytes; the caller holds
+// slot->lock. return 0 if the queue is empty, 1 if bytes remain, -1 on error.
+static int write_queued(int fd, TransportSlot *slot) {
+    while (slot->outStart < slot->outEnd) {
+        ssize_t n = write_some(fd, slot, slot->out + slot->outStart, slot->outEnd - slot->outStart);
+        if (n == -1) {
+            return (errno == EAGAIN) ? 1 : -1;
+        }
+        slot->outStart += n;
+    }
+    slot->outStart = 0;
+    slot->outEnd = 0;
+    return 0;
+}
+
+// Makes the caller the only writer of fd and sends the queued bytes ahead
+// of its own; the caller holds slot->lock, which is released while the
+// socket is full. Finish with end_write(), whatever this returns.
+// return 0, or -1 on error.
+static int begin_write(int fd, TransportSlot *slot) {
+    while (slot->writing) {
+        pthread_cond_wait(&slot->idle, &slot->lock);
+    }
+    slot->writing = 1;
+    int result = 1;
+    while (result == 1) {
+        if (slot->outClosed) {
+            errno = EPIPE;
+            return -1;
+        }
+        if ((result = write_queued(fd, slot)) == 1) {
+            wait_unlocked(fd, slot, SSL_ERROR_WANT_WRITE);
+        }
+    }
+    return result;
+}
+
+// Sends all of buf as the owner of fd (begin_write()); the caller holds
+// slot->lock, which is released while the socket is full.
+static ssize_t write_all(int fd, TransportSlot *slot, const char *buf, size_t len) {
+    if (slot->ssl != NULL) {
+        return tls_send(fd, slot, buf, len);
+    }
+    pthread_mutex_unlock(&slot->lock);
+    ssize_t result = plain_send(fd, buf, len);
+    pthread_mutex_lock(&slot->lock);
+    return result;
+}
+
+// Gives up the stream: what was queued meanwhile goes out as far as the
+// socket takes it now, the rest with the queuer's next net_flush().
+static void end_write(int fd, TransportSlot *slot) {
+    slot->writing = 0;
+    if (!slot->outClosed) {
+        write_queued(fd, slot);
+    }
+    pthread_cond_broadcast(&slot->idle);
+}
+
+// Drops the queue and shuts the connection down (its reader sees it end);
+// the caller holds slot->lock. return -1 with errno ENOBUFS.
+static int cut_off(int fd, TransportSlot *slot) {
+    free(slot->out);
+    slot->out = NULL;
+    slot->outStart = slot->outEnd = slot->outCapacity = 0;
+    slot->outClosed = 1;
+    shutdown(fd, SHUT_RDWR);
+    errno = ENOBUFS;
+    return -1;
+}
+
+// Appends to the queue; the caller holds slot->lock. Past NET_QUEUE_LIMIT the
+// client isn't reading, and the connection is cut off: part of a frame may
+// already be out, so it can't just be skipped.
+// return 1 (queued), or -1 (errno ENOBUFS).
+static int append_queued(int fd, TransportSlot *slot, const char *buf, size_t len) {
+    size_t queued = slot->outEnd - slot->outStart;
+    if (queued + len > NET_QUEUE_LIMIT) {
+        return cut_off(fd, slot);
+    }
+    if (slot->outStart > 0 && slot->outEnd + len > slot->outCapacity) {
+        memmove(slot->out, slot->out + slot->outStart, queued);
+        slot->outStart = 0;
+        slot->outEnd = queued;
+    }
+    if (queued + len > slot->outCapacity) {
+        size_t capacity = slot->outCapacity ? slot->outCapacity : 16384;
+        while (capacity < queued + len) {
+            capacity *= 2;
+        }
+        char *out = (char *) realloc(slot->out, capacity);
+        if (out == NULL) {
+            perror("Error growing connection queue");
+            return cut_off(fd, slot);
+        }
+        slot->out = out;
+        slot->outCapacity = capacity;
+    }
+    memcpy(slot->out + slot->outEnd, buf, len);
+    slot->outEnd += len;
+    return 1;
+}
+
+/**
+ * Sends the whole buffer on fd, encrypting it when fd carries a TLS session.
+ * Concurrent callers on the same fd are serialised, so each frame is written
+ * contiguously. Bytes queued by net_queue() go out first. While the socket
+ * is full the caller waits without the slot lock: net_queue() callers append
+ * behind it instead of waiting too.
+ *
+ * return len on success, -1 on error.
+ */
+ssize_t net_send(int fd, const void *buf, size_t len) {
+    TransportSlot *slot = get_slot(fd);
+    if (slot == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+    pthread_mutex_lock(&slot->lock);
+    ssize_t result = -1;
+    if (begin_write(fd, slot) == 0) {
+        result = write_all(fd, slot, (const char *) buf, len);
+    }
+    end_write(fd, slot);
+    pthread_mutex_unlock(&slot->lock);
+    return result;
+}
+
+/**
+ * Sends buf on fd without waiting: what the socket doesn't take now is
+ * queued, and goes out with the next write or net_flush(). While another
+ * thread is in the middle of a frame (net_send()) all of buf is queued. At most
+ * NET_QUEUE_LIMIT bytes are queued per connection; a client that lets more
+ * pile up isn't reading, and its connection is shut down (its reader sees
+ * the connection end).
+ *
+ * return 0 if all of buf was written, 1 if some of it is queued and the
+ *        queue was empty before, 2 if it already held bytes, -1 on error
+ *        (errno ENOBUFS when the queue overflowed).
+ */
+int net_queue(int fd, const void *buf, size_t len) {
+    TransportSlot *slot = get_slot(fd);
+    if (slot == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+    pthread_mutex_lock(&slot->lock);
+    if (slot->outClosed) {
+        pthread_mutex_unlock(&slot->lock);
+        errno = EPIPE;
+        return -1;
+    }
+    int waiting = slot->outStart != slot->outEnd;
+    int result = slot->writing ? 1 : write_queued(fd, slot);
+    size_t sent = 0;
+    while (result == 0 && sent < len) {
+        ssize_t n = write_some(fd, slot, (const char *) buf + sent, len - sent);
+        if (n == -1) {
+            result = (errno == EAGAIN) ? 1 : -1;
+        } else {
+            sent += n;
+        }
+    }
+    if (result == 1 && append_queued(fd, slot, (const char *) buf + sent, len - sent) == -1) {
+        result = -1;
+    } else if (result == 1 && waiting) {
+        result = 2;
+    }
+    pthread_mutex_unlock(&slot->lock);
+    return result;
+}
+
+/**
+ * Writes what the socket takes now of the bytes queued by net_queue().
+ *
+ * return 0 once nothing is queued, 1 if bytes remain (or another thread is
+ *        in the middle of a frame), -1 on error.
+ */
+int net_flush(int fd) {
+    TransportSlot *slot = get_slot(fd);
+    if (slot == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&slot->lock);
+    int result = -1;
+    if (slot->outClosed) {
+        errno = EPIPE;
+    } else if (slot->writing) {
+        result = 1;
+    } else {
+        result = write_queued(fd, slot);
+    }
+    pthread_mutex_unlock(&slot->lock);
+    return result;
+}
+
+/**
+ * Waits up to timeout_ms for the socket to take the bytes queued by
+ * net_queue() (before the connection changes hands or closes), and for a
+ * frame another thread is writing. With timeout_ms 0 it tries once.
+ *
+ * return 0 once nothing is queued, -1 if bytes remain or on error.
+ */
+int net_drain(int fd, int timeout_ms) {
+    TransportSlot *slot = get_slot(fd);
+    if (slot == NULL) {
+        return 0;
+    }
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&slot->lock);
+    int result = -1;
+    while (1) {
+        while (slot->writing && pthread_cond_timedwait(&slot->idle, &slot->lock, &deadline) == 0) {
+        }
+        if (slot->writing) {
+            break; // still in the middle of a frame
+        }
+        if (slot->outClosed) {
+            errno = EPIPE;
+            break;
+        }
+        result = write_queued(fd, slot);
+        if (result != 1) {
+            break;
+        }
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        long left = (deadline.tv_sec - now.tv_sec) * 1000L + (deadline.tv_nsec - now.tv_nsec) / 1000000L;
+        if (left <= 0) {
+            result = -1;
+            break;
+        }
+        pthread_mutex_unlock(&slot->lock);
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+        poll(&pfd, 1, (int) left);
+        pthread_mutex_lock(&slot->lock);
+    }
+    pthread_mutex_unlock(&slot->lock);
+    return result;
+}
+
+#define FILE_COPY_SIZE 16384 // piece of a file read and sent when the kernel can't send it
+
+// Reads the file and sends it: for TLS without kernel offload (slot given,
+// its lock held), and systems without sendfile() (slot NULL).
+static ssize_t copy_send_file(int fd, TransportSlot *slot, int file, off_t offset, size_t len) {
+    char buf[FILE_COPY_SIZE];
+    size_t sent = 0;
+    while (sent < len) {
+        size_t want = (len - sent < sizeof buf) ? len - sent : sizeof buf;
+        ssize_t n = pread(file, buf, want, offset + sent);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            errno = (n == 0) ? EIO : errno; // the file is shorter than promised
+            return -1;
+        }
+        if (((slot != NULL) ? tls_send(fd, slot, buf, n) : plain_send(fd, buf, n)) == -1) {
+            return -1;
+        }
+        sent += n;
+    }
+    return sent;
+}
+
+// sendfile() on a plain socket: the data goes from the page cache to the socket.
+static ssize_t plain_send_file(int fd, int file, off_t offset, size_t len) {
+#if defined(__linux__)
+    size_t sent = 0;
+    while (sent < len) {
+        off_t pos = offset + sent;
+        ssize_t n = sendfile(fd, file, &pos, len - sent);
+        if (n == -1 && (errno == EINTR || errno == EAGAIN)) {
+            if (errno == EAGAIN) {
+                wait_for_socket(fd, SSL_ERROR_WANT_WRITE);
+            }
+            continue;
+        }
+        if (n <= 0) {
+            errno = (n == 0) ? EIO : errno;
+            return -1;
+        }
+        sent += n;
+    }
+    return sent;
+#elif defined(__FreeBSD__)
+    size_t sent = 0;
+    while (sent < len) {
+        off_t n = 0;
+        int result = sendfile(file, fd, offset + sent, len - sent, NULL, &n, 0);
+        if (result == -1 && errno == EAGAIN) {
+            wait_for_socket(fd, SSL_ERROR_WANT_WRITE);
+        } else if ((result == -1 && errno != EINTR) || (result == 0 && n == 0)) {
+            errno = (result == 0) ? EIO : errno;
+            return -1;
+        }
+        sent += n;
+    }
+    return sent;
+#else
+    return copy_send_file(fd, NULL, file, offset, len);
+#endif
+}
+
+// With kTLS the kernel encrypts, so the file can still skip userland. The
+// caller holds slot->lock and owns the stream (slot->writing).
+static ssize_t tls_send_file(int fd, TransportSlot *slot, int file, off_t offset, size_t len) {
+    SSL *ssl = slot->ssl;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(OPENSSL_NO_KTLS)
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl))) {
+        size_t sent = 0;
+        while (sent < len) {
+            ossl_ssize_t n = SSL_sendfile(ssl, file, offset + sent, len - sent, 0);
+            if (n > 0) {
+                sent += n;
+                continue;
+            }
+            int err = SSL_get_error(ssl, (int) n);
+            if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) {
+                wait_unlocked(fd, slot, err);
+                continue;
+            }
+            ERR_clear_error();
+            errno = EPIPE;
+            return -1;
+        }
+        return sent;
+    }
+#endif
+    return copy_send_file(fd, slot, file, offset, len);
+}
+
+/**
+ * Sends a frame header followed by len bytes of a file, from offset, as one
+ * frame: other writers on fd queue (or wait) until both are out. On a plain
+ * socket, and on a TLS socket the kernel encrypts (kTLS), the file goes from
+ * the page cache to the socket without being copied through this process.
+ *
+ * return len on success, -1 on error.
+ */
+ssize_t net_send_file(int fd, const void *header, size_t header_len, int file, off_t offset, size_t len) {
+    TransportSlot *slot = get_slot(fd);
+    if (slot == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+    pthread_mutex_lock(&slot->lock);
+    ssize_t result = -1;
+    if (begin_write(fd, slot) == 0) {
+        result = write_all(fd, slot, (const char *) header, header_len);
+    }
+    if (result != -1 && slot->ssl != NULL) {
+        result = tls_send_file(fd, slot, file, offset, len);
+    } else if (result != -1) {
+        pthread_mutex_unlock(&slot->lock);
+        result = plain_send_file(fd, file, offset, len);
+        pthread_mutex_lock(&slot->lock);
+    }
+    end_write(fd, slot);
+    pthread_mutex_unlock(&slot->lock);
+    return result;
+}
+
+/**
+ * Sends buf only if fd can start taking it now, else nothing: for frames
+ * that may be dropped, so a client that doesn't read never holds up the
+ * sender. It never waits: if the socket takes only the start of the frame,
+ * the rest is queued as net_queue() would (and goes out with the next write
+ * or net_flush()).
+ *
+ * return 0 if all of buf was written, 1 if its tail is queued, -1 if
+ *        nothing was sent (errno EAGAIN when the socket was full, or
+ *        another thread is in the middle of a frame).
+ */
+int net_send_if_room(int fd, const void *buf, size_t len) {
+    TransportSlot *slot = get_slot(fd);
+    if (slot == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+    pthread_mutex_lock(&slot->lock);
+    int result = -1;
+    int queued = slot->outClosed ? -1 : (slot->writing ? 1 : write_queued(fd, slot));
+    if (queued == -1) {
+        errno = EPIPE;
+    } else if (queued == 1) {
+        errno = EAGAIN;
+    } else {
+        size_t sent = 0;
+        ssize_t n;
+        while (sent < len && (n = write_some(fd, slot, (const char *) buf + sent, len - sent)) != -1) {
+            sent += n;
+        }
+        if (sent == len) {
+            result = 0;
+        } else if (sent > 0 && errno == EAGAIN) {
+            result = append_queued(fd, slot, (const char *) buf + sent, len - sent);
+        }
+    }
+    pthread_mutex_unlock(&slot->lock);
+    return result;
+}
+
+/**
+ * Takes fd's writer lock for a caller that writes to the socket itself (the
+ * io_uring fan-out), so its frames can't interleave with net_send() calls.
+ *
+ * return 0 if fd is a plain socket and now locked (net_release() it after
+ *        the write), -1 if it carries TLS, still has queued bytes or another
+ *        thread is in the middle of a frame (not locked: use net_queue()).
+ */
+int net_claim_plain(int fd) {
+    TransportSlot *slot = get_slot(fd);
+    if (slot == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&slot->lock);
+    if (slot->ssl != NULL || slot->writing || slot->outClosed || slot->outStart != slot->outEnd) {
+        pthread_mutex_unlock(&slot->lock);
+        return -1;
+    }
+    return 0;
+}
+
+void net_release(int fd) {
+    pthread_mutex_unlock(&get_slot(fd)->lock);
+}
+
+/**
+ * Releases a claimed socket whose direct write took only part of a frame,
+ * queueing the rest as net_queue() would.
+ *
+ * return 1 if the rest is queued, -1 if the queue overflowed (errno ENOBUFS).
+ */
+int net_release_queue(int fd, const void *rest, size_t len) {
+    TransportSlot *slot = get_slot(fd);
+    int result = append_queued(fd, slot, (const char *) rest, len);
+    pthread_mutex_unlock(&slot->lock);
+    return result;
+}
+
+/**
+ * Receives up to len bytes from fd, decrypting when fd carries a TLS session.
+ *
+ * return number of bytes received, 0 when the peer closed, -1 on error.
+ */
+ssize_t net_recv(int fd, void *buf, size_t len) {
+    TransportSlot *slot = get_slot(fd);
+    if (slot == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+    if (slot->ssl == NULL) {
+        ssize_t n;
+        while ((n = recv(fd, buf, len, 0)) == -1 && errno == EINTR) {
+        }
+        return n;
+    }
+
+    while (1) {
+        size_t got = 0;
+        pthread_mutex_lock(&slot->lock);
+        if (slot->ssl == NULL) {
+            pthread_mutex_unlock(&slot->lock);
+            return 0;
+        }
+        int ret = SSL_read_ex(slot->ssl, buf, len, &got);
+        int err = (ret == 1) ? SSL_ERROR_NONE : SSL_get_error(slot->ssl, ret);
+        int saved_errno = errno;
+        if (err != SSL_ERROR_NONE) {
+            ERR_clear_error();
+        }
+        pthread_mutex_unlock(&slot->lock);
+
+        switch (err) {
+        case SSL_ERROR_NONE:
+            return got;
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            wait_for_socket(fd, err);
+            break;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0; // close_notify
+        case SSL_ERROR_SYSCALL:
+            // Peer closed without close_notify: treat like recv() == 0.
+            if (saved_errno == 0 || saved_errno == ECONNRESET) {
+                return 0;
+            }
+            errno = saved_errno;
+            return -1;
+        default:
+            errno = EPROTO;
+            return -1;
+        }
+    }
+}
+
+/**
+ * Writes as much of buf as the socket takes right now.
+ *
+ * return bytes written (> 0), or -1 with errno EAGAIN if nothing could be
+ *        written, or -1 on error.
+ */
+ssize_t net_send_some(int fd, const void *buf, size_t len) {
+    TransportSlot *slot = get_slot(fd);
+    if (slot == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+    pthread_mutex_lock(&slot->lock);
+    ssize_t result = write_some(fd, slot, (const char *) buf, len);
+    pthread_mutex_unlock(&slot->lock);
+    return result;
+}
+
+/**
+ * Reads what is available without waiting. Call until it returns EAGAIN:
+ * with TLS, decrypted bytes can be buffered where poll() can't see them.
+ *
+ * return bytes read, 0 when the peer closed, -1 with errno EAGAIN if nothing
+ *        is available, or -1 on error.
+ */
+ssize_t net_recv_some(int fd, void *buf, size_t len) {
+    TransportSlot *slot = get_slot(fd);
+    if (slot == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+    if (slot->ssl == NULL) {
+        ssize_t n;
+        while ((n = recv(fd, buf, len, MSG_DONTWAIT)) == -1 && errno == EINTR) {
+        }
+        return n;
+    }
+
+    size_t got = 0;
+    pthread_mutex_lock(&slot->lock);
+    int ret = SSL_read_ex(slot->ssl, buf, len, &got);
+    int err = (ret == 1) ? SSL_ERROR_NONE : SSL_get_error(slot->ssl, ret);
+    int saved_errno = errno;
+    if (err != SSL_ERROR_NONE) {
+        ERR_clear_error();
+    }
+    pthread_mutex_unlock(&slot->lock);
+
+    switch (err) {
+    case SSL_ERROR_NONE:
+        return got;
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        if (saved_errno == 0 || saved_errno == ECONNRESET) {
+            return 0;
+        }
+        errno = saved_errno;
+        return -1;
+    default:
+        errno = EPROTO;
+        return -1;
+    }
+}
+
+/**
+ * Receives exactly len bytes, looping over short reads. Frames are sized by
+ * their type, so a frame split across TCP segments is still read whole.
+ *
+ * return len on success, 0 if the peer closed first, -1 on error.
+ */
+ssize_t net_recv_all(int fd, void *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = net_recv(fd, (char *) buf + got, len - got);
+        if (n <= 0) {
+            return n;
+        }
+        got += n;
+    }
+    return got;
+}
+
+/**
+ * Closes fd, sending a TLS close_notify first when fd carries a session.
+ */
+void net_close(int fd) {
+    TransportSlot *slot = get_slot(fd);
+    if (slot != NULL) {
+        pthread_mutex_lock(&slot->lock);
+        if (slot->ssl != NULL) {
+            SSL_shutdown(slot->ssl); // best effort, the socket is non-blocking
+            SSL_free(slot->ssl);
+            slot->ssl = NULL;
+            ERR_clear_error();
+        }
+        free(slot->out);
+        slot->out = NULL;
+        slot->outStart = slot->outEnd = slot->outCapacity = 0;
+        slot->outClosed = 0;
+        pthread_mutex_unlock(&slot->lock);
+    }
+    close(fd);
+}
+
+/**
+ * return 1 if TLS already holds input for fd that poll() on the socket
+ *        won't report (decrypted, or a record read ahead), 0 otherwise.
+ */
+int net_pending(int fd) {
+    TransportSlot *slot = get_slot(fd);
+    if (slot == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&slot->lock);
+    int pending = slot->ssl != NULL && SSL_has_pending(slot->ssl);
+    pthread_mutex_unlock(&slot->lock);
+    return pending;
+}
+
+int tls_is_active(int fd) {
+    TransportSlot *slot = get_slot(fd);
+    return slot != NULL && slot->ssl != NULL;
+}
+
+/**
+ * Reports whether the kernel took over the record layer of fd.
+ *
+ * param tx Set to 1 if encryption of outgoing records is offloaded.
+ * param rx Set to 1 if decryption of incoming records is offloaded.
+ * return 1 if fd carries a TLS session, 0 otherwise.
+ */
+int tls_ktls_status(int fd, int *tx, int *rx) {
+    TransportSlot *slot = get_slot(fd);
+    *tx = 0;
+    *rx = 0;
+    if (slot == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&slot->lock);
+    int active = slot->ssl != NULL;
+    if (active) {
+        *tx = BIO_get_ktls_send(SSL_get_wbio(slot->ssl)) ? 1 : 0;
+        *rx = BIO_get_ktls_recv(SSL_get_rbio(slot->ssl)) ? 1 : 0;
+    }
+    pthread_mutex_unlock(&slot->lock);
+    return active;
+}
+
+int tls_session_reused(int fd) {
+    TransportSlot *slot = get_slot(fd);
+    if (slot == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&slot->lock);
+    int reused = slot->ssl != NULL && SSL_session_reused(slot->ssl);
+    pthread_mutex_unlock(&slot->lock);
+    return reused;
+}
+
+void tls_print_connection(int fd) {
+    int tx, rx;
+    if (!tls_ktls_status(fd, &tx, &rx)) {
+        printf("TLS: not active on socket %d\n", fd);
+        return;
+    }
+    TransportSlot *slot = get_slot(fd);
+    pthread_mutex_lock(&slot->lock);
+    printf("TLS: %s %s, %s, kTLS tx=%s rx=%s\n",
+           SSL_get_version(slot->ssl), SSL_get_cipher_name(slot->ssl),
+           SSL_session_reused(slot->ssl) ? "resumed session" : "full handshake",
+           tx ? "on" : "off", rx ? "on" : "off");
+    pthread_mutex_unlock(&slot->lock);
+}
@@ -0,0 +1,78 @@
+#ifndef TLS_TRANSPORT_H
+#define TLS_TRANSPORT_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+/**
+ * Optional TLS layer for the client and the server.
+ *
+ * Every socket in the program goes through net_send()/net_recv(). For a plain
+ * socket these are thin wrappers around send()/recv(); for a socket that went
+ * through tls_accept_client() or tls_connect_server() they use the SSL object
+ * attached to the descriptor. When the kernel supports it (Linux "tls" module,
+ * FreeBSD KERN_TLS) OpenSSL hands the record layer to the kernel after the
+ * handshake (kTLS), so encrypting the fan-out path costs no userland CPU.
+ *
+ * Session resumption: the server issues TLS 1.3 session tickets and keeps a
+ * server-side session cache, the client keeps its last session and offers it
+ * on the next connect, so reconnects skip the full key exchange.
+ *
+ * Outbound queue: net_queue() never waits. What the socket doesn't take is
+ * kept per connection and sent ahead of any later write, so threads that
+ * hold shared locks (the fan-out) never block on a client that stopped
+ * reading. A connection whose queue would pass NET_QUEUE_LIMIT is shut down.
+ * The writers that do wait (net_send(), net_send_file()) hold the
+ * connection's lock only while the socket takes bytes, never while it is
+ * full: net_queue() callers append behind the frame in progress.
+ */
+
+#define MAX_CONNECTIONS 65536 // highest socket descriptor tracked by the transport
+#define NET_QUEUE_LIMIT (256 * 1024) // bytes queued for one connection before it is cut off
+
+// Server side
+int tls_server_init(const char *cert_file, const char *key_file); // load cert/key, enable tickets + kTLS
+int tls_server_enabled(void);                                     // 1 if tls_server_init() succeeded
+int tls_accept_client(int client_socket);                         // server handshake on an accepted socket
+
+// Client side
+int tls_client_init(const char *ca_file);                         // trust store (NULL = system default)
+int tls_client_enabled(void);                                     // 1 if tls_client_init() succeeded
+int tls_connect_server(int server_socket, const char *hostname);  // client handshake (resumes if possible)
+void tls_client_forget_session(void);                             // drop the cached session
+
+// Transport used for every frame
+ssize_t net_send(int fd, const void *buf, size_t len);  // send all of buf, -1 on error
+int net_send_if_room(int fd, const void *buf, size_t len); // 0 sent, 1 tail queued, -1 EAGAIN if fd is full
+ssize_t net_send_file(int fd, const void *header, size_t header_len, int file, off_t offset, size_t len);
+                                                        // header, then file bytes (sendfile() where possible)
+ssize_t net_recv(int fd, void *buf, size_t len);        // like recv(), 0 on orderly close
+ssize_t net_recv_all(int fd, void *buf, size_t len);    // exactly len bytes, 0 on close, -1 on error
+void net_close(int fd);                                 // TLS close_notify (if any) + close()
+int net_queue(int fd, const void *buf, size_t len);    // send or queue without waiting: 0 sent, 1/2 queued, -1 error
+int net_flush(int fd);                                  // push queued bytes: 0 empty, 1 some left, -1 error
+int net_drain(int fd, int timeout_ms);                  // wait for the queue to empty, -1 if it didn't
+int net_claim_plain(int fd);                            // lock a plain socket for a direct write, -1 if TLS or queued
+void net_release(int fd);                               // unlock after net_claim_plain()
+int net_release_queue(int fd, const void *rest, size_t len); // unlock, queueing the part the write didn't take
+int net_pending(int fd);                                // 1 if TLS holds input poll() can't see
+
+// Non-blocking variants for event loops: never wait, -1 with errno EAGAIN
+// when the socket isn't ready. A send that returned EAGAIN or a short count
+// must be retried with the same (remaining) bytes.
+ssize_t net_send_some(int fd, const void *buf, size_t len); // bytes written
+ssize_t net_recv_some(int fd, void *buf, size_t len);       // bytes read, 0 on close
+
+// Introspection
+int tls_is_active(int fd);                    // 1 if fd carries a TLS session
+int tls_ktls_status(int fd, int *tx, int *rx); // kTLS offload state per direction
+int tls_session_reused(int fd);               // 1 if the handshake was a resumption
+void tls_print_connection(int fd);            // protocol/cipher/offload summary on stdout
+
+#endif // TLS_TRANSPORT_H
@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "traffic-capture.h"
+
+static long long monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// ======= RECORDING =========== //
+
+/**
+ * Creates (or truncates) a capture file.
+ *
+ * return 0 on success, -1 on failure.
+ */
+int openCapture(TrafficCapture *capture, const char *path) {
+    capture->file = fopen(path, "wb");
+    if (capture->file == NULL) {
+        perror("Error creating capture file");
+        return -1;
+    }
+    // Large buffer: records are small and come from every connection.
+    setvbuf(capture->file, NULL, _IOFBF, 1 << 20);
+    if (fwrite(CAPTURE_MAGIC, 1, strlen(CAPTURE_MAGIC), capture->file) != strlen(CAPTURE_MAGIC)) {
+        perror("Error writing capture file");
+        fclose(capture->file);
+        capture->file = NULL;
+        return -1;
+    }
+    pthread_mutex_init(&capture->lock, NULL);
+    capture->startNs = monotonic_ns();
+    capture->nextConnection = 1;
+    capture->records = 0;
+    return 0;
+}
+
+// Call with capture->lock held.
+static void write_record(TrafficCapture *capture, unsigned int connection, unsigned int kind,
+                         const void *head, size_t headLength, const void *rest, size_t restLength) {
+    CaptureRecord record;
+    record.connection = connection;
+    record.kind = kind;
+    record.length = headLength + restLength;
+    record.reserved = 0;
+    record.timestamp = monotonic_ns() - capture->startNs;
+    if (fwrite(&record, sizeof record, 1, capture->file) != 1 ||
+        (headLength > 0 && fwrite(head, 1, headLength, capture->file) != headLength) ||
+        (restLength > 0 && fwrite(rest, 1, restLength, capture->file) != restLength)) {
+        perror("Error writing capture file");
+        return;
+    }
+    capture->records++;
+}
+
+/**
+ * Records a new connection.
+ *
+ * return the connection's number, for its other records.
+ */
+unsigned int captureOpen(TrafficCapture *capture) {
+    pthread_mutex_lock(&capture->lock);
+    unsigned int connection = capture->nextConnection++;
+    write_record(capture, connection, CAPTURE_OPEN, NULL, 0, NULL, 0);
+    pthread_mutex_unlock(&capture->lock);
+    return connection;
+}
+
+/**
+ * Records one complete inbound frame (at most CAPTURE_MAX_FRAME bytes), given
+ * in two pieces as it was received (e.g. a batch header and its payload).
+ */
+void captureFrame(TrafficCapture *capture, unsigned int connection, const void *head, size_t headLength,
+                  const void *rest, size_t restLength) {
+    if (headLength + restLength > CAPTURE_MAX_FRAME) {
+        return;
+    }
+    pthread_mutex_lock(&capture->lock);
+    write_record(capture, connection, CAPTURE_FRAME, head, headLength, rest, restLength);
+    pthread_mutex_unlock(&capture->lock);
+}
+
+void captureClose(TrafficCapture *capture, unsigned int connection) {
+    pthread_mutex_lock(&capture->lock);
+    write_record(capture, connection, CAPTURE_CLOSE, NULL, 0, NULL, 0);
+    // A connection ends: a good moment to get the records to disk.
+    fflush(capture->file);
+    pthread_mutex_unlock(&capture->lock);
+}
+
+void closeCapture(TrafficCapture *capture) {
+    pthread_mutex_lock(&capture->lock);
+    fclose(capture->file);
+    capture->file = NULL;
+    pthread_mutex_unlock(&capture->lock);
+    pthread_mutex_destroy(&capture->lock);
+}
+
+// ======= REPLAY =========== //
+
+/**
+ * Opens a capture file for reading and checks its magic.
+ *
+ * return the file, positioned at the first record, or NULL.
+ */
+FILE *openCaptureReader(const char *path) {
+    char magic[sizeof CAPTURE_MAGIC];
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        perror("Error opening capture file");
+        return NULL;
+    }
+    if (fread(magic, 1, strlen(CAPTURE_MAGIC), file) != strlen(CAPTURE_MAGIC) ||
+        memcmp(magic, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC)) != 0) {
+        printf("%s is not a capture file\n", path);
+        fclose(file);
+        return NULL;
+    }
+    return file;
+}
+
+/**
+ * Reads the next record.
+ *
+ * param frame Receives the frame bytes (CAPTURE_MAX_FRAME bytes of space).
+ * return 1 on success, 0 at the end of the file (or a record cut off by a
+ *        crash), -1 if the file is corrupt.
+ */
+int readCaptureRecord(FILE *file, CaptureRecord *record, char *frame) {
+    if (fread(record, sizeof(CaptureRecord), 1, file) != 1) {
+        return 0;
+    }
+    if (record->kind < CAPTURE_OPEN || record->kind > CAPTURE_CLOSE || record->length > CAPTURE_MAX_FRAME) {
+        return -1;
+    }
+    if (record->length > 0 && fread(frame, 1, record->length, file) != record->length) {
+        return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,68 @@
+#ifndef TRAFFIC_CAPTURE_H
+#define TRAFFIC_CAPTURE_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/**
+ * Capture of inbound traffic (server -R) for offline replay (server -P).
+ *
+ * A capture file starts with CAPTURE_MAGIC, followed by one record per event
+ * in the order the server saw them: a connection opening, a complete frame
+ * received on it (exactly the bytes start_subserver() read), or the
+ * connection closing. Replaying the records against a copy of the data
+ * directory taken when the capture started reproduces the workload.
+ *
+ * Captures hold everything clients sent, passwords included: keep them
+ * private.
+ */
+
+#define CAPTURE_MAGIC "CHATCAP1"
+#define CAPTURE_OPEN 1
+#define CAPTURE_FRAME 2
+#define CAPTURE_CLOSE 3
+#define CAPTURE_MAX_FRAME 65536 // larger than any request frame
+
+/**
+ * Struct name: CaptureRecord
+ * Description: Header of one captured event, followed by `length` bytes of
+ *              frame (CAPTURE_FRAME only).
+ *
+ * param connection Connection number, 1, 2, ... in accept order.
+ * param timestamp  ns since the capture started.
+ */
+typedef struct {
+    unsigned int connection;
+    unsigned int kind;
+    unsigned int length;
+    unsigned int reserved;
+    long long timestamp;
+} CaptureRecord;
+
+/**
+ * Struct name: TrafficCapture
+ * Description: An open capture file. Writers on several threads are
+ *              serialised by lock.
+ */
+typedef struct TRAFFIC_CAPTURE {
+    FILE *file;
+    pthread_mutex_t lock;
+    long long startNs;
+    unsigned int nextConnection;
+    long long records;
+} TrafficCapture;
+
+// Recording
+int openCapture(TrafficCapture *capture, const char *path);
+unsigned int captureOpen(TrafficCapture *capture);
+void captureFrame(TrafficCapture *capture, unsigned int connection, const void *head, size_t headLength,
+                  const void *rest, size_t restLength);
+void captureClose(TrafficCapture *capture, unsigned int connection);
+void closeCapture(TrafficCapture *capture);
+
+// Replay
+FILE *openCaptureReader(const char *path);
+int readCaptureRecord(FILE *file, CaptureRecord *record, char *frame);
+
+#endif // TRAFFIC_CAPTURE_H
@@ -0,0 +1,288 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "uring-io.h"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#ifdef HAVE_IO_URING
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/**
+ * Creates an io_uring and maps its rings.
+ *
+ * return 0 on success, -1 if io_uring is not available.
+ */
+int initUring(Uring *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(ring, 0, sizeof(Uring));
+    memset(&params, 0, sizeof params);
+    ring->fd = io_uring_setup(entries, &params);
+    if (ring->fd == -1) {
+        return -1;
+    }
+    // Kernels too old for multishot accept (5.19) pass this test; their
+    // first accept completes with EINVAL and the caller falls back then.
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(ring->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (ring->cqRingSize > ring->sqRingSize) {
+        ring->sqRingSize = ring->cqRingSize; // one mapping holds both rings
+    }
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqRing == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        int saved_errno = errno;
+        if (ring->sqRing != MAP_FAILED) {
+            munmap(ring->sqRing, ring->sqRingSize);
+        }
+        if (ring->sqes != MAP_FAILED) {
+            munmap(ring->sqes, ring->sqesSize);
+        }
+        close(ring->fd);
+        errno = saved_errno;
+        return -1;
+    }
+    char *base = (char *) ring->sqRing;
+    ring->sqHead = (unsigned *) (base + params.sq_off.head);
+    ring->sqTail = (unsigned *) (base + params.sq_off.tail);
+    ring->sqMask = (unsigned *) (base + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *) (base + params.sq_off.array);
+    ring->sqEntries = params.sq_entries;
+    ring->sqTailLocal = *ring->sqTail;
+    ring->cqRing = ring->sqRing;
+    ring->cqHead = (unsigned *) (base + params.cq_off.head);
+    ring->cqTail = (unsigned *) (base + params.cq_off.tail);
+    ring->cqMask = (unsigned *) (base + params.cq_off.ring_mask);
+    ring->cqes = base + params.cq_off.cqes;
+    return 0;
+}
+
+void freeUring(Uring *ring) {
+    munmap(ring->sqes, ring->sqesSize);
+    munmap(ring->sqRing, ring->sqRingSize);
+    close(ring->fd);
+}
+
+// A zeroed entry at the submission tail, or NULL if the ring is full.
+static struct io_uring_sqe *get_sqe(Uring *ring) {
+    unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    if (ring->sqTailLocal - head >= ring->sqEntries) {
+        return NULL;
+    }
+    unsigned index = ring->sqTailLocal & *ring->sqMask;
+    struct io_uring_sqe *sqe = &((struct io_uring_sqe *) ring->sqes)[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sqArray[index] = index;
+    ring->sqTailLocal++;
+    ring->pending++;
+    return sqe;
+}
+
+// Makes the prepared entries visible to the kernel (taken on the next enter).
+static void publish_sqes(Uring *ring) {
+    __atomic_store_n(ring->sqTail, ring->sqTailLocal, __ATOMIC_RELEASE);
+}
+
+static int peek_cqe(Uring *ring, struct io_uring_cqe *out) {
+    unsigned head = *ring->cqHead;
+    if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    *out = ((struct io_uring_cqe *) ring->cqes)[head & *ring->cqMask];
+    __atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// Submits what is pending and waits until `wait` completions are ready.
+static int submit_and_wait(Uring *ring, unsigned wait) {
+    while (1) {
+        int ret = io_uring_enter(ring->fd, ring->pending, wait, IORING_ENTER_GETEVENTS);
+        if (ret >= 0) {
+            ring->pending -= ((unsigned) ret < ring->pending) ? (unsigned) ret : ring->pending;
+            return 0;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EBUSY) {
+            return 0; // completion ring full or kernel short of memory: reap and retry
+        }
+        ring->broken = 1;
+        return -1;
+    }
+}
+
+/**
+ * Arms the multishot accept on server_socket if it isn't already. From then
+ * on ring->fd polls readable whenever a connection is waiting in the ring.
+ *
+ * return 0 on success, -1 (errno set).
+ */
+int uringArmAccept(Uring *ring, int server_socket) {
+    if (ring->acceptArmed) {
+        return 0;
+    }
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (sqe == NULL) {
+        errno = EBUSY;
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = server_socket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    publish_sqes(ring);
+    ring->acceptArmed = 1;
+    return submit_and_wait(ring, 0);
+}
+
+/**
+ * Waits for the next connection on server_socket, keeping one multishot
+ * accept armed across calls.
+ *
+ * return the accepted socket, or -1 (errno set). Once ring->broken is set,
+ *        use accept() instead.
+ */
+int uringAccept(Uring *ring, int server_socket) {
+    while (!ring->broken) {
+        struct io_uring_cqe cqe;
+        if (peek_cqe(ring, &cqe)) {
+            if (!(cqe.flags & IORING_CQE_F_MORE)) {
+                ring->acceptArmed = 0; // the kernel dropped it (error, overflow); re-arm
+            }
+            if (cqe.res >= 0) {
+                return cqe.res;
+            }
+            if (cqe.res == -EINVAL) {
+                ring->broken = 1; // kernel without multishot accept
+            }
+            errno = -cqe.res;
+            return -1;
+        }
+        if (!ring->acceptArmed && uringArmAccept(ring, server_socket) == -1) {
+            return -1;
+        }
+        if (submit_and_wait(ring, 1) == -1) {
+            return -1;
+        }
+    }
+    errno = EIO;
+    return -1;
+}
+
+/**
+ * Sends the same buffer on every socket in fds: one submission (and wait) per
+ * URING_ENTRIES sockets. The sends don't wait for room: a socket takes what
+ * fits, and the caller keeps the rest. No other thread may write to these
+ * sockets until it returns, and each must be a plain (non-TLS) socket.
+ *
+ * param results results[i] is the number of bytes fds[i] took (0 if it was
+ *               full), -1 if the send failed, -2 if it wasn't attempted (the
+ *               ring broke).
+ * return 0 on success, -1 if the ring broke (send the -2 ones another way).
+ */
+int uringSendMany(Uring *ring, const int *fds, int count, const void *buf, size_t len, int *results) {
+    for (int i = 0; i < count; i++) {
+        results[i] = -2;
+    }
+    int next = 0;
+    while (next < count) {
+        if (ring->broken) {
+            return -1;
+        }
+        int inflight = 0;
+        struct io_uring_sqe *sqe;
+        while (next < count && (sqe = get_sqe(ring)) != NULL) {
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = fds[next];
+            sqe->addr = (uintptr_t) buf;
+            sqe->len = len;
+            sqe->msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+            sqe->user_data = next;
+            next++;
+            inflight++;
+        }
+        publish_sqes(ring);
+        while (inflight > 0) {
+            struct io_uring_cqe cqe;
+            if (!peek_cqe(ring, &cqe)) {
+                if (submit_and_wait(ring, inflight) == -1) {
+                    return -1;
+                }
+                continue;
+            }
+            int i = (int) cqe.user_data;
+            if (cqe.res == -EAGAIN) {
+                results[i] = 0;
+            } else {
+                results[i] = (cqe.res < 0) ? -1 : cqe.res;
+            }
+            inflight--;
+        }
+    }
+    return 0;
+}
+
+#else // no io_uring on this system
+
+int initUring(Uring *ring, unsigned entries) {
+    (void) ring;
+    (void) entries;
+    errno = ENOSYS;
+    return -1;
+}
+
+void freeUring(Uring *ring) {
+    (void) ring;
+}
+
+int uringArmAccept(Uring *ring, int server_socket) {
+    (void) ring;
+    (void) server_socket;
+    errno = ENOSYS;
+    return -1;
+}
+
+int uringAccept(Uring *ring, int server_socket) {
+    (void) ring;
+    (void) server_socket;
+    errno = ENOSYS;
+    return -1;
+}
+
+int uringSendMany(Uring *ring, const int *fds, int count, const void *buf, size_t len, int *results) {
+    (void) ring;
+    (void) fds;
+    (void) buf;
+    (void) len;
+    for (int i = 0; i < count; i++) {
+        results[i] = -2;
+    }
+    return -1;
+}
+
+#endif // HAVE_IO_URING
@@ -0,0 +1,62 @@
+#ifndef URING_IO_H
+#define URING_IO_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/**
+ * Optional io_uring backend (server -U option, Linux 5.19 or later).
+ *
+ * The accept loop keeps one multishot accept armed instead of calling
+ * accept() per connection. A fan-out worker queues one send per member and
+ * submits them all in a single io_uring_enter() call that also waits for the
+ * completions, so a message to 1,000 members costs about four syscalls
+ * (256 sends per submission) instead of 1,000.
+ *
+ * Talks to the kernel with raw syscalls, so liburing is not needed. Where
+ * io_uring is missing (FreeBSD, old kernels, seccomp) initUring() fails and
+ * the caller uses the accept()/send() path.
+ */
+
+#define URING_ENTRIES 256 // submission queue size: sends per io_uring_enter()
+
+/**
+ * Struct name: Uring
+ * Description: One io_uring instance with its mapped rings. Used by one
+ *              thread only.
+ *
+ * param pending     Requests in the submission ring the kernel hasn't taken yet.
+ * param acceptArmed A multishot accept is active.
+ * param broken      io_uring_enter() failed; don't use the ring any more.
+ */
+typedef struct URING {
+    int fd;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned sqEntries;
+    unsigned sqTailLocal;
+    void *sqes;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    void *cqes;
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    size_t sqesSize;
+    unsigned pending;
+    int acceptArmed;
+    int broken;
+} Uring;
+
+// Function prototypes
+int initUring(Uring *ring, unsigned entries);
+void freeUring(Uring *ring);
+int uringArmAccept(Uring *ring, int server_socket);
+int uringAccept(Uring *ring, int server_socket);
+int uringSendMany(Uring *ring, const int *fds, int count, const void *buf, size_t len, int *results);
+
+#endif // URING_IO_H
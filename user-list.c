@@ -3,16 +3,156 @@
 #include <unistd.h>
 #include <string.h>
 #include "protocol.h"
+#include "dedup-window.h"
+#include "user-list.h"
 
 // Added By: Daniel
 
+#define INITIAL_INDEX_CAPACITY 1024
+
 void initUserList(UserList *userList) {
     userList->first = NULL;
     userList->last = NULL;
     userList->count = 0;
+    userList->index = NULL;
+    userList->indexCapacity = 0;
+    userList->byId = NULL;
+}
+
+// FNV-1a hash of an email address.
+static unsigned int hashEmail(const char *email) {
+    unsigned int hash = 2166136261u;
+    while (*email) {
+        hash ^= (unsigned char) *email++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void indexInsert(User **index, unsigned int capacity, User *user) {
+    unsigned int slot = hashEmail(user->email) & (capacity - 1);
+    while (index[slot] != NULL) {
+        slot = (slot + 1) & (capacity - 1);
+    }
+    index[slot] = user;
+}
+
+// Keeps the email index at most half full so probes stay short.
+static int reserveIndex(UserList *userList, unsigned int count) {
+    if ((unsigned long) count * 2 <= userList->indexCapacity) {
+        return 0;
+    }
+    unsigned int capacity = userList->indexCapacity ? userList->indexCapacity : INITIAL_INDEX_CAPACITY;
+    while ((unsigned long) count * 2 > capacity) {
+        capacity *= 2;
+    }
+    User **index = (User **) calloc(capacity, sizeof(User *));
+    if (index == NULL) {
+        perror("Error allocating memory for user index");
+        return -1;
+    }
+    for (unsigned int i = 0; i < userList->indexCapacity; i++) {
+        if (userList->index[i] != NULL) {
+            indexInsert(index, capacity, userList->index[i]);
+        }
+    }
+    free(userList->index);
+    userList->index = index;
+    userList->indexCapacity = capacity;
+    return 0;
+}
+
+/**
+ * Looks up a user by email in O(1).
+ *
+ * return the user, or NULL if no user registered with that email.
+ */
+User *findUser(UserList *userList, const char *email) {
+    if (userList->index == NULL) {
+        return NULL;
+    }
+    unsigned int slot = hashEmail(email) & (userList->indexCapacity - 1);
+    while (userList->index[slot] != NULL) {
+        if (strcmp(userList->index[slot]->email, email) == 0) {
+            return userList->index[slot];
+        }
+        slot = (slot + 1) & (userList->indexCapacity - 1);
+    }
+    return NULL;
+}
+
+// Gives the user the next id and enters it in the id table, whose blocks
+// are allocated as they fill and then never move.
+static void assignId(UserList *userList, User *user, unsigned int id) {
+    user->id = id;
+    if (id / USER_ID_BLOCK >= USER_ID_BLOCKS) {
+        return;
+    }
+    if (userList->byId == NULL &&
+        (userList->byId = (User ***) calloc(USER_ID_BLOCKS, sizeof(User **))) == NULL) {
+        perror("Error allocating memory for user ids");
+        return;
+    }
+    User **block = userList->byId[id / USER_ID_BLOCK];
+    if (block == NULL) {
+        block = (User **) calloc(USER_ID_BLOCK, sizeof(User *));
+        if (block == NULL) {
+            perror("Error allocating memory for user ids");
+            return;
+        }
+        userList->byId[id / USER_ID_BLOCK] = block;
+    }
+    block[id % USER_ID_BLOCK] = user;
+}
+
+/**
+ * Looks up a user by id (stored messages refer to their sender by id).
+ * Ids are handed out under userList_mutex; one that a stored message holds
+ * was given before the message was, so the table isn't locked.
+ *
+ * return the user, or NULL if no user has that id.
+ */
+User *getUserById(UserList *userList, unsigned int id) {
+    if (userList->byId == NULL || id / USER_ID_BLOCK >= USER_ID_BLOCKS ||
+        userList->byId[id / USER_ID_BLOCK] == NULL) {
+        return NULL;
+    }
+    return userList->byId[id / USER_ID_BLOCK][id % USER_ID_BLOCK];
+}
+
+/**
+ * Links a batch of users that are already chained through ->next (e.g. a
+ * loaded snapshot) to the end of the list, indexing them in one pass.
+ *
+ * param first The first user of the chain.
+ * param last  The last user of the chain.
+ * param count Number of users in the chain.
+ */
+void appendUsers(UserList *userList, User *first, User *last, int count) {
+    last->next = NULL;
+    int indexed = reserveIndex(userList, userList->count + count) == 0;
+    unsigned int id = userList->count;
+    for (User *ptr = first; ptr != NULL; ptr = ptr->next) {
+        if (indexed) {
+            indexInsert(userList->index, userList->indexCapacity, ptr);
+        }
+        assignId(userList, ptr, id++);
+    }
+    if (userList->first == NULL) {
+        userList->first = first;
+    } else {
+        userList->last->next = first;
+    }
+    userList->last = last;
+    userList->count += count;
 }
 
 void appendUser(UserList *userList, User *user) {
+    if (reserveIndex(userList, userList->count + 1) == 0) {
+        indexInsert(userList->index, userList->indexCapacity, user);
+    }
+    assignId(userList, user, userList->count);
+
     if (userList->first == NULL) {
         userList->first = user;
         userList->last = user;
@@ -24,7 +164,7 @@ void appendUser(UserList *userList, User *user) {
     userList->count++;
 }
 
-User *createUser(char *email, char *name, char *password, int socketFd) {
+User *createUser(char *email, char *name, char *password) {
     User *user = (User *) malloc(sizeof(User));
     // DEBUG
     if (user == NULL) {
@@ -43,35 +183,180 @@ User *createUser(char *email, char *name, char *password, int socketFd) {
             perror("Error allocating memory for password");
         }
     }
-    user->socketFd = socketFd;
-    user->isOnline = 1; // User will be online after creation
+    user->retired = NULL;
+    user->devices = NULL;
+    user->recentPosts = NULL;
+    user->isOnline = 0; // online once a device connects
+    user->posts = 0;
+    user->inSnapshot = 0;
+    user->id = 0; // given by appendUser()
     user->next = NULL;
 
-    // Auto add user to "CMPS" group (Aedan)
-    Group *group = (Group *) malloc(sizeof(Group));
+    // Auto add user to the default group (Aedan)
+    Group *group = (Group *) calloc(1, sizeof(Group));
     if (group == NULL) {
         perror("Error allocating memory for group\n");
         free(user);
         return NULL;
     }
-    group->name = strdup("CMPS");
-    group->next = NULL;
+    group->name = strdup(DEFAULT_GROUP);
+    group->user = user;
     user->groups = group;
 
     return user;
 }
 
+/**
+ * Adds a group to the front of the user's group list, reusing the node of
+ * an earlier membership of the same group. The cursor starts at joinSeq,
+ * the group's head when the user joined.
+ *
+ * return the new membership node, or NULL if memory ran out.
+ */
+Group *addUserGroup(User *user, const char *name, unsigned int joinSeq) {
+    Group **link = &user->retired;
+    while (*link != NULL && strcmp((*link)->name, name) != 0) {
+        link = &(*link)->next;
+    }
+    Group *group = *link;
+    if (group != NULL) {
+        *link = group->next;
+    } else if ((group = (Group *) calloc(1, sizeof(Group))) == NULL ||
+               (group->name = strdup(name)) == NULL) {
+        perror("Error allocating memory for group\n");
+        free(group);
+        return NULL;
+    }
+    group->ackedSeq = joinSeq;
+    group->joins++;
+    group->user = user;
+    group->next = user->groups;
+    user->groups = group;
+    return group;
+}
+
+/**
+ * Moves a membership node from the user's group list to their retired
+ * list. Nodes are not freed while the server runs: the user's other
+ * connections may still hold one. Take it out of its group's members
+ * first (removeGroupMember()).
+ */
+void removeUserGroup(User *user, Group *group) {
+    Group **link = &user->groups;
+    while (*link != NULL && *link != group) {
+        link = &(*link)->next;
+    }
+    if (*link == NULL) {
+        return;
+    }
+    *link = group->next;
+    group->next = user->retired;
+    user->retired = group;
+}
+
+/**
+ * Finds a device's cursor for one of the user's groups. A new cursor, or
+ * one left from before the user last rejoined the group, starts at the
+ * membership's acknowledged position. Call with the user's lock held.
+ *
+ * return the cursor, or NULL if memory ran out.
+ */
+DeviceCursor *getDeviceCursor(Device *device, Group *membership) {
+    DeviceCursor *cursor = device->cursors;
+    while (cursor != NULL && cursor->membership != membership) {
+        cursor = cursor->next;
+    }
+    if (cursor == NULL) {
+        cursor = (DeviceCursor *) calloc(1, sizeof(DeviceCursor));
+        if (cursor == NULL) {
+            perror("Error allocating memory for device cursor");
+            return NULL;
+        }
+        cursor->membership = membership;
+        cursor->joins = membership->joins - 1;
+        cursor->next = device->cursors;
+        device->cursors = cursor;
+    }
+    if (cursor->joins != membership->joins) {
+        // Acks move the membership's cursor under the group's lock, not this one.
+        unsigned int acked = __atomic_load_n(&membership->ackedSeq, __ATOMIC_RELAXED);
+        cursor->ackedSeq = acked;
+        cursor->sentSeq = acked;
+        cursor->joins = membership->joins;
+    }
+    return cursor;
+}
+
+/**
+ * Frees a device and its cursors. Take it out of the user's devices and
+ * of the fan-out first.
+ */
+void freeDevice(Device *device) {
+    DeviceCursor *cursor = device->cursors;
+    while (cursor != NULL) {
+        DeviceCursor *next = cursor->next;
+        free(cursor);
+        cursor = next;
+    }
+    free(device->name);
+    free(device);
+}
+
+static void freeGroups(Group *group) {
+    while (group != NULL) {
+        Group *next = group->next;
+        // Snapshot memory is released by closeUserStore()
+        if (!group->inSnapshot) {
+            free(group->name);
+            free(group);
+        }
+        group = next;
+    }
+}
+
+/**
+ * Prints every user: email, name, connected devices and messages sent.
+ * userList may be a copy made under userList_mutex: only count users are
+ * walked, and users are never removed, so the list isn't locked.
+ */
+void printUserList(UserList *userList, FILE *out) {
+    User *ptr = userList->first;
+    for (int i = 0; i < userList->count; i++) {
+        fprintf(out, "%s %s devices=%d posts=%u\n", ptr->email, ptr->name,
+                __atomic_load_n(&ptr->isOnline, __ATOMIC_RELAXED), __atomic_load_n(&ptr->posts, __ATOMIC_RELAXED));
+        ptr = ptr->next;
+    }
+}
+
 void freeUserList(UserList *userList) {
     User *ptr = userList->first;
     for (int i = 0; i < userList->count; i++) {
         User *temp = ptr;
         ptr = ptr->next;
-        free(temp->email);
-        free(temp->name);
-        free(temp->password);
-        free(temp);
+        freeGroups(temp->groups);
+        freeGroups(temp->retired);
+        while (temp->devices != NULL) {
+            Device *device = temp->devices;
+            temp->devices = device->next;
+            freeDevice(device);
+        }
+        freeDedupWindow(temp->recentPosts);
+        if (!temp->inSnapshot) {
+            free(temp->email);
+            free(temp->name);
+            free(temp->password);
+            free(temp);
+        }
+    }
+    free(userList->index);
+    for (int b = 0; userList->byId != NULL && b < USER_ID_BLOCKS; b++) {
+        free(userList->byId[b]);
     }
+    free(userList->byId);
     userList->first = NULL;
     userList->last = NULL;
     userList->count = 0;
+    userList->index = NULL;
+    userList->indexCapacity = 0;
+    userList->byId = NULL;
 }
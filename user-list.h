@@ -7,11 +7,21 @@
 
 // Added By: Daniel
 
+#define USER_ID_BLOCK 65536  // users per block of the id table
+#define USER_ID_BLOCKS 65536 // blocks in the table (so at most 2^32 users)
+
 // Function prototypes
 void initUserList(UserList *userList);
 void appendUser(UserList *userList, User *user);
-User *createUser(char *email, char *name, char *password, int socketFd);
-void printUserList(UserList *userList);
+void appendUsers(UserList *userList, User *first, User *last, int count);
+User *findUser(UserList *userList, const char *email);
+User *getUserById(UserList *userList, unsigned int id);
+User *createUser(char *email, char *name, char *password);
+Group *addUserGroup(User *user, const char *name, unsigned int joinSeq);
+void removeUserGroup(User *user, Group *group);
+DeviceCursor *getDeviceCursor(Device *device, Group *membership);
+void freeDevice(Device *device);
+void printUserList(UserList *userList, FILE *out);
 void freeUserList(UserList *userList);
 
 #endif // USER_LIST_H
@@ -0,0 +1,913 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "protocol.h"
+#include "user-list.h"
+#include "group-list.h"
+#include "mutexes.h"
+#include "user-store.h"
+
+#define SNAPSHOT_FILE "users.snap"
+#define WAL_PREFIX "users.wal."
+#define SNAPSHOT_MAGIC 0x53554347u // "GCUS"
+#define SNAPSHOT_VERSION 2         // 1: no group registry
+#define MAX_WAL_PAYLOAD 1024       // 3 strings of at most BUFFER_SIZE plus the value
+#define WRITER_BUFFER_SIZE 65536
+
+#define WAL_REGISTER 1  // value: cursor in the default group; strings: email, name, password
+#define WAL_JOIN 2      // value: group head at join; strings: email, group
+#define WAL_CURSOR 3    // value: acknowledged seq; strings: email, group
+#define WAL_CREATE 4    // strings: group, creator's email (who joins it in a WAL_JOIN)
+#define WAL_LEAVE 5     // strings: email, group
+
+/**
+ * Snapshot layout: header, then the user records, then the membership
+ * records (each user's memberships are contiguous, in list order), then the
+ * group registry (one name offset per group, in creation order), then a
+ * string table. Records refer to strings by offset into the table, so the
+ * loaded users can point straight into the mapping. Group names are stored
+ * once no matter how many users joined the group.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t walGen;        // first log generation not contained in the snapshot
+    uint32_t userCount;
+    uint64_t groupCount;    // membership records
+    uint64_t usersOffset;
+    uint64_t groupsOffset;
+    uint64_t stringsOffset;
+    uint64_t stringsSize;
+    uint64_t registryCount; // version 2 on
+    uint64_t registryOffset;
+} SnapshotHeader;
+
+// Size of a version 1 header, which ends before the registry fields
+#define SNAPSHOT_V1_HEADER_SIZE offsetof(SnapshotHeader, registryCount)
+
+typedef struct {
+    uint64_t email;
+    uint64_t name;
+    uint64_t password;
+    uint64_t firstGroup;    // index of the user's first membership record
+    uint32_t groupCount;
+    uint32_t reserved;
+} SnapshotUser;
+
+typedef struct {
+    uint64_t name;
+    uint32_t ackedSeq;
+    uint32_t reserved;
+} SnapshotGroup;
+
+typedef struct {
+    uint32_t length;        // payload bytes
+    uint32_t checksum;      // FNV-1a of type, value and payload
+    uint32_t type;
+    uint32_t value;
+} WalHeader;
+
+// Buffered writer for one region of the snapshot file (pwrite-based, so
+// the three regions can be filled in a single pass).
+typedef struct {
+    int fd;
+    off_t offset;
+    size_t used;
+    char buf[WRITER_BUFFER_SIZE];
+} RegionWriter;
+
+// Group name -> string table offset, so repeated names are stored once.
+typedef struct {
+    const char **names;
+    uint64_t *offsets;
+    size_t capacity;
+    size_t count;
+} StringIntern;
+
+static uint32_t fnv1a(uint32_t hash, const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *) data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static char *store_path(UserStore *store, const char *name, unsigned int gen) {
+    size_t len = strlen(store->dir) + strlen(name) + 16;
+    char *path = (char *) malloc(len);
+    if (path != NULL) {
+        if (gen > 0) {
+            snprintf(path, len, "%s/%s%u", store->dir, name, gen);
+        } else {
+            snprintf(path, len, "%s/%s", store->dir, name);
+        }
+    }
+    return path;
+}
+
+// ======= WRITE-AHEAD LOG =========== //
+
+// When sync is 0 the record is only written, and reaches the disk with the
+// next synced record (or the next snapshot).
+static int appendRecord(UserStore *store, uint32_t type, uint32_t value, int sync,
+                        const char *s1, const char *s2, const char *s3) {
+    char record[sizeof(WalHeader) + MAX_WAL_PAYLOAD];
+    WalHeader *header = (WalHeader *) record;
+    size_t len = 0;
+    const char *strings[3] = { s1, s2, s3 };
+
+    for (int i = 0; i < 3 && strings[i] != NULL; i++) {
+        size_t n = strlen(strings[i]) + 1;
+        if (len + n > MAX_WAL_PAYLOAD) {
+            printf("User store: record too large\n");
+            return -1;
+        }
+        memcpy(record + sizeof(WalHeader) + len, strings[i], n);
+        len += n;
+    }
+    header->length = len;
+    header->type = type;
+    header->value = value;
+    header->checksum = fnv1a(fnv1a(2166136261u, &header->type, 2 * sizeof(uint32_t)),
+                             record + sizeof(WalHeader), len);
+
+    pthread_mutex_lock(&store->walMutex);
+    ssize_t written = write(store->walFd, record, sizeof(WalHeader) + len);
+    int synced = (written == (ssize_t) (sizeof(WalHeader) + len)) ? (sync ? fdatasync(store->walFd) : 0) : -1;
+    if (synced == 0) {
+        store->walRecords++;
+    }
+    pthread_mutex_unlock(&store->walMutex);
+
+    if (synced != 0) {
+        perror("Error writing user log");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Logs a new registration. Called with userList_mutex held, before the
+ * client is acknowledged.
+ *
+ * return 0 once the record is on disk, -1 on error.
+ */
+int logRegistration(UserStore *store, User *user) {
+    return appendRecord(store, WAL_REGISTER, user->groups ? user->groups->ackedSeq : 0, 1, user->email, user->name, user->password);
+}
+
+/**
+ * Logs that a user joined a group. Called with userList_mutex held.
+ *
+ * return 0 once the record is on disk, -1 on error.
+ */
+int logJoin(UserStore *store, User *user, const char *groupName) {
+    Group *group = user->groups;
+    while (group != NULL && strcmp(group->name, groupName) != 0) {
+        group = group->next;
+    }
+    return appendRecord(store, WAL_JOIN, group ? group->ackedSeq : 0, 1, user->email, groupName, NULL);
+}
+
+/**
+ * Logs that a user acknowledged messages of a group up to group->ackedSeq
+ * (their inbox cursor). Cursor records are not synced one by one: losing
+ * the last few in a crash only means those messages are delivered again,
+ * and the client drops them by sequence number.
+ *
+ * return 0 on success, -1 on error.
+ */
+int logCursor(UserStore *store, User *user, Group *group) {
+    return appendRecord(store, WAL_CURSOR, group->ackedSeq, 0, user->email, group->name, NULL);
+}
+
+/**
+ * Logs a new group. Called with userList_mutex held, so the group is in
+ * either the next snapshot or the log it names.
+ *
+ * return 0 once the record is on disk, -1 on error.
+ */
+int logCreate(UserStore *store, const char *groupName, User *creator) {
+    return appendRecord(store, WAL_CREATE, 0, 1, groupName, creator->email, NULL);
+}
+
+/**
+ * Logs that a user left a group. Called with userList_mutex held.
+ *
+ * return 0 once the record is on disk, -1 on error.
+ */
+int logLeave(UserStore *store, User *user, const char *groupName) {
+    return appendRecord(store, WAL_LEAVE, 0, 1, user->email, groupName, NULL);
+}
+
+// Adds a loaded membership to its group's members, creating the group.
+static void linkMembership(UserStore *store, Group *group) {
+    GroupInfo *info = getOrCreateGroup(store->groupList, group->name, NULL);
+    if (info == NULL || addGroupMember(info, group) == -1) {
+        printf("User store: %s not listed in group %s\n", group->user->email, group->name);
+    }
+}
+
+static void replayRecord(UserStore *store, WalHeader *header, char *payload) {
+    char *strings[3] = { NULL, NULL, NULL };
+    size_t pos = 0;
+    for (int i = 0; i < 3 && pos < header->length; i++) {
+        strings[i] = payload + pos;
+        pos += strlen(payload + pos) + 1;
+    }
+
+    if (header->type == WAL_REGISTER && strings[2] != NULL) {
+        if (findUser(store->userList, strings[0]) == NULL) {
+            User *user = createUser(strings[0], strings[1], strings[2]);
+            if (user != NULL) {
+                user->groups->ackedSeq = header->value;
+                appendUser(store->userList, user);
+                linkMembership(store, user->groups);
+            }
+        }
+    } else if (header->type == WAL_JOIN && strings[1] != NULL) {
+        User *user = findUser(store->userList, strings[0]);
+        if (user == NULL) {
+            return;
+        }
+        Group *group = user->groups;
+        while (group != NULL && strcmp(group->name, strings[1]) != 0) {
+            group = group->next;
+        }
+        if (group == NULL && (group = addUserGroup(user, strings[1], header->value)) != NULL) {
+            linkMembership(store, group);
+        }
+    } else if (header->type == WAL_LEAVE && strings[1] != NULL) {
+        User *user = findUser(store->userList, strings[0]);
+        Group *group = (user != NULL) ? user->groups : NULL;
+        while (group != NULL && strcmp(group->name, strings[1]) != 0) {
+            group = group->next;
+        }
+        if (group != NULL) {
+            removeGroupMember(group);
+            removeUserGroup(user, group);
+        }
+    } else if (header->type == WAL_CREATE && strings[1] != NULL) {
+        getOrCreateGroup(store->groupList, strings[0], NULL);
+    } else if (header->type == WAL_CURSOR && strings[1] != NULL) {
+        User *user = findUser(store->userList, strings[0]);
+        Group *group = (user != NULL) ? user->groups : NULL;
+        while (group != NULL && strcmp(group->name, strings[1]) != 0) {
+            group = group->next;
+        }
+        // Cursors only move forward.
+        if (group != NULL && header->value > group->ackedSeq) {
+            group->ackedSeq = header->value;
+        }
+    }
+}
+
+/**
+ * Replays one log generation. A torn or corrupt tail (crash mid-write) ends
+ * the replay; the file is cut back to the last good record so new records
+ * are appended after it.
+ *
+ * return number of records replayed, -1 if the file does not exist.
+ */
+static long replayWal(UserStore *store, unsigned int gen) {
+    char *path = store_path(store, WAL_PREFIX, gen);
+    FILE *fp = (path != NULL) ? fopen(path, "r") : NULL;
+    if (fp == NULL) {
+        free(path);
+        return -1;
+    }
+
+    long records = 0;
+    off_t good = 0;
+    WalHeader header;
+    char payload[MAX_WAL_PAYLOAD + 1];
+    while (fread(&header, sizeof header, 1, fp) == 1) {
+        if (header.length > MAX_WAL_PAYLOAD || fread(payload, 1, header.length, fp) != header.length) {
+            break;
+        }
+        uint32_t checksum = fnv1a(fnv1a(2166136261u, &header.type, 2 * sizeof(uint32_t)), payload, header.length);
+        if (checksum != header.checksum || (header.length > 0 && payload[header.length - 1] != '\0')) {
+            break;
+        }
+        payload[header.length] = '\0';
+        replayRecord(store, &header, payload);
+        records++;
+        good += sizeof header + header.length;
+    }
+    if (!feof(fp) || ftello(fp) != good) {
+        printf("User store: discarding damaged tail of %s at byte %lld\n", path, (long long) good);
+        if (truncate(path, good) == -1) {
+            perror("Error truncating user log");
+        }
+    }
+    fclose(fp);
+    free(path);
+    return records;
+}
+
+static int openWal(UserStore *store, unsigned int gen, int truncateFile) {
+    char *path = store_path(store, WAL_PREFIX, gen);
+    if (path == NULL) {
+        return -1;
+    }
+    int flags = O_WRONLY | O_CREAT | O_APPEND | (truncateFile ? O_TRUNC : 0);
+    int fd = open(path, flags, 0600);
+    if (fd == -1) {
+        perror("Error opening user log");
+    }
+    free(path);
+    return fd;
+}
+
+// Removes log generations below firstGen (already in the snapshot).
+static void removeOldWals(UserStore *store, unsigned int firstGen) {
+    DIR *dir = opendir(store->dir);
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent *entry;
+    size_t prefixLen = strlen(WAL_PREFIX);
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, WAL_PREFIX, prefixLen) == 0) {
+            unsigned int gen = (unsigned int) strtoul(entry->d_name + prefixLen, NULL, 10);
+            if (gen < firstGen) {
+                char *path = store_path(store, WAL_PREFIX, gen);
+                unlink(path);
+                free(path);
+            }
+        }
+    }
+    closedir(dir);
+}
+
+// ======= SNAPSHOT =========== //
+
+static uint64_t internString(StringIntern *intern, const char *name, uint64_t nextOffset, int *isNew) {
+    if (intern->count * 2 >= intern->capacity) {
+        size_t capacity = intern->capacity ? intern->capacity * 2 : 256;
+        const char **names = (const char **) calloc(capacity, sizeof(char *));
+        uint64_t *offsets = (uint64_t *) calloc(capacity, sizeof(uint64_t));
+        if (names == NULL || offsets == NULL) {
+            free(names);
+            free(offsets);
+            *isNew = 1; // store it again rather than fail the snapshot
+            return nextOffset;
+        }
+        for (size_t i = 0; i < intern->capacity; i++) {
+            if (intern->names[i] != NULL) {
+                size_t slot = fnv1a(2166136261u, intern->names[i], strlen(intern->names[i])) & (capacity - 1);
+                while (names[slot] != NULL) {
+                    slot = (slot + 1) & (capacity - 1);
+                }
+                names[slot] = intern->names[i];
+                offsets[slot] = intern->offsets[i];
+            }
+        }
+        free(intern->names);
+        free(intern->offsets);
+        intern->names = names;
+        intern->offsets = offsets;
+        intern->capacity = capacity;
+    }
+    size_t slot = fnv1a(2166136261u, name, strlen(name)) & (intern->capacity - 1);
+    while (intern->names[slot] != NULL) {
+        if (strcmp(intern->names[slot], name) == 0) {
+            *isNew = 0;
+            return intern->offsets[slot];
+        }
+        slot = (slot + 1) & (intern->capacity - 1);
+    }
+    intern->names[slot] = name;
+    intern->offsets[slot] = nextOffset;
+    intern->count++;
+    *isNew = 1;
+    return nextOffset;
+}
+
+static int flushWriter(RegionWriter *writer) {
+    size_t done = 0;
+    while (done < writer->used) {
+        ssize_t n = pwrite(writer->fd, writer->buf + done, writer->used - done, writer->offset + done);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += n;
+    }
+    writer->offset += writer->used;
+    writer->used = 0;
+    return 0;
+}
+
+static int writeBytes(RegionWriter *writer, const void *data, size_t len) {
+    const char *p = (const char *) data;
+    while (len > 0) {
+        if (writer->used == WRITER_BUFFER_SIZE && flushWriter(writer) == -1) {
+            return -1;
+        }
+        size_t n = WRITER_BUFFER_SIZE - writer->used;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(writer->buf + writer->used, p, n);
+        writer->used += n;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Appends a string to the string region and returns its offset.
+static uint64_t writeString(RegionWriter *strings, uint64_t *stringsSize, const char *s, int *error) {
+    uint64_t offset = *stringsSize;
+    size_t len = strlen(s) + 1;
+    if (writeBytes(strings, s, len) == -1) {
+        *error = 1;
+    }
+    *stringsSize += len;
+    return offset;
+}
+
+// A membership as copied under its user's lock for the snapshot.
+typedef struct {
+    const char *name;   // the node's own string: nodes are never freed
+    uint32_t ackedSeq;
+} SnapshotMembership;
+
+/**
+ * Copies the memberships of the first count users, each under its user's
+ * lock, so their number is known before anything is written.
+ *
+ * param perUser Set to each user's number of memberships (count entries).
+ * return the copies (*total of them), NULL if memory ran out.
+ */
+static SnapshotMembership *copyMemberships(User *first, int count, uint32_t *perUser, uint64_t *total) {
+    uint64_t capacity = (count > 0) ? count : 1;
+    SnapshotMembership *copies = (SnapshotMembership *) malloc(capacity * sizeof(SnapshotMembership));
+    *total = 0;
+    User *user = first;
+    for (int i = 0; i < count && copies != NULL; i++) {
+        perUser[i] = 0;
+        pthread_mutex_lock(user_lock(user));
+        for (Group *group = user->groups; group != NULL; group = group->next) {
+            if (*total == capacity) {
+                capacity *= 2;
+                SnapshotMembership *grown = (SnapshotMembership *) realloc(copies, capacity * sizeof(SnapshotMembership));
+                if (grown == NULL) {
+                    free(copies);
+                    copies = NULL;
+                    break;
+                }
+                copies = grown;
+            }
+            copies[*total].name = group->name;
+            copies[*total].ackedSeq = __atomic_load_n(&group->ackedSeq, __ATOMIC_RELAXED);
+            (*total)++;
+            perUser[i]++;
+        }
+        pthread_mutex_unlock(user_lock(user));
+        if (i + 1 < count) {
+            user = user->next; // the last user's next may be changing: not read
+        }
+    }
+    return copies;
+}
+
+/**
+ * Writes the first count users and the given group registry to fd. Runs
+ * without userList_mutex: users are appended and never freed, so the
+ * first count of them stay put, and their memberships are copied under
+ * each user's lock.
+ */
+static int writeSnapshotFile(int fd, unsigned int walGen, User *first, int count,
+                             GroupInfo **registry, unsigned int registryCount) {
+    SnapshotHeader header;
+    uint64_t groupCount = 0;
+    uint32_t *perUser = (uint32_t *) malloc(((count > 0) ? count : 1) * sizeof(uint32_t));
+    SnapshotMembership *memberships = (perUser != NULL) ? copyMemberships(first, count, perUser, &groupCount) : NULL;
+    if (memberships == NULL) {
+        free(perUser);
+        return -1;
+    }
+
+    memset(&header, 0, sizeof header);
+    header.magic = SNAPSHOT_MAGIC;
+    header.version = SNAPSHOT_VERSION;
+    header.walGen = walGen;
+    header.userCount = count;
+    header.groupCount = groupCount;
+    header.registryCount = registryCount;
+    header.usersOffset = sizeof(SnapshotHeader);
+    header.groupsOffset = header.usersOffset + (uint64_t) count * sizeof(SnapshotUser);
+    header.registryOffset = header.groupsOffset + groupCount * sizeof(SnapshotGroup);
+    header.stringsOffset = header.registryOffset + (uint64_t) registryCount * sizeof(uint64_t);
+
+    RegionWriter *users = (RegionWriter *) malloc(sizeof(RegionWriter));
+    RegionWriter *groups = (RegionWriter *) malloc(sizeof(RegionWriter));
+    RegionWriter *strings = (RegionWriter *) malloc(sizeof(RegionWriter));
+    StringIntern intern;
+    memset(&intern, 0, sizeof intern);
+    int error = (users == NULL || groups == NULL || strings == NULL);
+
+    if (!error) {
+        users->fd = groups->fd = strings->fd = fd;
+        users->used = groups->used = strings->used = 0;
+        users->offset = header.usersOffset;
+        groups->offset = header.groupsOffset;
+        strings->offset = header.stringsOffset;
+
+        uint64_t stringsSize = 0;
+        uint64_t groupIndex = 0;
+        User *user = first;
+        for (int i = 0; i < count && !error; i++) {
+            SnapshotUser record;
+            memset(&record, 0, sizeof record);
+            record.email = writeString(strings, &stringsSize, user->email, &error);
+            record.name = writeString(strings, &stringsSize, user->name, &error);
+            record.password = writeString(strings, &stringsSize, user->password, &error);
+            record.firstGroup = groupIndex;
+            for (uint32_t g = 0; g < perUser[i]; g++) {
+                SnapshotMembership *membership = &memberships[groupIndex];
+                SnapshotGroup groupRecord;
+                int isNew;
+                memset(&groupRecord, 0, sizeof groupRecord);
+                groupRecord.name = internString(&intern, membership->name, stringsSize, &isNew);
+                if (isNew) {
+                    groupRecord.name = writeString(strings, &stringsSize, membership->name, &error);
+                }
+                groupRecord.ackedSeq = membership->ackedSeq;
+                if (writeBytes(groups, &groupRecord, sizeof groupRecord) == -1) {
+                    error = 1;
+                }
+                record.groupCount++;
+                groupIndex++;
+            }
+            if (writeBytes(users, &record, sizeof record) == -1) {
+                error = 1;
+            }
+            if (i + 1 < count) {
+                user = user->next;
+            }
+        }
+        // The registry follows the memberships, so their writer carries on.
+        for (unsigned int i = 0; i < registryCount && !error; i++) {
+            int isNew;
+            uint64_t name = internString(&intern, registry[i]->name, stringsSize, &isNew);
+            if (isNew) {
+                name = writeString(strings, &stringsSize, registry[i]->name, &error);
+            }
+            if (writeBytes(groups, &name, sizeof name) == -1) {
+                error = 1;
+            }
+        }
+        header.stringsSize = stringsSize;
+        if (!error && (flushWriter(users) == -1 || flushWriter(groups) == -1 || flushWriter(strings) == -1 ||
+                       pwrite(fd, &header, sizeof header, 0) != (ssize_t) sizeof header)) {
+            error = 1;
+        }
+    }
+    free(memberships);
+    free(perUser);
+    free(intern.names);
+    free(intern.offsets);
+    free(users);
+    free(groups);
+    free(strings);
+    return error ? -1 : 0;
+}
+
+/**
+ * Writes a new snapshot and starts a new log generation.
+ *
+ * Under userList_mutex only the user count, the group registry and the
+ * switch to the next log generation are taken, so every change is either
+ * in the snapshot or in a log generation it names; the users are written
+ * after it is released, so registrations and joins don't wait for the
+ * disk. A change made meanwhile may be in both the snapshot and the new
+ * log, which is replayed over it (joins, leaves and cursors replay as
+ * settings, not increments). The old generations are deleted only after
+ * the snapshot is renamed into place, so a crash at any point leaves a
+ * recoverable directory; if the snapshot fails, the previous one still
+ * names the old generation and the new one is replayed after it.
+ *
+ * return 0 on success, -1 on error (the previous snapshot and logs remain).
+ */
+int writeUserSnapshot(UserStore *store) {
+    char *tmpPath = store_path(store, SNAPSHOT_FILE ".tmp", 0);
+    char *path = store_path(store, SNAPSHOT_FILE, 0);
+    int fd = (tmpPath != NULL) ? open(tmpPath, O_RDWR | O_CREAT | O_TRUNC, 0600) : -1;
+    if (fd == -1 || path == NULL) {
+        perror("Error creating user snapshot");
+        free(tmpPath);
+        free(path);
+        return -1;
+    }
+
+    // Groups are created under userList_mutex too, so the registry taken
+    // here has every group of the log generations before the switch.
+    pthread_mutex_lock(&userList_mutex);
+    User *first = store->userList->first;
+    int users = store->userList->count;
+    unsigned int registryCount;
+    GroupInfo **registry = NULL;
+    getGroupRange(store->groupList, 0, 0, NULL, &registryCount);
+    registry = (GroupInfo **) malloc((registryCount + 1) * sizeof(GroupInfo *));
+    if (registry != NULL) {
+        registryCount = getGroupRange(store->groupList, 0, registryCount, registry, &registryCount);
+    }
+    unsigned int newGen = store->walGen + 1;
+    int newWal = (registry != NULL) ? openWal(store, newGen, 1) : -1;
+    if (newWal != -1) {
+        pthread_mutex_lock(&store->walMutex);
+        close(store->walFd);
+        store->walFd = newWal;
+        store->walGen = newGen;
+        store->walRecords = 0;
+        pthread_mutex_unlock(&store->walMutex);
+    }
+    pthread_mutex_unlock(&userList_mutex);
+
+    int result = (newWal == -1) ? -1 : writeSnapshotFile(fd, newGen, first, users, registry, registryCount);
+    free(registry);
+    if (result == 0 && (fsync(fd) == -1 || rename(tmpPath, path) == -1)) {
+        result = -1;
+    }
+    close(fd);
+    if (result == 0) {
+        int dirFd = open(store->dir, O_RDONLY);
+        if (dirFd != -1) {
+            fsync(dirFd);
+            close(dirFd);
+        }
+        removeOldWals(store, newGen);
+        printf("User store: snapshot of %d users written\n", users);
+    } else {
+        perror("Error writing user snapshot");
+        unlink(tmpPath);
+    }
+    free(tmpPath);
+    free(path);
+    return result;
+}
+
+/**
+ * Maps the snapshot and links its users into the (empty) user list. The
+ * users and their memberships are carved out of two blocks and their strings
+ * point into the mapping, so loading does no parsing and no per-user
+ * allocation.
+ *
+ * return the first log generation to replay, 0 on error.
+ */
+static unsigned int loadSnapshot(UserStore *store) {
+    char *path = store_path(store, SNAPSHOT_FILE, 0);
+    int fd = (path != NULL) ? open(path, O_RDONLY) : -1;
+    free(path);
+    if (fd == -1) {
+        return (errno == ENOENT) ? 1 : 0; // no snapshot yet: replay from the first log
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t) SNAPSHOT_V1_HEADER_SIZE) {
+        close(fd);
+        printf("User store: snapshot is truncated\n");
+        return 0;
+    }
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    flags |= MAP_POPULATE; // fault the whole file in with one call
+#endif
+    char *base = (char *) mmap(NULL, st.st_size, PROT_READ, flags, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("Error mapping user snapshot");
+        return 0;
+    }
+
+    SnapshotHeader *header = (SnapshotHeader *) base;
+    uint64_t size = st.st_size;
+    uint64_t registryCount = 0;
+    uint64_t registryOffset = 0;
+    if (header->magic == SNAPSHOT_MAGIC && header->version >= 2 && size >= sizeof(SnapshotHeader)) {
+        registryCount = header->registryCount;
+        registryOffset = header->registryOffset;
+    }
+    if (header->magic != SNAPSHOT_MAGIC || header->version < 1 || header->version > SNAPSHOT_VERSION ||
+        (header->version >= 2 && size < sizeof(SnapshotHeader)) ||
+        header->usersOffset + (uint64_t) header->userCount * sizeof(SnapshotUser) > header->groupsOffset ||
+        header->groupsOffset + header->groupCount * sizeof(SnapshotGroup) > header->stringsOffset ||
+        (registryCount > 0 && (registryOffset < header->groupsOffset + header->groupCount * sizeof(SnapshotGroup) ||
+                               registryOffset + registryCount * sizeof(uint64_t) > header->stringsOffset)) ||
+        header->stringsOffset + header->stringsSize != size ||
+        (header->stringsSize > 0 && base[size - 1] != '\0')) {
+        printf("User store: snapshot header is invalid\n");
+        munmap(base, size);
+        return 0;
+    }
+    store->snapshot = base;
+    store->snapshotSize = size;
+    char *strings = base + header->stringsOffset;
+    uint64_t stringsSize = header->stringsSize;
+    // The registry first, so groups keep their creation order.
+    uint64_t *registry = (uint64_t *) (base + registryOffset);
+    for (uint64_t i = 0; i < registryCount; i++) {
+        getOrCreateGroup(store->groupList, strings + (registry[i] < stringsSize ? registry[i] : stringsSize - 1), NULL);
+    }
+    if (header->userCount == 0) {
+        return header->walGen;
+    }
+
+    SnapshotUser *userRecords = (SnapshotUser *) (base + header->usersOffset);
+    SnapshotGroup *groupRecords = (SnapshotGroup *) (base + header->groupsOffset);
+    User *users = (User *) malloc(header->userCount * sizeof(User));
+    Group *groups = (Group *) malloc((header->groupCount ? header->groupCount : 1) * sizeof(Group));
+    if (users == NULL || groups == NULL) {
+        perror("Error allocating memory for loaded users");
+        free(users);
+        free(groups);
+        return 0;
+    }
+
+    for (uint64_t g = 0; g < header->groupCount; g++) {
+        uint64_t name = groupRecords[g].name;
+        groups[g].name = strings + (name < stringsSize ? name : stringsSize - 1);
+        groups[g].ackedSeq = groupRecords[g].ackedSeq;
+        groups[g].joins = 0;
+        groups[g].inSnapshot = 1;
+        groups[g].user = NULL;
+        groups[g].info = NULL;
+        groups[g].memberIndex = 0;
+        groups[g].next = &groups[g + 1];
+    }
+    for (uint32_t i = 0; i < header->userCount; i++) {
+        SnapshotUser *record = &userRecords[i];
+        User *user = &users[i];
+        user->email = strings + (record->email < stringsSize ? record->email : stringsSize - 1);
+        user->name = strings + (record->name < stringsSize ? record->name : stringsSize - 1);
+        user->password = strings + (record->password < stringsSize ? record->password : stringsSize - 1);
+        user->groups = NULL;
+        if (record->groupCount > 0 && record->firstGroup + record->groupCount <= header->groupCount) {
+            user->groups = &groups[record->firstGroup];
+            groups[record->firstGroup + record->groupCount - 1].next = NULL;
+            for (uint32_t g = 0; g < record->groupCount; g++) {
+                groups[record->firstGroup + g].user = user;
+            }
+        }
+        user->retired = NULL;
+        user->devices = NULL;
+        user->recentPosts = NULL;
+        user->isOnline = 0;
+        user->posts = 0;
+        user->inSnapshot = 1;
+        user->next = &users[i + 1];
+    }
+    store->snapshotUsers = users;
+    store->snapshotGroups = groups;
+    appendUsers(store->userList, &users[0], &users[header->userCount - 1], header->userCount);
+    for (uint32_t i = 0; i < header->userCount; i++) {
+        for (Group *group = users[i].groups; group != NULL; group = group->next) {
+            linkMembership(store, group);
+        }
+    }
+    return header->walGen;
+}
+
+/**
+ * Opens (creating if needed) a data directory and loads its users into an
+ * empty user list: the snapshot first, then every log generation after it.
+ * The groups go into groupList, each with its members.
+ *
+ * return 0 on success, -1 if the directory could not be loaded.
+ */
+int openUserStore(UserStore *store, const char *dir, UserList *userList, GroupList *groupList) {
+    memset(store, 0, sizeof(UserStore));
+    store->dir = strdup(dir);
+    store->userList = userList;
+    store->groupList = groupList;
+    store->walFd = -1;
+    pthread_mutex_init(&store->walMutex, NULL);
+    pthread_cond_init(&store->snapshotWake, NULL);
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+        perror("Error creating data directory");
+        return -1;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    unsigned int gen = loadSnapshot(store);
+    if (gen == 0) {
+        return -1;
+    }
+    int fromSnapshot = userList->count;
+    unsigned int firstGen = gen;
+    removeOldWals(store, firstGen);
+
+    long records = 0;
+    long replayed;
+    while ((replayed = replayWal(store, gen)) != -1) {
+        records += replayed;
+        gen++;
+    }
+    // Keep appending to the newest generation (or start the first one).
+    store->walGen = (gen > firstGen) ? gen - 1 : gen;
+    store->walFd = openWal(store, store->walGen, 0);
+    if (store->walFd == -1) {
+        return -1;
+    }
+    store->walRecords = records;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("User store: %d users from snapshot + %ld log records in %.1f ms\n", fromSnapshot, records,
+           (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+    return 0;
+}
+
+static void *snapshotThread(void *arg) {
+    UserStore *store = (UserStore *) arg;
+    pthread_mutex_lock(&store->walMutex);
+    while (!store->stopSnapshots) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += SNAPSHOT_INTERVAL_SEC;
+        while (!store->stopSnapshots &&
+               pthread_cond_timedwait(&store->snapshotWake, &store->walMutex, &deadline) != ETIMEDOUT) {
+        }
+        if (store->stopSnapshots) {
+            break;
+        }
+        long records = store->walRecords;
+        pthread_mutex_unlock(&store->walMutex);
+        if (records >= SNAPSHOT_MIN_RECORDS) {
+            writeUserSnapshot(store);
+        }
+        pthread_mutex_lock(&store->walMutex);
+    }
+    pthread_mutex_unlock(&store->walMutex);
+    return NULL;
+}
+
+/**
+ * Starts the background thread that takes a snapshot every
+ * SNAPSHOT_INTERVAL_SEC when the log has grown.
+ *
+ * return 0 on success, -1 if the thread could not be created.
+ */
+int startSnapshotThread(UserStore *store) {
+    if (pthread_create(&store->snapshotThread, NULL, snapshotThread, store) != 0) {
+        perror("Error creating snapshot thread");
+        return -1;
+    }
+    store->snapshotThreadRunning = 1;
+    return 0;
+}
+
+/**
+ * Stops the snapshot thread, waiting for a snapshot in progress to finish.
+ * Call before freeing the user list.
+ */
+void stopSnapshotThread(UserStore *store) {
+    if (!store->snapshotThreadRunning) {
+        return;
+    }
+    pthread_mutex_lock(&store->walMutex);
+    store->stopSnapshots = 1;
+    pthread_cond_signal(&store->snapshotWake);
+    pthread_mutex_unlock(&store->walMutex);
+    pthread_join(store->snapshotThread, NULL);
+    store->snapshotThreadRunning = 0;
+}
+
+/**
+ * Syncs and closes the log and releases the snapshot. Call after
+ * stopSnapshotThread() and freeUserList(), since loaded users point into
+ * the snapshot.
+ */
+void closeUserStore(UserStore *store) {
+    if (store->walFd != -1) {
+        fdatasync(store->walFd); // cursors are written without a sync
+        close(store->walFd);
+    }
+    if (store->snapshot != NULL) {
+        munmap(store->snapshot, store->snapshotSize);
+    }
+    free(store->snapshotUsers);
+    free(store->snapshotGroups);
+    free(store->dir);
+    pthread_mutex_destroy(&store->walMutex);
+    pthread_cond_destroy(&store->snapshotWake);
+    memset(store, 0, sizeof(UserStore));
+    store->walFd = -1;
+}
@@ -0,0 +1,73 @@
+#ifndef USER_STORE_H
+#define USER_STORE_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "protocol.h"
+
+/**
+ * Durable storage for registered users, their group memberships and the
+ * group registry.
+ *
+ * Every registration, group creation, join and leave is appended to a
+ * write-ahead log before the client is acknowledged, as are the users' inbox
+ * cursors (how far into each group's message log they have acknowledged).
+ * Periodically the whole directory is written as a compact binary snapshot
+ * and the log starts over. At startup the snapshot
+ * is mmap()ed and the users point straight into it (no per-record parsing),
+ * then the log written since the snapshot is replayed.
+ *
+ * Files in the data directory:
+ *   users.snap        snapshot, its header names the first log generation not in it
+ *   users.wal.<gen>   log generations; replayed in order from the snapshot's
+ *
+ * The files are in host byte order: move a data directory only between
+ * machines of the same architecture.
+ */
+
+#define SNAPSHOT_INTERVAL_SEC 300   // how often the snapshot thread checks the log
+#define SNAPSHOT_MIN_RECORDS 1      // log records needed before a new snapshot is taken
+
+/**
+ * Struct name: UserStore
+ * Description: An open data directory.
+ *
+ * param walFd         The current log generation, opened for append.
+ * param walRecords    Records appended to it since it was started.
+ * param snapshot      mmap() of the loaded snapshot; loaded users' strings point into it.
+ * param snapshotUsers Block of User structs for the loaded users.
+ * param snapshotGroups Block of Group nodes for the loaded memberships.
+ * param stopSnapshots  Set by stopSnapshotThread(); snapshotWake wakes the thread for it.
+ */
+typedef struct USER_STORE {
+    char *dir;
+    int walFd;
+    unsigned int walGen;
+    long walRecords;
+    void *snapshot;
+    size_t snapshotSize;
+    User *snapshotUsers;
+    Group *snapshotGroups;
+    UserList *userList;
+    GroupList *groupList;
+    pthread_t snapshotThread;
+    int snapshotThreadRunning;
+    int stopSnapshots;
+    pthread_cond_t snapshotWake;
+    pthread_mutex_t walMutex;
+} UserStore;
+
+// Function prototypes
+int openUserStore(UserStore *store, const char *dir, UserList *userList, GroupList *groupList);
+int logRegistration(UserStore *store, User *user);
+int logCreate(UserStore *store, const char *groupName, User *creator);
+int logJoin(UserStore *store, User *user, const char *groupName);
+int logLeave(UserStore *store, User *user, const char *groupName);
+int logCursor(UserStore *store, User *user, Group *group);
+int writeUserSnapshot(UserStore *store);
+int startSnapshotThread(UserStore *store);
+void stopSnapshotThread(UserStore *store);
+void closeUserStore(UserStore *store);
+
+#endif // USER_STORE_H
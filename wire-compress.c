@@ -0,0 +1,308 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "protocol.h"
+#include "tls-transport.h"
+#include "wire-compress.h"
+
+#define WINDOW_BITS -15 // raw deflate, 32KB window (the dictionary must fit in it)
+#define MEM_LEVEL 6     // ~160KB per deflate stream instead of ~270KB
+
+/**
+ * Preset dictionary for COMPRESS_ALGORITHM. Deflate finds matches in it as
+ * if it had been sent just before the frame, so even one short message
+ * compresses. It holds what every frame repeats: the zero padding of the
+ * fixed-size structs, group names, and the words and phrases chat text is
+ * made of. The most frequent strings are at the end (shortest distances).
+ * Changing it changes the algorithm: bump the version in COMPRESS_ALGORITHM.
+ */
+static const char dictionary[] =
+    "https://www. .com .edu .org .pdf .png .jpg @gmail.com @scranton.edu "
+    "assignment homework project deadline due tomorrow tonight midterm final exam quiz lecture "
+    "lab office hours professor class slides notes question answer problem solution submit "
+    "github repo commit branch merge pull request compile error segfault warning bug fix test "
+    "server client socket thread mutex pointer struct function malloc free printf "
+    "does anyone know if we have class today? is the lab open? can someone send me the link "
+    "I think it's due on Friday at midnight. did you get it to compile? what time is the meeting? "
+    "let me know if you need help. thank you so much! thanks! no problem. sounds good. "
+    "see you there. on my way. running late. be there in 5 minutes. talk to you later. "
+    "good morning good night happy birthday congratulations sorry about that never mind "
+    "yes no maybe okay ok lol haha omg idk btw brb ttyl np thx pls imo tbh "
+    "Monday Tuesday Wednesday Thursday Friday Saturday Sunday today tomorrow yesterday "
+    "the and that this with have what when where which there their they them would could should "
+    "about because really just like know think going want need right now here sure "
+    "CMPS340 CMPS352 CMPS "
+    "Hello everyone! Hi! Hey, how are you? I'm good, thanks. What about you? ";
+
+typedef struct {
+    z_stream deflater;
+    int deflaterReady;
+    z_stream inflater;
+    int inflaterReady;
+} ZlibStreams;
+
+static unsigned char *enabled;
+static pthread_once_t enabled_once = PTHREAD_ONCE_INIT;
+static pthread_key_t streams_key;
+static pthread_once_t streams_once = PTHREAD_ONCE_INIT;
+
+static void init_enabled(void) {
+    enabled = (unsigned char *) calloc(MAX_CONNECTIONS, 1);
+    if (enabled == NULL) {
+        perror("Error allocating compression table");
+        exit(1);
+    }
+}
+
+/**
+ * Turns compression of frames sent to fd on or off. Reset it for every new
+ * connection: descriptors are reused.
+ */
+void compress_set(int fd, int on) {
+    pthread_once(&enabled_once, init_enabled);
+    if (fd >= 0 && fd < MAX_CONNECTIONS) {
+        // Written by the connection's thread, read by whichever thread
+        // sends to it.
+        __atomic_store_n(&enabled[fd], on ? 1 : 0, __ATOMIC_RELAXED);
+    }
+}
+
+int compress_enabled(int fd) {
+    pthread_once(&enabled_once, init_enabled);
+    return fd >= 0 && fd < MAX_CONNECTIONS && __atomic_load_n(&enabled[fd], __ATOMIC_RELAXED);
+}
+
+// ======= ZLIB STREAMS =========== //
+
+// Streams are kept per thread (deflateInit costs more than compressing a
+// message) and released when the thread exits.
+static void free_streams(void *arg) {
+    ZlibStreams *streams = (ZlibStreams *) arg;
+    if (streams->deflaterReady) {
+        deflateEnd(&streams->deflater);
+    }
+    if (streams->inflaterReady) {
+        inflateEnd(&streams->inflater);
+    }
+    free(streams);
+}
+
+static void init_streams_key(void) {
+    pthread_key_create(&streams_key, free_streams);
+}
+
+static ZlibStreams *get_streams(void) {
+    pthread_once(&streams_once, init_streams_key);
+    ZlibStreams *streams = (ZlibStreams *) pthread_getspecific(streams_key);
+    if (streams == NULL) {
+        streams = (ZlibStreams *) calloc(1, sizeof(ZlibStreams));
+        if (streams == NULL || pthread_setspecific(streams_key, streams) != 0) {
+            free(streams);
+            return NULL;
+        }
+    }
+    return streams;
+}
+
+static z_stream *get_deflater(void) {
+    ZlibStreams *streams = get_streams();
+    if (streams == NULL) {
+        return NULL;
+    }
+    if (!streams->deflaterReady) {
+        if (deflateInit2(&streams->deflater, COMPRESS_LEVEL, Z_DEFLATED, WINDOW_BITS, MEM_LEVEL,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+            return NULL;
+        }
+        streams->deflaterReady = 1;
+    } else if (deflateReset(&streams->deflater) != Z_OK) {
+        return NULL;
+    }
+    if (deflateSetDictionary(&streams->deflater, (const Bytef *) dictionary, sizeof dictionary - 1) != Z_OK) {
+        return NULL;
+    }
+    return &streams->deflater;
+}
+
+static z_stream *get_inflater(void) {
+    ZlibStreams *streams = get_streams();
+    if (streams == NULL) {
+        return NULL;
+    }
+    if (!streams->inflaterReady) {
+        if (inflateInit2(&streams->inflater, WINDOW_BITS) != Z_OK) {
+            return NULL;
+        }
+        streams->inflaterReady = 1;
+    } else if (inflateReset(&streams->inflater) != Z_OK) {
+        return NULL;
+    }
+    // A raw stream takes its dictionary up front.
+    if (inflateSetDictionary(&streams->inflater, (const Bytef *) dictionary, sizeof dictionary - 1) != Z_OK) {
+        return NULL;
+    }
+    return &streams->inflater;
+}
+
+// ======= FRAMES =========== //
+
+/**
+ * Marks a CompressedFrame as not filled in yet (for net_send_frame()).
+ */
+void initCompressedFrame(CompressedFrame *frame) {
+    frame->header.type = 0;
+}
+
+/**
+ * Compresses one or more complete frames into a COMPRESSED_TYPE frame.
+ *
+ * param raw Frames back to back, at most COMPRESS_MAX_RAW bytes.
+ * return 0 on success, -1 if compression would not make the frames smaller
+ *        (send them as they are).
+ */
+int compressFrames(CompressedFrame *out, const void *raw, size_t len) {
+    if (len > COMPRESS_MAX_RAW || len <= sizeof(s2c_compressed_header)) {
+        return -1;
+    }
+    z_stream *strm = get_deflater();
+    if (strm == NULL) {
+        return -1;
+    }
+    strm->next_in = (Bytef *) raw;
+    strm->avail_in = len;
+    strm->next_out = (Bytef *) out->data;
+    strm->avail_out = len - sizeof(s2c_compressed_header); // must come out smaller
+    if (deflate(strm, Z_FINISH) != Z_STREAM_END) {
+        return -1;
+    }
+    out->header.type = COMPRESSED_TYPE;
+    out->header.rawLength = len;
+    out->header.length = strm->total_out;
+    return 0;
+}
+
+/**
+ * return bytes to send for this frame (header plus compressed data).
+ */
+size_t compressedFrameSize(CompressedFrame *frame) {
+    return sizeof(s2c_compressed_header) + frame->header.length;
+}
+
+/**
+ * Inflates a received compressed frame.
+ *
+ * param out      Receives header->rawLength bytes of frames.
+ * param capacity Size of out.
+ * return number of bytes in out, -1 if the frame is malformed.
+ */
+int decompressFrames(s2c_compressed_header *header, const char *data, char *out, size_t capacity) {
+    if (header->rawLength > capacity || header->length > COMPRESS_MAX_RAW) {
+        return -1;
+    }
+    z_stream *strm = get_inflater();
+    if (strm == NULL) {
+        return -1;
+    }
+    strm->next_in = (Bytef *) data;
+    strm->avail_in = header->length;
+    strm->next_out = (Bytef *) out;
+    strm->avail_out = header->rawLength;
+    if (inflate(strm, Z_FINISH) != Z_STREAM_END || strm->total_out != header->rawLength) {
+        return -1;
+    }
+    return header->rawLength;
+}
+
+/**
+ * Sends one frame, compressed if the connection negotiated compression and
+ * the frame is worth it.
+ *
+ * param packed Compressed copy of the frame, filled in on first use so a
+ *              fan-out compresses once for all members
+ *              (initCompressedFrame() first). NULL sends the frame as it is.
+ * return like net_send().
+ */
+ssize_t net_send_frame(int fd, const void *frame, size_t len, CompressedFrame *packed) {
+    if (packed == NULL || len < COMPRESS_MIN_BYTES || !compress_enabled(fd)) {
+        return net_send(fd, frame, len);
+    }
+    if (packed->header.type == 0 && compressFrames(packed, frame, len) == -1) {
+        packed->header.type = -1; // incompressible: don't try again
+    }
+    if (packed->header.type != COMPRESSED_TYPE) {
+        return net_send(fd, frame, len);
+    }
+    return net_send(fd, packed, compressedFrameSize(packed));
+}
+
+// ======= FRAME WRITER =========== //
+
+/**
+ * return a writer for fd (free() it after the last flushFrames()), or NULL.
+ */
+FrameWriter *createFrameWriter(int fd) {
+    FrameWriter *writer = (FrameWriter *) malloc(sizeof(FrameWriter));
+    if (writer == NULL) {
+        perror("Error allocating memory for frame writer");
+        return NULL;
+    }
+    writer->fd = fd;
+    writer->queue = 0;
+    writer->queued = 0;
+    writer->length = 0;
+    return writer;
+}
+
+// Sends through the connection's queue when the writer must not wait.
+static ssize_t writer_send(FrameWriter *writer, const void *buf, size_t len) {
+    if (writer->queue) {
+        int result = net_queue(writer->fd, buf, len);
+        if (result > 0) {
+            writer->queued = 1;
+        }
+        return (result == -1) ? -1 : (ssize_t) len;
+    }
+    return net_send(writer->fd, buf, len);
+}
+
+/**
+ * Queues a frame, sending what is queued first if it doesn't fit.
+ *
+ * return 0 on success, -1 if sending failed.
+ */
+int writeFrame(FrameWriter *writer, const void *frame, size_t len) {
+    if (writer->length + len > COMPRESS_MAX_RAW && flushFrames(writer) == -1) {
+        return -1;
+    }
+    if (len > COMPRESS_MAX_RAW) {
+        return (writer_send(writer, frame, len) == -1) ? -1 : 0;
+    }
+    memcpy(writer->raw + writer->length, frame, len);
+    writer->length += len;
+    return 0;
+}
+
+/**
+ * Sends the queued frames: one compressed frame if the connection
+ * negotiated compression, otherwise one plain send.
+ *
+ * return 0 on success, -1 if sending failed.
+ */
+int flushFrames(FrameWriter *writer) {
+    if (writer->length == 0) {
+        return 0;
+    }
+    ssize_t result;
+    if (writer->length >= COMPRESS_MIN_BYTES && compress_enabled(writer->fd) &&
+        compressFrames(&writer->packed, writer->raw, writer->length) == 0) {
+        result = writer_send(writer, &writer->packed, compressedFrameSize(&writer->packed));
+    } else {
+        result = writer_send(writer, writer->raw, writer->length);
+    }
+    writer->length = 0;
+    return (result == -1) ? -1 : 0;
+}
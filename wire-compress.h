@@ -0,0 +1,70 @@
+#ifndef WIRE_COMPRESS_H
+#define WIRE_COMPRESS_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "protocol.h"
+
+/**
+ * Negotiated compression of server-to-client frames.
+ *
+ * A client that sends COMPRESS_TYPE with COMPRESS_ALGORITHM and gets an ACK
+ * may receive COMPRESSED_TYPE frames from then on. Each one is compressed on
+ * its own with raw deflate and a preset dictionary of chat text, so short
+ * frames compress well from the first byte and a frame can be compressed once
+ * and sent to every member of a group. Frames to one socket come from several
+ * threads (fan-out, catch-up), which is why there is no per-connection stream.
+ *
+ * Catch-up, history and retransmission go through a FrameWriter, which packs
+ * consecutive frames into one buffer and sends it as one (compressed) frame:
+ * fewer bytes and fewer send() calls.
+ */
+
+#define COMPRESS_ALGORITHM "deflate-chat1" // raw deflate + the built-in dictionary, version 1
+#define COMPRESS_MIN_BYTES 256             // smaller frames (acks, empty batches) go out as they are
+#define COMPRESS_LEVEL 6
+
+/**
+ * Struct name: CompressedFrame
+ * Description: A compressed frame being sent: the header followed directly
+ *              by the deflate data, so the whole frame goes out in one send.
+ *              header.type is 0 until compressFrames() fills it in.
+ */
+typedef struct {
+    s2c_compressed_header header;
+    char data[COMPRESS_MAX_RAW];
+} CompressedFrame;
+
+/**
+ * Struct name: FrameWriter
+ * Description: Frames queued for one socket, sent together by flushFrames().
+ *
+ * param queue  1: send with net_queue(), never waiting on the socket (for a
+ *              caller holding shared locks); 0: net_send().
+ * param queued Set when net_queue() left bytes on the connection's queue.
+ */
+typedef struct {
+    int fd;
+    int queue;
+    int queued;
+    size_t length;
+    char raw[COMPRESS_MAX_RAW];
+    CompressedFrame packed;
+} FrameWriter;
+
+// Per-connection setting (server side)
+void compress_set(int fd, int on);
+int compress_enabled(int fd);
+
+// Function prototypes
+void initCompressedFrame(CompressedFrame *frame);
+int compressFrames(CompressedFrame *out, const void *raw, size_t len);
+size_t compressedFrameSize(CompressedFrame *frame);
+int decompressFrames(s2c_compressed_header *header, const char *data, char *out, size_t capacity);
+ssize_t net_send_frame(int fd, const void *frame, size_t len, CompressedFrame *packed);
+
+FrameWriter *createFrameWriter(int fd);
+int writeFrame(FrameWriter *writer, const void *frame, size_t len);
+int flushFrames(FrameWriter *writer);
+
+#endif // WIRE_COMPRESS_H